@@ -0,0 +1,494 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include "capture.h"
+
+#ifndef WIN32
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define CAPTURE_RING_SIZE   (4 * 1024 * 1024)
+#define CAPTURE_MIN_RING    (256 * 1024)
+
+// the write() mode buffer, flushed when full or when the ring is empty
+#define CAPTURE_WBUF_SIZE   (256 * 1024)
+
+// the mmap mode file window
+#define CAPTURE_MAP_SIZE    (4 * 1024 * 1024)
+
+// how long the writer sleeps when the ring is empty
+#define CAPTURE_POLL_MS     5
+
+#define CACHE_LINE 64
+
+// pcapng blocks
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_MAGIC        0x1A2B3C4D
+#define PCAPNG_OPT_EPB_FLAGS 2
+#define LINKTYPE_RAW        101
+
+// two consecutive 16 bit fields in the host byte order
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define U16_PAIR(first, second) (((uint32_t)(first) << 16) | (second))
+#else
+#define U16_PAIR(first, second) (((uint32_t)(second) << 16) | (first))
+#endif
+
+#define EPB_FLAG_INBOUND    0x1
+#define EPB_FLAG_OUTBOUND   0x2
+
+// block type + block length + interface + timestamp + caplen + origlen
+#define EPB_HEADER_LEN      28
+// epb_flags + opt_endofopt + trailing block length
+#define EPB_TRAILER_LEN     16
+
+// a ring record. rec_len is the size of the record, including the header and
+// the padding. A rec_len with RING_REC_WRAP means that the rest of the ring is unused.
+typedef struct {
+  uint32_t rec_len;
+  uint32_t caplen;
+  uint32_t origlen;
+  uint32_t epb_flags;
+  uint64_t ts_us;
+} ring_rec_t;
+
+#define RING_REC_WRAP       0x80000000
+#define ALIGN8(x)           (((x) + 7) & ~7u)
+#define ALIGN4(x)           (((x) + 3) & ~3u)
+
+struct capture {
+  // written by the producer
+  _Atomic uint64_t head;
+  uint64_t tail_cache;        // last seen tail, to avoid touching the consumer cache line
+  char pad1[CACHE_LINE - 2 * sizeof(uint64_t)];
+
+  // written by the writer
+  _Atomic uint64_t tail;
+  char pad2[CACHE_LINE - sizeof(uint64_t)];
+
+  _Atomic uint64_t pkts;
+  _Atomic uint64_t bytes;
+  _Atomic uint64_t drops;
+  _Atomic uint32_t num_files;
+  _Atomic int stop;
+
+  char *ring;
+  uint32_t ring_size;         // power of 2
+  uint32_t snaplen;
+  pthread_t thread;
+
+  // writer state
+  char *path;
+  uint64_t max_file_size;
+  uint32_t max_files;
+  uint8_t use_mmap;
+  uint8_t failed;             // the output failed, the packets are discarded
+  int fd;
+  uint32_t file_idx;
+  uint64_t file_size;         // data written to the current file
+
+  char *wbuf;
+  uint32_t wbuf_used;
+
+  char *map;                  // mapping of the file window starting at map_off
+  uint64_t map_off;
+};
+
+/* ******************************************************* */
+
+// Only reads the clock, may be called in the forwarding path of each packet
+void capture_pkt(capture_t *cap, const char *pkt, uint32_t len, uint8_t outbound) {
+  uint32_t caplen = (cap->snaplen && (len > cap->snaplen)) ? cap->snaplen : len;
+  uint32_t rec_len = ALIGN8(sizeof(ring_rec_t) + caplen);
+  uint64_t head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+  uint32_t off = head & (cap->ring_size - 1);
+  uint32_t to_end = cap->ring_size - off;
+  uint32_t needed = rec_len + ((to_end < rec_len) ? to_end : 0);
+  struct timespec ts;
+
+  if((cap->ring_size - (head - cap->tail_cache)) < needed) {
+    cap->tail_cache = atomic_load_explicit(&cap->tail, memory_order_acquire);
+
+    if((cap->ring_size - (head - cap->tail_cache)) < needed) {
+      atomic_fetch_add_explicit(&cap->drops, 1, memory_order_relaxed);
+      return;
+    }
+  }
+
+  if(to_end < rec_len) {
+    // the records are contiguous, skip the end of the ring
+    ((ring_rec_t*)(cap->ring + off))->rec_len = RING_REC_WRAP;
+    head += to_end;
+    off = 0;
+  }
+
+  ring_rec_t *rec = (ring_rec_t*)(cap->ring + off);
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  rec->rec_len = rec_len;
+  rec->caplen = caplen;
+  rec->origlen = len;
+  rec->epb_flags = outbound ? EPB_FLAG_OUTBOUND : EPB_FLAG_INBOUND;
+  rec->ts_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  memcpy(rec + 1, pkt, caplen);
+
+  // publish the record to the writer
+  atomic_store_explicit(&cap->head, head + rec_len, memory_order_release);
+}
+
+/* ******************************************************* */
+
+static int write_all(int fd, const char *data, size_t len) {
+  while(len > 0) {
+    ssize_t rv = write(fd, data, len);
+
+    if(rv < 0) {
+      if(errno == EINTR)
+        continue;
+      return(-1);
+    }
+
+    data += rv;
+    len -= rv;
+  }
+
+  return(0);
+}
+
+/* ******************************************************* */
+
+static void output_failed(capture_t *cap, const char *what) {
+  error("capture %s failed[%d]: %s", what, errno, strerror(errno));
+  cap->failed = 1;
+}
+
+/* ******************************************************* */
+
+static void flush_wbuf(capture_t *cap) {
+  if(!cap->wbuf_used)
+    return;
+
+  if(!cap->failed && (write_all(cap->fd, cap->wbuf, cap->wbuf_used) != 0))
+    output_failed(cap, "write");
+
+  cap->wbuf_used = 0;
+}
+
+/* ******************************************************* */
+
+// Maps the file window which contains the current end of the file
+static int map_window(capture_t *cap) {
+  long page_size = sysconf(_SC_PAGESIZE);
+
+  if(cap->map)
+    munmap(cap->map, CAPTURE_MAP_SIZE);
+
+  cap->map = NULL;
+  cap->map_off = cap->file_size & ~((uint64_t)page_size - 1);
+
+  if(ftruncate(cap->fd, cap->map_off + CAPTURE_MAP_SIZE) != 0) {
+    output_failed(cap, "ftruncate");
+    return(-1);
+  }
+
+  char *map = mmap(NULL, CAPTURE_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, cap->map_off);
+
+  if(map == MAP_FAILED) {
+    output_failed(cap, "mmap");
+    return(-1);
+  }
+
+  cap->map = map;
+  return(0);
+}
+
+/* ******************************************************* */
+
+// Returns a pointer where to write len bytes of the current file, NULL on error
+static char* output_reserve(capture_t *cap, uint32_t len) {
+  char *ptr;
+
+  if(cap->failed)
+    return(NULL);
+
+  if(cap->use_mmap) {
+    if((!cap->map || ((cap->file_size + len) > (cap->map_off + CAPTURE_MAP_SIZE)))
+        && (map_window(cap) != 0))
+      return(NULL);
+
+    ptr = cap->map + (cap->file_size - cap->map_off);
+  } else {
+    if((cap->wbuf_used + len) > CAPTURE_WBUF_SIZE) {
+      flush_wbuf(cap);
+
+      if(cap->failed)
+        return(NULL);
+    }
+
+    ptr = cap->wbuf + cap->wbuf_used;
+    cap->wbuf_used += len;
+  }
+
+  cap->file_size += len;
+  atomic_fetch_add_explicit(&cap->bytes, len, memory_order_relaxed);
+  return(ptr);
+}
+
+/* ******************************************************* */
+
+static void close_file(capture_t *cap) {
+  if(cap->fd < 0)
+    return;
+
+  if(cap->use_mmap) {
+    if(cap->map)
+      munmap(cap->map, CAPTURE_MAP_SIZE);
+    cap->map = NULL;
+
+    // remove the unused part of the last window
+    if(ftruncate(cap->fd, cap->file_size) != 0)
+      output_failed(cap, "ftruncate");
+  } else
+    flush_wbuf(cap);
+
+  close(cap->fd);
+  cap->fd = -1;
+}
+
+/* ******************************************************* */
+
+static void file_name(capture_t *cap, uint32_t idx, char *buf, size_t bufsize) {
+  if(cap->max_file_size)
+    snprintf(buf, bufsize, "%s.%u", cap->path, idx);
+  else
+    snprintf(buf, bufsize, "%s", cap->path);
+}
+
+/* ******************************************************* */
+
+// Opens the next capture file and writes the pcapng section header and interface description
+static int open_file(capture_t *cap) {
+  char fname[1024];
+  char *ptr;
+
+  file_name(cap, cap->file_idx, fname, sizeof(fname));
+
+  // a shared mapping also requires the read access
+  int flags = (cap->use_mmap ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+  if((cap->fd = open(fname, flags, 0644)) < 0) {
+    output_failed(cap, "open");
+    return(-1);
+  }
+
+  if(cap->max_files && (cap->file_idx >= cap->max_files)) {
+    char old[1024];
+
+    file_name(cap, cap->file_idx - cap->max_files, old, sizeof(old));
+    unlink(old);
+  }
+
+  cap->file_idx++;
+  cap->file_size = 0;
+  atomic_fetch_add_explicit(&cap->num_files, 1, memory_order_relaxed);
+
+  if(!(ptr = output_reserve(cap, 28 + 20)))
+    return(-1);
+
+  // Section Header Block, with an unspecified section length
+  uint32_t shb[] = {PCAPNG_SHB, 28, PCAPNG_MAGIC, 0x00000001 /* version 1.0 */,
+    0xFFFFFFFF, 0xFFFFFFFF, 28};
+
+  // Interface Description Block, with the default microseconds resolution
+  uint32_t idb[] = {PCAPNG_IDB, 20, U16_PAIR(LINKTYPE_RAW, 0 /* reserved */),
+    cap->snaplen, 20};
+
+  memcpy(ptr, shb, sizeof(shb));
+  memcpy(ptr + sizeof(shb), idb, sizeof(idb));
+  return(0);
+}
+
+/* ******************************************************* */
+
+static void write_epb(capture_t *cap, const ring_rec_t *rec) {
+  uint32_t data_len = ALIGN4(rec->caplen);
+  uint32_t block_len = EPB_HEADER_LEN + data_len + EPB_TRAILER_LEN;
+  char *ptr;
+
+  if(cap->failed || ((cap->fd < 0) && (open_file(cap) != 0)))
+    goto drop;
+
+  if(!(ptr = output_reserve(cap, block_len)))
+    goto drop;
+
+  uint32_t hdr[] = {PCAPNG_EPB, block_len, 0 /* interface */,
+    (uint32_t)(rec->ts_us >> 32), (uint32_t)rec->ts_us, rec->caplen, rec->origlen};
+  uint32_t trailer[] = {U16_PAIR(PCAPNG_OPT_EPB_FLAGS, 4), rec->epb_flags,
+    0 /* opt_endofopt */, block_len};
+
+  memcpy(ptr, hdr, sizeof(hdr));
+  memcpy(ptr + EPB_HEADER_LEN, rec + 1, rec->caplen);
+  memset(ptr + EPB_HEADER_LEN + rec->caplen, 0, data_len - rec->caplen);
+  memcpy(ptr + EPB_HEADER_LEN + data_len, trailer, sizeof(trailer));
+  atomic_fetch_add_explicit(&cap->pkts, 1, memory_order_relaxed);
+
+  if(cap->max_file_size && (cap->file_size >= cap->max_file_size))
+    close_file(cap);
+  return;
+
+drop:
+  atomic_fetch_add_explicit(&cap->drops, 1, memory_order_relaxed);
+}
+
+/* ******************************************************* */
+
+static void* capture_writer(void *arg) {
+  capture_t *cap = (capture_t*) arg;
+  uint64_t tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+
+  while(1) {
+    // read before the head, so that the records published before the stop are written
+    int stop = atomic_load_explicit(&cap->stop, memory_order_acquire);
+    uint64_t head = atomic_load_explicit(&cap->head, memory_order_acquire);
+
+    if(tail == head) {
+      if(stop)
+        break;
+
+      // keep the file up to date when the traffic is low
+      if(!cap->use_mmap && (cap->fd >= 0))
+        flush_wbuf(cap);
+
+      struct timespec ts = {0, CAPTURE_POLL_MS * 1000000};
+      nanosleep(&ts, NULL);
+      continue;
+    }
+
+    while(tail != head) {
+      const ring_rec_t *rec = (const ring_rec_t*)(cap->ring + (tail & (cap->ring_size - 1)));
+
+      if(rec->rec_len & RING_REC_WRAP)
+        tail += cap->ring_size - (tail & (cap->ring_size - 1));
+      else {
+        write_epb(cap, rec);
+        tail += rec->rec_len;
+      }
+
+      atomic_store_explicit(&cap->tail, tail, memory_order_release);
+    }
+  }
+
+  close_file(cap);
+  return(NULL);
+}
+
+/* ******************************************************* */
+
+static void capture_free(capture_t *cap) {
+  free(cap->ring);
+  free(cap->wbuf);
+  free(cap->path);
+  free(cap);
+}
+
+/* ******************************************************* */
+
+capture_t* capture_open(const zdtun_capture_config_t *config) {
+  capture_t *cap;
+  uint32_t ring_size = config->ring_size ? config->ring_size : CAPTURE_RING_SIZE;
+  uint32_t size = CAPTURE_MIN_RING;
+
+  if(!config->path) {
+    error("capture: missing path");
+    return(NULL);
+  }
+
+  // a record must always fit the ring
+  while((size < ring_size) && (size < (1u << 30)))
+    size <<= 1;
+
+  safe_alloc(cap, capture_t);
+  cap->ring_size = size;
+  cap->snaplen = config->snaplen;
+  cap->max_file_size = config->max_file_size;
+  cap->max_files = config->max_files;
+  cap->use_mmap = config->use_mmap;
+  cap->fd = -1;
+
+  if(!(cap->ring = (char*) malloc(size)) || !(cap->path = strdup(config->path)) ||
+      (!cap->use_mmap && !(cap->wbuf = (char*) malloc(CAPTURE_WBUF_SIZE)))) {
+    error("capture: allocation failed");
+    capture_free(cap);
+    return(NULL);
+  }
+
+  // open the first file now, to report the errors to the caller
+  if(open_file(cap) != 0) {
+    close_file(cap);
+    capture_free(cap);
+    return(NULL);
+  }
+
+  if(pthread_create(&cap->thread, NULL, capture_writer, cap) != 0) {
+    error("capture: pthread_create failed");
+    close_file(cap);
+    capture_free(cap);
+    return(NULL);
+  }
+
+  return(cap);
+}
+
+/* ******************************************************* */
+
+void capture_close(capture_t *cap) {
+  atomic_store_explicit(&cap->stop, 1, memory_order_release);
+  pthread_join(cap->thread, NULL);
+  capture_free(cap);
+}
+
+/* ******************************************************* */
+
+void capture_get_stats(capture_t *cap, zdtun_capture_stats_t *stats) {
+  stats->pkts = atomic_load_explicit(&cap->pkts, memory_order_relaxed);
+  stats->bytes = atomic_load_explicit(&cap->bytes, memory_order_relaxed);
+  stats->drops = atomic_load_explicit(&cap->drops, memory_order_relaxed);
+  stats->num_files = atomic_load_explicit(&cap->num_files, memory_order_relaxed);
+}
+
+#else // WIN32
+
+capture_t* capture_open(const zdtun_capture_config_t *config) {
+  error("capture: not supported on Windows");
+  return(NULL);
+}
+
+void capture_pkt(capture_t *cap, const char *pkt, uint32_t len, uint8_t outbound) {}
+void capture_close(capture_t *cap) {}
+void capture_get_stats(capture_t *cap, zdtun_capture_stats_t *stats) {}
+
+#endif
@@ -0,0 +1,46 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __ZDTUN_CAPTURE_H__
+#define __ZDTUN_CAPTURE_H__
+
+#include <stdint.h>
+#include "zdtun.h"
+
+/*
+ * A pcapng packet capture.
+ *
+ * capture_pkt copies the packet into a single producer single consumer ring,
+ * without locks or system calls other than reading the clock. A writer thread
+ * drains the ring and writes the Enhanced Packet Blocks to the capture files,
+ * through a large buffer or a memory mapping. capture_pkt must always be
+ * called from the same thread, which is also the one calling capture_close.
+ */
+typedef struct capture capture_t;
+
+capture_t* capture_open(const zdtun_capture_config_t *config);
+void capture_pkt(capture_t *cap, const char *pkt, uint32_t len, uint8_t outbound);
+void capture_close(capture_t *cap);
+void capture_get_stats(capture_t *cap, zdtun_capture_stats_t *stats);
+
+#endif
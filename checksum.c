@@ -0,0 +1,214 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#include "checksum.h"
+
+#if !defined(ZDTUN_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CSUM_X86
+#include <immintrin.h>
+#elif !defined(ZDTUN_NO_SIMD) && defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_CSUM_NEON
+#include <arm_neon.h>
+#endif
+
+// below this size the SIMD setup is not worth it
+#define SIMD_MIN_LEN 64
+
+typedef uint64_t (*csum_kernel_t)(const uint8_t *buf, size_t len, uint64_t sum);
+
+/* ******************************************************* */
+
+// ones' complement 64 bit addition
+static inline uint64_t add64(uint64_t sum, uint64_t val) {
+  sum += val;
+  return sum + (sum < val);
+}
+
+/* ******************************************************* */
+
+static uint64_t csum_tail(const uint8_t *buf, size_t len, uint64_t sum) {
+  uint32_t v32;
+  uint16_t v16;
+
+  if(len >= 4) {
+    memcpy(&v32, buf, 4);
+    sum += v32;
+    buf += 4;
+    len -= 4;
+  }
+
+  if(len >= 2) {
+    memcpy(&v16, buf, 2);
+    sum += v16;
+    buf += 2;
+    len -= 2;
+  }
+
+  // the odd byte is the high half of a word. Not tested with _BIG_ENDIAN,
+  // which bionic and FreeBSD define on every CPU
+  if(len) {
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    sum += (uint16_t)buf[0] << 8;
+#else
+    sum += buf[0];
+#endif
+  }
+
+  return sum;
+}
+
+/* ******************************************************* */
+
+// Portable kernel: sums 32 bit words into a 64 bit accumulator, so that the
+// carries only need to be folded at the end
+static uint64_t csum_scalar(const uint8_t *buf, size_t len, uint64_t sum) {
+  uint64_t acc = 0;
+
+  while(len >= 8) {
+    uint64_t v;
+
+    memcpy(&v, buf, 8);
+    acc += (v & 0xFFFFFFFF) + (v >> 32);
+    buf += 8;
+    len -= 8;
+  }
+
+  return add64(sum, csum_tail(buf, len, acc));
+}
+
+/* ******************************************************* */
+
+#ifdef HAVE_CSUM_X86
+
+__attribute__((target("sse2")))
+static uint64_t csum_sse2(const uint8_t *buf, size_t len, uint64_t sum) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  uint64_t lanes[2];
+
+  while(len >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)buf);
+
+    // zero extend the 32 bit words to the 64 bit lanes
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    buf += 16;
+    len -= 16;
+  }
+
+  _mm_storeu_si128((__m128i*)lanes, acc);
+
+  sum = add64(sum, lanes[0]);
+  sum = add64(sum, lanes[1]);
+
+  return csum_scalar(buf, len, sum);
+}
+
+/* ******************************************************* */
+
+__attribute__((target("avx2")))
+static uint64_t csum_avx2(const uint8_t *buf, size_t len, uint64_t sum) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc0 = zero, acc1 = zero;
+  uint64_t lanes[4];
+
+  while(len >= 64) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)buf);
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(buf + 32));
+
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+    acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+    acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+    buf += 64;
+    len -= 64;
+  }
+
+  _mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(acc0, acc1));
+
+  for(int i = 0; i < 4; i++)
+    sum = add64(sum, lanes[i]);
+
+  return csum_scalar(buf, len, sum);
+}
+
+#endif
+
+/* ******************************************************* */
+
+#ifdef HAVE_CSUM_NEON
+
+static uint64_t csum_neon(const uint8_t *buf, size_t len, uint64_t sum) {
+  uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+
+  while(len >= 32) {
+    // pairwise add the 32 bit words into the 64 bit lanes
+    acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(buf)));
+    acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(buf + 16)));
+    buf += 32;
+    len -= 32;
+  }
+
+  acc0 = vaddq_u64(acc0, acc1);
+
+  sum = add64(sum, vgetq_lane_u64(acc0, 0));
+  sum = add64(sum, vgetq_lane_u64(acc0, 1));
+
+  return csum_scalar(buf, len, sum);
+}
+
+#endif
+
+/* ******************************************************* */
+
+#if defined(HAVE_CSUM_X86)
+
+static csum_kernel_t csum_kernel = csum_scalar;
+
+// Selects the best kernel once, at load time, so that the shard threads
+// only ever read it
+__attribute__((constructor))
+static void csum_select_kernel(void) {
+  __builtin_cpu_init();
+
+  if(__builtin_cpu_supports("avx2"))
+    csum_kernel = csum_avx2;
+  else if(__builtin_cpu_supports("sse2"))
+    csum_kernel = csum_sse2;
+}
+
+#elif defined(HAVE_CSUM_NEON)
+static const csum_kernel_t csum_kernel = csum_neon;
+#else
+static const csum_kernel_t csum_kernel = csum_scalar;
+#endif
+
+/* ******************************************************* */
+
+uint64_t csum_partial(const void *buf, size_t len, uint64_t sum) {
+  if(len < SIMD_MIN_LEN)
+    return csum_scalar((const uint8_t*)buf, len, sum);
+
+  return csum_kernel((const uint8_t*)buf, len, sum);
+}
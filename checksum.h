@@ -0,0 +1,68 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __ZDTUN_CHECKSUM_H__
+#define __ZDTUN_CHECKSUM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Internet checksum (RFC 1071) helpers.
+ *
+ * The partial sums are 64 bit ones' complement accumulators of the native
+ * byte order 16 bit words of the data. They can be chained over multiple
+ * buffers, provided that all but the last one have an even length, and must
+ * be reduced with csum_fold. The SIMD kernel (AVX2, SSE2 or NEON) is selected
+ * at load time, define ZDTUN_NO_SIMD to only use the portable one.
+ */
+
+/* Adds the buffer words to sum */
+uint64_t csum_partial(const void *buf, size_t len, uint64_t sum);
+
+/* Reduces a partial sum to 16 bits. The result is not complemented. */
+static inline uint16_t csum_fold(uint64_t sum) {
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+
+  return (uint16_t) sum;
+}
+
+/*
+ * RFC 1624 incremental update of a checksum field, when a 16 bit word of
+ * the data changes from old_val to new_val. The values must be in the same
+ * byte order of the data (e.g. network byte order for the header fields).
+ */
+static inline uint16_t csum_update16(uint16_t csum, uint16_t old_val, uint16_t new_val) {
+  // HC' = ~(~HC + ~m + m')
+  uint32_t sum = (uint16_t)~csum + (uint16_t)~old_val + new_val;
+
+  sum = (sum & 0xFFFF) + (sum >> 16);
+  sum = (sum & 0xFFFF) + (sum >> 16);
+
+  return (uint16_t) ~sum;
+}
+
+#endif
@@ -0,0 +1,548 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "dnscache.h"
+
+#define DNS_HEADER_LEN 12
+
+#define DNS_FLAG_QR         0x8000
+#define DNS_FLAG_TC         0x0200
+#define DNS_FLAG_CD         0x0010
+#define DNS_OPCODE(flags)   (((flags) >> 11) & 0xF)
+#define DNS_RCODE(flags)    ((flags) & 0xF)
+
+#define DNS_RCODE_NOERROR   0
+#define DNS_RCODE_NXDOMAIN  3
+
+#define DNS_TYPE_OPT        41
+
+// in the "TTL" of the OPT pseudo-RR
+#define DNS_EDNS_DO         0x8000
+
+// the flags in the key suffix
+#define DNS_KEY_DO          0x01
+#define DNS_KEY_CD          0x02
+
+// how long to wait for an upstream response before sending the query again
+#define DNS_PENDING_TIMEOUT 5
+
+// upper bound to the TTL of the cached responses
+#define DNS_MAX_TTL 86400
+
+/* ******************************************************* */
+
+static inline uint16_t get_u16(const char *p) {
+  uint16_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+static inline uint32_t get_u32(const char *p) {
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static inline void put_u32(char *p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+/* ******************************************************* */
+
+/* Parses the (only) question of the message into the cache key.
+ * Returns the offset of the first RR on success, -1 on error. */
+static int parse_question(const char *msg, int len, uint8_t *key, uint16_t *key_len) {
+  int off = DNS_HEADER_LEN;
+  int name_len = 0;
+
+  while(1) {
+    if(off >= len)
+      return -1;
+
+    uint8_t label_len = msg[off];
+
+    // compression pointers are not expected in the question
+    if(label_len & 0xC0)
+      return -1;
+
+    if((off + 1 + label_len > len) || (name_len + 1 + label_len > DNS_MAX_NAME_LEN))
+      return -1;
+
+    key[name_len++] = label_len;
+    off++;
+
+    if(label_len == 0)
+      break;
+
+    for(int i = 0; i < label_len; i++)
+      key[name_len++] = tolower((uint8_t) msg[off + i]);
+
+    off += label_len;
+  }
+
+  // qtype + qclass
+  if(off + 4 > len)
+    return -1;
+
+  memcpy(key + name_len, msg + off, 4);
+  *key_len = name_len + 4;
+
+  return off + 4;
+}
+
+/* ******************************************************* */
+
+/* Returns the offset after the (possibly compressed) name at off, -1 on error */
+static int skip_name(const char *msg, int len, int off) {
+  while(off < len) {
+    uint8_t label_len = msg[off];
+
+    if((label_len & 0xC0) == 0xC0)
+      return((off + 2 <= len) ? (off + 2) : -1);
+    else if(label_len & 0xC0)
+      return -1;
+
+    off += 1 + label_len;
+
+    if(label_len == 0)
+      return((off <= len) ? off : -1);
+  }
+
+  return -1;
+}
+
+/* ******************************************************* */
+
+/* Looks for the OPT pseudo-RR among the RRs starting at off.
+ * Returns 1 if found, 0 if not found, -1 on error. */
+static int find_opt(const char *msg, int len, int off, uint16_t *opt_class, uint32_t *opt_ttl) {
+  int num_rrs = get_u16(msg + 6) + get_u16(msg + 8) + get_u16(msg + 10);
+
+  for(int i = 0; i < num_rrs; i++) {
+    off = skip_name(msg, len, off);
+
+    // type + class + ttl + rdlength
+    if((off < 0) || (off + 10 > len))
+      return -1;
+
+    if(get_u16(msg + off) == DNS_TYPE_OPT) {
+      *opt_class = get_u16(msg + off + 2);
+      *opt_ttl = get_u32(msg + off + 4);
+      return 1;
+    }
+
+    off += 10 + get_u16(msg + off + 8);
+
+    if(off > len)
+      return -1;
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+/* Appends the EDNS flags and the resolver address (the tuple destination) to the key */
+static void add_key_suffix(uint8_t *key, uint16_t *key_len, uint8_t flags, const zdtun_5tuple_t *tuple) {
+  uint8_t *suffix = key + *key_len;
+
+  memset(suffix, 0, DNS_KEY_SUFFIX_LEN);
+  suffix[0] = flags;
+  suffix[1] = tuple->ipver;
+
+  if(tuple->ipver == 4)
+    memcpy(suffix + 2, &tuple->dst_ip.ip4, 4);
+  else
+    memcpy(suffix + 2, &tuple->dst_ip.ip6, 16);
+
+  *key_len += DNS_KEY_SUFFIX_LEN;
+}
+
+/* ******************************************************* */
+
+static void free_entry(dns_cache_t *cache, dns_cache_entry_t *entry) {
+  HASH_DELETE(hh, cache->entries, entry);
+  free(entry->resp);
+  free(entry->waiters);
+  free(entry);
+}
+
+/* ******************************************************* */
+
+static dns_cache_entry_t* new_entry(dns_cache_t *cache, const uint8_t *key, uint16_t key_len) {
+  dns_cache_entry_t *entry;
+
+  // evict the least recently used entries
+  while(cache->entries && (dns_cache_count(cache) >= cache->max_entries))
+    free_entry(cache, cache->entries);
+
+  entry = calloc(1, sizeof(dns_cache_entry_t) + key_len);
+  if(!entry)
+    return NULL;
+
+  memcpy(entry->key, key, key_len);
+  entry->key_len = key_len;
+  HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+
+  return entry;
+}
+
+/* ******************************************************* */
+
+void dns_cache_init(dns_cache_t *cache, uint32_t max_entries) {
+  memset(cache, 0, sizeof(*cache));
+  cache->max_entries = max_entries;
+}
+
+/* ******************************************************* */
+
+void dns_cache_flush(dns_cache_t *cache) {
+  dns_cache_entry_t *entry, *tmp;
+
+  HASH_ITER(hh, cache->entries, entry, tmp)
+    free_entry(cache, entry);
+}
+
+/* ******************************************************* */
+
+void dns_cache_set_size(dns_cache_t *cache, uint32_t max_entries) {
+  cache->max_entries = max_entries;
+
+  while(cache->entries && (dns_cache_count(cache) > max_entries))
+    free_entry(cache, cache->entries);
+}
+
+/* ******************************************************* */
+
+/* Parses a standard query with a single question, sent on the tuple connection.
+ * Returns 0 on success. */
+int dns_parse_query(const char *msg, int len, const zdtun_5tuple_t *tuple, dns_query_t *query) {
+  uint16_t opt_class = 0;
+  uint32_t opt_ttl = 0;
+
+  if(len < DNS_HEADER_LEN)
+    return -1;
+
+  uint16_t flags = get_u16(msg + 2);
+
+  if((flags & DNS_FLAG_QR) || (DNS_OPCODE(flags) != 0) || (get_u16(msg + 4) != 1))
+    return -1;
+
+  int off = parse_question(msg, len, query->key, &query->key_len);
+  if(off < 0)
+    return -1;
+
+  int has_opt = find_opt(msg, len, off, &opt_class, &opt_ttl);
+  if(has_opt < 0)
+    return -1;
+
+  // without EDNS, the client only accepts 512 bytes responses
+  query->udp_size = (has_opt && (opt_class > DNS_DEFAULT_UDP_SIZE)) ? opt_class : DNS_DEFAULT_UDP_SIZE;
+
+  add_key_suffix(query->key, &query->key_len,
+    ((flags & DNS_FLAG_CD) ? DNS_KEY_CD : 0) | ((opt_ttl & DNS_EDNS_DO) ? DNS_KEY_DO : 0), tuple);
+
+  memcpy(&query->query_id, msg, sizeof(query->query_id));
+  query->qname = (const uint8_t*) msg + DNS_HEADER_LEN;
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+/* Returns the entry of the query if it's still valid, NULL otherwise. */
+dns_cache_entry_t* dns_cache_find(dns_cache_t *cache, const dns_query_t *query, time_t now) {
+  dns_cache_entry_t *entry;
+
+  HASH_FIND(hh, cache->entries, query->key, query->key_len, entry);
+
+  if(entry && (entry->expire <= now)) {
+    free_entry(cache, entry);
+    entry = NULL;
+  }
+
+  if(!entry) {
+    cache->misses++;
+    return NULL;
+  }
+
+  if(entry->resp) {
+    // move to the tail of the LRU order
+    HASH_DELETE(hh, cache->entries, entry);
+    HASH_ADD_KEYPTR(hh, cache->entries, entry->key, entry->key_len, entry);
+
+    // a response too large for the client must be fetched again
+    if(entry->resp_len <= query->udp_size)
+      cache->hits++;
+    else
+      cache->misses++;
+  }
+
+  return entry;
+}
+
+/* ******************************************************* */
+
+dns_cache_entry_t* dns_cache_add_pending(dns_cache_t *cache, const dns_query_t *query,
+        const zdtun_5tuple_t *leader, time_t now) {
+  dns_cache_entry_t *entry = new_entry(cache, query->key, query->key_len);
+
+  if(!entry)
+    return NULL;
+
+  entry->tstamp = now;
+  entry->expire = now + DNS_PENDING_TIMEOUT;
+  entry->leader = *leader;
+  entry->udp_size = query->udp_size;
+
+  return entry;
+}
+
+/* ******************************************************* */
+
+/* Makes the query wait for the response of a pending entry. Returns 0 if the
+ * query was added, 1 if it was already waiting, -1 if it must be sent upstream. */
+int dns_cache_add_waiter(dns_cache_entry_t *entry, const dns_query_t *query, const zdtun_5tuple_t *tuple) {
+  // retransmissions of the upstream query go upstream, as well as the queries
+  // which may not fit the response size requested upstream
+  if(entry->resp || !memcmp(&entry->leader, tuple, sizeof(*tuple)) ||
+      (query->udp_size < entry->udp_size))
+    return -1;
+
+  for(int i = 0; i < entry->num_waiters; i++) {
+    dns_waiter_t *waiter = &entry->waiters[i];
+
+    // already waiting
+    if((waiter->query_id == query->query_id) && !memcmp(&waiter->tuple, tuple, sizeof(*tuple)))
+      return 1;
+  }
+
+  if(entry->num_waiters >= DNS_MAX_WAITERS)
+    return -1;
+
+  if(!entry->waiters) {
+    entry->waiters = malloc(DNS_MAX_WAITERS * sizeof(dns_waiter_t));
+
+    if(!entry->waiters)
+      return -1;
+  }
+
+  dns_waiter_t *waiter = &entry->waiters[entry->num_waiters++];
+
+  waiter->tuple = *tuple;
+  waiter->query_id = query->query_id;
+  memcpy(waiter->qname, query->qname, dns_key_name_len(entry->key_len));
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+/* Stores an upstream response, received on the tuple connection. Responses which cannot be cached are still
+ * stored, already expired, if some queries are waiting for them.
+ * Returns the entry of the response, NULL if it was not stored. */
+dns_cache_entry_t* dns_cache_store(dns_cache_t *cache, const char *resp, int len,
+        const zdtun_5tuple_t *tuple, time_t now) {
+  uint8_t key[DNS_MAX_KEY_LEN];
+  uint16_t key_len;
+  uint16_t opt_class = 0;
+  uint32_t opt_ttl = 0;
+  uint16_t ttl_offsets[DNS_MAX_TTLS];
+  uint32_t min_ttl = DNS_MAX_TTL;
+  int num_ttls = 0;
+  int cacheable;
+  dns_cache_entry_t *entry;
+
+  if((len < DNS_HEADER_LEN) || (len > 0xFFFF))
+    return NULL;
+
+  uint16_t flags = get_u16(resp + 2);
+
+  if(!(flags & DNS_FLAG_QR) || (DNS_OPCODE(flags) != 0) || (get_u16(resp + 4) != 1))
+    return NULL;
+
+  int off = parse_question(resp, len, key, &key_len);
+  if(off < 0)
+    return NULL;
+
+  cacheable = !(flags & DNS_FLAG_TC) &&
+    ((DNS_RCODE(flags) == DNS_RCODE_NOERROR) || (DNS_RCODE(flags) == DNS_RCODE_NXDOMAIN));
+
+  // the resolver echoes the CD bit and, if it supports EDNS, the DO bit
+  int has_opt = find_opt(resp, len, off, &opt_class, &opt_ttl);
+  uint8_t key_flags = ((flags & DNS_FLAG_CD) ? DNS_KEY_CD : 0) | ((opt_ttl & DNS_EDNS_DO) ? DNS_KEY_DO : 0);
+
+  if(has_opt < 0)
+    cacheable = 0;
+
+  add_key_suffix(key, &key_len, key_flags, tuple);
+
+  int num_rrs = get_u16(resp + 6) + get_u16(resp + 8) + get_u16(resp + 10);
+
+  for(int i = 0; (i < num_rrs) && cacheable; i++) {
+    off = skip_name(resp, len, off);
+
+    // type + class + ttl + rdlength
+    if((off < 0) || (off + 10 > len)) {
+      cacheable = 0;
+      break;
+    }
+
+    uint16_t rdlen = get_u16(resp + off + 8);
+
+    // the "TTL" of the OPT pseudo-RR holds the EDNS flags
+    if(get_u16(resp + off) != DNS_TYPE_OPT) {
+      uint32_t ttl = get_u32(resp + off + 4);
+
+      if(num_ttls >= DNS_MAX_TTLS) {
+        cacheable = 0;
+        break;
+      }
+
+      ttl_offsets[num_ttls++] = off + 4;
+
+      if(ttl < min_ttl)
+        min_ttl = ttl;
+    }
+
+    off += 10 + rdlen;
+
+    if(off > len)
+      cacheable = 0;
+  }
+
+  // nothing to derive the TTL from
+  if((num_ttls == 0) || (min_ttl == 0))
+    cacheable = 0;
+
+  HASH_FIND(hh, cache->entries, key, key_len, entry);
+
+  if((has_opt <= 0) && (!entry || entry->resp)) {
+    // a resolver without EDNS drops the DO bit, the response also
+    // resolves a pending DO query
+    dns_cache_entry_t *do_entry;
+
+    key[key_len - DNS_KEY_SUFFIX_LEN] |= DNS_KEY_DO;
+    HASH_FIND(hh, cache->entries, key, key_len, do_entry);
+
+    if(do_entry && !do_entry->resp)
+      entry = do_entry;
+    else
+      key[key_len - DNS_KEY_SUFFIX_LEN] = key_flags;
+  }
+
+  if(!entry) {
+    if(!cacheable)
+      return NULL;
+
+    entry = new_entry(cache, key, key_len);
+    if(!entry)
+      return NULL;
+  } else if(entry->resp && !cacheable) {
+    // keep the response already cached
+    return NULL;
+  }
+
+  char *copy = realloc(entry->resp, len);
+
+  if(!copy) {
+    free_entry(cache, entry);
+    return NULL;
+  }
+
+  memcpy(copy, resp, len);
+  entry->resp = copy;
+  entry->resp_len = len;
+  entry->tstamp = now;
+  entry->expire = cacheable ? (now + min_ttl) : now;
+  entry->num_ttls = cacheable ? num_ttls : 0;
+  memcpy(entry->ttl_offsets, ttl_offsets, num_ttls * sizeof(uint16_t));
+
+  return entry;
+}
+
+/* ******************************************************* */
+
+/* Builds the answer to a query from a resolved entry, with the query ID and
+ * qname and the TTLs decreased by the time spent in the cache.
+ * Returns the length of the answer, -1 on error. */
+int dns_cache_answer(const dns_cache_entry_t *entry, uint16_t query_id, const uint8_t *qname,
+        time_t now, char *out, int out_size) {
+  uint32_t elapsed = (now > entry->tstamp) ? (now - entry->tstamp) : 0;
+
+  if(!entry->resp || (entry->resp_len > out_size))
+    return -1;
+
+  memcpy(out, entry->resp, entry->resp_len);
+  memcpy(out, &query_id, sizeof(query_id));
+  memcpy(out + DNS_HEADER_LEN, qname, dns_key_name_len(entry->key_len));
+
+  for(int i = 0; i < entry->num_ttls; i++) {
+    char *p = out + entry->ttl_offsets[i];
+    uint32_t ttl = get_u32(p);
+
+    put_u32(p, (ttl > elapsed) ? (ttl - elapsed) : 0);
+  }
+
+  return entry->resp_len;
+}
+
+/* ******************************************************* */
+
+/* Converts a cache key to the dotted qname. Returns 0 on success. */
+int dns_key_to_name(const uint8_t *key, uint16_t key_len, char *buf, int bufsize, uint16_t *qtype) {
+  int name_len = dns_key_name_len(key_len);
+  int off = 0, out = 0;
+
+  if((name_len <= 0) || (bufsize < 2))
+    return -1;
+
+  while((off < name_len) && key[off]) {
+    uint8_t label_len = key[off++];
+
+    if((off + label_len > name_len) || (out + label_len + 2 > bufsize))
+      return -1;
+
+    if(out > 0)
+      buf[out++] = '.';
+
+    memcpy(buf + out, key + off, label_len);
+    out += label_len;
+    off += label_len;
+  }
+
+  // root
+  if(out == 0)
+    buf[out++] = '.';
+
+  buf[out] = '\0';
+  *qtype = get_u16((const char*) key + name_len);
+
+  return 0;
+}
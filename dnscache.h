@@ -0,0 +1,119 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __ZDTUN_DNSCACHE_H__
+#define __ZDTUN_DNSCACHE_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "zdtun.h"
+#include "third_party/uthash.h"
+
+#define DNS_MAX_NAME_LEN 255
+
+// EDNS flags + resolver IP version + resolver IP
+#define DNS_KEY_SUFFIX_LEN 18
+
+// qname (lowercase, wire format) + qtype + qclass + suffix
+#define DNS_MAX_KEY_LEN (DNS_MAX_NAME_LEN + 4 + DNS_KEY_SUFFIX_LEN)
+
+// the max response size of the clients without EDNS
+#define DNS_DEFAULT_UDP_SIZE 512
+
+// max number of queries which can wait for the same upstream response
+#define DNS_MAX_WAITERS 8
+
+// max number of RRs whose TTL is adjusted in the cached responses
+#define DNS_MAX_TTLS 32
+
+/*
+ * A cache of the DNS responses, keyed by (qname, qtype, qclass), the DO and CD
+ * bits and the resolver address, so that the resolvers and the DNSSEC
+ * queries do not share their responses.
+ *
+ * An entry is either pending, when a query has been sent upstream and its
+ * response is still missing, or resolved. The identical queries received while
+ * an entry is pending are recorded as waiters and answered when the upstream
+ * response arrives. The entries are kept in LRU order.
+ */
+typedef struct {
+  zdtun_5tuple_t tuple;         // the connection of the query
+  uint16_t query_id;            // network byte order
+  uint8_t qname[DNS_MAX_NAME_LEN]; // as sent by the client, to preserve its case
+} dns_waiter_t;
+
+typedef struct dns_cache_entry {
+  time_t tstamp;                // when the response was stored, or the query sent
+  time_t expire;                // the entry is stale after this
+  zdtun_5tuple_t leader;        // the connection of the upstream query
+  uint16_t udp_size;            // the max response size of the upstream query
+  char *resp;                   // NULL if pending
+  uint16_t resp_len;
+  uint8_t num_ttls;
+  uint8_t num_waiters;
+  uint16_t ttl_offsets[DNS_MAX_TTLS];
+  dns_waiter_t *waiters;
+  UT_hash_handle hh;
+  uint16_t key_len;
+  uint8_t key[];
+} dns_cache_entry_t;
+
+typedef struct {
+  dns_cache_entry_t *entries;
+  uint32_t max_entries;         // 0 if the cache is disabled
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t coalesced;
+} dns_cache_t;
+
+typedef struct {
+  uint8_t key[DNS_MAX_KEY_LEN];
+  uint16_t key_len;
+  uint16_t query_id;            // network byte order
+  uint16_t udp_size;            // the max response size accepted by the client
+  const uint8_t *qname;         // points into the query
+} dns_query_t;
+
+void dns_cache_init(dns_cache_t *cache, uint32_t max_entries);
+void dns_cache_flush(dns_cache_t *cache);
+void dns_cache_set_size(dns_cache_t *cache, uint32_t max_entries);
+int dns_parse_query(const char *msg, int len, const zdtun_5tuple_t *tuple, dns_query_t *query);
+dns_cache_entry_t* dns_cache_find(dns_cache_t *cache, const dns_query_t *query, time_t now);
+dns_cache_entry_t* dns_cache_add_pending(dns_cache_t *cache, const dns_query_t *query,
+        const zdtun_5tuple_t *leader, time_t now);
+int dns_cache_add_waiter(dns_cache_entry_t *entry, const dns_query_t *query, const zdtun_5tuple_t *tuple);
+dns_cache_entry_t* dns_cache_store(dns_cache_t *cache, const char *resp, int len,
+        const zdtun_5tuple_t *tuple, time_t now);
+int dns_cache_answer(const dns_cache_entry_t *entry, uint16_t query_id, const uint8_t *qname,
+        time_t now, char *out, int out_size);
+int dns_key_to_name(const uint8_t *key, uint16_t key_len, char *buf, int bufsize, uint16_t *qtype);
+
+static inline int dns_key_name_len(uint16_t key_len) {
+  return key_len - 4 - DNS_KEY_SUFFIX_LEN;
+}
+
+static inline uint32_t dns_cache_count(const dns_cache_t *cache) {
+  return HASH_COUNT(cache->entries);
+}
+
+#endif
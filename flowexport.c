@@ -0,0 +1,129 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include "flowexport.h"
+
+#ifndef WIN32
+
+#include <stdatomic.h>
+
+struct flow_export {
+  _Atomic uint32_t seq;         // odd while swapping the buffers
+  _Atomic uint32_t pub_idx;     // the published buffer
+  _Atomic uint32_t pub_count;
+  uint32_t max_flows;
+  zdtun_flow_t *bufs[2];
+};
+
+/* ******************************************************* */
+
+flow_export_t* flow_export_create(uint32_t max_flows) {
+  flow_export_t *fe;
+
+  safe_alloc(fe, flow_export_t);
+  fe->max_flows = max_flows;
+
+  if(!(fe->bufs[0] = (zdtun_flow_t*) calloc(max_flows, sizeof(zdtun_flow_t))) ||
+      !(fe->bufs[1] = (zdtun_flow_t*) calloc(max_flows, sizeof(zdtun_flow_t)))) {
+    error("flow export: allocation failed");
+    flow_export_destroy(fe);
+    return(NULL);
+  }
+
+  return(fe);
+}
+
+/* ******************************************************* */
+
+void flow_export_destroy(flow_export_t *fe) {
+  free(fe->bufs[0]);
+  free(fe->bufs[1]);
+  free(fe);
+}
+
+/* ******************************************************* */
+
+zdtun_flow_t* flow_export_staging(flow_export_t *fe) {
+  return(fe->bufs[atomic_load_explicit(&fe->pub_idx, memory_order_relaxed) ^ 1]);
+}
+
+/* ******************************************************* */
+
+uint32_t flow_export_capacity(const flow_export_t *fe) {
+  return(fe->max_flows);
+}
+
+/* ******************************************************* */
+
+void flow_export_publish(flow_export_t *fe, uint32_t num_flows) {
+  uint32_t seq = atomic_load_explicit(&fe->seq, memory_order_relaxed);
+
+  // the readers of the old buffer, which becomes the staging one, will retry
+  atomic_store_explicit(&fe->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  atomic_store_explicit(&fe->pub_idx, atomic_load_explicit(&fe->pub_idx, memory_order_relaxed) ^ 1,
+    memory_order_relaxed);
+  atomic_store_explicit(&fe->pub_count, min(num_flows, fe->max_flows), memory_order_relaxed);
+
+  atomic_store_explicit(&fe->seq, seq + 2, memory_order_release);
+}
+
+/* ******************************************************* */
+
+uint32_t flow_export_read(flow_export_t *fe, zdtun_flow_t *flows, uint32_t max_flows) {
+  uint32_t seq, count = 0;
+
+  do {
+    seq = atomic_load_explicit(&fe->seq, memory_order_acquire);
+
+    if(seq & 1)
+      continue;
+
+    count = atomic_load_explicit(&fe->pub_count, memory_order_relaxed);
+    count = min(count, max_flows);
+
+    memcpy(flows, fe->bufs[atomic_load_explicit(&fe->pub_idx, memory_order_relaxed)],
+      count * sizeof(zdtun_flow_t));
+
+    // the copy must complete before checking the sequence again
+    atomic_thread_fence(memory_order_acquire);
+  } while((seq & 1) || (atomic_load_explicit(&fe->seq, memory_order_relaxed) != seq));
+
+  return(count);
+}
+
+#else // WIN32
+
+flow_export_t* flow_export_create(uint32_t max_flows) {
+  error("flow export: not supported on Windows");
+  return(NULL);
+}
+
+void flow_export_destroy(flow_export_t *fe) {}
+zdtun_flow_t* flow_export_staging(flow_export_t *fe) { return(NULL); }
+uint32_t flow_export_capacity(const flow_export_t *fe) { return(0); }
+void flow_export_publish(flow_export_t *fe, uint32_t num_flows) {}
+uint32_t flow_export_read(flow_export_t *fe, zdtun_flow_t *flows, uint32_t max_flows) { return(0); }
+
+#endif
@@ -0,0 +1,52 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+
+#ifndef __ZDTUN_FLOWEXPORT_H__
+#define __ZDTUN_FLOWEXPORT_H__
+
+#include <stdint.h>
+#include "zdtun.h"
+
+/*
+ * The flow records published for zdtun_flows_snapshot.
+ *
+ * The owner thread fills the staging buffer at its own pace, then
+ * flow_export_publish swaps it with the published buffer. The published
+ * records can be read from any thread: the readers retry when the buffers are
+ * swapped during the copy (seqlock), so the owner thread never waits for them.
+ */
+typedef struct flow_export flow_export_t;
+
+flow_export_t* flow_export_create(uint32_t max_flows);
+void flow_export_destroy(flow_export_t *fe);
+
+/* The buffer to fill, with room for max_flows records. Only for the owner thread. */
+zdtun_flow_t* flow_export_staging(flow_export_t *fe);
+uint32_t flow_export_capacity(const flow_export_t *fe);
+void flow_export_publish(flow_export_t *fe, uint32_t num_flows);
+
+/* Copies up to max_flows published records. Returns the number of copied records. */
+uint32_t flow_export_read(flow_export_t *fe, zdtun_flow_t *flows, uint32_t max_flows);
+
+#endif
@@ -0,0 +1,258 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "flowtable.h"
+
+// must be a power of 2
+#define FLOWTABLE_INITIAL_SLOTS 256
+#define FLOWTABLE_INITIAL_ENTRIES 64
+
+// the slots are doubled when more than 3/4 of them are in use
+#define flowtable_needs_grow(ft, n) (((uint64_t)(n)) * 4 > ((uint64_t)(ft)->mask + 1) * 3)
+
+// distance of the slot i from the home slot of hash
+#define probe_distance(mask, hash, i) (((i) - ((hash) & (mask))) & (mask))
+
+#define SLOT_NOT_FOUND ((uint32_t)-1)
+
+/* ******************************************************* */
+
+// murmur3 64-bit finalizer
+static inline uint64_t fmix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* ******************************************************* */
+
+uint32_t flowtable_hash(const zdtun_5tuple_t *key) {
+  uint64_t words[4];
+  int num_words;
+  uint64_t h = ((uint64_t)key->src_port << 32) | ((uint64_t)key->dst_port << 16) |
+    ((uint64_t)key->ipver << 8) | key->ipproto;
+
+  if(key->ipver == 4) {
+    words[0] = ((uint64_t)key->src_ip.ip4 << 32) | key->dst_ip.ip4;
+    num_words = 1;
+  } else {
+    memcpy(words, &key->src_ip.ip6, 16);
+    memcpy(words + 2, &key->dst_ip.ip6, 16);
+    num_words = 4;
+  }
+
+  for(int i = 0; i < num_words; i++) {
+    h = (h ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+
+  uint32_t hash = (uint32_t) fmix64(h);
+
+  // 0 is reserved for the free slots
+  return hash ? hash : 1;
+}
+
+/* ******************************************************* */
+
+int flowtable_init(flowtable_t *ft) {
+  memset(ft, 0, sizeof(*ft));
+
+  ft->slots = (flow_slot_t*) calloc(FLOWTABLE_INITIAL_SLOTS, sizeof(flow_slot_t));
+  if(!ft->slots)
+    return -1;
+
+  ft->mask = FLOWTABLE_INITIAL_SLOTS - 1;
+  return 0;
+}
+
+/* ******************************************************* */
+
+void flowtable_destroy(flowtable_t *ft) {
+  free(ft->slots);
+  free(ft->entries);
+  memset(ft, 0, sizeof(*ft));
+}
+
+/* ******************************************************* */
+
+// Robin Hood insertion: an entry closer to its home slot is displaced by the
+// entry being inserted, which keeps the probe sequences short
+static void insert_slot(flow_slot_t *slots, uint32_t mask, uint32_t hash, uint32_t idx) {
+  flow_slot_t cur = { .hash = hash, .idx = idx };
+  uint32_t i = hash & mask;
+  uint32_t dist = 0;
+
+  while(1) {
+    flow_slot_t *slot = &slots[i];
+    uint32_t slot_dist;
+
+    if(!slot->hash) {
+      *slot = cur;
+      return;
+    }
+
+    slot_dist = probe_distance(mask, slot->hash, i);
+
+    if(slot_dist < dist) {
+      flow_slot_t tmp = *slot;
+
+      *slot = cur;
+      cur = tmp;
+      dist = slot_dist;
+    }
+
+    i = (i + 1) & mask;
+    dist++;
+  }
+}
+
+/* ******************************************************* */
+
+static uint32_t find_slot(flowtable_t *ft, const zdtun_5tuple_t *key, uint32_t hash) {
+  uint32_t mask = ft->mask;
+  uint32_t i = hash & mask;
+  uint32_t dist = 0;
+
+  while(1) {
+    flow_slot_t *slot = &ft->slots[i];
+
+    // with Robin Hood, the key cannot be past a slot closer to its home
+    if(!slot->hash || (probe_distance(mask, slot->hash, i) < dist))
+      return SLOT_NOT_FOUND;
+
+    if((slot->hash == hash) && !memcmp(ft->entries[slot->idx].key, key, sizeof(*key)))
+      return i;
+
+    i = (i + 1) & mask;
+    dist++;
+  }
+}
+
+/* ******************************************************* */
+
+void* flowtable_find(flowtable_t *ft, const zdtun_5tuple_t *key) {
+  uint32_t i = find_slot(ft, key, flowtable_hash(key));
+
+  return (i != SLOT_NOT_FOUND) ? ft->entries[ft->slots[i].idx].value : NULL;
+}
+
+/* ******************************************************* */
+
+static int grow_slots(flowtable_t *ft) {
+  uint32_t num_slots = (ft->mask + 1) * 2;
+  flow_slot_t *slots = (flow_slot_t*) calloc(num_slots, sizeof(flow_slot_t));
+
+  if(!slots)
+    return -1;
+
+  // the dense array contains all the hashes, the old slots can be discarded
+  for(uint32_t i = 0; i < ft->count; i++)
+    insert_slot(slots, num_slots - 1, ft->entries[i].hash, i);
+
+  free(ft->slots);
+  ft->slots = slots;
+  ft->mask = num_slots - 1;
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+int flowtable_add(flowtable_t *ft, const zdtun_5tuple_t *key, void *value) {
+  uint32_t hash = flowtable_hash(key);
+
+  if(ft->count == ft->entries_cap) {
+    uint32_t cap = ft->entries_cap ? (ft->entries_cap * 2) : FLOWTABLE_INITIAL_ENTRIES;
+    flow_entry_t *entries = (flow_entry_t*) realloc(ft->entries, cap * sizeof(flow_entry_t));
+
+    if(!entries)
+      return -1;
+
+    ft->entries = entries;
+    ft->entries_cap = cap;
+  }
+
+  if(flowtable_needs_grow(ft, ft->count + 1) && (grow_slots(ft) != 0))
+    return -1;
+
+  flow_entry_t *entry = &ft->entries[ft->count];
+  entry->key = key;
+  entry->value = value;
+  entry->hash = hash;
+
+  insert_slot(ft->slots, ft->mask, hash, ft->count);
+  ft->count++;
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+int flowtable_remove(flowtable_t *ft, const zdtun_5tuple_t *key) {
+  uint32_t mask = ft->mask;
+  uint32_t i = find_slot(ft, key, flowtable_hash(key));
+  uint32_t idx, last;
+
+  if(i == SLOT_NOT_FOUND)
+    return -1;
+
+  idx = ft->slots[i].idx;
+
+  // backward shift deletion: move back the following slots of the cluster,
+  // until a free slot or a slot in its home position is found
+  while(1) {
+    uint32_t next = (i + 1) & mask;
+    flow_slot_t *slot = &ft->slots[next];
+
+    if(!slot->hash || (probe_distance(mask, slot->hash, next) == 0))
+      break;
+
+    ft->slots[i] = *slot;
+    i = next;
+  }
+
+  ft->slots[i].hash = 0;
+
+  // keep the dense array compact by moving the last entry into the hole
+  last = ft->count - 1;
+
+  if(idx != last) {
+    flow_entry_t *entry = &ft->entries[idx];
+
+    *entry = ft->entries[last];
+    i = entry->hash & mask;
+
+    while(ft->slots[i].idx != last || (ft->slots[i].hash != entry->hash))
+      i = (i + 1) & mask;
+
+    ft->slots[i].idx = idx;
+  }
+
+  ft->count--;
+  return 0;
+}
@@ -0,0 +1,82 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __ZDTUN_FLOWTABLE_H__
+#define __ZDTUN_FLOWTABLE_H__
+
+#include <stdint.h>
+#include "zdtun.h"
+
+/*
+ * An open addressing hash table which maps a zdtun_5tuple_t to a value, using
+ * Robin Hood hashing with backward shift deletion. The slots only contain the
+ * hash of the key and the index of the entry into a dense array, which holds
+ * the actual keys and values. The dense array can be iterated with
+ * flowtable_count/flowtable_value.
+ *
+ * The keys are not copied: a key must stay valid (and unchanged) until its
+ * entry is removed, e.g. it can point to a field of the value.
+ */
+typedef struct {
+  uint32_t hash;        // 0 if the slot is free
+  uint32_t idx;         // index into the entries array
+} flow_slot_t;
+
+typedef struct {
+  const zdtun_5tuple_t *key;
+  void *value;
+  uint32_t hash;
+} flow_entry_t;
+
+typedef struct {
+  flow_slot_t *slots;
+  uint32_t mask;        // number of slots - 1
+  flow_entry_t *entries;
+  uint32_t count;
+  uint32_t entries_cap;
+} flowtable_t;
+
+int flowtable_init(flowtable_t *ft);
+void flowtable_destroy(flowtable_t *ft);
+
+uint32_t flowtable_hash(const zdtun_5tuple_t *key);
+
+/* Returns the value associated to the key, or NULL */
+void* flowtable_find(flowtable_t *ft, const zdtun_5tuple_t *key);
+
+/* The key must not be already present. Returns 0 on success */
+int flowtable_add(flowtable_t *ft, const zdtun_5tuple_t *key, void *value);
+
+/* Removes the key, moving the last entry of the dense array in its place.
+ * Returns 0 if the key was found. */
+int flowtable_remove(flowtable_t *ft, const zdtun_5tuple_t *key);
+
+static inline uint32_t flowtable_count(const flowtable_t *ft) {
+  return ft->count;
+}
+
+static inline void* flowtable_value(const flowtable_t *ft, uint32_t i) {
+  return ft->entries[i].value;
+}
+
+#endif
@@ -0,0 +1,232 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#ifdef WIN32
+#include <malloc.h>
+#endif
+#include "mempool.h"
+
+// Items are aligned to a cache line. The slabs are allocated on a cache line
+// boundary and the header is padded, so that an item of two cache lines, like
+// zdtun_conn_t, never spans three.
+#define POOL_ALIGN 64
+#define align_size(s) (((s) + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1))
+
+// A slab header, followed by the items
+typedef struct slab {
+  struct slab *next;
+  char pad[POOL_ALIGN - sizeof(struct slab*)];
+  char items[];
+} slab_t;
+
+_Static_assert(sizeof(slab_t) == POOL_ALIGN, "the slab header must be padded to POOL_ALIGN");
+// with the item sizes rounded by align_size, every item starts on a cache
+// line, which keeps the per-packet fields of zdtun_conn_t in a single one
+_Static_assert((offsetof(slab_t, items) % POOL_ALIGN) == 0, "the slab items must be aligned to POOL_ALIGN");
+
+// Overlaid to the free items
+typedef struct free_item {
+  struct free_item *next;
+} free_item_t;
+
+/* ******************************************************* */
+
+static slab_t* slab_alloc(size_t size) {
+#ifdef WIN32
+  return (slab_t*) _aligned_malloc(size, POOL_ALIGN);
+#else
+  void *slab;
+
+  if(posix_memalign(&slab, POOL_ALIGN, size) != 0)
+    return NULL;
+
+  return (slab_t*) slab;
+#endif
+}
+
+static void slab_free(slab_t *slab) {
+#ifdef WIN32
+  _aligned_free(slab);
+#else
+  free(slab);
+#endif
+}
+
+/* ******************************************************* */
+
+void mempool_init(mempool_t *pool, uint32_t item_size, uint32_t items_per_slab) {
+  memset(pool, 0, sizeof(*pool));
+
+  if(item_size < sizeof(free_item_t))
+    item_size = sizeof(free_item_t);
+
+  pool->item_size = align_size(item_size);
+  pool->items_per_slab = (items_per_slab > 0) ? items_per_slab : 1;
+}
+
+/* ******************************************************* */
+
+void mempool_destroy(mempool_t *pool) {
+  slab_t *slab = (slab_t*) pool->slabs;
+
+  while(slab) {
+    slab_t *next = slab->next;
+    slab_free(slab);
+    slab = next;
+  }
+
+  pool->slabs = NULL;
+  pool->free_list = NULL;
+}
+
+/* ******************************************************* */
+
+void* mempool_alloc(mempool_t *pool) {
+  free_item_t *item = (free_item_t*) pool->free_list;
+
+  if(item)
+    pool->hits++;
+  else {
+    // Allocate a new slab and add its items to the free list
+    slab_t *slab = slab_alloc(sizeof(slab_t) + (size_t)pool->item_size * pool->items_per_slab);
+
+    if(!slab)
+      return NULL;
+
+    slab->next = (slab_t*) pool->slabs;
+    pool->slabs = slab;
+
+    for(int i = pool->items_per_slab - 1; i >= 0; i--) {
+      free_item_t *cur = (free_item_t*) &slab->items[(size_t)i * pool->item_size];
+
+      cur->next = item;
+      item = cur;
+    }
+
+    pool->misses++;
+  }
+
+  pool->free_list = item->next;
+  memset(item, 0, pool->item_size);
+
+  return item;
+}
+
+/* ******************************************************* */
+
+void mempool_free(mempool_t *pool, void *ptr) {
+  free_item_t *item = (free_item_t*) ptr;
+
+  if(!item)
+    return;
+
+  item->next = (free_item_t*) pool->free_list;
+  pool->free_list = item;
+}
+
+/* ******************************************************* */
+
+// The biggest class holds a full TCP segment from the client (64 KB)
+static const size_t bufpool_classes[BUFPOOL_NUM_CLASSES] = {
+  256, 1024, 2048, 4096, 16384, 65536 + 64
+};
+
+static int bufpool_class(size_t size) {
+  for(int i = 0; i < BUFPOOL_NUM_CLASSES; i++) {
+    if(size <= bufpool_classes[i])
+      return i;
+  }
+
+  return -1;
+}
+
+/* ******************************************************* */
+
+void bufpool_init(bufpool_t *pool, uint32_t max_cached) {
+  memset(pool, 0, sizeof(*pool));
+  pool->max_cached = max_cached;
+}
+
+/* ******************************************************* */
+
+void bufpool_destroy(bufpool_t *pool) {
+  for(int i = 0; i < BUFPOOL_NUM_CLASSES; i++) {
+    free_item_t *item = (free_item_t*) pool->free_list[i];
+
+    while(item) {
+      free_item_t *next = item->next;
+      free(item);
+      item = next;
+    }
+
+    pool->free_list[i] = NULL;
+    pool->num_cached[i] = 0;
+  }
+}
+
+/* ******************************************************* */
+
+void* bufpool_alloc(bufpool_t *pool, size_t size) {
+  int cls = bufpool_class(size);
+  free_item_t *item;
+
+  if(cls < 0) {
+    pool->misses++;
+    return malloc(size);
+  }
+
+  item = (free_item_t*) pool->free_list[cls];
+
+  if(item) {
+    pool->free_list[cls] = item->next;
+    pool->num_cached[cls]--;
+    pool->hits++;
+
+    return item;
+  }
+
+  pool->misses++;
+  return malloc(bufpool_classes[cls]);
+}
+
+/* ******************************************************* */
+
+void bufpool_free(bufpool_t *pool, void *buf, size_t size) {
+  int cls = bufpool_class(size);
+  free_item_t *item = (free_item_t*) buf;
+
+  if(!buf)
+    return;
+
+  if((cls < 0) || (pool->num_cached[cls] >= pool->max_cached)) {
+    free(buf);
+    return;
+  }
+
+  item->next = (free_item_t*) pool->free_list[cls];
+  pool->free_list[cls] = item;
+  pool->num_cached[cls]++;
+}
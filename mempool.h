@@ -0,0 +1,80 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2022 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __ZDTUN_MEMPOOL_H__
+#define __ZDTUN_MEMPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A slab allocator for fixed size items. Items are carved from slabs of
+ * items_per_slab items, each one aligned to a 64 bytes cache line. Freed items are kept in a free list and reused,
+ * slabs are only released by mempool_destroy.
+ */
+typedef struct {
+  uint32_t item_size;
+  uint32_t items_per_slab;
+  void *free_list;
+  void *slabs;
+
+  uint32_t hits;        // items served from the free list
+  uint32_t misses;      // items which required a new slab
+} mempool_t;
+
+void mempool_init(mempool_t *pool, uint32_t item_size, uint32_t items_per_slab);
+void mempool_destroy(mempool_t *pool);
+
+/* Returns a zeroed item, or NULL if the allocation fails */
+void* mempool_alloc(mempool_t *pool);
+void mempool_free(mempool_t *pool, void *item);
+
+/* ******************************************************* */
+
+#define BUFPOOL_NUM_CLASSES 6
+
+/*
+ * A size-classed buffer pool. A buffer is allocated from the smallest class
+ * which can hold it and, when freed, it is cached to be reused by a later
+ * allocation of the same class. Up to max_cached buffers are cached per class.
+ * Buffers bigger than the biggest class are directly allocated with malloc.
+ */
+typedef struct {
+  void *free_list[BUFPOOL_NUM_CLASSES];
+  uint32_t num_cached[BUFPOOL_NUM_CLASSES];
+  uint32_t max_cached;
+
+  uint32_t hits;        // buffers served from the cache
+  uint32_t misses;      // buffers which required a malloc
+} bufpool_t;
+
+void bufpool_init(bufpool_t *pool, uint32_t max_cached);
+void bufpool_destroy(bufpool_t *pool);
+
+/* Returns an uninitialized buffer of at least size bytes, or NULL */
+void* bufpool_alloc(bufpool_t *pool, size_t size);
+
+/* size must match the one passed to bufpool_alloc */
+void bufpool_free(bufpool_t *pool, void *buf, size_t size);
+
+#endif
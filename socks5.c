@@ -27,6 +27,11 @@
 
 #define SOCKS5_AUTH_USERNAME_PASSWORD 0x02
 
+#define SOCKS5_HELLO_LEN 3
+
+// CONNECT request with an IPv6 address
+#define SOCKS5_MAX_REQ_LEN 22
+
 PACK_ON
 struct socks5_srv_choice {
   uint8_t ver;
@@ -62,57 +67,48 @@ typedef enum {
 
 /* ******************************************************* */
 
-int socks5_connect(zdtun_t *tun, zdtun_conn_t *conn) {
-  // ver, nauth, no_auth|username_password
-  uint8_t hello[] = {5, 1, tun->socks5_user ? SOCKS5_AUTH_USERNAME_PASSWORD : 0};
-
-  if(send(conn->sock, hello, 3, 0) < 0)
-    return close_with_socket_error(tun, conn, "SOCKS5_HELLO send");
+// ver, nauth, no_auth|username_password
+static int build_hello(zdtun_t *tun, uint8_t *buf) {
+  buf[0] = 5;
+  buf[1] = 1;
+  buf[2] = tun->socks5_user ? SOCKS5_AUTH_USERNAME_PASSWORD : 0;
 
-  //debug("SOCKS5_HELLO sent");
+  return 3;
+}
 
-  conn->socks5_status = SOCKS5_HELLO;
+/* ******************************************************* */
 
-  return 0;
+static int auth_req_len(zdtun_t *tun) {
+  return tun->socks5_user ? (3 + strlen(tun->socks5_user) + strlen(tun->socks5_pass)) : 0;
 }
 
 /* ******************************************************* */
 
 // Client auth request - https://datatracker.ietf.org/doc/html/rfc1929
-static int socks5_auth(zdtun_t *tun, zdtun_conn_t *conn) {
+static int build_auth_req(zdtun_t *tun, uint8_t *buf) {
   int user_len = strlen(tun->socks5_user);
   int pass_len = strlen(tun->socks5_pass);
   int i = 0;
 
-  uint8_t auth_req[3 + user_len + pass_len];
+  buf[i++] = 1;
 
-  auth_req[i++] = 1;
-
-  auth_req[i++] = user_len;
-  memcpy(auth_req + i, tun->socks5_user, user_len);
+  buf[i++] = user_len;
+  memcpy(buf + i, tun->socks5_user, user_len);
   i += user_len;
 
-  auth_req[i++] = pass_len;
-  memcpy(auth_req + i, tun->socks5_pass, pass_len);
+  buf[i++] = pass_len;
+  memcpy(buf + i, tun->socks5_pass, pass_len);
   i += pass_len;
 
-  if(send(conn->sock, auth_req, i, 0) < 0)
-    return close_with_socket_error(tun, conn, "SOCKS5_AUTH send");
-
-  //debug("SOCKS5_AUTH sent");
-
-  conn->socks5_status = SOCKS5_AUTH;
-
-  return 0;
+  return i;
 }
 
 /* ******************************************************* */
 
-static int socks5_req(zdtun_t *tun, zdtun_conn_t *conn) {
-  uint8_t req[32], *p;
+static int build_connect_req(zdtun_conn_t *conn, uint8_t *buf) {
+  uint8_t *p = buf;
   int addrsize;
 
-  p = req;
   (*p++) = 5; // ver
   (*p++) = 1; // cmd: TCP/IP connection
   (*p++) = 0; // reserved
@@ -129,37 +125,177 @@ static int socks5_req(zdtun_t *tun, zdtun_conn_t *conn) {
 
   memcpy(p+addrsize, &conn->tuple.dst_port, 2);
 
-  if(send(conn->sock, req, 6+addrsize, 0) < 0)
+  return 6+addrsize;
+}
+
+/* ******************************************************* */
+
+// The greeting, the auth request (if any) and the CONNECT request, back to back
+static int build_pipelined_handshake(zdtun_t *tun, zdtun_conn_t *conn, uint8_t *buf) {
+  int len = build_hello(tun, buf);
+
+  if(tun->socks5_user)
+    len += build_auth_req(tun, buf + len);
+
+  return len + build_connect_req(conn, buf + len);
+}
+
+/* ******************************************************* */
+
+static int socks5_req(zdtun_t *tun, zdtun_conn_t *conn) {
+  uint8_t req[SOCKS5_MAX_REQ_LEN];
+
+  if(send(conn->sock, req, build_connect_req(conn, req), 0) < 0)
     return close_with_socket_error(tun, conn, "SOCKS5_CONNECTING send");
 
   //debug("SOCKS5_CONNECTING sent");
 
-  conn->socks5_status = SOCKS5_CONNECTING;
+  conn->ext->socks5_status = SOCKS5_CONNECTING;
+  return 0;
+}
+
+/* ******************************************************* */
+
+int socks5_connect(zdtun_t *tun, zdtun_conn_t *conn) {
+  if(conn->ext->socks5_flags & SOCKS5_FLAG_POOLED) {
+    // already authenticated, see socks5_pool_take
+    return socks5_req(tun, conn);
+  }
+
+  if(conn->ext->socks5_flags & SOCKS5_FLAG_SENT) {
+    // already sent with the SYN, see socks5_fastopen_connect
+    return 0;
+  }
+
+  if(tun->socks5_opts & (ZDTUN_SOCKS5_PIPELINE | ZDTUN_SOCKS5_FASTOPEN)) {
+    uint8_t handshake[SOCKS5_HELLO_LEN + auth_req_len(tun) + SOCKS5_MAX_REQ_LEN];
+    int len = build_pipelined_handshake(tun, conn, handshake);
+
+    if(send(conn->sock, handshake, len, 0) < 0)
+      return close_with_socket_error(tun, conn, "SOCKS5 pipelined send");
+
+    conn->ext->socks5_flags |= SOCKS5_FLAG_PIPELINED;
+  } else {
+    uint8_t hello[SOCKS5_HELLO_LEN];
+
+    if(send(conn->sock, hello, build_hello(tun, hello), 0) < 0)
+      return close_with_socket_error(tun, conn, "SOCKS5_HELLO send");
+  }
+
+  //debug("SOCKS5_HELLO sent");
+
+  conn->ext->socks5_status = SOCKS5_HELLO;
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+#ifdef MSG_FASTOPEN
+
+// Connects to the proxy with TCP Fast Open. When a TFO cookie is available,
+// the pipelined handshake is sent within the SYN, otherwise it's sent by
+// socks5_connect once connected. On success, returns SOCKET_ERROR with
+// socket_in_progress, like a non-blocking connect.
+// If TFO is not supported or disabled via net.ipv4.tcp_fastopen, it falls back
+// to a plain connect and stops using TFO for the next connections.
+int socks5_fastopen_connect(zdtun_t *tun, zdtun_conn_t *conn,
+        const struct sockaddr *addr, socklen_t addrlen) {
+  uint8_t handshake[SOCKS5_HELLO_LEN + auth_req_len(tun) + SOCKS5_MAX_REQ_LEN];
+  int len = build_pipelined_handshake(tun, conn, handshake);
+  int rv = sendto(conn->sock, handshake, len, MSG_FASTOPEN | MSG_NOSIGNAL, addr, addrlen);
+
+  if((rv < 0) && ((errno == EOPNOTSUPP) || (errno == EPIPE) || (errno == ENOTCONN))) {
+    log("TCP Fast Open not available[%d], only pipelining the SOCKS5 handshake", errno);
+
+    // the handshake will be sent by socks5_connect
+    tun->socks5_opts = (tun->socks5_opts & ~ZDTUN_SOCKS5_FASTOPEN) | ZDTUN_SOCKS5_PIPELINE;
+    return connect(conn->sock, addr, addrlen);
+  }
+
+  if(rv == len) {
+    conn->ext->socks5_flags |= SOCKS5_FLAG_PIPELINED | SOCKS5_FLAG_SENT;
+    conn->ext->socks5_status = SOCKS5_HELLO;
+    errno = socket_in_progress;
+  } else if(rv >= 0) {
+    // cannot happen with such a small handshake
+    errno = EPROTO;
+  }
+
+  // SOCKET_ERROR with socket_in_progress when the plain SYN was sent
+  return SOCKET_ERROR;
+}
+
+#endif
+
+/* ******************************************************* */
+
+static int socks5_auth(zdtun_t *tun, zdtun_conn_t *conn) {
+  uint8_t auth_req[auth_req_len(tun)];
+
+  if(send(conn->sock, auth_req, build_auth_req(tun, auth_req), 0) < 0)
+    return close_with_socket_error(tun, conn, "SOCKS5_AUTH send");
+
+  //debug("SOCKS5_AUTH sent");
+
+  conn->ext->socks5_status = SOCKS5_AUTH;
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+// In the pipelined mode the requests are already sent, so only the status is
+// updated. The replies may be received together, processes the remaining ones.
+static int socks5_next(zdtun_t *tun, zdtun_conn_t *conn, socks5_status_t status,
+        char *data, int len, int reply_len) {
+  conn->ext->socks5_status = status;
+
+  if(len > reply_len)
+    return handle_socks5_reply(tun, conn, data + reply_len, len - reply_len);
+
   return 0;
 }
 
 /* ******************************************************* */
 
 int handle_socks5_reply(zdtun_t *tun, zdtun_conn_t *conn, char *data, int len) {
-  if(conn->socks5_status == SOCKS5_HELLO) {
+  uint8_t pipelined = (conn->ext->socks5_flags & SOCKS5_FLAG_PIPELINED);
+
+  if(conn->ext->socks5_status == SOCKS5_HELLO) {
     struct socks5_srv_choice *reply = (struct socks5_srv_choice*) data;
 
-    if((len != 2) || (reply->ver != 5)) {
+    if((len < 2) || ((len != 2) && !pipelined) || (reply->ver != 5)) {
       zdtun_conn_close(tun, conn, CONN_STATUS_SOCKS5_ERROR);
       return -1;
     }
 
     if(reply->cauth != 0) {
-      if((reply->cauth == SOCKS5_AUTH_USERNAME_PASSWORD) && tun->socks5_user)
+      if((reply->cauth == SOCKS5_AUTH_USERNAME_PASSWORD) && tun->socks5_user) {
+        if(pipelined)
+          return socks5_next(tun, conn, SOCKS5_AUTH, data, len, 2);
+
         return socks5_auth(tun, conn);
+      }
 
       error("SOCKS5 bad auth: %d", reply->cauth);
       zdtun_conn_close(tun, conn, CONN_STATUS_SOCKS5_ERROR);
       return -1;
     }
 
+    if(pipelined) {
+      // the auth request was already sent, it would be parsed as the CONNECT
+      if(tun->socks5_user) {
+        error("SOCKS5 auth not requested by the proxy");
+        zdtun_conn_close(tun, conn, CONN_STATUS_SOCKS5_ERROR);
+        return -1;
+      }
+
+      return socks5_next(tun, conn, SOCKS5_CONNECTING, data, len, 2);
+    }
+
     return socks5_req(tun, conn);
-  } else if(conn->socks5_status == SOCKS5_AUTH) {
+  } else if(conn->ext->socks5_status == SOCKS5_AUTH) {
     struct socks5_auth_response *reply = (struct socks5_auth_response*) data;
 
     if((len < sizeof(*reply)) || (reply->ver != 1) || (reply->status != 0)) {
@@ -168,8 +304,11 @@ int handle_socks5_reply(zdtun_t *tun, zdtun_conn_t *conn, char *data, int len) {
       return -1;
     }
 
+    if(pipelined)
+      return socks5_next(tun, conn, SOCKS5_CONNECTING, data, len, sizeof(*reply));
+
     return socks5_req(tun, conn);
-  } else if(conn->socks5_status == SOCKS5_CONNECTING) {
+  } else if(conn->ext->socks5_status == SOCKS5_CONNECTING) {
     struct socks5_connect_reply *reply = (struct socks5_connect_reply*) data;
 
     if((len < 4) || (reply->ver != 5)) {
@@ -221,27 +360,286 @@ int handle_socks5_reply(zdtun_t *tun, zdtun_conn_t *conn, char *data, int len) {
 
       // some proxies split the BND address and port in different messages,
       // use SOCKS5_SKIP_BND to skip such bytes
-      conn->socks5_skip = to_skip;
-      conn->socks5_status = SOCKS5_SKIP_BND;
+      conn->ext->socks5_skip = to_skip;
+      conn->ext->socks5_status = SOCKS5_SKIP_BND;
 
       if(len > 4)
         return handle_socks5_reply(tun, conn, data + 4, len - 4);
 
       return 0;
     }
-  } else if((conn->socks5_status == SOCKS5_SKIP_BND) && (len <= conn->socks5_skip)) {
-    conn->socks5_skip -= len;
+  } else if((conn->ext->socks5_status == SOCKS5_SKIP_BND) && (len <= conn->ext->socks5_skip)) {
+    conn->ext->socks5_skip -= len;
 
-    if(conn->socks5_skip == 0) {
+    if(conn->ext->socks5_skip == 0) {
       //debug("SOCKS5 established");
-      conn->socks5_status = SOCKS5_ESTABLISHED;
+      conn->ext->socks5_status = SOCKS5_ESTABLISHED;
     }
 
     return 0;
   } else {
-    error("invalid SOCKS5 status: %d", conn->socks5_status);
+    error("invalid SOCKS5 status: %d", conn->ext->socks5_status);
 
     zdtun_conn_close(tun, conn, CONN_STATUS_SOCKS5_ERROR);
     return -1;
   }
 }
+
+/* ******************************************************* */
+
+// The pool keeps some connections to the proxy already authenticated, so that a
+// proxied connection only needs the CONNECT request. Since the pending events
+// may still reference them, the used entries are only freed by socks5_pool_purge.
+
+static void pool_set_events(zdtun_t *tun, socks5_pooled_t *entry, uint8_t events) {
+  if(entry->ev_mask == events)
+    return;
+
+  set_socket_events(tun, entry->sock, (void*)((uintptr_t)entry | EV_TAG_SOCKS5_POOL),
+    entry->ev_mask, events);
+  entry->ev_mask = events;
+}
+
+/* ******************************************************* */
+
+static void pool_drop(zdtun_t *tun, socks5_pooled_t *entry) {
+  socket_t sock = entry->sock;
+
+  pool_set_events(tun, entry, 0);
+  entry->sock = INVALID_SOCKET;
+  release_socket(tun, sock);
+}
+
+/* ******************************************************* */
+
+static int pool_open(zdtun_t *tun) {
+  struct sockaddr_in6 servaddr = {0};
+  socklen_t addrlen;
+  socks5_pooled_t *entry;
+  int val = 1;
+
+  socket_t sock = new_socket(tun, (tun->socks5.ipver == 4) ? PF_INET : PF_INET6,
+    SOCK_STREAM, IPPROTO_TCP);
+
+  if(sock == INVALID_SOCKET)
+    return -1;
+
+  if(!(entry = calloc(1, sizeof(*entry)))) {
+    error("socks5_pooled_t alloc failed");
+    release_socket(tun, sock);
+    return -1;
+  }
+
+  if(setsockopt(sock, SOL_TCP, TCP_NODELAY, &val, sizeof(val)) < 0)
+    error("setsockopt TCP_NODELAY failed");
+
+  set_nonblocking(sock, 1);
+
+  entry->sock = sock;
+  entry->status = SOCKS5_POOL_CONNECTING;
+  entry->tstamp = zdtun_now(tun);
+  entry->next = tun->socks5_pool;
+  tun->socks5_pool = entry;
+
+  if(tun->socks5.ipver == 4) {
+    struct sockaddr_in *addr4 = (struct sockaddr_in*) &servaddr;
+
+    addr4->sin_family = AF_INET;
+    addr4->sin_addr.s_addr = tun->socks5.ip.ip4;
+    addr4->sin_port = tun->socks5.port;
+    addrlen = sizeof(struct sockaddr_in);
+  } else {
+    servaddr.sin6_family = AF_INET6;
+    servaddr.sin6_addr = tun->socks5.ip.ip6;
+    servaddr.sin6_port = tun->socks5.port;
+    addrlen = sizeof(struct sockaddr_in6);
+  }
+
+  if((connect(sock, (struct sockaddr *) &servaddr, addrlen) == SOCKET_ERROR) &&
+      (socket_errno != socket_in_progress)) {
+    debug("SOCKS5 pool connect failed[%d]", socket_errno);
+    pool_drop(tun, entry);
+    return -1;
+  }
+
+  // reported as writable when connected
+  pool_set_events(tun, entry, ZDTUN_EV_WRITE);
+  return 0;
+}
+
+/* ******************************************************* */
+
+// Opens the missing connections of the pool. The failed connections are only
+// replaced by socks5_pool_purge or socks5_pool_take, to avoid a busy loop when
+// the proxy is down.
+void socks5_pool_fill(zdtun_t *tun) {
+  int num_open = 0;
+
+  if(tun->socks5.port == 0)
+    return;
+
+  for(socks5_pooled_t *entry = tun->socks5_pool; entry; entry = entry->next) {
+    if(entry->sock != INVALID_SOCKET)
+      num_open++;
+  }
+
+  while((num_open < tun->socks5_pool_size) && (pool_open(tun) == 0))
+    num_open++;
+}
+
+/* ******************************************************* */
+
+static void pool_ready(zdtun_t *tun, socks5_pooled_t *entry) {
+  //debug("SOCKS5 pooled connection ready");
+
+  entry->status = SOCKS5_POOL_READY;
+  entry->tstamp = zdtun_now(tun);
+}
+
+/* ******************************************************* */
+
+void handle_socks5_pool_event(zdtun_t *tun, socks5_pooled_t *entry, uint8_t readable, uint8_t writable) {
+  uint8_t reply[16];
+  int len;
+
+  if(entry->status == SOCKS5_POOL_CONNECTING) {
+    uint8_t hello[SOCKS5_HELLO_LEN];
+    int optval = -1;
+    socklen_t optlen = sizeof(optval);
+
+    if(!writable)
+      return;
+
+    if((getsockopt(entry->sock, SOL_SOCKET, SO_ERROR, (char*)&optval, &optlen) == SOCKET_ERROR) ||
+        (optval != 0) || (send(entry->sock, hello, build_hello(tun, hello), 0) < 0)) {
+      debug("SOCKS5 pool connect failed[%d]", (optval > 0) ? optval : socket_errno);
+      pool_drop(tun, entry);
+      return;
+    }
+
+    entry->status = SOCKS5_POOL_HELLO;
+    pool_set_events(tun, entry, ZDTUN_EV_READ);
+    return;
+  }
+
+  if(!readable)
+    return;
+
+  len = recv(entry->sock, (char*)reply, sizeof(reply), 0);
+
+  if((entry->status == SOCKS5_POOL_HELLO) && (len == 2) && (reply[0] == 5)) {
+    if((reply[1] == 0) && !tun->socks5_user) {
+      pool_ready(tun, entry);
+      return;
+    }
+
+    if((reply[1] == SOCKS5_AUTH_USERNAME_PASSWORD) && tun->socks5_user) {
+      uint8_t auth_req[auth_req_len(tun)];
+
+      if(send(entry->sock, auth_req, build_auth_req(tun, auth_req), 0) >= 0) {
+        entry->status = SOCKS5_POOL_AUTH;
+        return;
+      }
+    }
+  } else if((entry->status == SOCKS5_POOL_AUTH) && (len == 2) && (reply[0] == 1) && (reply[1] == 0)) {
+    pool_ready(tun, entry);
+    return;
+  }
+
+  // failed handshake, or a ready connection closed by the proxy
+  debug("SOCKS5 pooled connection dropped (status: %d, recv: %d)", entry->status, len);
+  pool_drop(tun, entry);
+}
+
+/* ******************************************************* */
+
+// Moves a ready connection of the pool to the proxied connection.
+// Returns 1 on success, 0 if no connection is ready.
+int socks5_pool_take(zdtun_t *tun, zdtun_conn_t *conn) {
+  time_t now = zdtun_now(tun);
+  int found = 0;
+
+  if(tun->socks5_pool_size == 0)
+    return 0;
+
+  for(socks5_pooled_t *entry = tun->socks5_pool; entry; entry = entry->next) {
+    if((entry->sock == INVALID_SOCKET) || (entry->status != SOCKS5_POOL_READY))
+      continue;
+
+    if(now >= (entry->tstamp + SOCKS5_POOL_MAX_IDLE)) {
+      // the proxy may have dropped it without notice
+      pool_drop(tun, entry);
+      continue;
+    }
+
+    socket_t sock = entry->sock;
+
+    pool_set_events(tun, entry, 0);
+    entry->sock = INVALID_SOCKET;
+
+    conn->sock = sock;
+    conn->ev_mask = 0;
+    conn_set_events(tun, conn, ZDTUN_EV_READ);
+    conn->ext->socks5_flags |= SOCKS5_FLAG_POOLED;
+    found = 1;
+    break;
+  }
+
+  if(found)
+    tun->stats.socks5_pool_hits++;
+  else
+    tun->stats.socks5_pool_misses++;
+
+  // replace the used and the dropped connections
+  socks5_pool_fill(tun);
+
+  return found;
+}
+
+/* ******************************************************* */
+
+// Frees the used entries, closes the stale and the excess connections and
+// reopens the missing ones. Must not be called while handling the events.
+void socks5_pool_purge(zdtun_t *tun, time_t now) {
+  time_t connect_timeout = list_timeout(tun, CONN_LIST_TCP_CONNECTING);
+  socks5_pooled_t **prev = &tun->socks5_pool;
+  socks5_pooled_t *entry;
+  int num_open = 0;
+
+  while((entry = *prev)) {
+    if(entry->sock != INVALID_SOCKET) {
+      time_t timeout = (entry->status == SOCKS5_POOL_READY) ? SOCKS5_POOL_MAX_IDLE : connect_timeout;
+
+      if((num_open >= tun->socks5_pool_size) || (now >= (entry->tstamp + timeout)))
+        pool_drop(tun, entry);
+      else
+        num_open++;
+    }
+
+    if(entry->sock == INVALID_SOCKET) {
+      *prev = entry->next;
+      free(entry);
+    } else
+      prev = &entry->next;
+  }
+
+  socks5_pool_fill(tun);
+}
+
+/* ******************************************************* */
+
+void socks5_pool_close(zdtun_t *tun) {
+  socks5_pooled_t *entry = tun->socks5_pool;
+
+  while(entry) {
+    socks5_pooled_t *next = entry->next;
+
+    if(entry->sock != INVALID_SOCKET)
+      pool_drop(tun, entry);
+
+    free(entry);
+    entry = next;
+  }
+
+  tun->socks5_pool = NULL;
+}
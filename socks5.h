@@ -32,10 +32,74 @@ typedef enum {
   SOCKS5_ESTABLISHED
 } socks5_status_t;
 
+// conn_ext_t.socks5_flags
+#define SOCKS5_FLAG_PIPELINED 0x01  // the requests were sent without waiting for the replies
+#define SOCKS5_FLAG_SENT      0x02  // the handshake was sent with the SYN
+#define SOCKS5_FLAG_POOLED    0x04  // an authenticated connection from the pool, see socks5_pool_take
+
+// max number of connections kept in the pool, see zdtun_set_socks5_pool
+#define SOCKS5_MAX_POOL_SIZE 64
+
+// the pooled connections are replaced after this idle time, as the proxy may drop them
+#define SOCKS5_POOL_MAX_IDLE 60
+
+typedef enum {
+  SOCKS5_POOL_CONNECTING = 0,   // TCP connect in progress
+  SOCKS5_POOL_HELLO,            // waiting for the server auth choice
+  SOCKS5_POOL_AUTH,             // waiting for the auth response
+  SOCKS5_POOL_READY,            // ready for the CONNECT request
+} socks5_pool_status_t;
+
+// A connection to the SOCKS5 proxy, authenticated in advance
+typedef struct socks5_pooled {
+  socket_t sock;                // INVALID_SOCKET once used or failed, then freed by socks5_pool_purge
+  socks5_pool_status_t status;
+  uint8_t ev_mask;
+  time_t tstamp;                // when opened, then when ready
+  struct socks5_pooled *next;
+} socks5_pooled_t;
+
+// The epoll events of a pooled connection carry the socks5_pooled_t pointer
+// tagged with this bit, see EV_TAG_UDP_MAPPING
+#define EV_TAG_SOCKS5_POOL ((uintptr_t)2)
+
+#ifndef ZDTUN_NO_SOCKS5
+
 #define socks5_in_progress(c) ((c->proxy_mode == PROXY_SOCKS5)\
-  && (c->socks5_status != SOCKS5_ESTABLISHED))
+  && (c->ext->socks5_status != SOCKS5_ESTABLISHED))
 
 int socks5_connect(zdtun_t *tun, zdtun_conn_t *conn);
 int handle_socks5_reply(zdtun_t *tun, zdtun_conn_t *conn, char *data, int len);
+#ifdef MSG_FASTOPEN
+int socks5_fastopen_connect(zdtun_t *tun, zdtun_conn_t *conn,
+        const struct sockaddr *addr, socklen_t addrlen);
+#endif
+
+int socks5_pool_take(zdtun_t *tun, zdtun_conn_t *conn);
+void socks5_pool_fill(zdtun_t *tun);
+void socks5_pool_purge(zdtun_t *tun, time_t now);
+void socks5_pool_close(zdtun_t *tun);
+void handle_socks5_pool_event(zdtun_t *tun, socks5_pooled_t *entry, uint8_t readable, uint8_t writable);
+
+#else
+
+// SOCKS5 compiled out: zdtun_conn_proxy is a no-op, so these are never reached
+#define socks5_in_progress(c) 0
+
+static inline int socks5_connect(zdtun_t *tun, zdtun_conn_t *conn) { return(-1); }
+static inline int handle_socks5_reply(zdtun_t *tun, zdtun_conn_t *conn, char *data, int len) { return(-1); }
+#ifdef MSG_FASTOPEN
+static inline int socks5_fastopen_connect(zdtun_t *tun, zdtun_conn_t *conn,
+        const struct sockaddr *addr, socklen_t addrlen) { return(-1); }
+#endif
+
+static inline int socks5_pool_take(zdtun_t *tun, zdtun_conn_t *conn) { return(0); }
+static inline void socks5_pool_fill(zdtun_t *tun) {}
+static inline void socks5_pool_purge(zdtun_t *tun, time_t now) {}
+static inline void socks5_pool_close(zdtun_t *tun) {}
+static inline void handle_socks5_pool_event(zdtun_t *tun, socks5_pooled_t *entry,
+        uint8_t readable, uint8_t writable) {}
+
+#endif
 
 #endif
@@ -13,6 +13,7 @@
 #define IPPROTO_ICMP            1
 #define IPPROTO_TCP             6
 #define IPPROTO_UDP             17
+#define IPPROTO_FRAGMENT        44
 #define IPPROTO_ICMPV6          58
 
 #endif
@@ -45,6 +46,10 @@ struct iphdr
 #define ICMP_ECHO               8
 #define ICMPv6_ECHO             128
 #define ICMPv6_ECHOREPLY        129
+#define ICMP_DEST_UNREACH       3
+#define ICMP_HOST_UNREACH       1
+#define ICMPv6_DEST_UNREACH     1
+#define ICMPv6_ADDR_UNREACH     3
 
 PACK_ON
 struct icmphdr
@@ -128,4 +133,12 @@ struct ipv6_hdr {
   struct in6_addr daddr;
 } PACK_OFF;
 
+PACK_ON
+struct ipv6_frag_hdr {
+  uint8_t nexthdr;
+  uint8_t reserved;
+  uint16_t frag_off;  // 13 bit offset, 2 reserved bits, M flag
+  uint32_t identification;
+} PACK_OFF;
+
 #endif
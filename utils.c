@@ -23,11 +23,13 @@
 
 #include "zdtun.h"
 #include "utils.h"
+#include "checksum.h"
 
 #include <stdarg.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 
 //#define DEBUG_COMMUNICATION
 
@@ -129,67 +131,214 @@ static u_int32_t send_ctr = 0;
 static u_int32_t recv_ctr = 0;
 #endif
 
-void con_send(socket_t sock, char*data, u_int32_t len) {
+// ENCODE_KEY repeated to a multiple of the word size, so that the key offset
+// can be reset every XOR_KEY_LEN bytes
+#define XOR_KEY_LEN ((sizeof(ENCODE_KEY) - 1) * sizeof(uint64_t))
+
+static char xor_key[XOR_KEY_LEN];
+
+/* ******************************************************* */
+
+// Same output as xor_encdec with ENCODE_KEY, one word at a time. src and dst can be the same
+static void xor_link(char *dst, const char *src, u_int32_t len) {
+  for(u_int32_t off = 0; off < len; off += XOR_KEY_LEN) {
+    u_int32_t n = min(len - off, XOR_KEY_LEN);
+    u_int32_t i = 0;
+
+    for(; (i + sizeof(uint64_t)) <= n; i += sizeof(uint64_t)) {
+      uint64_t word, key;
+
+      memcpy(&word, src + off + i, sizeof(word));
+      memcpy(&key, xor_key + i, sizeof(key));
+      word ^= key;
+      memcpy(dst + off + i, &word, sizeof(word));
+    }
+
+    for(; i < n; i++)
+      dst[off + i] = src[off + i] ^ xor_key[i];
+  }
+}
+
+/* ******************************************************* */
+
+void con_link_init(con_link_t *link, socket_t sock) {
+  memset(link, 0, sizeof(*link));
+  link->sock = sock;
+
+  if(!(link->tx_buf = (char*) malloc(CON_BUF_SIZE)) || !(link->rx_buf = (char*) malloc(CON_BUF_SIZE)))
+    fatal("Cannot allocate the link buffers");
+
+  if(!xor_key[0]) {
+    for(u_int32_t i = 0; i < XOR_KEY_LEN; i++)
+      xor_key[i] = ENCODE_KEY[i % (sizeof(ENCODE_KEY) - 1)];
+  }
+}
+
+/* ******************************************************* */
+
+void con_link_destroy(con_link_t *link) {
+  free(link->tx_buf);
+  free(link->rx_buf);
+  link->tx_buf = link->rx_buf = NULL;
+}
+
+/* ******************************************************* */
+
+// Sends all the iovecs, which are consumed
+static int writev_all(socket_t sock, struct iovec *iov, int iovcnt) {
+  while(iovcnt > 0) {
+    ssize_t n = writev(sock, iov, iovcnt);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+
+      error("link send error[%d]: %s", errno, strerror(errno));
+      return(-1);
+    }
+
+    while((iovcnt > 0) && ((size_t)n >= iov->iov_len)) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if(iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return(0);
+}
+
+/* ******************************************************* */
+
+int con_send(con_link_t *link, char *data, u_int32_t len) {
   u_int32_t bo_len = htonl(len);
 
+  // the peer would drop the link, see con_next_frame
+  if(len > CON_MAX_FRAME) {
+    error("Packet too big! [%u > %u]", len, CON_MAX_FRAME);
+    return(-1);
+  }
+
 #ifdef DEBUG_COMMUNICATION
   log("[SEND] %u bytes #[%u]", len, send_ctr++);
 #endif
 
-  xor_encdec(data, len, ENCODE_KEY);
+  xor_link(data, data, len);
 
-  // send the size
-  send(sock, (char*)&bo_len, sizeof(bo_len), 0);
+  // the queued frames, the size and the data with a single call
+  struct iovec iov[] = {
+    {link->tx_buf, link->tx_used},
+    {&bo_len, sizeof(bo_len)},
+    {data, len},
+  };
 
-  // send data
-  send(sock, data, len, 0);
+  link->tx_used = 0;
+  return(writev_all(link->sock, iov, 3));
 }
 
-u_int32_t con_recv(socket_t sock, char*data, u_int32_t len) {
-  u_int32_t size;
-  u_int32_t sofar;
+/* ******************************************************* */
+
+int con_queue(con_link_t *link, const char *data, u_int32_t len) {
+  u_int32_t bo_len = htonl(len);
 
-  // read the size
-  sofar = 0;
+  if(len > CON_MAX_FRAME) {
+    error("Packet too big! [%u > %u]", len, CON_MAX_FRAME);
+    return(-1);
+  }
+
+#ifdef DEBUG_COMMUNICATION
+  log("[QUEUE] %u bytes #[%u]", len, send_ctr++);
+#endif
+
+  if(((link->tx_used + sizeof(bo_len) + len) > CON_BUF_SIZE) && (con_flush(link) != 0))
+    return(-1);
+
+  memcpy(link->tx_buf + link->tx_used, &bo_len, sizeof(bo_len));
+  xor_link(link->tx_buf + link->tx_used + sizeof(bo_len), data, len);
+  link->tx_used += sizeof(bo_len) + len;
+
+  return(0);
+}
+
+/* ******************************************************* */
+
+int con_flush(con_link_t *link) {
+  struct iovec iov = {link->tx_buf, link->tx_used};
 
-  while(sofar < sizeof(size)) {
-    int n = recv(sock, &((char*)&size)[sofar], sizeof(size) - sofar, 0);
+  if(!link->tx_used)
+    return(0);
 
-    if(n == SOCKET_ERROR)
-      fatal("recv error2: %d", socket_errno);
+  link->tx_used = 0;
+  return(writev_all(link->sock, &iov, 1));
+}
 
-    if(n == 0)
-      fatal("peer disconnected");
+/* ******************************************************* */
 
-    sofar += n;
+int con_recv(con_link_t *link) {
+  // keep the partial frame, the returned frames are now invalid
+  if(link->rx_off) {
+    memmove(link->rx_buf, link->rx_buf + link->rx_off, link->rx_used - link->rx_off);
+    link->rx_used -= link->rx_off;
+    link->rx_off = 0;
   }
 
-  size = ntohl(size);
+  // the caller must consume the frames first
+  if(link->rx_used == CON_BUF_SIZE)
+    return(0);
 
-#ifdef DEBUG_COMMUNICATION
-    log("[RECV] %u bytes #[%u]", len, recv_ctr++);
-#endif
+  int n = recv(link->sock, link->rx_buf + link->rx_used, CON_BUF_SIZE - link->rx_used, MSG_DONTWAIT);
 
-  if(size > len)
-    fatal("Packet too big! [%u > %u]", size, len);
+  if(n == SOCKET_ERROR) {
+    if((socket_errno == EAGAIN) || (socket_errno == EINTR))
+      return(0);
 
-  // read the data
-  sofar = 0;
+    error("link recv error[%d]", socket_errno);
+    return(-1);
+  }
 
-  while(sofar < size) {
-    int n = recv(sock, &data[sofar], size - sofar, 0);
+  if(n == 0) {
+    log("peer disconnected");
+    return(-1);
+  }
 
-    if(n == SOCKET_ERROR)
-      fatal("recv error3: %d", socket_errno);
+  link->rx_used += n;
+  return(0);
+}
 
-    if(n == 0)
-      fatal("peer disconnected");
+/* ******************************************************* */
 
-    sofar += n;
+int con_next_frame(con_link_t *link, char **frame, u_int32_t *len) {
+  u_int32_t avail = link->rx_used - link->rx_off;
+  u_int32_t size;
+
+  if(avail < sizeof(size))
+    return(0);
+
+  memcpy(&size, link->rx_buf + link->rx_off, sizeof(size));
+  size = ntohl(size);
+
+  if(size > CON_MAX_FRAME) {
+    error("Packet too big! [%u > %u]", size, CON_MAX_FRAME);
+    return(-1);
   }
 
-  xor_encdec(data, size, ENCODE_KEY);
-  return size;
+  if(avail < (sizeof(size) + size))
+    return(0);
+
+#ifdef DEBUG_COMMUNICATION
+  log("[RECV] %u bytes #[%u]", size, recv_ctr++);
+#endif
+
+  *frame = link->rx_buf + link->rx_off + sizeof(size);
+  *len = size;
+  link->rx_off += sizeof(size) + size;
+
+  xor_link(*frame, *frame, size);
+  return(1);
 }
 
 /* ******************************************************* */
@@ -204,24 +353,8 @@ char* ipv4str(u_int32_t addr, char *buf) {
 
 /* ******************************************************* */
 
-// from netguard
 uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, u_int16_t length) {
-  register uint32_t sum = start;
-  register uint16_t *buf = (uint16_t *) buffer;
-  register uint16_t len = length;
-
-  while(len > 1) {
-    sum += *buf++;
-    len -= 2;
-  }
-
-  if(len > 0)
-    sum += *((uint8_t *) buf);
-
-  while (sum >> 16)
-    sum = (sum & 0xFFFF) + (sum >> 16);
-
-  return (uint16_t) sum;
+  return csum_fold(csum_partial(buffer, length, start));
 }
 
 /* ******************************************************* */
@@ -239,6 +372,12 @@ void xor_encdec(char *data, int data_len, char *key) {
 /* ******************************************************* */
 
 int open_tun(const char *tun_dev, const char*ip, const char *netmask) {
+  return open_tun_ex(tun_dev, ip, netmask, 0);
+}
+
+/* ******************************************************* */
+
+int open_tun_ex(const char *tun_dev, const char*ip, const char *netmask, int extra_flags) {
   struct ifreq ifr;
   char cmd_buf[255];
   int tun_fd;
@@ -249,7 +388,7 @@ int open_tun(const char *tun_dev, const char*ip, const char *netmask) {
     fatal("Cannot open TUN device[%d]: %s", errno, strerror(errno));
 
   memset(&ifr, 0, sizeof(ifr));
-  ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+  ifr.ifr_flags = IFF_TUN | IFF_NO_PI | extra_flags;
   strncpy(ifr.ifr_name, tun_dev, IFNAMSIZ);
 
   int rc = ioctl(tun_fd, TUNSETIFF, (void *)&ifr);
@@ -36,15 +36,54 @@ typedef struct {
   socket_t socket;
 } con_mode_info;
 
+// max size of a frame payload
+#define CON_MAX_FRAME 65535
+
+// size of the link TX and RX buffers, must fit multiple frames
+#define CON_BUF_SIZE (256 * 1024)
+
+/*
+ * A link carrying the packets as obfuscated, length prefixed frames.
+ * The frames can be sent one by one with con_send or queued with con_queue
+ * and then sent at once with con_flush. On the RX side, con_recv reads the
+ * available data without blocking, con_next_frame returns the complete frames.
+ */
+typedef struct {
+  socket_t sock;
+  char *tx_buf;         // the frames queued by con_queue, already encoded
+  u_int32_t tx_used;
+  char *rx_buf;         // the received data, possibly ending with a partial frame
+  u_int32_t rx_used;
+  u_int32_t rx_off;     // start of the next frame
+} con_link_t;
+
 void con_parse_args(char **argv, con_mode_info *info);
 socket_t con_wait_connection(con_mode_info *info, struct sockaddr_in *cli_addr);
-void con_send(socket_t sock, char *data, u_int32_t len);
-u_int32_t con_recv(socket_t sock, char *data, u_int32_t len);
+void con_link_init(con_link_t *link, socket_t sock);
+void con_link_destroy(con_link_t *link);
+
+/* Sends the queued frames and a new frame. The data is encoded in place. */
+int con_send(con_link_t *link, char *data, u_int32_t len);
+
+/* Queues a frame, which is sent by con_flush or when the TX buffer is full. */
+int con_queue(con_link_t *link, const char *data, u_int32_t len);
+int con_flush(con_link_t *link);
+
+/* Reads the available data. Returns -1 on error or when the peer disconnects. */
+int con_recv(con_link_t *link);
+
+/*
+ * Gets the next complete frame, decoded in place. The frame is valid until the
+ * next con_recv. Returns 1 if a frame is returned, 0 if more data is needed,
+ * -1 if the frame is invalid.
+ */
+int con_next_frame(con_link_t *link, char **frame, u_int32_t *len);
 
 u_int16_t calc_checksum(u_int16_t start, const u_int8_t *buffer, u_int16_t length);
 char* ipv4str(u_int32_t addr, char *buf);
 void xor_encdec(char *data, int data_len, char *key);
 int open_tun(const char *tun_dev, const char*ip, const char *netmask);
+int open_tun_ex(const char *tun_dev, const char*ip, const char *netmask, int extra_flags);
 void cmd(const char *fmt, ...);
 u_int32_t get_default_gw();
 int get_default_gw6_and_iface(struct in6_addr *gw, char *iface);
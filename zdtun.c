@@ -21,14 +21,47 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // recvmmsg
+#endif
+
 #include "zdtun.h"
 #include "utils.h"
 #include "socks5.h"
+#include "mempool.h"
+#include "checksum.h"
 #include "third_party/uthash.h"
+#include "flowtable.h"
+#include "dnscache.h"
+#include "capture.h"
+#include "flowexport.h"
 #include "third_party/net_headers.h"
 
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && !defined(ZDTUN_NO_EPOLL)
+#define HAVE_EPOLL
+#endif
+
+#ifdef __linux__
+#define HAVE_RECVMMSG
+#include <sys/epoll.h>
+#endif
+
+// the MSG_ZEROCOPY completions are only handled by the epoll backend
+#if defined(HAVE_EPOLL) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
 #define REPLY_BUF_SIZE 65535
 #define DEFAULT_TCP_WINDOW 65535
+
+// window scale of the zdtun side, when the client supports it. Allows
+// advertising windows up to 4 MB, see get_available_sndbuf
+#define TCP_WINDOW_SCALE 6
 #define TCP_HEADER_LEN 20
 #define IPV4_HEADER_LEN 20
 #define IPV6_HEADER_LEN 40
@@ -37,7 +70,99 @@
 #define ICMP_TIMEOUT_SEC 5
 #define UDP_TIMEOUT_SEC 30
 #define TCP_TIMEOUT_SEC 60
+#define TCP_CONNECT_TIMEOUT_SEC 10
+#define VERDICT_TIMEOUT_SEC 5
+
+// the published flows are refreshed every FLOWS_EXPORT_INTERVAL seconds, visiting up
+// to FLOWS_EXPORT_BATCH connections per pass, see flows_export_step
+#define FLOWS_EXPORT_INTERVAL 1
+#define FLOWS_EXPORT_BATCH 1024
+
+// default max number of connections waiting for zdtun_conn_verdict
+#define MAX_PENDING_VERDICTS 256
+
+// initial sequence number of the zdtun side of the TCP connections
+#define TCP_ISN 0x77EB77EB
+
+// The fragments cache is made of FRAG_CACHE_BUCKETS buckets, each one
+// holding up to FRAG_CACHE_WAYS entries
+#define FRAG_CACHE_BUCKETS 16
+#define FRAG_CACHE_WAYS 4
+#define FRAG_TIMEOUT_SEC 15
+
+// Direct mapped cache of the last looked up connections, must be a power of 2
+#define FLOW_CACHE_SIZE 8
+
+// number of connections allocated at once by the connections pool
+#define CONNS_PER_SLAB 64
+
+// number of connection extensions allocated at once, see conn_ext
+#define EXTS_PER_SLAB 64
+
+// max number of TX buffers to cache, per size class
+#define MAX_CACHED_TX_BUFS 32
+
+// capacity of a TX queue chunk. Small client segments are coalesced into it.
+#define TX_CHUNK_SIZE (16384 - sizeof(tcp_data_t))
+
+// max number of TX queue chunks to flush with a single sendmsg
+#define MAX_TX_IOVECS 16
+
+// smaller payloads of zdtun_forward_owned are still copied, as coalescing
+// them into a TX chunk is cheaper than queuing a reference to each buffer
+#define MIN_OWNED_DATA_SIZE 512
+
+// MSG_ZEROCOPY is only convenient for large sends, as the page pinning and
+// the completion notifications have a cost
+#define MIN_ZEROCOPY_SIZE 10240
+
+// max seconds to wait for the MSG_ZEROCOPY completions of a closed socket
+#define ZC_LINGER_TIMEOUT 10
+
+// max number of packets and bytes collected before calling send_client_batch
+#define MAX_BATCH_PKTS 64
+#define BATCH_BUF_SIZE (256 * 1024)
+
+// max number of events dispatched by a single zdtun_handle_events pass
+#define MAX_EVENTS_PER_PASS 64
+
+// default max bytes a connection socket can transfer per pass, see conn_pass_budget
+#define CONN_PASS_BUDGET (256 * 1024)
+
+// default max packets a connection socket can transfer per pass, see conn_pass_pkts
+#define CONN_PASS_PKTS 64
+
+// a bulk connection skipped by the first round of zdtun_handle_fd
+#define BULK_DEFERRED 2
+
+// number of datagrams read at once from a shared UDP socket
+#ifdef HAVE_RECVMMSG
+#define UDP_RECV_BATCH 8
+#else
+#define UDP_RECV_BATCH 1
+#endif
+
+// Compile time feature selection, see the CMake options. The disabled paths
+// are replaced by constants, so that the compiler can drop them:
+//  - ZDTUN_NO_SOCKS5: zdtun_conn_proxy is a no-op
+//  - ZDTUN_IPV4_ONLY: the IPv6 packets are rejected by zdtun_parse_pkt
+//  - ZDTUN_NO_ACCOUNTING: no account_packet, packet capture and flow counters
+#ifdef ZDTUN_NO_SOCKS5
+#define is_socks5(conn) 0
+#else
+#define is_socks5(conn) ((conn)->proxy_mode == PROXY_SOCKS5)
+#endif
+
+#ifdef ZDTUN_IPV4_ONLY
+#define ipv6_enabled 0
+#else
+#define ipv6_enabled 1
+#endif
+
+#define ZDTUN_EV_READ   0x01
+#define ZDTUN_EV_WRITE  0x02
 
+// Default limits, see zdtun_config_t
 #ifdef WIN32
   // 64 is the per-thread limit on Winsocks
   // use a lower value to leave room for user defined connections
@@ -52,34 +177,90 @@
 /* ******************************************************* */
 
 static void destroy_conn(zdtun_t *tun, zdtun_conn_t *conn);
+static void flows_export_step(zdtun_t *tun);
+static int send_udp_reply(zdtun_t *tun, zdtun_conn_t *conn, char *pkt_buf, int l4_len, uint8_t from_upstream);
+#ifdef HAVE_MSG_ZEROCOPY
+static void linger_zerocopy(zdtun_t *tun, zdtun_conn_t *conn);
+static void purge_zerocopy_lingering(zdtun_t *tun, uint8_t force);
+#endif
 
 #define default_mss(tun, conn) (tun->mtu - sizeof(struct tcphdr) -\
       ((sock_ipver(tun, conn) == 4) ? sizeof(struct iphdr) : sizeof(struct ipv6_hdr)))
 
+// Instrumentation, see zdtun_get_ext_stats. Compiled out by default.
+#ifdef ZDTUN_INSTRUMENTATION
+#define instr_drop(tun, reason)         ((tun)->ext_stats.drops[reason]++)
+#define instr_pkt(tun, pkt, to_zdtun)   instr_account_pkt(tun, pkt, to_zdtun)
+#define instr_start(var)                uint64_t var = instr_now_us()
+#define instr_hist(tun, hist, start)    hist_add(&(tun)->ext_stats.hist, instr_now_us() - (start))
+#else
+#define instr_drop(tun, reason)         do {} while(0)
+#define instr_pkt(tun, pkt, to_zdtun)   do {} while(0)
+#define instr_start(var)                do {} while(0)
+#define instr_hist(tun, hist, start)    do {} while(0)
+#endif
+
 /* ******************************************************* */
 
 typedef struct tcp_data {
   struct tcp_data* next;
-  uint16_t len;
-  uint16_t sofar;
-  uint8_t flags;
+  char *ptr;        // the payload, either data or a part of the owned buffer
+  char *owned;      // a zdtun_forward_owned buffer, released via release_buf
+  uint32_t zc_first;  // the first and the last MSG_ZEROCOPY sends which referenced the payload
+  uint32_t zc_last;
+  uint16_t cap;     // allocated data size
+  uint16_t len;     // bytes stored in ptr
+  uint16_t sofar;   // bytes already sent
+  uint16_t zc_refs; // sends not completed yet, the kernel may still reference the payload
+  uint8_t flags;    // TCP flags of the coalesced segments
   char data[];
 } tcp_data_t;
 
-// used to resolve port numbers for IP fragments
+// A closed socket with MSG_ZEROCOPY sends not completed yet, see linger_zerocopy
+typedef struct zc_linger {
+  struct zc_linger *next;
+  socket_t sock;
+  tcp_data_t *pending;
+  time_t since;
+} zc_linger_t;
+
+// used to resolve port numbers for IP fragments, see frag_cache_lookup
 typedef struct {
+  zdtun_ip_t src_ip;
+  zdtun_ip_t dst_ip;
+  uint32_t ip_id;       // 16 bit IPv4 ID or 32 bit IPv6 fragment ID
   uint16_t sport;
   uint16_t dport;
-} ip_frag_ports_t;
+  uint8_t ipver;
+  uint8_t ipproto;
+  time_t tstamp;        // 0 if the entry is unused
+} ip_frag_entry_t;
+
+// Keeps track of the client UDP ports numbers (see bind_and_connect_udp).
+// With zdtun_config_t.udp_shared_sockets, it also holds the unconnected socket
+// shared by the connections of the client port (see bind_shared_udp).
+// The key also holds the client IP, so that the replies on a shared socket
+// can be delivered to the right client (e.g. with zdtun_gateway)
+typedef struct {
+  zdtun_ip_t client_ip;
+  uint16_t client_port;
+  uint8_t ipver;
+  uint8_t pad;          // must be 0, the key is hashed as raw bytes
+} udp_mapping_key_t;
 
-// Keeps track of the client UDP ports numbers (see bind_and_connect_udp)
 typedef struct {
-  uint32_t key;         // combination of ipver and port number
+  udp_mapping_key_t key;
   uint16_t port;        // the local port associated to the client port
   uint16_t num_uses;    // number of connections using this client port
+  socket_t sock;        // the shared socket, INVALID_SOCKET if not used
+  uint8_t shared;       // set if sock was ever opened, see zdtun_purge_expired
   UT_hash_handle hh;
 } udp_mapping_t;
 
+// The epoll events of a shared UDP socket carry the udp_mapping_t pointer
+// tagged with this bit, to distinguish it from a zdtun_conn_t
+#define EV_TAG_UDP_MAPPING ((uintptr_t)1)
+
 typedef enum {
   PROXY_NONE = 0,
   PROXY_DNAT,
@@ -92,45 +273,117 @@ typedef struct {
   uint8_t ipver;
 } proxy_t;
 
+// Connections are linked into per-protocol idle lists, ordered by tstamp
+// (oldest first). Since all the connections of a list share the same timeout,
+// only the list heads must be checked to find the expired connections.
+typedef enum {
+  CONN_LIST_TCP = 0,
+  CONN_LIST_UDP,
+  CONN_LIST_ICMP,
+  CONN_LIST_TCP_CONNECTING, // TCP connections waiting for the SYN+ACK, ordered by connect time
+  CONN_LIST_PENDING,    // connections waiting for zdtun_conn_verdict, ordered by creation time
+  CONN_LIST_CLOSED,     // closed connections, waiting to be destroyed
+  CONN_LIST_MAX
+} conn_list_id_t;
+
+typedef struct {
+  struct zdtun_conn *head;
+  struct zdtun_conn *tail;
+} conn_list_t;
+
 
 /* ******************************************************* */
 
+// The state needed only by some connections (proxy, SOCKS5, DNS, deferred
+// verdict, MSG_ZEROCOPY, flows export), allocated on demand by conn_ext
+typedef struct {
+  proxy_t dnat;              // with PROXY_DNAT
+  socks5_status_t socks5_status;
+  uint8_t socks5_skip;
+  uint8_t socks5_flags;      // SOCKS5_FLAG_*
+
+  struct {
+    u_int8_t pending_queries;
+    u_int8_t cache_waits;    // queries waiting for an in-flight query, see check_dns_cache_query
+  } dns;
+
+  uint16_t held_len;
+  char *held_pkt;            // the first client packet, held until the verdict
+
+  tcp_data_t *zc_pending;    // sent with MSG_ZEROCOPY, waiting for the kernel completion
+  u_int32_t zc_next_id;      // id of the next MSG_ZEROCOPY send on the socket
+
+  // with zdtun_flows_export, indexed by to_zdtun
+  u_int32_t pkts[2];
+  u_int64_t bytes[2];
+  u_int32_t export_round;    // last flows export round which staged the connection, 0 if none
+} conn_ext_t;
+
+// The fields accessed for each packet are in the first cache line, the rest
+// of the TCP state and the idle list links in the second one. Keep the struct
+// within two cache lines, see the static asserts below.
 typedef struct zdtun_conn {
   zdtun_5tuple_t tuple;
-  time_t tstamp;
+  uint16_t status:4;         // zdtun_conn_status_t
+  uint16_t list_id:3;        // conn_list_id_t, see conn_lists
+  uint16_t proxy_mode:2;     // proxy_mode_t
+  uint16_t ev_mask:2;        // ZDTUN_EV_READ | ZDTUN_EV_WRITE, events we are interested in
+  uint16_t bulk:2;           // data was left to handle in the last pass, see handle_conn_event
+  uint16_t verdict_pending:1;  // waiting for zdtun_conn_verdict
+  uint16_t ext_heap:1;       // ext was allocated with calloc, see conn_ext_heap
   socket_t sock;
-  zdtun_conn_status_t status;
-
-  proxy_t *dnat;
-  proxy_mode_t proxy_mode;
-  socks5_status_t socks5_status;
-  uint8_t socks5_skip;
+  uint32_t tstamp;           // last seen, see zdtun_now
 
   union {
     struct {
-      tcp_data_t *tx_queue;    // contains TCP segment data to send via the socket
-      u_int32_t tx_queue_size; // queued bytes in partial_send
       u_int32_t client_seq;    // next client sequence number
       u_int32_t zdtun_seq;     // next proxy sequence number
       u_int32_t window_size;   // scaled client window size
+      u_int32_t tx_queue_size; // queued bytes in partial_send
+      tcp_data_t *tx_queue;    // contains TCP segment data to send via the socket
+      tcp_data_t *tx_queue_tail;
+      u_int32_t sndbuf;        // cached socket send buffer size, see refresh_sndbuf
+      u_int32_t sndbuf_used;   // estimated bytes in the socket send buffer
       u_int16_t mss;           // client MSS
-      u_int8_t window_scale;   // client/zdtun TCP window scale
+      u_int8_t window_scale:4; // client TCP window scale
+      u_int8_t zdtun_window_scale:4; // window scale of the windows advertised to the client
 
       struct {
         uint8_t fin_ack_sent:1;
         uint8_t client_closed:1;
+        uint8_t zerocopy:1;    // SO_ZEROCOPY is enabled and the kernel does not copy the data
+        uint8_t zc_used:1;     // MSG_ZEROCOPY was used, completions may be pending
       };
     } tcp;
+
+    struct {
+      udp_mapping_t *shared;   // the mapping holding the shared socket, if any
+    } udp;
   };
 
-  struct {
-    u_int8_t pending_queries;
-  } dns;
+  // idle list, see conn_list_id_t
+  struct zdtun_conn *list_prev;
+  struct zdtun_conn *list_next;
 
   void *user_data;
-  UT_hash_handle hh;  // tuple -> conn
+  conn_ext_t *ext;
+
+#ifdef ZDTUN_INSTRUMENTATION
+  uint64_t instr_start_us;   // start of the TCP connect, then of the SOCKS5 handshake
+#endif
 } zdtun_conn_t;
 
+// on 64 bit, where socket_t is an int
+#if !defined(ZDTUN_INSTRUMENTATION) && !defined(WIN32) && (UINTPTR_MAX == 0xFFFFFFFFFFFFFFFF)
+_Static_assert(offsetof(zdtun_conn_t, tcp.tx_queue) == 64, "the per-packet fields must fit the first cache line");
+_Static_assert(sizeof(zdtun_conn_t) == 128, "zdtun_conn_t must fit two cache lines");
+#endif
+_Static_assert(CONN_STATUS_VERDICT_TIMEOUT < 16, "zdtun_conn_t.status is too small");
+_Static_assert(CONN_LIST_MAX <= 8, "zdtun_conn_t.list_id is too small");
+
+#define conn_pending_queries(conn) ((conn)->ext ? (conn)->ext->dns.pending_queries : 0)
+#define conn_cache_waits(conn)     ((conn)->ext ? (conn)->ext->dns.cache_waits : 0)
+
 /* ******************************************************* */
 
 typedef struct zdtun_t {
@@ -138,20 +391,75 @@ typedef struct zdtun_t {
   void *user_data;
   fd_set all_fds;
   fd_set write_fds;
+  socket_t event_fd;    // epoll fd, INVALID_SOCKET when the select backend is used
+  zdtun_config_t cfg;
   uint32_t mtu;
   zdtun_statistics_t stats;
   time_t now;
   zdtun_pkt_t last_pkt; // store pkt here to prevent invalid memory access by subsequent API calls
-  ip_frag_ports_t id2ports[65536];
+  ip_frag_entry_t frag_cache[FRAG_CACHE_BUCKETS][FRAG_CACHE_WAYS];
   char reply_buf[REPLY_BUF_SIZE];
+  char *owned_buf;      // the zdtun_forward_owned buffer, until referenced by enqueue_tcp_data
 
   proxy_t socks5;
 
   char *socks5_user;
   char *socks5_pass;
+  uint8_t socks5_opts;  // ZDTUN_SOCKS5_* flags
+  socks5_pooled_t *socks5_pool; // authenticated proxy connections, see zdtun_set_socks5_pool
+  uint8_t socks5_pool_size;     // number of connections to keep in the pool
+
+  flowtable_t conn_table;     // tuple -> conn
+  zdtun_conn_t *flow_cache[FLOW_CACHE_SIZE];
+  conn_list_t conn_lists[CONN_LIST_MAX];
+  uint8_t offload;
+  uint32_t rr_start;          // first connection visited by the next zdtun_handle_fd pass
+
+  // the ready connections of the zdtun_handle_fd pass, NULL once destroyed
+  struct {
+    zdtun_conn_t **conns;
+    uint32_t num;
+    uint32_t size;
+  } ready;
+
+#ifdef HAVE_EPOLL
+  // the events of the handle_epoll_events pass, data.ptr is NULL once destroyed
+  struct epoll_event *pass_events;
+  int num_pass_events;
+#endif
 
-  zdtun_conn_t *conn_table;
+  // packets for send_client_batch, copied from reply_buf
+  struct {
+    char *buf;
+    u_int32_t buf_used;
+    int num_pkts;
+    zdtun_pkt_t pkts[MAX_BATCH_PKTS];
+    zdtun_conn_t *conns[MAX_BATCH_PKTS];
+  } batch;
+
+  mempool_t conn_pool;
+  mempool_t ext_pool;
+  bufpool_t tx_pool;
   udp_mapping_t *udp_mappings;
+  uint16_t num_unused_mappings;  // shared socket mappings to free, see zdtun_purge_expired
+  char *udp_rx_bufs;             // UDP_RECV_BATCH buffers for the shared sockets
+  dns_cache_t dns_cache;
+  capture_t *capture;         // see zdtun_capture_start
+  zc_linger_t *zc_lingering;  // see linger_zerocopy
+
+  // see zdtun_flows_export
+  struct {
+    flow_export_t *exp;       // NULL if disabled
+    zdtun_conn_cursor_t cursor;
+    uint32_t staged;          // records in the staging buffer
+    uint32_t round;           // current round, never 0, see conn_ext_t.export_round
+    uint8_t active;           // a round is in progress
+    time_t last_publish;
+  } flows;
+
+#ifdef ZDTUN_INSTRUMENTATION
+  zdtun_ext_statistics_t ext_stats;
+#endif
 } zdtun_t;
 
 /* ******************************************************* */
@@ -192,6 +500,15 @@ struct ip6_hdr_pseudo {
 /* ******************************************************* */
 
 void zdtun_fds(zdtun_t *tun, int *max_fd, fd_set *rdfd, fd_set *wrfd) {
+  if(tun->event_fd != INVALID_SOCKET) {
+    // zdtun sockets are multiplexed by the event fd
+    FD_ZERO(rdfd);
+    FD_ZERO(wrfd);
+    FD_SET(tun->event_fd, rdfd);
+    *max_fd = tun->event_fd;
+    return;
+  }
+
   *max_fd = tun->stats.all_max_fd;
   *rdfd = tun->all_fds;
   *wrfd = tun->write_fds;
@@ -199,10 +516,72 @@ void zdtun_fds(zdtun_t *tun, int *max_fd, fd_set *rdfd, fd_set *wrfd) {
 
 /* ******************************************************* */
 
+socket_t zdtun_get_event_fd(zdtun_t *tun) {
+  return tun->event_fd;
+}
+
+/* ******************************************************* */
+
+// Updates the events to watch for a socket. ev_data is reported by epoll.
+static void set_socket_events(zdtun_t *tun, socket_t sock, void *ev_data,
+        uint8_t old_events, uint8_t events) {
+#ifdef HAVE_EPOLL
+  if(tun->event_fd != INVALID_SOCKET) {
+    struct epoll_event ev = {0};
+    int op;
+
+    // NOTE: EPOLLHUP/EPOLLERR are always reported, so the socket is removed
+    // when no events are requested (e.g. on TCP zero window)
+    if(events == 0)
+      op = EPOLL_CTL_DEL;
+    else if(old_events == 0)
+      op = EPOLL_CTL_ADD;
+    else
+      op = EPOLL_CTL_MOD;
+
+    ev.events = ((events & ZDTUN_EV_READ) ? EPOLLIN : 0) |
+      ((events & ZDTUN_EV_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = ev_data;
+
+    if(epoll_ctl(tun->event_fd, op, sock, &ev) != 0)
+      error("epoll_ctl(%d) failed[%d]: %s", op, errno, strerror(errno));
+
+    return;
+  }
+#endif
+
+  if(events & ZDTUN_EV_READ)
+    FD_SET(sock, &tun->all_fds);
+  else
+    FD_CLR(sock, &tun->all_fds);
+
+  if(events & ZDTUN_EV_WRITE)
+    FD_SET(sock, &tun->write_fds);
+  else
+    FD_CLR(sock, &tun->write_fds);
+}
+
+/* ******************************************************* */
+
+// Updates the events to watch for the connection socket
+static void conn_set_events(zdtun_t *tun, zdtun_conn_t *conn, uint8_t events) {
+  uint8_t old_events = conn->ev_mask;
+
+  if((conn->sock == INVALID_SOCKET) || (old_events == events))
+    return;
+
+  conn->ev_mask = events;
+  set_socket_events(tun, conn->sock, conn, old_events, events);
+}
+
+/* ******************************************************* */
+
 static uint8_t sock_ipver(zdtun_t *tun, zdtun_conn_t *conn) {
-  if(conn->proxy_mode == PROXY_DNAT)
-    return conn->dnat->ipver;
-  else if(conn->proxy_mode == PROXY_SOCKS5)
+  if(!ipv6_enabled)
+    return 4;
+  else if(conn->proxy_mode == PROXY_DNAT)
+    return conn->ext->dnat.ipver;
+  else if(is_socks5(conn))
     return tun->socks5.ipver;
   else
     return conn->tuple.ipver;
@@ -210,15 +589,23 @@ static uint8_t sock_ipver(zdtun_t *tun, zdtun_conn_t *conn) {
 
 /* ******************************************************* */
 
-static inline uint32_t udp_mapping_key(const zdtun_5tuple_t *tuple) {
-  // ignoring the src IP, assume only 1 client
-  return (uint32_t)tuple->ipver << 16 | tuple->src_port;
+static inline void udp_mapping_key(const zdtun_5tuple_t *tuple, udp_mapping_key_t *key) {
+  memset(key, 0, sizeof(*key));
+
+  if(tuple->ipver == 4)
+    key->client_ip.ip4 = tuple->src_ip.ip4;
+  else
+    key->client_ip = tuple->src_ip;
+
+  key->client_port = tuple->src_port;
+  key->ipver = tuple->ipver;
 }
 
 /* ******************************************************* */
 
-static socket_t open_socket(zdtun_t *tun, int domain, int type, int protocol) {
-  if(tun->stats.num_open_sockets >= MAX_NUM_SOCKETS)
+// Opens a socket, accounting it into the stats
+static socket_t new_socket(zdtun_t *tun, int domain, int type, int protocol) {
+  if(tun->stats.num_open_sockets >= tun->cfg.max_sockets)
     return(INVALID_SOCKET);
 
   socket_t sock = socket(domain, type, protocol);
@@ -231,7 +618,7 @@ static socket_t open_socket(zdtun_t *tun, int domain, int type, int protocol) {
     return(INVALID_SOCKET);
 
   /* FD_SETSIZE should never be execeeded, otherwise FD_SET will crash */
-  if(sock >= FD_SETSIZE) {
+  if((tun->event_fd == INVALID_SOCKET) && (sock >= FD_SETSIZE)) {
     error("socket exceeds FD_SETSIZE");
     closesocket(sock);
 
@@ -242,11 +629,11 @@ static socket_t open_socket(zdtun_t *tun, int domain, int type, int protocol) {
   if(tun->callbacks.on_socket_open)
     tun->callbacks.on_socket_open(tun, sock);
 
-  FD_SET(sock, &tun->all_fds);
   tun->stats.num_open_sockets++;
 
 #ifndef WIN32
-  tun->stats.all_max_fd = max(tun->stats.all_max_fd, sock);
+  if(tun->event_fd == INVALID_SOCKET)
+    tun->stats.all_max_fd = max(tun->stats.all_max_fd, sock);
 #endif
 
   switch(protocol) {
@@ -267,10 +654,39 @@ static socket_t open_socket(zdtun_t *tun, int domain, int type, int protocol) {
 
 /* ******************************************************* */
 
-static void close_socket(zdtun_t *tun, socket_t sock) {
+// Opens a socket for the connection and starts watching it for read events
+static socket_t open_socket(zdtun_t *tun, zdtun_conn_t *conn, int domain, int type, int protocol) {
+  socket_t sock = new_socket(tun, domain, type, protocol);
+
   if(sock == INVALID_SOCKET)
-    return;
+    return(INVALID_SOCKET);
 
+  conn->sock = sock;
+  conn->ev_mask = 0;
+  conn_set_events(tun, conn, ZDTUN_EV_READ);
+
+  return(sock);
+}
+
+/* ******************************************************* */
+
+static void set_nonblocking(socket_t sock, uint8_t enabled) {
+#ifdef WIN32
+  unsigned nonblocking = enabled;
+  ioctlsocket(sock, FIONBIO, &nonblocking);
+#else
+  int flags = fcntl(sock, F_GETFL);
+
+  flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+  if(fcntl(sock, F_SETFL, flags) == -1)
+    error("Cannot %s non-blocking mode: %d", enabled ? "enable" : "disable", errno);
+#endif
+}
+
+/* ******************************************************* */
+
+static void release_socket(zdtun_t *tun, socket_t sock) {
   int rv = closesocket(sock);
 
   if(rv == SOCKET_ERROR) {
@@ -278,14 +694,37 @@ static void close_socket(zdtun_t *tun, socket_t sock) {
   } else if(tun->callbacks.on_socket_close)
     tun->callbacks.on_socket_close(tun, sock);
 
-  FD_CLR(sock, &tun->all_fds);
-  FD_CLR(sock, &tun->write_fds);
-
   tun->stats.num_open_sockets = max(tun->stats.num_open_sockets-1, 0);
 }
 
 /* ******************************************************* */
 
+static void close_socket(zdtun_t *tun, zdtun_conn_t *conn) {
+  socket_t sock = conn->sock;
+
+  if(sock == INVALID_SOCKET)
+    return;
+
+  conn_set_events(tun, conn, 0);
+  conn->sock = INVALID_SOCKET;
+  release_socket(tun, sock);
+}
+
+/* ******************************************************* */
+
+static void close_shared_udp(zdtun_t *tun, udp_mapping_t *mapping) {
+  socket_t sock = mapping->sock;
+
+  if(sock == INVALID_SOCKET)
+    return;
+
+  set_socket_events(tun, sock, NULL, ZDTUN_EV_READ, 0);
+  mapping->sock = INVALID_SOCKET;
+  release_socket(tun, sock);
+}
+
+/* ******************************************************* */
+
 // Returns != 0 if the error is related to a client side problem
 static int close_with_socket_error(zdtun_t *tun, zdtun_conn_t *conn, const char *ctx) {
   int rv = 0;
@@ -349,1118 +788,3347 @@ static time_t zdtun_now(zdtun_t *tun) {
 
 /* ******************************************************* */
 
-void zdtun_set_socks5_proxy(zdtun_t *tun, const zdtun_ip_t *proxy_ip,
-        uint16_t proxy_port, uint8_t ipver) {
-  tun->socks5.ip = *proxy_ip;
-  tun->socks5.port = proxy_port;
-  tun->socks5.ipver = ipver;
-}
+#ifdef ZDTUN_INSTRUMENTATION
 
-/* ******************************************************* */
+static uint64_t instr_now_us() {
+  struct timespec ts;
 
-void zdtun_set_socks5_userpass(zdtun_t *tun, const char *username, const char *password) {
-  free(tun->socks5_user);
-  free(tun->socks5_pass);
+  if(clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    return 0;
 
-  tun->socks5_user = strdup(username);
-  tun->socks5_pass = strdup(password);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /* ******************************************************* */
 
-/* Connection methods */
-void* zdtun_conn_get_userdata(const zdtun_conn_t *conn) {
-  return conn->user_data;
-}
+static void hist_add(zdtun_histogram_t *hist, uint64_t usec) {
+  uint64_t val = usec;
+  int bucket = 0;
 
-void zdtun_conn_set_userdata(zdtun_conn_t *conn, void *userdata) {
-  conn->user_data = userdata;
-}
+  // log2 buckets, see zdtun_histogram_t
+  while((val > 0) && (bucket < (ZDTUN_HIST_BUCKETS - 1))) {
+    val >>= 1;
+    bucket++;
+  }
 
-const zdtun_5tuple_t* zdtun_conn_get_5tuple(const zdtun_conn_t *conn) {
-  return &conn->tuple;
+  hist->buckets[bucket]++;
+  hist->count++;
+  hist->sum_us += usec;
 }
 
-time_t zdtun_conn_get_last_seen(const zdtun_conn_t *conn) {
-  return conn->tstamp;
-}
+/* ******************************************************* */
 
-zdtun_conn_status_t zdtun_conn_get_status(const zdtun_conn_t *conn) {
-  return conn->status;
-}
+static void instr_account_pkt(zdtun_t *tun, const zdtun_pkt_t *pkt, uint8_t to_zdtun) {
+  int proto;
 
-socket_t zdtun_conn_get_socket(const zdtun_conn_t *conn) {
-  return conn->sock;
-}
+  if(pkt->tuple.ipproto == IPPROTO_TCP)
+    proto = ZDTUN_STATS_TCP;
+  else if(pkt->tuple.ipproto == IPPROTO_UDP)
+    proto = ZDTUN_STATS_UDP;
+  else
+    proto = ZDTUN_STATS_ICMP;
 
-void zdtun_conn_proxy(zdtun_conn_t *conn) {
-  // NOTE: only TCP is currently supported
-  if(conn->tuple.ipproto == IPPROTO_TCP)
-    conn->proxy_mode = PROXY_SOCKS5;
+  if(to_zdtun) {
+    tun->ext_stats.pkts_fwd[proto]++;
+    tun->ext_stats.bytes_fwd[proto] += pkt->len;
+  } else {
+    tun->ext_stats.pkts_reply[proto]++;
+    tun->ext_stats.bytes_reply[proto] += pkt->len;
+  }
 }
 
-void zdtun_conn_dnat(zdtun_conn_t *conn, const zdtun_ip_t *proxy_ip, uint16_t proxy_port, uint8_t ipver) {
-  proxy_t *proxy;
-  safe_alloc(proxy, proxy_t);
+#endif
 
-  proxy->ip = *proxy_ip;
-  proxy->port = proxy_port;
-  proxy->ipver = ipver;
+/* ******************************************************* */
 
-  if(conn->dnat)
-    free(conn->dnat);
+static conn_ext_t* conn_ext(zdtun_t *tun, zdtun_conn_t *conn);
 
-  conn->dnat = proxy;
-  conn->proxy_mode = PROXY_DNAT;
+// Called for each packet successfully exchanged with the client
+static inline void account_pkt(zdtun_t *tun, const zdtun_pkt_t *pkt, uint8_t to_zdtun, zdtun_conn_t *conn) {
+#ifndef ZDTUN_NO_ACCOUNTING
+  if(tun->capture)
+    capture_pkt(tun->capture, pkt->buf, pkt->len, to_zdtun);
+
+  if(tun->flows.exp) {
+    conn_ext_t *ext = conn_ext(tun, conn);
+
+    if(ext) {
+      ext->pkts[to_zdtun]++;
+      ext->bytes[to_zdtun] += pkt->len;
+    }
+  }
+
+  if(tun->callbacks.account_packet)
+    tun->callbacks.account_packet(tun, pkt, to_zdtun, conn);
+#endif
 }
 
 /* ******************************************************* */
 
-zdtun_t* zdtun_init(struct zdtun_callbacks *callbacks, void *udata) {
-  zdtun_t *tun;
-  safe_alloc(tun, zdtun_t);
+static void list_unlink(zdtun_t *tun, zdtun_conn_t *conn) {
+  conn_list_t *list = &tun->conn_lists[conn->list_id];
 
-  if(!tun) {
-    error("zdtun_t calloc error");
-    return NULL;
-  }
+  if(conn->list_prev)
+    conn->list_prev->list_next = conn->list_next;
+  else
+    list->head = conn->list_next;
 
-  /* Verify mandatory callbacks */
-  if(!callbacks) {
-    error("callbacks parameter is NULL");
-    return NULL;
-  }
-  if(!callbacks->send_client) {
-    error("missing mandatory send_client callback");
-    return NULL;
-  }
+  if(conn->list_next)
+    conn->list_next->list_prev = conn->list_prev;
+  else
+    list->tail = conn->list_prev;
 
-  tun->user_data = udata;
-  tun->mtu = 1500;
-  memcpy(&tun->callbacks, callbacks, sizeof(tun->callbacks));
+  conn->list_prev = conn->list_next = NULL;
+}
 
-  FD_ZERO(&tun->all_fds);
-  FD_ZERO(&tun->write_fds);
+static void list_append(zdtun_t *tun, zdtun_conn_t *conn, conn_list_id_t list_id) {
+  conn_list_t *list = &tun->conn_lists[list_id];
 
-  return tun;
+  conn->list_id = list_id;
+  conn->list_prev = list->tail;
+  conn->list_next = NULL;
+
+  if(list->tail)
+    list->tail->list_next = conn;
+  else
+    list->head = conn;
+
+  list->tail = conn;
 }
 
 /* ******************************************************* */
 
-void zdtun_finalize(zdtun_t *tun) {
-  zdtun_conn_t *conn, *tmp;
+static conn_list_id_t proto_list_id(uint8_t ipproto) {
+  switch(ipproto) {
+    case IPPROTO_TCP:
+      return CONN_LIST_TCP;
+    case IPPROTO_UDP:
+      return CONN_LIST_UDP;
+    default:
+      return CONN_LIST_ICMP;
+  }
+}
 
-  HASH_ITER(hh, tun->conn_table, conn, tmp) {
-    destroy_conn(tun, conn);
+static time_t list_timeout(zdtun_t *tun, conn_list_id_t list_id) {
+  switch(list_id) {
+    case CONN_LIST_TCP:
+      return tun->cfg.tcp_timeout;
+    case CONN_LIST_UDP:
+      return tun->cfg.udp_timeout;
+    case CONN_LIST_ICMP:
+      return tun->cfg.icmp_timeout;
+    case CONN_LIST_TCP_CONNECTING:
+      return tun->cfg.tcp_connect_timeout ? tun->cfg.tcp_connect_timeout : tun->cfg.tcp_timeout;
+    case CONN_LIST_PENDING:
+      return tun->cfg.verdict_timeout;
+    default:
+      return 0;
   }
+}
 
-  // tun->udp_mappings is cleaned up during destroy_conn
+/* ******************************************************* */
 
-  free(tun->socks5_user);
-  free(tun->socks5_pass);
-  free(tun);
+// Moves the connection to the tail of another list
+static void list_move(zdtun_t *tun, zdtun_conn_t *conn, conn_list_id_t list_id) {
+  list_unlink(tun, conn);
+  list_append(tun, conn, list_id);
 }
 
 /* ******************************************************* */
 
-static int send_to_client(zdtun_t *tun, zdtun_conn_t *conn, int l3_len) {
-  int size = l3_len + zdtun_iphdr_len(tun, conn);
-
-  if(zdtun_parse_pkt(tun, tun->reply_buf, size, &tun->last_pkt) < 0) {
-    error("zdtun_parse_pkt failed, this should never happen");
-    return -1;
-  }
-
-  int rv = tun->callbacks.send_client(tun, &tun->last_pkt, conn);
-
-  if(rv == 0) {
-    if(tun->callbacks.account_packet)
-        tun->callbacks.account_packet(tun, &tun->last_pkt, 0 /* from zdtun */, conn);
-  } else {
-    debug("send_client failed [%d]", rv);
+// Updates the connection last seen time. The connection is moved to the tail
+// of its idle list, which keeps the list ordered by tstamp.
+// The connecting and pending connections keep their connect (creation) time,
+// so that the client retransmissions do not postpone their timeout.
+static void conn_touch(zdtun_t *tun, zdtun_conn_t *conn) {
+  if((conn->list_id == CONN_LIST_TCP_CONNECTING) || (conn->list_id == CONN_LIST_PENDING))
+    return;
 
-    if(conn->tuple.ipproto == IPPROTO_TCP)
-        // important: set this to prevent close_conn to call send_to_client again in a loop
-        conn->tcp.fin_ack_sent = 1;
+  conn->tstamp = zdtun_now(tun);
 
-    zdtun_conn_close(tun, conn, CONN_STATUS_CLIENT_ERROR);
+  if((conn->list_id != CONN_LIST_CLOSED) && (tun->conn_lists[conn->list_id].tail != conn)) {
+    list_unlink(tun, conn);
+    list_append(tun, conn, conn->list_id);
   }
-
-  return(rv);
 }
 
 /* ******************************************************* */
 
-#ifndef WIN32
+// Returns the next connection to evict: the closed connections first, then
+// the least recently used one
+static zdtun_conn_t* oldest_conn(zdtun_t *tun) {
+  zdtun_conn_t *oldest = tun->conn_lists[CONN_LIST_CLOSED].head;
 
-// Try to get the free space in the socket TX buffer. The value returned
-// is just an approximation which helps tuning the TCP receiver window
-// seen by the client, thus possibly throttling the upload before
-// reaching the bottleneck and subsequent retransmissions.
-//
-// http://lkml.iu.edu/hypermail/linux/kernel/0502.2/1087.html
-// https://gitlab.torproject.org/tpo/core/tor/-/issues/12890
-static int get_available_sndbuf(zdtun_conn_t *conn) {
-  int bufsize = 0;
-  int queued = 0;
-  socklen_t len = sizeof(bufsize);
+  if(oldest)
+    return oldest;
 
-  // Get the available bytes in the send buffer
-  getsockopt(conn->sock, SOL_SOCKET, SO_SNDBUF, &bufsize, &len);
-  if(bufsize == 0)
-    bufsize = DEFAULT_TCP_WINDOW;
+  for(int i = 0; i < CONN_LIST_CLOSED; i++) {
+    zdtun_conn_t *conn = tun->conn_lists[i].head;
 
-  ioctl(conn->sock, SIOCOUTQ, &queued);
-  int sockbuf_avail = bufsize - queued - conn->tcp.tx_queue_size;
+    if(conn && (!oldest || (conn->tstamp < oldest->tstamp)))
+      oldest = conn;
+  }
 
-  return max(sockbuf_avail, 0);
+  return oldest;
 }
 
-#endif
-
 /* ******************************************************* */
 
-int zdtun_iphdr_len(zdtun_t *tun, zdtun_conn_t *conn) {
-  return (sock_ipver(tun, conn) == 4) ? IPV4_HEADER_LEN : IPV6_HEADER_LEN;
+void zdtun_set_socks5_proxy(zdtun_t *tun, const zdtun_ip_t *proxy_ip,
+        uint16_t proxy_port, uint8_t ipver) {
+  if(!ipv6_enabled && (ipver != 4)) {
+    error("zdtun built without IPv6 support");
+    return;
+  }
+
+  tun->socks5.ip = *proxy_ip;
+  tun->socks5.port = proxy_port;
+  tun->socks5.ipver = ipver;
+
+  // the pooled connections are bound to the previous proxy
+  socks5_pool_close(tun);
+  socks5_pool_fill(tun);
 }
 
 /* ******************************************************* */
 
-void zdtun_make_iphdr(zdtun_t *tun, zdtun_conn_t *conn, char *pkt_buf, u_int16_t l3_len) {
-  if(sock_ipver(tun, conn) == 4) {
-    struct iphdr *ip = (struct iphdr*)pkt_buf;
-    uint16_t tot_len = l3_len + IPV4_HEADER_LEN;
-
-    memset(ip, 0, IPV4_HEADER_LEN);
-    ip->ihl = 5; // 5 * 4 = 20 = IPV4_HEADER_LEN
-    ip->version = 4;
-    ip->frag_off = htons(0x4000); // don't fragment
-    ip->tot_len = htons(tot_len);
-    ip->ttl = 64; // hops
-    ip->protocol = conn->tuple.ipproto;
-    ip->saddr = conn->tuple.dst_ip.ip4;
-    ip->daddr = conn->tuple.src_ip.ip4;
+void zdtun_set_socks5_userpass(zdtun_t *tun, const char *username, const char *password) {
+  free(tun->socks5_user);
+  free(tun->socks5_pass);
 
-    ip->check = ~calc_checksum(0, (u_int8_t*)ip, IPV4_HEADER_LEN);
-  } else {
-    struct ipv6_hdr *ip = (struct ipv6_hdr*)pkt_buf;
+  tun->socks5_user = strdup(username);
+  tun->socks5_pass = strdup(password);
 
-    memset(ip, 0, IPV6_HEADER_LEN);
-    ip->version = 6;
-    ip->payload_len = htons(l3_len);
-    ip->nexthdr = (conn->tuple.ipproto != IPPROTO_ICMP) ? conn->tuple.ipproto : IPPROTO_ICMPV6;
-    ip->hop_limit = 64;
-    ip->saddr = conn->tuple.dst_ip.ip6;
-    ip->daddr = conn->tuple.src_ip.ip6;
-  }
+  socks5_pool_close(tun);
+  socks5_pool_fill(tun);
 }
 
 /* ******************************************************* */
 
-uint16_t zdtun_l3_checksum(zdtun_t *tun, zdtun_conn_t *conn, char *ipbuf, char *l3, uint16_t l3_len) {
-  uint8_t ipver = sock_ipver(tun, conn);
-  uint8_t ipproto = conn->tuple.ipproto;
-  uint16_t rv = calc_checksum(0, (uint8_t*)l3, l3_len);
-
-  if(ipver == 4) {
-    struct iphdr *ip_header = (struct iphdr*)ipbuf;
-    struct ippseudo pseudo = {0};
-
-    pseudo.ippseudo_src = ip_header->saddr;
-    pseudo.ippseudo_dst = ip_header->daddr;
-    pseudo.ippseudo_p = ipproto;
-    pseudo.ippseudo_len = htons(l3_len);
+void zdtun_set_socks5_opts(zdtun_t *tun, uint8_t flags) {
+#ifndef MSG_FASTOPEN
+  if(flags & ZDTUN_SOCKS5_FASTOPEN) {
+    log("TCP Fast Open not available, only pipelining the SOCKS5 handshake");
+    flags = (flags & ~ZDTUN_SOCKS5_FASTOPEN) | ZDTUN_SOCKS5_PIPELINE;
+  }
+#endif
 
-    rv = calc_checksum(rv, (uint8_t*)&pseudo, sizeof(pseudo));
-  } else {
-    struct ipv6_hdr *ip_header = (struct ipv6_hdr*)ipbuf;
-    struct ip6_hdr_pseudo pseudo;
-    memset(&pseudo, 0, sizeof(pseudo));
+  tun->socks5_opts = flags;
+}
 
-    pseudo.ip6ph_src = ip_header->saddr;
-    pseudo.ip6ph_dst = ip_header->daddr;
-    pseudo.ip6ph_len = ip_header->payload_len;
-    pseudo.ip6ph_nxt = ((ipver == 6) && (ipproto == IPPROTO_ICMP)) ? IPPROTO_ICMPV6 : ipproto;
+/* ******************************************************* */
 
-    rv = calc_checksum(rv, (uint8_t*)&pseudo, sizeof(pseudo));
-  }
+void zdtun_set_socks5_pool(zdtun_t *tun, uint8_t size) {
+  tun->socks5_pool_size = min(size, SOCKS5_MAX_POOL_SIZE);
 
-  return ~rv;
+  // closes the excess connections and opens the missing ones
+  socks5_pool_purge(tun, zdtun_now(tun));
 }
 
 /* ******************************************************* */
 
-static void build_reply_tcpip(zdtun_t *tun, zdtun_conn_t *conn, u_int8_t flags,
-        u_int16_t l4_len, u_int16_t optsoff) {
-  uint8_t ipver = sock_ipver(tun, conn);
-  int iphdr_len = zdtun_iphdr_len(tun, conn);
-  const u_int16_t l3_len = l4_len + TCP_HEADER_LEN + (optsoff * 4);
-  struct tcphdr *tcp = (struct tcphdr *)&tun->reply_buf[iphdr_len];
-  uint32_t max_win = ((uint32_t)0xFFFF) << conn->tcp.window_scale;
-  uint32_t tcpwin;
+void zdtun_dns_cache_set_size(zdtun_t *tun, u_int32_t max_entries) {
+  dns_cache_set_size(&tun->dns_cache, max_entries);
+}
 
-  memset(tcp, 0, TCP_HEADER_LEN);
-  tcp->th_sport = conn->tuple.dst_port;
-  tcp->th_dport = conn->tuple.src_port;
-  tcp->th_seq = htonl(conn->tcp.zdtun_seq);
-  tcp->th_ack = (flags & TH_ACK) ? htonl(conn->tcp.client_seq) : 0;
-  tcp->th_off = 5 + optsoff;
-  tcp->th_flags = flags;
+/* ******************************************************* */
 
-#ifdef WIN32
-  tcpwin = max_win;
-#else
-  // To avoid slowdowns, it's better to check the free space in the send
-  // buffer and reduce the TCP window accordingly. If a 0 window is sent,
-  // the client will periodically send TCP_KEEPALIVE to wake the connection.
-  // This prevents connection stall.
-  tcpwin = min(get_available_sndbuf(conn), max_win);
-#endif
+void zdtun_dns_cache_flush(zdtun_t *tun) {
+  dns_cache_flush(&tun->dns_cache);
+}
 
-  tcp->th_win = htons(tcpwin >> conn->tcp.window_scale);
+/* ******************************************************* */
 
-  zdtun_make_iphdr(tun, conn, tun->reply_buf, l3_len);
-  tcp->th_sum = zdtun_l3_checksum(tun, conn, tun->reply_buf, (char*)tcp, l3_len);
+void zdtun_dns_cache_get_stats(zdtun_t *tun, zdtun_dns_cache_stats_t *stats) {
+  stats->num_entries = dns_cache_count(&tun->dns_cache);
+  stats->max_entries = tun->dns_cache.max_entries;
+  stats->hits = tun->dns_cache.hits;
+  stats->misses = tun->dns_cache.misses;
+  stats->coalesced = tun->dns_cache.coalesced;
 }
 
 /* ******************************************************* */
 
-// It is used to defer the destroy_conn function to let the user
-// consume the connection without accessing invalid memory. The connections
-// will be (later) destroyed by zdtun_purge_expired.
-// May be called multiple times.
-void zdtun_conn_close(zdtun_t *tun, zdtun_conn_t *conn, zdtun_conn_status_t status) {
-  if(conn->status >= CONN_STATUS_CLOSED)
-    return;
-
-  if(conn->tuple.ipproto == IPPROTO_UDP) {
-    udp_mapping_t *mapping;
-    uint32_t key = udp_mapping_key(&conn->tuple);
+int zdtun_dns_cache_iter(zdtun_t *tun, zdtun_dns_cache_iterator_t iterator, void *user_data) {
+  dns_cache_entry_t *entry, *tmp;
+  time_t now = zdtun_now(tun);
+  int num_iter = 0;
 
-    HASH_FIND(hh, tun->udp_mappings, &key, sizeof(key), mapping);
+  HASH_ITER(hh, tun->dns_cache.entries, entry, tmp) {
+    char qname[DNS_MAX_NAME_LEN + 1];
+    uint16_t qtype;
 
-    if(mapping && (--mapping->num_uses == 0)) {
-      HASH_DELETE(hh, tun->udp_mappings, mapping);
-      free(mapping);
-    }
-  }
+    // skip the pending and the stale entries
+    if(!entry->resp || (entry->expire <= now) ||
+        (dns_key_to_name(entry->key, entry->key_len, qname, sizeof(qname), &qtype) != 0))
+      continue;
 
-  close_socket(tun, conn->sock);
-  conn->sock = INVALID_SOCKET;
+    num_iter++;
 
-  if((conn->tuple.ipproto == IPPROTO_TCP)
-      && !conn->tcp.fin_ack_sent) {
-    // Send TCP RST
-    build_reply_tcpip(tun, conn, TH_RST | TH_ACK, 0, 0);
-    send_to_client(tun, conn, TCP_HEADER_LEN);
+    if(iterator(tun, qname, qtype, entry->expire - now, user_data) != 0)
+      break;
   }
 
-  if(conn->tuple.ipproto == IPPROTO_TCP) {
-    tcp_data_t *cur = conn->tcp.tx_queue;
+  return num_iter;
+}
 
-    // free tx_queue
-    while(cur) {
-      tcp_data_t *next = cur->next;
-      free(cur);
-      cur = next;
-    }
+/* ******************************************************* */
 
-    conn->tcp.tx_queue = NULL;
+int zdtun_capture_start(zdtun_t *tun, const zdtun_capture_config_t *config) {
+#ifdef ZDTUN_NO_ACCOUNTING
+  error("zdtun built without packets accounting");
+  return(-1);
+#else
+  if(tun->capture) {
+    error("capture already running");
+    return(-1);
   }
 
-  conn->status = (status >= CONN_STATUS_CLOSED) ? status : CONN_STATUS_CLOSED;
+  if(!(tun->capture = capture_open(config)))
+    return(-1);
 
-  if(tun->callbacks.on_connection_close)
-    tun->callbacks.on_connection_close(tun, conn);
+  return(0);
+#endif
 }
 
 /* ******************************************************* */
 
-// Avoid calling destroy_conn inside zdtun_forward_full as it may
-// generate dangling pointers. Use close_conn instead.
-static void destroy_conn(zdtun_t *tun, zdtun_conn_t *conn) {
-  debug("PURGE SOCKET (type=%d)", conn->tuple.ipproto);
-
-  zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
-
-  if(conn->dnat)
-    free(conn->dnat);
-
-  switch(conn->tuple.ipproto) {
-    case IPPROTO_TCP:
-      tun->stats.num_tcp_conn--;
-      break;
-    case IPPROTO_UDP:
-      tun->stats.num_udp_conn--;
-      break;
-    case IPPROTO_ICMP:
-      tun->stats.num_icmp_conn--;
-      break;
+void zdtun_capture_stop(zdtun_t *tun) {
+  if(tun->capture) {
+    capture_close(tun->capture);
+    tun->capture = NULL;
   }
-
-  HASH_DELETE(hh, tun->conn_table, conn);
-  free(conn);
 }
 
 /* ******************************************************* */
 
-static int send_syn_ack(zdtun_t *tun, zdtun_conn_t *conn) {
-  int rv;
-  int iphdr_len = zdtun_iphdr_len(tun, conn);
-  uint8_t *opts = (uint8_t*) &tun->reply_buf[iphdr_len + TCP_HEADER_LEN];
-
-  // MSS option
-  *(opts++) = 2;
-  *(opts++) = 4;
-  *((uint16_t*)opts) = htons(default_mss(tun, conn));
-  opts += 2;
-
-  // Window Scale
-  *(opts++) = 3;
-  *(opts++) = 3;
-  *(opts++) = conn->tcp.window_scale;
-
-  // End, aligned to 32 bits
-  *(opts++) = 0;
-
-  build_reply_tcpip(tun, conn, TH_SYN | TH_ACK, 0, 2 /* n. 32bit words*/);
+int zdtun_capture_get_stats(zdtun_t *tun, zdtun_capture_stats_t *stats) {
+  if(!tun->capture)
+    return(-1);
 
-  if((rv = send_to_client(tun, conn, TCP_HEADER_LEN + 8 /* opts length */)) == 0)
-    conn->tcp.zdtun_seq += 1;
-
-  return rv;
+  capture_get_stats(tun->capture, stats);
+  return(0);
 }
 
 /* ******************************************************* */
 
-static int tcp_socket_syn(zdtun_t *tun, zdtun_conn_t *conn) {
-  // disable non-blocking mode from now on
-
-#ifdef WIN32
-  unsigned nonblocking = 0;
-  ioctlsocket(conn->sock, FIONBIO, &nonblocking);
-#else
-  int flags = fcntl(conn->sock, F_GETFL);
+/* Connection methods */
+// Returns the extension of the connection, allocating it from the ext_pool on
+// first use. Returns NULL if the allocation fails.
+static conn_ext_t* conn_ext(zdtun_t *tun, zdtun_conn_t *conn) {
+  if(!conn->ext && !(conn->ext = mempool_alloc(&tun->ext_pool)))
+    error("conn_ext alloc failed");
 
-  if(fcntl(conn->sock, F_SETFL, flags &(~O_NONBLOCK)) == -1)
-    error("Cannot disable non-blocking: %d", errno);
-#endif
+  return conn->ext;
+}
 
-  FD_CLR(conn->sock, &tun->write_fds);
-  conn->status = CONN_STATUS_CONNECTED;
+// Like conn_ext, for the connection methods which have no zdtun instance
+static conn_ext_t* conn_ext_heap(zdtun_conn_t *conn) {
+  if(!conn->ext) {
+    if(!(conn->ext = calloc(1, sizeof(conn_ext_t)))) {
+      error("conn_ext alloc failed");
+      return NULL;
+    }
 
-  if(conn->proxy_mode == PROXY_SOCKS5) {
-    // wait before sending the SYN+ACK
-    return socks5_connect(tun, conn);
+    conn->ext_heap = 1;
   }
 
-  return send_syn_ack(tun, conn);
+  return conn->ext;
 }
 
-/* ******************************************************* */
+static void conn_ext_free(zdtun_t *tun, zdtun_conn_t *conn) {
+  if(!conn->ext)
+    return;
 
-static void tcp_socket_fin_ack(zdtun_t *tun, zdtun_conn_t *conn) {
-  build_reply_tcpip(tun, conn, TH_FIN | TH_ACK, 0, 0);
+  if(conn->ext_heap)
+    free(conn->ext);
+  else
+    mempool_free(&tun->ext_pool, conn->ext);
 
-  if(send_to_client(tun, conn, TCP_HEADER_LEN) == 0)
-    conn->tcp.zdtun_seq += 1;
+  conn->ext = NULL;
 }
 
 /* ******************************************************* */
 
-zdtun_conn_t* zdtun_lookup(zdtun_t *tun, const zdtun_5tuple_t *tuple, uint8_t create) {
-  zdtun_conn_t *conn = NULL;
+void* zdtun_conn_get_userdata(const zdtun_conn_t *conn) {
+  return conn->user_data;
+}
 
-  HASH_FIND(hh, tun->conn_table, tuple, sizeof(*tuple), conn);
-  if(conn && (conn->status >= CONN_STATUS_CLOSED)) {
-    // avoid returning connections to purge, for which the close_callback was already called and
-    // user data was probably already deallocated.
-    destroy_conn(tun, conn);
-    conn = NULL;
-  }
+void zdtun_conn_set_userdata(zdtun_conn_t *conn, void *userdata) {
+  conn->user_data = userdata;
+}
 
-  if(!conn && create) {
-    if(tun->stats.num_open_sockets >= MAX_NUM_SOCKETS) {
-      debug("Force purge!");
-      zdtun_purge_expired(tun);
-    }
+const zdtun_5tuple_t* zdtun_conn_get_5tuple(const zdtun_conn_t *conn) {
+  return &conn->tuple;
+}
 
-    /* Add a new connection */
-    safe_alloc(conn, zdtun_conn_t);
-    conn->sock = INVALID_SOCKET;
-    conn->tuple = *tuple;
-    conn->tstamp = zdtun_now(tun);
+time_t zdtun_conn_get_last_seen(const zdtun_conn_t *conn) {
+  return conn->tstamp;
+}
 
-    if(tun->callbacks.on_connection_open) {
-      if(tun->callbacks.on_connection_open(tun, conn) != 0) {
-        debug("Dropping connection");
-        free(conn);
-        return NULL;
-      }
-    }
+zdtun_conn_status_t zdtun_conn_get_status(const zdtun_conn_t *conn) {
+  return conn->status;
+}
 
-    HASH_ADD(hh, tun->conn_table, tuple, sizeof(*tuple), conn);
+socket_t zdtun_conn_get_socket(const zdtun_conn_t *conn) {
+  if((conn->tuple.ipproto == IPPROTO_UDP) && conn->udp.shared)
+    return conn->udp.shared->sock;
 
-    switch(conn->tuple.ipproto) {
-      case IPPROTO_TCP:
-        tun->stats.num_tcp_conn++;
-        break;
-      case IPPROTO_UDP:
-        tun->stats.num_udp_conn++;
-        break;
-      case IPPROTO_ICMP:
-        tun->stats.num_icmp_conn++;
-        break;
+  return conn->sock;
+}
+
+void zdtun_conn_proxy(zdtun_conn_t *conn) {
+#ifdef ZDTUN_NO_SOCKS5
+  error("zdtun built without SOCKS5 support");
+#else
+  // NOTE: only TCP is currently supported
+  if(conn->tuple.ipproto == IPPROTO_TCP) {
+    // fail closed, rather than bypassing the proxy
+    if(!conn_ext_heap(conn)) {
+      conn->status = CONN_STATUS_ERROR;
+      return;
     }
-  }
 
-  return conn;
+    conn->proxy_mode = PROXY_SOCKS5;
+  }
+#endif
 }
 
-/* ******************************************************* */
+void zdtun_conn_dnat(zdtun_conn_t *conn, const zdtun_ip_t *proxy_ip, uint16_t proxy_port, uint8_t ipver) {
+  if(!ipv6_enabled && (ipver != 4)) {
+    error("zdtun built without IPv6 support");
+    return;
+  }
 
-static void check_dns_request(zdtun_conn_t *conn, char *l4_payload, uint16_t l4_len) {
-  struct dns_packet *dns;
+  conn_ext_t *ext = conn_ext_heap(conn);
 
-  if((l4_len < sizeof(struct dns_packet)) || (conn->tuple.dst_port != ntohs(53)))
+  if(!ext) {
+    conn->status = CONN_STATUS_ERROR;
     return;
+  }
 
-  dns = (struct dns_packet*)l4_payload;
+  proxy_t *proxy = &ext->dnat;
+
+  proxy->ip = *proxy_ip;
+  proxy->port = proxy_port;
+  proxy->ipver = ipver;
 
-  if((dns->flags & DNS_FLAGS_MASK) == DNS_TYPE_REQUEST)
-    conn->dns.pending_queries++;
+  conn->proxy_mode = PROXY_DNAT;
 }
 
 /* ******************************************************* */
 
-static int check_dns_purge(zdtun_t *tun, zdtun_conn_t *conn,
-        char *l4_payload, uint16_t l4_len) {
-    struct dns_packet *dns;
-
-    if((l4_len < sizeof(struct dns_packet)) || (conn->tuple.dst_port != ntohs(53)))
-      return(1);
-
-    dns = (struct dns_packet*)l4_payload;
-
-    if(((dns->flags & DNS_FLAGS_MASK) == DNS_TYPE_RESPONSE)
-        && (conn->dns.pending_queries > 0)) {
-      conn->dns.pending_queries--;
-
-      if(conn->dns.pending_queries == 0) {
-        char buf[256];
-
-        /* DNS responses received, can now purge the conn */
-        debug("DNS purge: %s", zdtun_5tuple2str(&conn->tuple, buf, sizeof(buf)));
-        zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
-
-        /* purged */
-        return(0);
-      }
-    }
-
-    return(1);
+void zdtun_default_config(zdtun_config_t *config) {
+  memset(config, 0, sizeof(*config));
+
+  config->max_sockets = MAX_NUM_SOCKETS;
+  config->sockets_after_purge = NUM_SOCKETS_AFTER_PURGE;
+  config->max_connections = 0;
+  config->tcp_timeout = TCP_TIMEOUT_SEC;
+  config->udp_timeout = UDP_TIMEOUT_SEC;
+  config->icmp_timeout = ICMP_TIMEOUT_SEC;
+  config->tcp_connect_timeout = TCP_CONNECT_TIMEOUT_SEC;
+  config->max_pending_verdicts = MAX_PENDING_VERDICTS;
+  config->verdict_timeout = VERDICT_TIMEOUT_SEC;
+  config->conn_pass_budget = CONN_PASS_BUDGET;
+  config->conn_pass_pkts = CONN_PASS_PKTS;
 }
 
 /* ******************************************************* */
 
-static int is_upper_layer(int proto) {
-  return (proto == IPPROTO_TCP ||
-          proto == IPPROTO_UDP ||
-          proto == IPPROTO_ICMP ||
-          proto == IPPROTO_ICMPV6);
+zdtun_t* zdtun_init(struct zdtun_callbacks *callbacks, void *udata) {
+  return zdtun_init_ex(callbacks, udata, NULL);
 }
 
 /* ******************************************************* */
 
-int zdtun_parse_pkt(zdtun_t *tun, const char *_pkt_buf, uint16_t pkt_len, zdtun_pkt_t *pkt) {
-  memset(pkt, 0, sizeof(zdtun_pkt_t));
+zdtun_t* zdtun_init_ex(struct zdtun_callbacks *callbacks, void *udata, const zdtun_config_t *config) {
+  zdtun_t *tun;
+  safe_alloc(tun, zdtun_t);
 
-  if(pkt_len < IPV4_HEADER_LEN) {
-    debug("Ignoring non IP packet (len: %d)", pkt_len);
-    return -1;
+  if(!tun) {
+    error("zdtun_t calloc error");
+    return NULL;
   }
 
-  char *pkt_buf = (char *)_pkt_buf; /* needed to set the zdtun_pkt_t pointers */
-  uint8_t ipver = (*pkt_buf) >> 4;
-  uint8_t ipproto;
-  int iphdr_len;
-
-  if((ipver != 4) && (ipver != 6)) {
-    debug("Ignoring non IP packet (len: %d, v: %d)", pkt_len, ipver);
-    return -1;
+  /* Verify mandatory callbacks */
+  if(!callbacks) {
+    error("callbacks parameter is NULL");
+    free(tun);
+    return NULL;
+  }
+  if(!callbacks->send_client && !callbacks->send_client_batch) {
+    error("missing mandatory send_client callback");
+    free(tun);
+    return NULL;
+  }
+  if(callbacks->alloc_buf && !callbacks->release_buf) {
+    error("the alloc_buf callback requires release_buf");
+    free(tun);
+    return NULL;
+  }
+  if(callbacks->send_client_batch && !(tun->batch.buf = malloc(BATCH_BUF_SIZE))) {
+    error("batch buffer alloc error");
+    free(tun);
+    return NULL;
+  }
+  if(flowtable_init(&tun->conn_table) != 0) {
+    error("connections table alloc error");
+    free(tun->batch.buf);
+    free(tun);
+    return NULL;
   }
 
-  if(ipver == 4) {
-    struct iphdr *ip_header = (struct iphdr*) pkt_buf;
-    iphdr_len = ip_header->ihl * 4;
-
-    if(pkt_len < iphdr_len) {
-      debug("IPv4 packet too short: %d bytes", pkt_len);
-      return -1;
-    }
+  tun->user_data = udata;
+  tun->mtu = 1500;
+  memcpy(&tun->callbacks, callbacks, sizeof(tun->callbacks));
 
-    uint16_t tot_len = ntohs(ip_header->tot_len);
-    if(tot_len < iphdr_len) {
-      debug("Invalid IPv4 packet: tot_len=%d, hdr_len=%d", tot_len, iphdr_len);
-      return -1;
-    }
+  if(config)
+    tun->cfg = *config;
+  else
+    zdtun_default_config(&tun->cfg);
+
+  if(tun->cfg.udp_shared_sockets &&
+      !(tun->udp_rx_bufs = malloc((size_t)UDP_RECV_BATCH * REPLY_BUF_SIZE))) {
+    error("UDP receive buffers alloc error");
+    flowtable_destroy(&tun->conn_table);
+    free(tun->batch.buf);
+    free(tun);
+    return NULL;
+  }
 
-    // exclude non-IP data
-    pkt_len = min(pkt_len, tot_len);
+  if(tun->cfg.max_sockets == 0)
+    tun->cfg.max_sockets = MAX_NUM_SOCKETS;
 
-    pkt->tuple.src_ip.ip4 = ip_header->saddr;
-    pkt->tuple.dst_ip.ip4 = ip_header->daddr;
-    ipproto = ip_header->protocol;
+  mempool_init(&tun->conn_pool, sizeof(zdtun_conn_t), CONNS_PER_SLAB);
+  mempool_init(&tun->ext_pool, sizeof(conn_ext_t), EXTS_PER_SLAB);
+  bufpool_init(&tun->tx_pool, MAX_CACHED_TX_BUFS);
+  dns_cache_init(&tun->dns_cache, 0);
 
-    if (ip_header->frag_off & htons(0x1FFF)) {
-      // this an IP fragment (not the first one)
-      pkt->flags |= ZDTUN_PKT_IS_FRAGMENT;
-    } else if (ip_header->frag_off & htons(0x2000)) { // IP_MF
-      // this the first IP fragment
-      pkt->flags |= ZDTUN_PKT_IS_FRAGMENT;
-      pkt->flags |= ZDTUN_PKT_IS_FIRST_FRAGMENT;
-    }
-  } else {
-    struct ipv6_hdr *ip_header = (struct ipv6_hdr*) pkt_buf;
+  if(tun->cfg.sockets_after_purge >= tun->cfg.max_sockets) {
+    error("invalid sockets_after_purge (%u), using %u", tun->cfg.sockets_after_purge,
+      tun->cfg.max_sockets * 3 / 4);
+    tun->cfg.sockets_after_purge = tun->cfg.max_sockets * 3 / 4;
+  }
 
-    if(pkt_len < sizeof(struct ipv6_hdr)) {
-      debug("IPv6 packet too short: %d bytes", pkt_len);
-      return -1;
-    }
+  FD_ZERO(&tun->all_fds);
+  FD_ZERO(&tun->write_fds);
+  tun->event_fd = INVALID_SOCKET;
 
-    iphdr_len = sizeof(struct ipv6_hdr);
+#ifdef HAVE_EPOLL
+  tun->event_fd = epoll_create1(EPOLL_CLOEXEC);
 
-    if(!is_upper_layer(ip_header->nexthdr)) {
-      debug("IPv6 extensions not supported: %d", ip_header->nexthdr);
-      return -1;
-    }
+  if(tun->event_fd < 0) {
+    error("epoll_create1 failed[%d]: %s, falling back to select", errno, strerror(errno));
+    tun->event_fd = INVALID_SOCKET;
+  } else
+    tun->stats.all_max_fd = tun->event_fd;
+#endif
 
-    // exclude non-IP data
-    uint16_t payload_len = ntohs(ip_header->payload_len);
-    pkt_len = min(pkt_len, payload_len + iphdr_len);
+  return tun;
+}
 
-    pkt->tuple.src_ip.ip6 = ip_header->saddr;
-    pkt->tuple.dst_ip.ip6 = ip_header->daddr;
+/* ******************************************************* */
 
-    // Treat IPPROTO_ICMPV6 as IPPROTO_ICMP for simplicity
-    ipproto = (ip_header->nexthdr != IPPROTO_ICMPV6) ? ip_header->nexthdr : IPPROTO_ICMP;
-  }
+void zdtun_finalize(zdtun_t *tun) {
+  uint32_t num_conns;
 
-  pkt->buf = pkt_buf;
-  pkt->l3 = pkt_buf;
-  pkt->tuple.ipproto = ipproto;
-  pkt->tuple.ipver = ipver;
-  pkt->len = pkt_len;
-  pkt->ip_hdr_len = iphdr_len;
-  pkt->l4 = &pkt_buf[iphdr_len];
+  while((num_conns = flowtable_count(&tun->conn_table)) > 0)
+    destroy_conn(tun, flowtable_value(&tun->conn_table, num_conns - 1));
 
-  if((pkt->flags & ZDTUN_PKT_IS_FRAGMENT) &&
-     !(pkt->flags & ZDTUN_PKT_IS_FIRST_FRAGMENT)) {
-    // this an IP fragment (not the first one)
-    ip_frag_ports_t *ports = &tun->id2ports[pkt->ip4->id];
+  flowtable_destroy(&tun->conn_table);
 
-    // may be 0
-    pkt->tuple.src_port = ports->sport;
-    pkt->tuple.dst_port = ports->dport;
-    pkt->l4_hdr_len = 0;
+#ifdef HAVE_MSG_ZEROCOPY
+  purge_zerocopy_lingering(tun, 1);
+#endif
 
-    if(!(pkt->ip4->frag_off & htons(0x2000))) { // !IP_MF
-      // this is the last fragment. Reset the ports to avoid matching unrelated fragments.
-      // This assumes that the previous fragments are not lost and retransmitted afterwards.
-      ports->sport = 0;
-      ports->dport = 0;
-    }
-  } else if(ipproto == IPPROTO_TCP) {
-    struct tcphdr *data = pkt->tcp;
-    int32_t tcp_header_len;
+  // the mappings without a shared socket are freed by destroy_conn
+  udp_mapping_t *mapping, *tmp;
 
-    if(pkt_len < (iphdr_len + TCP_HEADER_LEN)) {
-      debug("Packet too small for TCP[%d]", pkt_len);
-      return -1;
-    }
+  HASH_ITER(hh, tun->udp_mappings, mapping, tmp) {
+    close_shared_udp(tun, mapping);
+    HASH_DELETE(hh, tun->udp_mappings, mapping);
+    free(mapping);
+  }
 
-    tcp_header_len = data->th_off * 4;
+  socks5_pool_close(tun);
 
-    if(pkt_len < (iphdr_len + tcp_header_len)) {
-      debug("Malformed TCP packet");
-      return -1;
-    }
+  if(tun->event_fd != INVALID_SOCKET)
+    closesocket(tun->event_fd);
 
-    pkt->l4_hdr_len = tcp_header_len;
-    pkt->tuple.src_port = data->th_sport;
-    pkt->tuple.dst_port = data->th_dport;
-  } else if(ipproto == IPPROTO_UDP) {
-    struct udphdr *data = pkt->udp;
+  mempool_destroy(&tun->conn_pool);
+  mempool_destroy(&tun->ext_pool);
+  bufpool_destroy(&tun->tx_pool);
+  free(tun->batch.buf);
+  free(tun->ready.conns);
+  free(tun->udp_rx_bufs);
+  dns_cache_flush(&tun->dns_cache);
+  zdtun_capture_stop(tun);
+  zdtun_flows_export(tun, 0);
 
-    if(pkt_len < (iphdr_len + UDP_HEADER_LEN)) {
-      debug("Packet too small for UDP[%d]", pkt_len);
-      return -1;
-    }
+  free(tun->socks5_user);
+  free(tun->socks5_pass);
+  free(tun);
+}
 
-    pkt->l4_hdr_len = 8;
-    pkt->tuple.src_port = data->uh_sport;
-    pkt->tuple.dst_port = data->uh_dport;
-  } else if(ipproto == IPPROTO_ICMP) {
-    struct icmphdr *data = (struct icmphdr*) &pkt_buf[iphdr_len];
+/* ******************************************************* */
 
-    if(pkt_len < (iphdr_len + sizeof(struct icmphdr))) {
-      debug("Packet too small for ICMP");
-      return -1;
-    }
+// Reports the checksum offloaded by reply_l4_checksum
+static void set_pkt_csum_info(zdtun_t *tun, zdtun_pkt_t *pkt, uint16_t gso_size) {
+  uint8_t ipproto = pkt->tuple.ipproto;
 
-    if((data->type != ICMP_ECHO) && (data->type != ICMP_ECHOREPLY) &&
-        (data->type != ICMPv6_ECHO) && (data->type != ICMPv6_ECHOREPLY)) {
-      debug("Discarding unsupported ICMP[%d]", data->type);
-      return -2;
-    }
+  if(gso_size) {
+    pkt->flags |= ZDTUN_PKT_GSO;
+    pkt->gso_size = gso_size;
+  } else if(!(tun->offload & (ZDTUN_OFFLOAD_CSUM_PARTIAL | ZDTUN_OFFLOAD_CSUM_NONE)))
+    return;
 
-    pkt->l4_hdr_len = sizeof(struct icmphdr);
+  // ICMPv4 replies are patched in place, IPv4 UDP replies have no checksum
+  if((pkt->tuple.ipver == 4) && (ipproto != IPPROTO_TCP))
+    return;
 
-    // NOTE: echo ID in the source port is the same convention used by linux for ICMP connections
-    if((data->type == ICMP_ECHO) || (data->type == ICMPv6_ECHO)) {
-      pkt->tuple.echo_id = data->un.echo.id;
-      pkt->tuple.dst_port = 0;
-    } else {
-      pkt->tuple.echo_id = 0;
-      pkt->tuple.dst_port = data->un.echo.id;
-    }
-  } else {
-    debug("Packet with unknown protocol: %u", ipproto);
-    return -3;
+  if((tun->offload & ZDTUN_OFFLOAD_CSUM_NONE) && !gso_size) {
+    pkt->flags |= ZDTUN_PKT_CSUM_NONE;
+    return;
   }
 
-  if(pkt->flags & ZDTUN_PKT_IS_FIRST_FRAGMENT) {
-    // save the ports to restore them on the next fragments
-    // Assumption: the IP ID field of different connections does not collide
-    ip_frag_ports_t *ports = &tun->id2ports[pkt->ip4->id];
-    ports->sport = pkt->tuple.src_port;
-    ports->dport = pkt->tuple.dst_port;
-  }
+  pkt->flags |= ZDTUN_PKT_CSUM_PARTIAL;
+  pkt->csum_start = pkt->ip_hdr_len;
 
-  pkt->l7_len = pkt_len - iphdr_len - pkt->l4_hdr_len;
-  pkt->l7 = &pkt_buf[iphdr_len + pkt->l4_hdr_len];
-  return 0;
+  if(ipproto == IPPROTO_TCP)
+    pkt->csum_offset = offsetof(struct tcphdr, th_sum);
+  else if(ipproto == IPPROTO_UDP)
+    pkt->csum_offset = offsetof(struct udphdr, uh_sum);
+  else
+    pkt->csum_offset = offsetof(struct icmphdr, checksum);
 }
 
 /* ******************************************************* */
 
-void zdtun_set_mtu(zdtun_t *tun, int mtu) {
-  tun->mtu = min(mtu, REPLY_BUF_SIZE);
+static void client_send_failed(zdtun_t *tun, zdtun_conn_t *conn, int rv) {
+  debug("send_client failed [%d]", rv);
+  instr_drop(tun, ZDTUN_DROP_SEND_CLIENT);
+
+  if(conn->tuple.ipproto == IPPROTO_TCP)
+      // important: set this to prevent close_conn to call send_to_client again in a loop
+      conn->tcp.fin_ack_sent = 1;
+
+  zdtun_conn_close(tun, conn, CONN_STATUS_CLIENT_ERROR);
 }
 
 /* ******************************************************* */
 
-int zdtun_parse_ip(const char *ip_str, zdtun_ip_t *parsed) {
-  int rv = -1;
+// Removes the packets of conn from the batch. The owned buffers are still owned
+// by zdtun, as the packets were not passed to send_client_batch again.
+static void batch_drop_conn(zdtun_t *tun, zdtun_conn_t *conn) {
+  int num_kept = 0;
 
-  if(strchr(ip_str, '.')) {
-    if(inet_pton(AF_INET, ip_str, &parsed->ip4) > 0)
-      rv = 4;
-  } else{
-    if(inet_pton(AF_INET6, ip_str, &parsed->ip6) > 0)
-      rv = 6;
-  }
+  tun->batch.buf_used = 0;
 
-  return rv;
-}
+  for(int i = 0; i < tun->batch.num_pkts; i++) {
+    zdtun_pkt_t *pkt = &tun->batch.pkts[i];
 
-/* ******************************************************* */
+    if(tun->batch.conns[i] == conn) {
+      instr_drop(tun, ZDTUN_DROP_SEND_CLIENT);
 
-int zdtun_cmp_ip(int ipver, zdtun_ip_t *ip_a, zdtun_ip_t *ip_b) {
-  if(ipver == 4)
-    return(memcmp(&ip_a->ip4, &ip_b->ip4, 4));
-  else
-    return(memcmp(&ip_a->ip6, &ip_b->ip6, 16));
+      if(pkt->flags & ZDTUN_PKT_OWNED)
+        tun->callbacks.release_buf(tun, pkt->buf);
+      continue;
+    }
+
+    // the data of the kept packets is not moved
+    if(!(pkt->flags & ZDTUN_PKT_OWNED))
+      tun->batch.buf_used = (pkt->buf + pkt->len) - tun->batch.buf;
+
+    if(i != num_kept) {
+      tun->batch.pkts[num_kept] = *pkt;
+      tun->batch.conns[num_kept] = tun->batch.conns[i];
+    }
+    num_kept++;
+  }
+
+  tun->batch.num_pkts = num_kept;
 }
 
 /* ******************************************************* */
 
-static void fill_conn_sockaddr(zdtun_t *tun, zdtun_conn_t *conn,
-        struct sockaddr_in6 *addr6, socklen_t *addrlen) {
-  uint8_t ipver = sock_ipver(tun, conn);
-  const proxy_t *proxy;
+void zdtun_flush(zdtun_t *tun) {
+  int num_pkts = tun->batch.num_pkts;
+  int num_sent;
 
-  if(conn->proxy_mode == PROXY_DNAT)
-    proxy = conn->dnat;
-  else if(conn->proxy_mode == PROXY_SOCKS5)
-    proxy = &tun->socks5;
-  else
-    proxy = NULL;
+  if(num_pkts == 0)
+    return;
 
-  if(ipver == 4) {
-    // struct sockaddr_in is smaller than struct sockaddr_in6
-    struct sockaddr_in *addr4 = (struct sockaddr_in*)addr6;
+  num_sent = tun->callbacks.send_client_batch(tun, tun->batch.pkts,
+    (const zdtun_conn_t**) tun->batch.conns, num_pkts);
 
-    addr4->sin_family = AF_INET;
-    addr4->sin_addr.s_addr = proxy ? proxy->ip.ip4 : conn->tuple.dst_ip.ip4;
-    addr4->sin_port = proxy ? proxy->port : conn->tuple.dst_port;
-    *addrlen = sizeof(struct sockaddr_in);
-  } else {
-    addr6->sin6_family = AF_INET6;
-    addr6->sin6_addr = proxy ? proxy->ip.ip6 : conn->tuple.dst_ip.ip6;
-    addr6->sin6_port = proxy ? proxy->port : conn->tuple.dst_port;
-    *addrlen = sizeof(struct sockaddr_in6);
-  }
-}
+  if(num_sent < 0)
+    num_sent = 0;
+  else if(num_sent > num_pkts)
+    num_sent = num_pkts;
 
-/* ******************************************************* */
+  for(int i = 0; i < num_sent; i++) {
+    instr_pkt(tun, &tun->batch.pkts[i], 0);
 
-static int enqueue_tcp_data(zdtun_t *tun, zdtun_conn_t *conn, const char *buf, int bufsize, uint8_t flags) {
-  tcp_data_t *item;
+    account_pkt(tun, &tun->batch.pkts[i], 0 /* from zdtun */, tun->batch.conns[i]);
+  }
 
-  item = calloc(1, sizeof(tcp_data_t) + bufsize);
-  if(!item) {
-    error("calloc(tcp_data_t) failed");
-    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
-    return -1;
+  if(num_sent == num_pkts) {
+    tun->batch.num_pkts = 0;
+    tun->batch.buf_used = 0;
+    return;
   }
 
-  item->flags = flags;
-  item->len = bufsize;
-  memcpy(item->data, buf, bufsize);
+  // Only the packet at num_sent failed, e.g. on a full TUN device queue, and
+  // its owned buffer now belongs to the callback. The next packets were not
+  // tried: keep them for the next flush, except the ones of its connection,
+  // which is closed.
+  zdtun_conn_t *failed = tun->batch.conns[num_sent];
+  int num_kept = num_pkts - num_sent - 1;
 
-  // append
-  if(conn->tcp.tx_queue) {
-    tcp_data_t *cur = conn->tcp.tx_queue;
-    while(cur->next)
-      cur = cur->next;
-    cur->next = item;
-  } else
-    conn->tcp.tx_queue = item;
+  memmove(&tun->batch.pkts[0], &tun->batch.pkts[num_sent + 1], num_kept * sizeof(zdtun_pkt_t));
+  memmove(&tun->batch.conns[0], &tun->batch.conns[num_sent + 1], num_kept * sizeof(zdtun_conn_t*));
+  tun->batch.num_pkts = num_kept;
+  batch_drop_conn(tun, failed);
 
-  conn->tcp.tx_queue_size += bufsize;
+  // closing the connection may enqueue new packets
+  client_send_failed(tun, failed, -1);
+}
 
-  // will be handled in handle_queued_tcp_data
-  // increment of client_seq and sending of ACK is also deferred
-  FD_SET(conn->sock, &tun->write_fds);
+/* ******************************************************* */
 
-  return 0;
+// the unused bytes must be 0, as the tuple is hashed as a whole
+static inline zdtun_ip_t ip4_to_zdtun_ip(uint32_t addr) {
+  zdtun_ip_t ip;
+
+  memset(&ip, 0, sizeof(ip));
+  ip.ip4 = addr;
+  return ip;
 }
 
 /* ******************************************************* */
 
-// returns 0 on success
-// returns <0 on error
-// no_ack: can be used to avoid sending the ACK to the client and keep
-// its sequence number unchanged. This is needed to implement out of band
-// data.
-static int handle_tcp_fwd(zdtun_t *tun, const zdtun_pkt_t *pkt,
-          zdtun_conn_t *conn) {
-  struct tcphdr *data = pkt->tcp;
-  int family = (sock_ipver(tun, conn) == 4) ? PF_INET : PF_INET6;
-  int val;
+// Fills the metadata of a packet built by zdtun (see zdtun_make_iphdr) for
+// conn. This avoids parsing the packet again with zdtun_parse_pkt.
+static void fill_reply_pkt(zdtun_t *tun, zdtun_conn_t *conn, zdtun_pkt_t *pkt, char *pkt_buf, int size) {
+  uint8_t ipver = sock_ipver(tun, conn);
+  int iphdr_len = (ipver == 4) ? IPV4_HEADER_LEN : IPV6_HEADER_LEN;
 
-  if(data->th_flags & TH_URG) {
-    error("URG data not supported");
-    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
-    return -1;
+  // not always the conn protocol, see send_host_unreachable
+  uint8_t ipproto = (ipver == 4) ? ((struct iphdr*)pkt_buf)->protocol :
+    ((struct ipv6_hdr*)pkt_buf)->nexthdr;
+
+  if(ipproto == IPPROTO_ICMPV6)
+    ipproto = IPPROTO_ICMP;
+
+  if(ipver == 4) {
+    pkt->tuple.src_ip = ip4_to_zdtun_ip(conn->tuple.dst_ip.ip4);
+    pkt->tuple.dst_ip = ip4_to_zdtun_ip(conn->tuple.src_ip.ip4);
+  } else {
+    pkt->tuple.src_ip = conn->tuple.dst_ip;
+    pkt->tuple.dst_ip = conn->tuple.src_ip;
   }
 
-  if(conn->status == CONN_STATUS_CONNECTING) {
-    debug("ignore TCP packet, we are connecting");
-    return 0;
-  } else if(conn->status == CONN_STATUS_NEW) {
-    debug("Allocating new TCP socket for port %d", ntohs(conn->tuple.dst_port));
-    socket_t tcp_sock = open_socket(tun, family, SOCK_STREAM, IPPROTO_TCP);
+  pkt->tuple.ipver = ipver;
+  pkt->tuple.ipproto = ipproto;
+  pkt->flags = 0;
+  pkt->len = size;
+  pkt->ip_hdr_len = iphdr_len;
+  pkt->csum_start = 0;
+  pkt->csum_offset = 0;
+  pkt->gso_size = 0;
+  pkt->buf = pkt_buf;
+  pkt->l3 = pkt_buf;
+  pkt->l4 = &pkt_buf[iphdr_len];
 
-    if(tcp_sock == INVALID_SOCKET) {
-      error("Cannot create TCP socket[%d]", socket_errno);
-      conn->status = CONN_STATUS_SOCKET_ERROR;
-      return -1;
-    }
+  if(ipproto == IPPROTO_TCP) {
+    pkt->l4_hdr_len = pkt->tcp->th_off * 4;
+    pkt->tuple.src_port = conn->tuple.dst_port;
+    pkt->tuple.dst_port = conn->tuple.src_port;
+  } else if(ipproto == IPPROTO_UDP) {
+    pkt->l4_hdr_len = UDP_HEADER_LEN;
+    pkt->tuple.src_port = conn->tuple.dst_port;
+    pkt->tuple.dst_port = conn->tuple.src_port;
+  } else {
+    // same convention of zdtun_parse_pkt
+    pkt->l4_hdr_len = sizeof(struct icmphdr);
 
-    conn->sock = tcp_sock;
+    if((pkt->icmp->type == ICMP_ECHO) || (pkt->icmp->type == ICMPv6_ECHO)) {
+      pkt->tuple.echo_id = pkt->icmp->un.echo.id;
+      pkt->tuple.dst_port = 0;
+    } else {
+      pkt->tuple.echo_id = 0;
+      pkt->tuple.dst_port = pkt->icmp->un.echo.id;
+    }
+  }
 
-    // Disable Nagle algorithm. We will manually buffer data with MSG_MORE
-    // when needed.
-    val = 1;
-    if(setsockopt(tcp_sock, SOL_TCP, TCP_NODELAY, &val, sizeof(val)) < 0)
-      error("setsockopt TCP_NODELAY failed");
+  pkt->l7_len = size - iphdr_len - pkt->l4_hdr_len;
+  pkt->l7 = &pkt_buf[iphdr_len + pkt->l4_hdr_len];
+}
 
-    // Setup for the connection
-    struct sockaddr_in6 servaddr = {0};
-    socklen_t addrlen;
-    fill_conn_sockaddr(tun, conn, &servaddr, &addrlen);
+/* ******************************************************* */
 
-#ifdef WIN32
-    unsigned nonblocking = 1;
-    ioctlsocket(tcp_sock, FIONBIO, &nonblocking);
-#else
-    int flags = fcntl(tcp_sock, F_GETFL);
+// Copies the packet into the batch, to be sent with zdtun_flush. An owned
+// packet (see alloc_buf) is referenced instead.
+static int batch_pkt(zdtun_t *tun, zdtun_conn_t *conn, char *pkt_buf, int size,
+        uint16_t gso_size, uint8_t owned) {
+  // a failed flush keeps the untried packets, but always removes one
+  while((tun->batch.num_pkts > 0) && ((tun->batch.num_pkts == MAX_BATCH_PKTS) ||
+      (!owned && ((tun->batch.buf_used + size) > BATCH_BUF_SIZE))))
+    zdtun_flush(tun);
+
+  char *buf = pkt_buf;
+  zdtun_pkt_t *pkt = &tun->batch.pkts[tun->batch.num_pkts];
+
+  if(!owned) {
+    buf = tun->batch.buf + tun->batch.buf_used;
+    memcpy(buf, pkt_buf, size);
+    tun->batch.buf_used += size;
+  }
 
-    if(fcntl(tcp_sock, F_SETFL, flags | O_NONBLOCK) == -1)
-      error("Cannot set socket non blocking: %d", errno);
-#endif
+  fill_reply_pkt(tun, conn, pkt, buf, size);
+  set_pkt_csum_info(tun, pkt, gso_size);
 
-    uint8_t in_progress = 0;
+  if(owned)
+    pkt->flags |= ZDTUN_PKT_OWNED;
 
-    // Account the SYN
-    if(tun->callbacks.account_packet)
-      tun->callbacks.account_packet(tun, pkt, 1 /* to zdtun */, conn);
+  tun->batch.conns[tun->batch.num_pkts++] = conn;
 
-    // TCP options
-    uint8_t optslen = data->th_off * 4 - TCP_HEADER_LEN;
-    uint8_t *opts = (uint8_t*)data + TCP_HEADER_LEN;
-    uint16_t mss = default_mss(tun, conn);
-    uint8_t scale = 0;
+  return 0;
+}
 
-    while(optslen > 1) {
-      uint8_t kind = *opts++;
-      uint8_t len;
+/* ******************************************************* */
 
-      if(kind == 1) { // NOP
-        optslen--;
-        continue;
-      }
+// Sends a packet built in pkt_buf. gso_size is non-zero for TCP GSO super segments.
+// When owned is set, pkt_buf comes from alloc_buf and its ownership is passed to the client callback.
+static int send_pkt_to_client(zdtun_t *tun, zdtun_conn_t *conn, char *pkt_buf, int size,
+        uint16_t gso_size, uint8_t owned) {
+  if(tun->callbacks.send_client_batch)
+    return batch_pkt(tun, conn, pkt_buf, size, gso_size, owned);
 
-      len = *opts++;
+  fill_reply_pkt(tun, conn, &tun->last_pkt, pkt_buf, size);
+  set_pkt_csum_info(tun, &tun->last_pkt, gso_size);
 
-      if((kind == 0) || (len < 2) || (optslen < len))
-        break;
+  if(owned)
+    tun->last_pkt.flags |= ZDTUN_PKT_OWNED;
 
-      if((kind == 2) && (len == 4)) // MSS
-        mss = ntohs(*(uint16_t*)opts);
+  int rv = tun->callbacks.send_client(tun, &tun->last_pkt, conn);
 
-      if((kind == 3) && (len == 3)) // Window Scale
-        scale = *opts;
+  if(rv == 0) {
+    instr_pkt(tun, &tun->last_pkt, 0);
 
-      opts += (len - 2);
-      optslen -= len;
-    }
+    account_pkt(tun, &tun->last_pkt, 0 /* from zdtun */, conn);
+  } else
+    client_send_failed(tun, conn, rv);
 
-    debug("MSS: %d, scale: %d\n", mss, scale);
+  return(rv);
+}
 
-    conn->tcp.window_size = ntohs(data->th_win) << scale;
-    conn->tcp.window_scale = scale;
-    conn->tcp.mss = mss;
+/* ******************************************************* */
 
-    // connect with the server
-    if(connect(tcp_sock, (struct sockaddr *) &servaddr, addrlen) == SOCKET_ERROR) {
-      if(socket_errno == socket_in_progress) {
-        debug("Connection in progress");
-        in_progress = 1;
-      } else {
-        close_with_socket_error(tun, conn, "TCP connect");
-        return 0;
-      }
-    }
+static inline int send_to_client(zdtun_t *tun, zdtun_conn_t *conn, int l3_len) {
+  return send_pkt_to_client(tun, conn, tun->reply_buf, l3_len + zdtun_iphdr_len(tun, conn), 0, 0);
+}
 
-    conn->tcp.client_seq = ntohl(data->th_seq) + 1;
-    conn->tcp.zdtun_seq = 0x77EB77EB;
+/* ******************************************************* */
 
-    if(!in_progress)
-      return tcp_socket_syn(tun, conn);
+// Fetches the size and the occupancy of the socket TX buffer. The free space
+// is just an approximation which helps tuning the TCP receiver window
+// seen by the client, thus possibly throttling the upload before
+// reaching the bottleneck and subsequent retransmissions.
+//
+// http://lkml.iu.edu/hypermail/linux/kernel/0502.2/1087.html
+// https://gitlab.torproject.org/tpo/core/tor/-/issues/12890
+static void refresh_sndbuf(zdtun_conn_t *conn) {
+#ifdef WIN32
+  // the ideal send backlog is the amount of data to keep queued in the
+  // socket, there is no way to get the queued bytes
+  ULONG isb = 0;
+  DWORD bytes = 0;
+
+#ifdef SIO_IDEAL_SEND_BACKLOG_QUERY
+  if(WSAIoctl(conn->sock, SIO_IDEAL_SEND_BACKLOG_QUERY, NULL, 0,
+      &isb, sizeof(isb), &bytes, NULL, NULL) != 0)
+    isb = 0;
+#endif
 
-    conn->status = CONN_STATUS_CONNECTING;
-    FD_SET(tcp_sock, &tun->write_fds);
-    return 0;
-  }
+  conn->tcp.sndbuf = isb ? isb : DEFAULT_TCP_WINDOW;
+  conn->tcp.sndbuf_used = 0;
+#else
+  int bufsize = 0;
+  int queued = 0;
+  socklen_t len = sizeof(bufsize);
 
-  // Here a connection is already active
-  if(tun->callbacks.account_packet)
-     tun->callbacks.account_packet(tun, pkt, 1 /* to zdtun */, conn);
+  getsockopt(conn->sock, SOL_SOCKET, SO_SNDBUF, &bufsize, &len);
+  ioctl(conn->sock, SIOCOUTQ, &queued);
 
-  uint32_t seq = ntohl(data->th_seq);
-  uint8_t is_keep_alive = ((data->th_flags & TH_ACK) &&
-    ((seq + 1) == conn->tcp.client_seq));
+  conn->tcp.sndbuf = (bufsize > 0) ? bufsize : DEFAULT_TCP_WINDOW;
+  conn->tcp.sndbuf_used = max(queued, 0);
+#endif
+}
 
-  if(!is_keep_alive && (seq != (conn->tcp.client_seq + conn->tcp.tx_queue_size))) {
-    debug("ignoring out of sequence data: expected %d, got %d", conn->tcp.client_seq, seq);
-    return 0;
-  }
+/* ******************************************************* */
 
-  if(socks5_in_progress(conn)) {
-    error("Got data while SOCKS5 in progress (status: %d, %d bytes, TCP flags: %d)",
-        conn->socks5_status, pkt->l7_len, data->th_flags);
+// Gets the free space in the socket TX buffer, minus the data still queued
+// in zdtun. The bytes sent to the socket are added to sndbuf_used, which can
+// only overestimate the occupancy as the kernel drains the buffer. The real
+// state is only fetched when the estimate may be throttling the client.
+static uint32_t get_available_sndbuf(zdtun_conn_t *conn) {
+  uint32_t used = conn->tcp.sndbuf_used + conn->tcp.tx_queue_size;
 
-    zdtun_conn_close(tun, conn, CONN_STATUS_SOCKS5_ERROR);
-    return -1;
+  if(used >= (conn->tcp.sndbuf - conn->tcp.sndbuf / 4)) {
+    refresh_sndbuf(conn);
+    used = conn->tcp.sndbuf_used + conn->tcp.tx_queue_size;
   }
 
-  if(data->th_flags & TH_RST) {
-    debug("Got TCP reset from client");
-    zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+  return (used < conn->tcp.sndbuf) ? (conn->tcp.sndbuf - used) : 0;
+}
 
-    return 0;
-  } else if((data->th_flags & (TH_FIN | TH_ACK)) == (TH_FIN | TH_ACK)) {
-    int rv;
+/* ******************************************************* */
 
-    debug("Got TCP FIN+ACK from client");
+int zdtun_iphdr_len(zdtun_t *tun, zdtun_conn_t *conn) {
+  return (sock_ipver(tun, conn) == 4) ? IPV4_HEADER_LEN : IPV6_HEADER_LEN;
+}
 
-    if(conn->sock != INVALID_SOCKET) {
-      // Half close the socket to possibly signal the remote server
-      // (e.g. in after an HTTP request is completed).
+/* ******************************************************* */
 
-      if(shutdown(conn->sock, SHUT_WR) != 0)
-        debug("shutdown failed[%d] %s", errno, strerror(errno));
-    }
+static inline void make_ip4hdr(zdtun_conn_t *conn, char *pkt_buf, u_int16_t l3_len) {
+  struct iphdr *ip = (struct iphdr*)pkt_buf;
+  uint16_t tot_len = l3_len + IPV4_HEADER_LEN;
+
+  memset(ip, 0, IPV4_HEADER_LEN);
+  ip->ihl = 5; // 5 * 4 = 20 = IPV4_HEADER_LEN
+  ip->version = 4;
+  ip->frag_off = htons(0x4000); // don't fragment
+  ip->tot_len = htons(tot_len);
+  ip->ttl = 64; // hops
+  ip->protocol = conn->tuple.ipproto;
+  ip->saddr = conn->tuple.dst_ip.ip4;
+  ip->daddr = conn->tuple.src_ip.ip4;
+
+  ip->check = ~calc_checksum(0, (u_int8_t*)ip, IPV4_HEADER_LEN);
+}
 
-    conn->tcp.client_seq += ((uint32_t)pkt->l7_len) + 1;
-    conn->tcp.client_closed = 1;
+/* ******************************************************* */
 
-    // send the ACK
-    build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
-    rv = send_to_client(tun, conn, TCP_HEADER_LEN);
+static inline void make_ip6hdr(zdtun_conn_t *conn, char *pkt_buf, u_int16_t l3_len) {
+  struct ipv6_hdr *ip = (struct ipv6_hdr*)pkt_buf;
 
-    if(conn->sock == INVALID_SOCKET)
-      // Both the client and the server have closed, terminate the connection
-      zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+  memset(ip, 0, IPV6_HEADER_LEN);
+  ip->version = 6;
+  ip->payload_len = htons(l3_len);
+  ip->nexthdr = (conn->tuple.ipproto != IPPROTO_ICMP) ? conn->tuple.ipproto : IPPROTO_ICMPV6;
+  ip->hop_limit = 64;
+  ip->saddr = conn->tuple.dst_ip.ip6;
+  ip->daddr = conn->tuple.src_ip.ip6;
+}
 
-    return rv;
-  }
+/* ******************************************************* */
 
-  if((data->th_flags & TH_ACK) && (conn->sock != INVALID_SOCKET)) {
-    if(is_keep_alive) {
-      debug("TCP KEEPALIVE");
+void zdtun_make_iphdr(zdtun_t *tun, zdtun_conn_t *conn, char *pkt_buf, u_int16_t l3_len) {
+  if(sock_ipver(tun, conn) == 4)
+    make_ip4hdr(conn, pkt_buf, l3_len);
+  else
+    make_ip6hdr(conn, pkt_buf, l3_len);
+}
 
-      int val = 1;
-      if(setsockopt(conn->sock, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) != 0)
-        error("setsockopt SO_KEEPALIVE failed[%d]: %s", errno, strerror(errno));
+/* ******************************************************* */
 
-      // Assume that the server is alive until its socket is closed.
-      build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
+static inline uint64_t pseudo_header_sum4(zdtun_conn_t *conn, char *ipbuf, uint16_t l3_len) {
+  struct iphdr *ip_header = (struct iphdr*)ipbuf;
+  struct ippseudo pseudo = {0};
 
-      if(send_to_client(tun, conn, TCP_HEADER_LEN) != 0)
-        return -1;
-    } else {
-      // Received ACK from the client, update the window. Take into account
-      // the in flight bytes which the client has not ACK-ed yet.
-      uint32_t ack_num = ntohl(data->th_ack);
-      uint32_t in_flight;
+  pseudo.ippseudo_src = ip_header->saddr;
+  pseudo.ippseudo_dst = ip_header->daddr;
+  pseudo.ippseudo_p = conn->tuple.ipproto;
+  pseudo.ippseudo_len = htons(l3_len);
 
-      if(conn->tcp.zdtun_seq >= ack_num)
-        in_flight = conn->tcp.zdtun_seq - ack_num;
-      else
-        // TCP seq wrapped
-        in_flight = 0xFFFFFFFF - ack_num + conn->tcp.zdtun_seq + 1;
+  return csum_partial(&pseudo, sizeof(pseudo), 0);
+}
 
-      uint32_t window = ntohs(data->th_win) << conn->tcp.window_scale;
-      conn->tcp.window_size = window - in_flight;
+/* ******************************************************* */
 
-      if(!FD_ISSET(conn->sock, &tun->all_fds) && (conn->tcp.window_size > 0)) {
-        log_tcp_window("[%d][Window size: %u] enabling socket", conn->tuple.src_port, conn->tcp.window_size);
+static inline uint64_t pseudo_header_sum6(zdtun_conn_t *conn, char *ipbuf) {
+  struct ipv6_hdr *ip_header = (struct ipv6_hdr*)ipbuf;
+  uint8_t ipproto = conn->tuple.ipproto;
+  struct ip6_hdr_pseudo pseudo;
+  memset(&pseudo, 0, sizeof(pseudo));
 
-        // make the socket selectable again
-        FD_SET(conn->sock, &tun->all_fds);
-      }
-    }
-  }
+  pseudo.ip6ph_src = ip_header->saddr;
+  pseudo.ip6ph_dst = ip_header->daddr;
+  pseudo.ip6ph_len = ip_header->payload_len;
+  pseudo.ip6ph_nxt = (ipproto == IPPROTO_ICMP) ? IPPROTO_ICMPV6 : ipproto;
 
-  // check for payload data (avoid sending ACK to an ACK)
-  if(pkt->l7_len > 0) {
-    if(conn->sock == INVALID_SOCKET) {
-      // The server may have closed the connection while the client is still
-      // sending data. We should still ACK this data
-      debug("Write after server socket closed");
+  return csum_partial(&pseudo, sizeof(pseudo), 0);
+}
 
-      // send the ACK
-      conn->tcp.client_seq += pkt->l7_len;
-      build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
-      return send_to_client(tun, conn, TCP_HEADER_LEN);
-    } else
-      // data send is deferred to handle_queued_tcp_data, when socket will be ready for TX
-      return enqueue_tcp_data(tun, conn, pkt->l7, pkt->l7_len, data->th_flags);
-  }
+/* ******************************************************* */
 
-  return 0;
+static uint64_t pseudo_header_sum(zdtun_t *tun, zdtun_conn_t *conn, char *ipbuf, uint16_t l3_len) {
+  if(sock_ipver(tun, conn) == 4)
+    return pseudo_header_sum4(conn, ipbuf, l3_len);
+  else
+    return pseudo_header_sum6(conn, ipbuf);
 }
 
 /* ******************************************************* */
 
-static int fill_ipv6_bind_addr(struct sockaddr_in6 *addr) {
-  struct addrinfo *ainfo = NULL;
-  struct addrinfo hint = {};
+uint16_t zdtun_l3_checksum(zdtun_t *tun, zdtun_conn_t *conn, char *ipbuf, char *l3, uint16_t l3_len) {
+  uint64_t sum = pseudo_header_sum(tun, conn, ipbuf, l3_len);
 
-  hint.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
-  hint.ai_family = AF_INET6;
-  hint.ai_socktype = SOCK_DGRAM;
-  hint.ai_protocol = IPPROTO_UDP;
+  return ~csum_fold(csum_partial(l3, l3_len, sum));
+}
 
-  if(getaddrinfo("::0", NULL, &hint, &ainfo) < 0) {
-    error("getaddrinfo failed");
-    return -1;
-  }
+/* ******************************************************* */
 
-  if(!ainfo || (ainfo->ai_family != AF_INET6)) {
-    error("getaddrinfo invalid family");
-    freeaddrinfo(ainfo);
-    return -1;
-  }
+// Computes the L4 checksum of a reply in reply_buf, unless it's offloaded
+// (see set_pkt_csum_info). With ZDTUN_OFFLOAD_CSUM_PARTIAL only the pseudo
+// header is summed, like the CHECKSUM_PARTIAL packets of the Linux kernel.
+// GSO super segments always use a partial checksum.
+static uint16_t reply_l4_checksum(zdtun_t *tun, zdtun_conn_t *conn, char *ipbuf,
+        char *l3, uint16_t l3_len, uint8_t is_gso) {
+  if((tun->offload & ZDTUN_OFFLOAD_CSUM_NONE) && !is_gso)
+    return 0;
+  else if((tun->offload & ZDTUN_OFFLOAD_CSUM_PARTIAL) || is_gso)
+    return csum_fold(pseudo_header_sum(tun, conn, ipbuf, l3_len));
 
-  *addr = *(struct sockaddr_in6*)ainfo->ai_addr;
-  freeaddrinfo(ainfo);
-  return 0;
+  return zdtun_l3_checksum(tun, conn, ipbuf, l3, l3_len);
 }
 
 /* ******************************************************* */
 
-// UDP socket operations:
-//  - bind: picks up a local port for inbound packets. This is normally done
-//    by sendto, but here we will possibly reuse an existing port from udp_mapping_t
-//    to make STUN to work properly
-//  - connect: ensures that the socket can only send/receive from the specified peer.
-//    Moreover, it speeds up send/sendto, removing route lookup on each packet
-static int bind_and_connect_udp(zdtun_t *tun, zdtun_conn_t *conn) {
-  uint8_t ipver = sock_ipver(tun, conn);
-  struct sockaddr_in6 bind_addr = {0};
-  socklen_t addrlen = (ipver == 4) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+void zdtun_set_offload(zdtun_t *tun, uint8_t flags) {
+  tun->offload = flags;
+}
 
-  if(ipver == 6) {
-    if(fill_ipv6_bind_addr(&bind_addr) < 0) {
-      zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
-      return -1;
-    }
-  }
+/* ******************************************************* */
 
-  uint32_t key = udp_mapping_key(&conn->tuple);
-  udp_mapping_t *mapping;
+// Builds the IP and TCP headers of a segment in pkt_buf
+static void build_tcp_segment(zdtun_t *tun, zdtun_conn_t *conn, char *pkt_buf, u_int8_t flags,
+        u_int16_t l4_len, u_int16_t optsoff, uint8_t is_gso) {
+  uint8_t ipver = sock_ipver(tun, conn);
+  int iphdr_len = zdtun_iphdr_len(tun, conn);
+  const u_int16_t l3_len = l4_len + TCP_HEADER_LEN + (optsoff * 4);
+  struct tcphdr *tcp = (struct tcphdr *)&pkt_buf[iphdr_len];
+  uint32_t max_win = ((uint32_t)0xFFFF) << conn->tcp.zdtun_window_scale;
+  uint32_t tcpwin;
 
-  HASH_FIND(hh, tun->udp_mappings, &key, sizeof(key), mapping);
-  if(mapping != NULL) {
-    // If the client opens a UDP connection with the same source port of an
-    // existing (not purged) connection, then reuse the existing local port.
-    // This makes NAT traversal protocols like STUN work.
-    if(ipver == 4)
-      ((struct sockaddr_in*)&bind_addr)->sin_port = mapping->port;
-    else
-      bind_addr.sin6_port = mapping->port;
-  } // else pick a random local port (see below getsockname)
+  memset(tcp, 0, TCP_HEADER_LEN);
+  tcp->th_sport = conn->tuple.dst_port;
+  tcp->th_dport = conn->tuple.src_port;
+  tcp->th_seq = htonl(conn->tcp.zdtun_seq);
+  tcp->th_ack = (flags & TH_ACK) ? htonl(conn->tcp.client_seq) : 0;
+  tcp->th_off = 5 + optsoff;
+  tcp->th_flags = flags;
+
+  // To avoid slowdowns, it's better to check the free space in the send
+  // buffer and reduce the TCP window accordingly. If a 0 window is sent,
+  // the client will periodically send TCP_KEEPALIVE to wake the connection.
+  // This prevents connection stall.
+  tcpwin = (conn->sock != INVALID_SOCKET) ? get_available_sndbuf(conn) : DEFAULT_TCP_WINDOW;
+  tcpwin = min(tcpwin, max_win);
+
+  tcp->th_win = htons(tcpwin >> conn->tcp.zdtun_window_scale);
+
+  zdtun_make_iphdr(tun, conn, pkt_buf, l3_len);
+  tcp->th_sum = reply_l4_checksum(tun, conn, pkt_buf, (char*)tcp, l3_len, is_gso);
+}
+
+/* ******************************************************* */
+
+static inline void build_reply_tcpip(zdtun_t *tun, zdtun_conn_t *conn, u_int8_t flags,
+        u_int16_t l4_len, u_int16_t optsoff) {
+  build_tcp_segment(tun, conn, tun->reply_buf, flags, l4_len, optsoff, 0);
+}
+
+/* ******************************************************* */
+
+static void free_tcp_data(zdtun_t *tun, tcp_data_t *item) {
+  if(item->owned)
+    tun->callbacks.release_buf(tun, item->owned);
+
+  bufpool_free(&tun->tx_pool, item, sizeof(tcp_data_t) + item->cap);
+}
+
+/* ******************************************************* */
+
+// Replies to the client SYN with an ICMP host unreachable, which quotes the
+// IP header and the first 8 bytes of the TCP header of the SYN
+static void send_host_unreachable(zdtun_t *tun, zdtun_conn_t *conn) {
+  int iphdr_len = zdtun_iphdr_len(tun, conn);
+  struct icmphdr *icmp = (struct icmphdr*) (tun->reply_buf + iphdr_len);
+  char *quoted = (char*)icmp + sizeof(struct icmphdr);
+  struct tcphdr *syn = (struct tcphdr*) (quoted + iphdr_len);
+  int icmp_len = sizeof(struct icmphdr) + iphdr_len + 8;
+
+  // the SYN, rebuilt from the connection tuple
+  if(sock_ipver(tun, conn) == 4) {
+    struct iphdr *ip = (struct iphdr*) quoted;
+
+    memset(ip, 0, IPV4_HEADER_LEN);
+    ip->ihl = 5;
+    ip->version = 4;
+    ip->tot_len = htons(IPV4_HEADER_LEN + TCP_HEADER_LEN);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_TCP;
+    ip->saddr = conn->tuple.src_ip.ip4;
+    ip->daddr = conn->tuple.dst_ip.ip4;
+    ip->check = ~calc_checksum(0, (u_int8_t*)ip, IPV4_HEADER_LEN);
+  } else {
+    struct ipv6_hdr *ip = (struct ipv6_hdr*) quoted;
+
+    memset(ip, 0, IPV6_HEADER_LEN);
+    ip->version = 6;
+    ip->payload_len = htons(TCP_HEADER_LEN);
+    ip->nexthdr = IPPROTO_TCP;
+    ip->hop_limit = 64;
+    ip->saddr = conn->tuple.src_ip.ip6;
+    ip->daddr = conn->tuple.dst_ip.ip6;
+  }
+
+  syn->th_sport = conn->tuple.src_port;
+  syn->th_dport = conn->tuple.dst_port;
+  syn->th_seq = htonl(conn->tcp.client_seq - 1);
+
+  zdtun_make_iphdr(tun, conn, tun->reply_buf, icmp_len);
+  memset(icmp, 0, sizeof(struct icmphdr));
+
+  if(sock_ipver(tun, conn) == 4) {
+    struct iphdr *ip = (struct iphdr*) tun->reply_buf;
+
+    ip->protocol = IPPROTO_ICMP;
+    ip->check = 0;
+    ip->check = ~calc_checksum(0, (u_int8_t*)ip, IPV4_HEADER_LEN);
+
+    icmp->type = ICMP_DEST_UNREACH;
+    icmp->code = ICMP_HOST_UNREACH;
+    icmp->checksum = ~calc_checksum(0, (u_int8_t*)icmp, icmp_len);
+  } else {
+    struct ipv6_hdr *ip = (struct ipv6_hdr*) tun->reply_buf;
+    struct ip6_hdr_pseudo pseudo;
+
+    ip->nexthdr = IPPROTO_ICMPV6;
+
+    icmp->type = ICMPv6_DEST_UNREACH;
+    icmp->code = ICMPv6_ADDR_UNREACH;
+
+    memset(&pseudo, 0, sizeof(pseudo));
+    pseudo.ip6ph_src = ip->saddr;
+    pseudo.ip6ph_dst = ip->daddr;
+    pseudo.ip6ph_len = htonl(icmp_len);
+    pseudo.ip6ph_nxt = IPPROTO_ICMPV6;
+
+    // like reply_l4_checksum
+    uint64_t sum = csum_partial(&pseudo, sizeof(pseudo), 0);
+
+    if(tun->offload & ZDTUN_OFFLOAD_CSUM_NONE)
+      icmp->checksum = 0;
+    else if(tun->offload & ZDTUN_OFFLOAD_CSUM_PARTIAL)
+      icmp->checksum = csum_fold(sum);
+    else
+      icmp->checksum = ~csum_fold(csum_partial(icmp, icmp_len, sum));
+  }
+
+  send_to_client(tun, conn, icmp_len);
+}
+
+/* ******************************************************* */
+
+// It is used to defer the destroy_conn function to let the user
+// consume the connection without accessing invalid memory. The connections
+// will be (later) destroyed by zdtun_purge_expired.
+// May be called multiple times.
+void zdtun_conn_close(zdtun_t *tun, zdtun_conn_t *conn, zdtun_conn_status_t status) {
+  uint8_t was_pending = conn->verdict_pending;
+
+  if(conn->status >= CONN_STATUS_CLOSED)
+    return;
+
+  if(was_pending) {
+    conn->verdict_pending = 0;
+    tun->stats.num_pending_verdicts--;
+  }
+
+  if(conn->ext && conn->ext->held_pkt) {
+    free(conn->ext->held_pkt);
+    conn->ext->held_pkt = NULL;
+  }
+
+  if(conn->tuple.ipproto == IPPROTO_UDP) {
+    udp_mapping_t *mapping;
+    udp_mapping_key_t key;
+
+    udp_mapping_key(&conn->tuple, &key);
+    HASH_FIND(hh, tun->udp_mappings, &key, sizeof(key), mapping);
+
+    if(mapping && (--mapping->num_uses == 0)) {
+      if(mapping->shared) {
+        // epoll may still report events for the mapping, free it later
+        close_shared_udp(tun, mapping);
+        tun->num_unused_mappings++;
+      } else {
+        HASH_DELETE(hh, tun->udp_mappings, mapping);
+        free(mapping);
+      }
+    }
+
+    conn->udp.shared = NULL;
+  }
+
+#ifdef HAVE_MSG_ZEROCOPY
+  if((conn->tuple.ipproto == IPPROTO_TCP) && conn->tcp.zc_used && conn->ext &&
+      (conn->sock != INVALID_SOCKET))
+    linger_zerocopy(tun, conn);
+#endif
+
+  close_socket(tun, conn);
+
+  // nothing was sent to the client of a pending connection
+  if((conn->tuple.ipproto == IPPROTO_TCP)
+      && !conn->tcp.fin_ack_sent && !was_pending) {
+    if(tun->cfg.tcp_unreachable_icmp && (conn->list_id == CONN_LIST_TCP_CONNECTING) &&
+        ((status == CONN_STATUS_CONNECT_TIMEOUT) || (status == CONN_STATUS_UNREACHABLE)))
+      send_host_unreachable(tun, conn);
+    else {
+      // Send TCP RST
+      build_reply_tcpip(tun, conn, TH_RST | TH_ACK, 0, 0);
+      send_to_client(tun, conn, TCP_HEADER_LEN);
+    }
+  }
+
+  if(conn->tuple.ipproto == IPPROTO_TCP) {
+    tcp_data_t *cur = conn->tcp.tx_queue;
+
+    // free tx_queue
+    while(cur) {
+      tcp_data_t *next = cur->next;
+      free_tcp_data(tun, cur);
+      cur = next;
+    }
+
+    conn->tcp.tx_queue = NULL;
+    conn->tcp.tx_queue_tail = NULL;
+
+    if(conn->ext) {
+      // not lingering, the socket is closed and no more completions will be received
+      cur = conn->ext->zc_pending;
+
+      while(cur) {
+        tcp_data_t *next = cur->next;
+        free_tcp_data(tun, cur);
+        cur = next;
+      }
+
+      conn->ext->zc_pending = NULL;
+    }
+  }
+
+  conn->status = (status >= CONN_STATUS_CLOSED) ? status : CONN_STATUS_CLOSED;
+
+  // will be destroyed by zdtun_purge_expired
+  list_unlink(tun, conn);
+  list_append(tun, conn, CONN_LIST_CLOSED);
+
+  if(tun->callbacks.on_connection_close)
+    tun->callbacks.on_connection_close(tun, conn);
+}
+
+/* ******************************************************* */
+
+// A cheap hash, the flow_cache entries are verified with the full tuple
+static inline uint32_t flow_cache_idx(const zdtun_5tuple_t *tuple) {
+  uint32_t h = tuple->src_ip.ip4 ^ tuple->dst_ip.ip4 ^
+    tuple->src_port ^ ((uint32_t)tuple->dst_port << 16);
+
+  h ^= h >> 16;
+  h ^= h >> 8;
+
+  return(h & (FLOW_CACHE_SIZE - 1));
+}
+
+/* ******************************************************* */
+
+// Avoid calling destroy_conn inside zdtun_forward_full as it may
+// generate dangling pointers. Use close_conn instead.
+static void destroy_conn(zdtun_t *tun, zdtun_conn_t *conn) {
+  debug("PURGE SOCKET (type=%d)", conn->tuple.ipproto);
+
+  zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+
+  // the batch may still reference this connection
+  zdtun_flush(tun);
+
+  if(tun->batch.num_pkts > 0)
+    batch_drop_conn(tun, conn);
+
+  // the zdtun_handle_fd pass must skip it
+  for(uint32_t i = 0; i < tun->ready.num; i++) {
+    if(tun->ready.conns[i] == conn)
+      tun->ready.conns[i] = NULL;
+  }
+
+#ifdef HAVE_EPOLL
+  // as well as the epoll pass (e.g. evicted by a reentrant zdtun_forward)
+  for(int i = 0; i < tun->num_pass_events; i++) {
+    if(tun->pass_events[i].data.ptr == conn)
+      tun->pass_events[i].data.ptr = NULL;
+  }
+#endif
+
+  conn_ext_free(tun, conn);
+
+  switch(conn->tuple.ipproto) {
+    case IPPROTO_TCP:
+      tun->stats.num_tcp_conn--;
+      break;
+    case IPPROTO_UDP:
+      tun->stats.num_udp_conn--;
+      break;
+    case IPPROTO_ICMP:
+      tun->stats.num_icmp_conn--;
+      break;
+  }
+
+  list_unlink(tun, conn);
+  flowtable_remove(&tun->conn_table, &conn->tuple);
+
+  uint32_t cache_idx = flow_cache_idx(&conn->tuple);
+
+  if(tun->flow_cache[cache_idx] == conn)
+    tun->flow_cache[cache_idx] = NULL;
+
+  mempool_free(&tun->conn_pool, conn);
+}
+
+/* ******************************************************* */
+
+static int send_syn_ack(zdtun_t *tun, zdtun_conn_t *conn) {
+  int rv;
+  int iphdr_len = zdtun_iphdr_len(tun, conn);
+  uint8_t *opts = (uint8_t*) &tun->reply_buf[iphdr_len + TCP_HEADER_LEN];
+
+  // MSS option
+  *(opts++) = 2;
+  *(opts++) = 4;
+  *((uint16_t*)opts) = htons(default_mss(tun, conn));
+  opts += 2;
+
+  // Window Scale
+  *(opts++) = 3;
+  *(opts++) = 3;
+  *(opts++) = conn->tcp.zdtun_window_scale;
+
+  // End, aligned to 32 bits
+  *(opts++) = 0;
+
+  build_reply_tcpip(tun, conn, TH_SYN | TH_ACK, 0, 2 /* n. 32bit words*/);
+
+  if((rv = send_to_client(tun, conn, TCP_HEADER_LEN + 8 /* opts length */)) == 0) {
+    conn->tcp.zdtun_seq += 1;
+
+    // connection established, now subject to the idle timeout
+    if(conn->list_id == CONN_LIST_TCP_CONNECTING) {
+      list_move(tun, conn, CONN_LIST_TCP);
+      conn_touch(tun, conn);
+    }
+  }
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+static int tcp_socket_syn(zdtun_t *tun, zdtun_conn_t *conn) {
+  // disable non-blocking mode from now on
+  set_nonblocking(conn->sock, 0);
+  refresh_sndbuf(conn);
+
+#ifdef HAVE_MSG_ZEROCOPY
+  // only the zdtun_forward_owned buffers can be sent with MSG_ZEROCOPY
+  // the extension holds the completions state
+  if(tun->callbacks.release_buf && (tun->event_fd != INVALID_SOCKET) && conn_ext(tun, conn)) {
+    int val = 1;
+
+    if(setsockopt(conn->sock, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) == 0)
+      conn->tcp.zerocopy = 1;
+  }
+#endif
+
+#ifdef ZDTUN_INSTRUMENTATION
+  uint64_t now_us = instr_now_us();
+
+  if(!conn->ext || !(conn->ext->socks5_flags & SOCKS5_FLAG_POOLED))
+    hist_add(&tun->ext_stats.tcp_connect_time, now_us - conn->instr_start_us);
+
+  conn->instr_start_us = now_us;
+#endif
+
+  conn_set_events(tun, conn, conn->ev_mask & ~ZDTUN_EV_WRITE);
+  conn->status = CONN_STATUS_CONNECTED;
+
+  if(is_socks5(conn)) {
+    // wait before sending the SYN+ACK
+    return socks5_connect(tun, conn);
+  }
+
+  return send_syn_ack(tun, conn);
+}
+
+/* ******************************************************* */
+
+static void tcp_socket_fin_ack(zdtun_t *tun, zdtun_conn_t *conn) {
+  build_reply_tcpip(tun, conn, TH_FIN | TH_ACK, 0, 0);
+
+  if(send_to_client(tun, conn, TCP_HEADER_LEN) == 0)
+    conn->tcp.zdtun_seq += 1;
+}
+
+/* ******************************************************* */
+
+// Destroys the least recently used connections until the number of open
+// sockets drops to max_sockets. Only the evicted connections are visited.
+static void purge_lru(zdtun_t *tun, uint32_t max_sockets) {
+  zdtun_conn_t *conn;
+
+  while((tun->stats.num_open_sockets > max_sockets) && (conn = oldest_conn(tun))) {
+    debug("FORCE PURGE (type=%d)", conn->tuple.ipproto);
+    instr_drop(tun, ZDTUN_DROP_PURGED);
+    destroy_conn(tun, conn);
+  }
+}
+
+/* ******************************************************* */
+
+zdtun_conn_t* zdtun_lookup(zdtun_t *tun, const zdtun_5tuple_t *tuple, uint8_t create) {
+  uint32_t cache_idx = flow_cache_idx(tuple);
+  zdtun_conn_t *conn = tun->flow_cache[cache_idx];
+
+  // packets usually come in bursts of the same connection
+  if(conn && !memcmp(&conn->tuple, tuple, sizeof(*tuple)))
+    tun->stats.flow_cache_hits++;
+  else {
+    tun->stats.flow_cache_misses++;
+
+    if((conn = flowtable_find(&tun->conn_table, tuple)))
+      tun->flow_cache[cache_idx] = conn;
+  }
+
+  if(conn && (conn->status >= CONN_STATUS_CLOSED)) {
+    // avoid returning connections to purge, for which the close_callback was already called and
+    // user data was probably already deallocated.
+    destroy_conn(tun, conn);
+    conn = NULL;
+  }
+
+  if(!conn && create) {
+    if(tun->stats.num_open_sockets >= tun->cfg.max_sockets) {
+      debug("Force purge!");
+      purge_lru(tun, tun->cfg.sockets_after_purge);
+    }
+
+    if(tun->cfg.max_connections &&
+        (zdtun_get_num_connections(tun) >= tun->cfg.max_connections)) {
+      zdtun_conn_t *oldest = oldest_conn(tun);
+
+      if(oldest) {
+        debug("Max connections reached, evicting the oldest one");
+        instr_drop(tun, ZDTUN_DROP_PURGED);
+        destroy_conn(tun, oldest);
+      }
+    }
+
+    /* Add a new connection */
+    if(!(conn = mempool_alloc(&tun->conn_pool))) {
+      error("zdtun_conn_t alloc failed");
+      return NULL;
+    }
+
+    conn->sock = INVALID_SOCKET;
+    conn->tuple = *tuple;
+    conn->tstamp = zdtun_now(tun);
+
+    // the key points to conn->tuple
+    if(flowtable_add(&tun->conn_table, &conn->tuple, conn) != 0) {
+      error("connections table alloc failed");
+      mempool_free(&tun->conn_pool, conn);
+      return NULL;
+    }
+
+    int verdict = ZDTUN_VERDICT_ALLOW;
+
+    if(tun->callbacks.on_connection_open)
+      verdict = tun->callbacks.on_connection_open(tun, conn);
+
+    if((verdict != ZDTUN_VERDICT_ALLOW) && (verdict != ZDTUN_VERDICT_PENDING)) {
+      debug("Dropping connection");
+      flowtable_remove(&tun->conn_table, &conn->tuple);
+      conn_ext_free(tun, conn);
+      mempool_free(&tun->conn_pool, conn);
+      return NULL;
+    }
+
+    if(verdict == ZDTUN_VERDICT_PENDING) {
+      // the first packet is held by forward_pkt
+      conn->verdict_pending = 1;
+      tun->stats.num_pending_verdicts++;
+      list_append(tun, conn, CONN_LIST_PENDING);
+    } else
+      list_append(tun, conn, proto_list_id(conn->tuple.ipproto));
+    tun->flow_cache[cache_idx] = conn;
+
+    switch(conn->tuple.ipproto) {
+      case IPPROTO_TCP:
+        tun->stats.num_tcp_conn++;
+        break;
+      case IPPROTO_UDP:
+        tun->stats.num_udp_conn++;
+        break;
+      case IPPROTO_ICMP:
+        tun->stats.num_icmp_conn++;
+        break;
+    }
+
+    if(conn->verdict_pending && tun->cfg.max_pending_verdicts &&
+        (tun->stats.num_pending_verdicts > tun->cfg.max_pending_verdicts)) {
+      // the callback already got the connection: block it like zdtun_conn_verdict
+      // does, so that on_connection_close is called and zdtun_purge_expired destroys it
+      debug("Too many pending verdicts");
+      zdtun_conn_close(tun, conn, CONN_STATUS_BLOCKED);
+      return NULL;
+    }
+  }
+
+  return conn;
+}
+
+/* ******************************************************* */
+
+static void check_dns_request(zdtun_t *tun, zdtun_conn_t *conn, char *l4_payload, uint16_t l4_len) {
+  struct dns_packet *dns;
+
+  if((l4_len < sizeof(struct dns_packet)) || (conn->tuple.dst_port != ntohs(53)))
+    return;
+
+  dns = (struct dns_packet*)l4_payload;
+
+  // without the extension, the connection is just not purged early
+  if(((dns->flags & DNS_FLAGS_MASK) == DNS_TYPE_REQUEST) && conn_ext(tun, conn))
+    conn->ext->dns.pending_queries++;
+}
+
+/* ******************************************************* */
+
+static int check_dns_purge(zdtun_t *tun, zdtun_conn_t *conn,
+        char *l4_payload, uint16_t l4_len) {
+    struct dns_packet *dns;
+
+    if((l4_len < sizeof(struct dns_packet)) || (conn->tuple.dst_port != ntohs(53)))
+      return(1);
+
+    dns = (struct dns_packet*)l4_payload;
+
+    if(((dns->flags & DNS_FLAGS_MASK) == DNS_TYPE_RESPONSE)
+        && (conn_pending_queries(conn) > 0)) {
+      conn->ext->dns.pending_queries--;
+
+      if((conn->ext->dns.pending_queries == 0) && !conn->ext->dns.cache_waits) {
+        char buf[256];
+
+        /* DNS responses received, can now purge the conn */
+        debug("DNS purge: %s", zdtun_5tuple2str(&conn->tuple, buf, sizeof(buf)));
+        zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+
+        /* purged */
+        return(0);
+      }
+    }
+
+    return(1);
+}
+
+/* ******************************************************* */
+
+/* Sends the answer to a query from a resolved DNS cache entry */
+static int send_dns_cache_answer(zdtun_t *tun, zdtun_conn_t *conn, const dns_cache_entry_t *entry,
+        uint16_t query_id, const uint8_t *qname, time_t now) {
+  int hdrs_len = zdtun_iphdr_len(tun, conn) + sizeof(struct udphdr);
+  int l4_len = dns_cache_answer(entry, query_id, qname, now,
+    tun->reply_buf + hdrs_len, REPLY_BUF_SIZE - hdrs_len);
+
+  if(l4_len < 0)
+    return -1;
+
+  return send_udp_reply(tun, conn, tun->reply_buf, l4_len, 0 /* from the cache */);
+}
+
+/* ******************************************************* */
+
+/* Answers a DNS query from the cache, or makes it wait for an identical
+ * in-flight query. Returns 1 if the query must not be sent upstream. */
+static int check_dns_cache_query(zdtun_t *tun, zdtun_conn_t *conn, const zdtun_pkt_t *pkt) {
+  dns_cache_entry_t *entry;
+  dns_query_t query;
+  time_t now;
+
+  if(conn->tuple.dst_port != ntohs(53))
+    return 0;
+
+  if(dns_parse_query(pkt->l7, pkt->l7_len, &conn->tuple, &query) != 0)
+    return 0;
+
+  now = zdtun_now(tun);
+  entry = dns_cache_find(&tun->dns_cache, &query, now);
+
+  if(!entry) {
+    // the upstream response will resolve the entry
+    dns_cache_add_pending(&tun->dns_cache, &query, &conn->tuple, now);
+    return 0;
+  }
+
+  // too large for the client, let the resolver truncate it
+  if(entry->resp && (entry->resp_len > query.udp_size))
+    return 0;
+
+  if(!entry->resp) {
+    // the extension keeps the connection alive until the answer
+    conn_ext_t *ext = conn_ext(tun, conn);
+    int rv;
+
+    if(!ext || ((rv = dns_cache_add_waiter(entry, &query, &conn->tuple)) < 0))
+      return 0;
+    else if(rv == 0) {
+      ext->dns.cache_waits++;
+      tun->dns_cache.coalesced++;
+    }
+  }
+
+  account_pkt(tun, pkt, 1 /* to zdtun */, conn);
+
+  if(entry->resp)
+    send_dns_cache_answer(tun, conn, entry, query.query_id, query.qname, now);
+
+  return 1;
+}
+
+/* ******************************************************* */
+
+/* Caches an upstream DNS response and answers the queries waiting for it */
+static void check_dns_cache_reply(zdtun_t *tun, zdtun_conn_t *conn,
+        char *l4_payload, uint16_t l4_len) {
+  time_t now = zdtun_now(tun);
+  dns_cache_entry_t *entry;
+
+  if(conn->tuple.dst_port != ntohs(53))
+    return;
+
+  entry = dns_cache_store(&tun->dns_cache, l4_payload, l4_len, &conn->tuple, now);
+
+  if(!entry || !entry->num_waiters)
+    return;
+
+  // NOTE: l4_payload may point into reply_buf, which is reused below
+  dns_waiter_t *waiters = entry->waiters;
+  int num_waiters = entry->num_waiters;
+
+  entry->waiters = NULL;
+  entry->num_waiters = 0;
+
+  for(int i = 0; i < num_waiters; i++) {
+    zdtun_conn_t *waiting = flowtable_find(&tun->conn_table, &waiters[i].tuple);
+
+    if(waiting && (waiting->status < CONN_STATUS_CLOSED)) {
+      if(conn_cache_waits(waiting) > 0)
+        waiting->ext->dns.cache_waits--;
+
+      send_dns_cache_answer(tun, waiting, entry, waiters[i].query_id, waiters[i].qname, now);
+    }
+  }
+
+  free(waiters);
+}
+
+/* ******************************************************* */
+
+static ip_frag_entry_t* frag_cache_bucket(zdtun_t *tun, const zdtun_5tuple_t *tuple, uint32_t ip_id) {
+  uint32_t h = ip_id ^ tuple->ipproto;
+
+  if(tuple->ipver == 4)
+    h ^= tuple->src_ip.ip4 ^ tuple->dst_ip.ip4;
+  else {
+    uint32_t words[8];
+
+    memcpy(words, &tuple->src_ip.ip6, 16);
+    memcpy(words + 4, &tuple->dst_ip.ip6, 16);
+
+    for(int i = 0; i < 8; i++)
+      h ^= words[i];
+  }
+
+  h ^= h >> 16;
+  h ^= h >> 8;
+
+  return tun->frag_cache[h % FRAG_CACHE_BUCKETS];
+}
+
+/* ******************************************************* */
+
+static int frag_entry_match(const ip_frag_entry_t *entry, const zdtun_5tuple_t *tuple, uint32_t ip_id) {
+  int ip_len = (tuple->ipver == 4) ? 4 : 16;
+
+  return((entry->ip_id == ip_id) &&
+    (entry->ipver == tuple->ipver) &&
+    (entry->ipproto == tuple->ipproto) &&
+    !memcmp(&entry->src_ip, &tuple->src_ip, ip_len) &&
+    !memcmp(&entry->dst_ip, &tuple->dst_ip, ip_len));
+}
+
+/* ******************************************************* */
+
+// Saves the ports of a first fragment. The entry to replace is either an
+// unused/expired one or, if the bucket is full, the oldest one.
+static void frag_cache_add(zdtun_t *tun, const zdtun_5tuple_t *tuple, uint32_t ip_id) {
+  ip_frag_entry_t *bucket = frag_cache_bucket(tun, tuple, ip_id);
+  ip_frag_entry_t *entry = &bucket[0];
+  time_t now = zdtun_now(tun);
+
+  for(int i = 0; i < FRAG_CACHE_WAYS; i++) {
+    ip_frag_entry_t *cur = &bucket[i];
+
+    if(!cur->tstamp || ((cur->tstamp + FRAG_TIMEOUT_SEC) <= now) ||
+        frag_entry_match(cur, tuple, ip_id)) {
+      entry = cur;
+      break;
+    } else if(cur->tstamp < entry->tstamp)
+      entry = cur;
+  }
+
+  entry->src_ip = tuple->src_ip;
+  entry->dst_ip = tuple->dst_ip;
+  entry->ip_id = ip_id;
+  entry->sport = tuple->src_port;
+  entry->dport = tuple->dst_port;
+  entry->ipver = tuple->ipver;
+  entry->ipproto = tuple->ipproto;
+  entry->tstamp = now;
+}
+
+/* ******************************************************* */
+
+// Resolves the ports of a non-first fragment. When the last fragment is
+// seen, the entry is released. This assumes that the previous fragments are
+// not lost and retransmitted afterwards.
+static void frag_cache_lookup(zdtun_t *tun, zdtun_5tuple_t *tuple, uint32_t ip_id, uint8_t is_last) {
+  ip_frag_entry_t *bucket = frag_cache_bucket(tun, tuple, ip_id);
+  time_t now = zdtun_now(tun);
+
+  for(int i = 0; i < FRAG_CACHE_WAYS; i++) {
+    ip_frag_entry_t *entry = &bucket[i];
+
+    if(entry->tstamp && ((entry->tstamp + FRAG_TIMEOUT_SEC) > now) &&
+        frag_entry_match(entry, tuple, ip_id)) {
+      tuple->src_port = entry->sport;
+      tuple->dst_port = entry->dport;
+
+      if(is_last)
+        entry->tstamp = 0;
+      return;
+    }
+  }
+
+  // unknown, the ports are 0
+}
+
+/* ******************************************************* */
+
+static int is_upper_layer(int proto) {
+  return (proto == IPPROTO_TCP ||
+          proto == IPPROTO_UDP ||
+          proto == IPPROTO_ICMP ||
+          proto == IPPROTO_ICMPV6);
+}
+
+/* ******************************************************* */
+
+// Fast path for the common packets: unfragmented IPv4 without options or
+// IPv6 without extension headers, carrying TCP or UDP. Returns 0 if the packet
+// must be handled by the full parser, which also reports the errors.
+static inline int parse_pkt_fast(char *pkt_buf, uint16_t pkt_len, zdtun_pkt_t *pkt) {
+  uint8_t ipproto;
+  uint16_t ip_len;
+  int iphdr_len;
+
+  // the full parser reports the error
+  if(pkt_len < IPV4_HEADER_LEN)
+    return 0;
+
+  uint8_t ipver = ((uint8_t)pkt_buf[0]) >> 4;
+
+  if(ipver == 4) {
+    struct iphdr *ip_header = (struct iphdr*) pkt_buf;
+
+    // ihl == 5, no MF flag, no fragment offset
+    if((ip_header->ihl != 5) ||
+        (ip_header->frag_off & htons(0x3FFF)))
+      return 0;
+
+    iphdr_len = IPV4_HEADER_LEN;
+    ip_len = ntohs(ip_header->tot_len);
+    ipproto = ip_header->protocol;
+    pkt->tuple.src_ip = ip4_to_zdtun_ip(ip_header->saddr);
+    pkt->tuple.dst_ip = ip4_to_zdtun_ip(ip_header->daddr);
+  } else if(ipv6_enabled && (ipver == 6)) {
+    struct ipv6_hdr *ip_header = (struct ipv6_hdr*) pkt_buf;
+
+    if(pkt_len < IPV6_HEADER_LEN)
+      return 0;
+
+    iphdr_len = IPV6_HEADER_LEN;
+    ip_len = ntohs(ip_header->payload_len) + IPV6_HEADER_LEN;
+    ipproto = ip_header->nexthdr;
+    pkt->tuple.src_ip.ip6 = ip_header->saddr;
+    pkt->tuple.dst_ip.ip6 = ip_header->daddr;
+  } else
+    return 0;
+
+  // exclude non-IP data
+  if(pkt_len > ip_len)
+    pkt_len = ip_len;
+
+  if(ipproto == IPPROTO_TCP) {
+    struct tcphdr *tcp = (struct tcphdr*) &pkt_buf[iphdr_len];
+
+    if((pkt_len < (iphdr_len + TCP_HEADER_LEN)) ||
+        (pkt_len < (iphdr_len + tcp->th_off * 4)))
+      return 0;
+
+    pkt->l4_hdr_len = tcp->th_off * 4;
+    pkt->tuple.src_port = tcp->th_sport;
+    pkt->tuple.dst_port = tcp->th_dport;
+  } else if(ipproto == IPPROTO_UDP) {
+    struct udphdr *udp = (struct udphdr*) &pkt_buf[iphdr_len];
+
+    if(pkt_len < (iphdr_len + UDP_HEADER_LEN))
+      return 0;
+
+    pkt->l4_hdr_len = UDP_HEADER_LEN;
+    pkt->tuple.src_port = udp->uh_sport;
+    pkt->tuple.dst_port = udp->uh_dport;
+  } else
+    return 0;
+
+  pkt->tuple.ipver = ipver;
+  pkt->tuple.ipproto = ipproto;
+  pkt->flags = 0;
+  pkt->len = pkt_len;
+  pkt->ip_hdr_len = iphdr_len;
+  pkt->csum_start = 0;
+  pkt->csum_offset = 0;
+  pkt->gso_size = 0;
+  pkt->buf = pkt_buf;
+  pkt->l3 = pkt_buf;
+  pkt->l4 = &pkt_buf[iphdr_len];
+  pkt->l7_len = pkt_len - iphdr_len - pkt->l4_hdr_len;
+  pkt->l7 = &pkt_buf[iphdr_len + pkt->l4_hdr_len];
+
+  return 1;
+}
+
+/* ******************************************************* */
+
+static int parse_pkt(zdtun_t *tun, const char *_pkt_buf, uint16_t pkt_len, zdtun_pkt_t *pkt) {
+  char *pkt_buf = (char *)_pkt_buf; /* needed to set the zdtun_pkt_t pointers */
+
+  if(parse_pkt_fast(pkt_buf, pkt_len, pkt))
+    return 0;
+
+  if(pkt_len < IPV4_HEADER_LEN) {
+    debug("Ignoring non IP packet (len: %d)", pkt_len);
+    return -1;
+  }
+
+  uint8_t ipver = (*pkt_buf) >> 4;
+  uint8_t ipproto;
+  int iphdr_len;
+  uint32_t frag_id = 0;
+  uint8_t more_frags = 0;
+
+  // all the fields are set below, on success
+  pkt->flags = 0;
+  pkt->csum_start = 0;
+  pkt->csum_offset = 0;
+  pkt->gso_size = 0;
+  pkt->tuple.src_port = 0;
+  pkt->tuple.dst_port = 0;
+
+  if((ipver != 4) && (!ipv6_enabled || (ipver != 6))) {
+    debug("Ignoring non IP packet (len: %d, v: %d)", pkt_len, ipver);
+    return -1;
+  }
+
+  if(ipver == 4) {
+    struct iphdr *ip_header = (struct iphdr*) pkt_buf;
+    iphdr_len = ip_header->ihl * 4;
+
+    if(pkt_len < iphdr_len) {
+      debug("IPv4 packet too short: %d bytes", pkt_len);
+      return -1;
+    }
+
+    uint16_t tot_len = ntohs(ip_header->tot_len);
+    if(tot_len < iphdr_len) {
+      debug("Invalid IPv4 packet: tot_len=%d, hdr_len=%d", tot_len, iphdr_len);
+      return -1;
+    }
+
+    // exclude non-IP data
+    pkt_len = min(pkt_len, tot_len);
+
+    pkt->tuple.src_ip = ip4_to_zdtun_ip(ip_header->saddr);
+    pkt->tuple.dst_ip = ip4_to_zdtun_ip(ip_header->daddr);
+    ipproto = ip_header->protocol;
+
+    frag_id = ip_header->id;
+    more_frags = (ip_header->frag_off & htons(0x2000)) != 0; // IP_MF
+
+    if (ip_header->frag_off & htons(0x1FFF)) {
+      // this an IP fragment (not the first one)
+      pkt->flags |= ZDTUN_PKT_IS_FRAGMENT;
+    } else if (more_frags) {
+      // this the first IP fragment
+      pkt->flags |= ZDTUN_PKT_IS_FRAGMENT;
+      pkt->flags |= ZDTUN_PKT_IS_FIRST_FRAGMENT;
+    }
+  } else {
+    struct ipv6_hdr *ip_header = (struct ipv6_hdr*) pkt_buf;
+
+    if(pkt_len < sizeof(struct ipv6_hdr)) {
+      debug("IPv6 packet too short: %d bytes", pkt_len);
+      return -1;
+    }
+
+    iphdr_len = sizeof(struct ipv6_hdr);
+    uint8_t nexthdr = ip_header->nexthdr;
+
+    if(nexthdr == IPPROTO_FRAGMENT) {
+      struct ipv6_frag_hdr *frag_hdr = (struct ipv6_frag_hdr*) &pkt_buf[iphdr_len];
+
+      if(pkt_len < (iphdr_len + sizeof(struct ipv6_frag_hdr))) {
+        debug("IPv6 packet too short for the fragment header: %d bytes", pkt_len);
+        return -1;
+      }
+
+      // the fragment header is considered part of the IP header
+      iphdr_len += sizeof(struct ipv6_frag_hdr);
+      nexthdr = frag_hdr->nexthdr;
+      frag_id = frag_hdr->identification;
+      more_frags = (frag_hdr->frag_off & htons(0x0001)) != 0;
+
+      if(frag_hdr->frag_off & htons(0xFFF8))
+        pkt->flags |= ZDTUN_PKT_IS_FRAGMENT;
+      else if(more_frags)
+        pkt->flags |= ZDTUN_PKT_IS_FRAGMENT | ZDTUN_PKT_IS_FIRST_FRAGMENT;
+    }
+
+    if(!is_upper_layer(nexthdr)) {
+      debug("IPv6 extensions not supported: %d", nexthdr);
+      return -1;
+    }
+
+    // exclude non-IP data
+    uint16_t payload_len = ntohs(ip_header->payload_len);
+    pkt_len = min(pkt_len, payload_len + sizeof(struct ipv6_hdr));
+
+    if(pkt_len < iphdr_len) {
+      debug("Invalid IPv6 packet: payload_len=%d", payload_len);
+      return -1;
+    }
+
+    pkt->tuple.src_ip.ip6 = ip_header->saddr;
+    pkt->tuple.dst_ip.ip6 = ip_header->daddr;
+
+    // Treat IPPROTO_ICMPV6 as IPPROTO_ICMP for simplicity
+    ipproto = (nexthdr != IPPROTO_ICMPV6) ? nexthdr : IPPROTO_ICMP;
+  }
+
+  pkt->buf = pkt_buf;
+  pkt->l3 = pkt_buf;
+  pkt->tuple.ipproto = ipproto;
+  pkt->tuple.ipver = ipver;
+  pkt->len = pkt_len;
+  pkt->ip_hdr_len = iphdr_len;
+  pkt->l4 = &pkt_buf[iphdr_len];
+
+  if((pkt->flags & ZDTUN_PKT_IS_FRAGMENT) &&
+     !(pkt->flags & ZDTUN_PKT_IS_FIRST_FRAGMENT)) {
+    // this an IP fragment (not the first one). The ports may be 0.
+    frag_cache_lookup(tun, &pkt->tuple, frag_id, !more_frags);
+    pkt->l4_hdr_len = 0;
+  } else if(ipproto == IPPROTO_TCP) {
+    struct tcphdr *data = pkt->tcp;
+    int32_t tcp_header_len;
+
+    if(pkt_len < (iphdr_len + TCP_HEADER_LEN)) {
+      debug("Packet too small for TCP[%d]", pkt_len);
+      return -1;
+    }
+
+    tcp_header_len = data->th_off * 4;
+
+    if(pkt_len < (iphdr_len + tcp_header_len)) {
+      debug("Malformed TCP packet");
+      return -1;
+    }
+
+    pkt->l4_hdr_len = tcp_header_len;
+    pkt->tuple.src_port = data->th_sport;
+    pkt->tuple.dst_port = data->th_dport;
+  } else if(ipproto == IPPROTO_UDP) {
+    struct udphdr *data = pkt->udp;
+
+    if(pkt_len < (iphdr_len + UDP_HEADER_LEN)) {
+      debug("Packet too small for UDP[%d]", pkt_len);
+      return -1;
+    }
+
+    pkt->l4_hdr_len = 8;
+    pkt->tuple.src_port = data->uh_sport;
+    pkt->tuple.dst_port = data->uh_dport;
+  } else if(ipproto == IPPROTO_ICMP) {
+    struct icmphdr *data = (struct icmphdr*) &pkt_buf[iphdr_len];
+
+    if(pkt_len < (iphdr_len + sizeof(struct icmphdr))) {
+      debug("Packet too small for ICMP");
+      return -1;
+    }
+
+    if((data->type != ICMP_ECHO) && (data->type != ICMP_ECHOREPLY) &&
+        (data->type != ICMPv6_ECHO) && (data->type != ICMPv6_ECHOREPLY)) {
+      debug("Discarding unsupported ICMP[%d]", data->type);
+      return -2;
+    }
+
+    pkt->l4_hdr_len = sizeof(struct icmphdr);
+
+    // NOTE: echo ID in the source port is the same convention used by linux for ICMP connections
+    if((data->type == ICMP_ECHO) || (data->type == ICMPv6_ECHO)) {
+      pkt->tuple.echo_id = data->un.echo.id;
+      pkt->tuple.dst_port = 0;
+    } else {
+      pkt->tuple.echo_id = 0;
+      pkt->tuple.dst_port = data->un.echo.id;
+    }
+  } else {
+    debug("Packet with unknown protocol: %u", ipproto);
+    return -3;
+  }
+
+  if(pkt->flags & ZDTUN_PKT_IS_FIRST_FRAGMENT)
+    // save the ports to restore them on the next fragments
+    frag_cache_add(tun, &pkt->tuple, frag_id);
+
+  pkt->l7_len = pkt_len - iphdr_len - pkt->l4_hdr_len;
+  pkt->l7 = &pkt_buf[iphdr_len + pkt->l4_hdr_len];
+  return 0;
+}
+
+/* ******************************************************* */
+
+int zdtun_parse_pkt(zdtun_t *tun, const char *pkt_buf, uint16_t pkt_len, zdtun_pkt_t *pkt) {
+  int rv = parse_pkt(tun, pkt_buf, pkt_len, pkt);
+
+  if(rv != 0)
+    instr_drop(tun, ZDTUN_DROP_PARSE_ERROR);
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+void zdtun_set_mtu(zdtun_t *tun, int mtu) {
+  tun->mtu = min(mtu, REPLY_BUF_SIZE);
+}
+
+/* ******************************************************* */
+
+int zdtun_parse_ip(const char *ip_str, zdtun_ip_t *parsed) {
+  int rv = -1;
+
+  if(strchr(ip_str, '.')) {
+    if(inet_pton(AF_INET, ip_str, &parsed->ip4) > 0)
+      rv = 4;
+  } else{
+    if(inet_pton(AF_INET6, ip_str, &parsed->ip6) > 0)
+      rv = 6;
+  }
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+int zdtun_cmp_ip(int ipver, zdtun_ip_t *ip_a, zdtun_ip_t *ip_b) {
+  if(ipver == 4)
+    return(memcmp(&ip_a->ip4, &ip_b->ip4, 4));
+  else
+    return(memcmp(&ip_a->ip6, &ip_b->ip6, 16));
+}
+
+/* ******************************************************* */
+
+static void fill_conn_sockaddr(zdtun_t *tun, zdtun_conn_t *conn,
+        struct sockaddr_in6 *addr6, socklen_t *addrlen) {
+  uint8_t ipver = sock_ipver(tun, conn);
+  const proxy_t *proxy;
+
+  if(conn->proxy_mode == PROXY_DNAT)
+    proxy = &conn->ext->dnat;
+  else if(is_socks5(conn))
+    proxy = &tun->socks5;
+  else
+    proxy = NULL;
+
+  if(ipver == 4) {
+    // struct sockaddr_in is smaller than struct sockaddr_in6
+    struct sockaddr_in *addr4 = (struct sockaddr_in*)addr6;
+
+    addr4->sin_family = AF_INET;
+    addr4->sin_addr.s_addr = proxy ? proxy->ip.ip4 : conn->tuple.dst_ip.ip4;
+    addr4->sin_port = proxy ? proxy->port : conn->tuple.dst_port;
+    *addrlen = sizeof(struct sockaddr_in);
+  } else {
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_addr = proxy ? proxy->ip.ip6 : conn->tuple.dst_ip.ip6;
+    addr6->sin6_port = proxy ? proxy->port : conn->tuple.dst_port;
+    *addrlen = sizeof(struct sockaddr_in6);
+  }
+}
+
+/* ******************************************************* */
+
+static int enqueue_tcp_data(zdtun_t *tun, zdtun_conn_t *conn, const char *buf, int bufsize, uint8_t flags) {
+  tcp_data_t *item = conn->tcp.tx_queue_tail;
+
+  // zero-copy: reference the zdtun_forward_owned buffer instead of copying it
+  char *owned = (bufsize >= MIN_OWNED_DATA_SIZE) ? tun->owned_buf : NULL;
+
+  // Coalesce into the tail chunk. A TH_PUSH chunk is never extended, as it
+  // terminates a MSG_MORE batch in handle_queued_tcp_data.
+  if(!owned && item && !item->owned && !(item->flags & TH_PUSH) &&
+      ((item->cap - item->len) >= bufsize)) {
+    memcpy(item->data + item->len, buf, bufsize);
+    item->len += bufsize;
+    item->flags |= flags;
+  } else {
+    uint16_t cap = owned ? 0 : max(bufsize, (int)TX_CHUNK_SIZE);
+
+    item = bufpool_alloc(&tun->tx_pool, sizeof(tcp_data_t) + cap);
+    if(!item) {
+      error("tcp_data_t alloc failed");
+      zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+      return -1;
+    }
+
+    item->next = NULL;
+    item->cap = cap;
+    item->sofar = 0;
+    item->flags = flags;
+    item->len = bufsize;
+    item->owned = owned;
+    item->zc_refs = 0;
+
+    if(owned) {
+      // now released by free_tcp_data
+      item->ptr = (char*) buf;
+      tun->owned_buf = NULL;
+    } else {
+      item->ptr = item->data;
+      memcpy(item->data, buf, bufsize);
+    }
+
+    // append
+    if(conn->tcp.tx_queue_tail)
+      conn->tcp.tx_queue_tail->next = item;
+    else
+      conn->tcp.tx_queue = item;
+
+    conn->tcp.tx_queue_tail = item;
+  }
+
+  conn->tcp.tx_queue_size += bufsize;
+
+  // will be handled in handle_queued_tcp_data
+  // increment of client_seq and sending of ACK is also deferred
+  conn_set_events(tun, conn, conn->ev_mask | ZDTUN_EV_WRITE);
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+// Accounts the client SYN and initializes the TCP state of the connection
+static void init_tcp_conn(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
+  struct tcphdr *data = pkt->tcp;
+
+  // Account the SYN
+  account_pkt(tun, pkt, 1 /* to zdtun */, conn);
+
+  // TCP options
+  uint8_t optslen = data->th_off * 4 - TCP_HEADER_LEN;
+  uint8_t *opts = (uint8_t*)data + TCP_HEADER_LEN;
+  uint16_t mss = default_mss(tun, conn);
+  uint8_t scale = 0;
+  uint8_t has_scale = 0;
+
+  while(optslen > 1) {
+    uint8_t kind = *opts++;
+    uint8_t len;
+
+    if(kind == 1) { // NOP
+      optslen--;
+      continue;
+    }
+
+    len = *opts++;
+
+    if((kind == 0) || (len < 2) || (optslen < len))
+      break;
+
+    if((kind == 2) && (len == 4)) // MSS
+      mss = ntohs(*(uint16_t*)opts);
+
+    if((kind == 3) && (len == 3)) { // Window Scale
+      scale = min(*opts, 14);
+      has_scale = 1;
+    }
+
+    opts += (len - 2);
+    optslen -= len;
+  }
+
+  debug("MSS: %d, scale: %d\n", mss, scale);
+
+  conn->tcp.window_size = ntohs(data->th_win) << scale;
+  conn->tcp.window_scale = scale;
+  conn->tcp.mss = mss;
+
+  // our scale is independent, but only allowed if the client also scales
+  conn->tcp.zdtun_window_scale = has_scale ? max(scale, TCP_WINDOW_SCALE) : 0;
+
+  conn->tcp.client_seq = ntohl(data->th_seq) + 1;
+  conn->tcp.zdtun_seq = TCP_ISN;
+
+  // the connect timeout starts now, see CONN_LIST_TCP_CONNECTING
+  conn->tstamp = zdtun_now(tun);
+  list_move(tun, conn, CONN_LIST_TCP_CONNECTING);
+}
+
+/* ******************************************************* */
+
+// returns 0 on success
+// returns <0 on error
+// no_ack: can be used to avoid sending the ACK to the client and keep
+// its sequence number unchanged. This is needed to implement out of band
+// data.
+static int handle_tcp_fwd(zdtun_t *tun, const zdtun_pkt_t *pkt,
+          zdtun_conn_t *conn) {
+  struct tcphdr *data = pkt->tcp;
+  int family = (sock_ipver(tun, conn) == 4) ? PF_INET : PF_INET6;
+  int val;
+
+  if(data->th_flags & TH_URG) {
+    error("URG data not supported");
+    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+    return -1;
+  }
+
+  if(conn->status == CONN_STATUS_CONNECTING) {
+    debug("ignore TCP packet, we are connecting");
+    return 0;
+  } else if(conn->status == CONN_STATUS_NEW) {
+    if(is_socks5(conn) && socks5_pool_take(tun, conn)) {
+      // already connected and authenticated, only the CONNECT request is needed
+      init_tcp_conn(tun, pkt, conn);
+      return tcp_socket_syn(tun, conn);
+    }
+
+    debug("Allocating new TCP socket for port %d", ntohs(conn->tuple.dst_port));
+    socket_t tcp_sock = open_socket(tun, conn, family, SOCK_STREAM, IPPROTO_TCP);
+
+    if(tcp_sock == INVALID_SOCKET) {
+      error("Cannot create TCP socket[%d]", socket_errno);
+      conn->status = CONN_STATUS_SOCKET_ERROR;
+      return -1;
+    }
+
+    // Disable Nagle algorithm. We will manually buffer data with MSG_MORE
+    // when needed.
+    val = 1;
+    if(setsockopt(tcp_sock, SOL_TCP, TCP_NODELAY, &val, sizeof(val)) < 0)
+      error("setsockopt TCP_NODELAY failed");
+
+    // Setup for the connection
+    struct sockaddr_in6 servaddr = {0};
+    socklen_t addrlen;
+    fill_conn_sockaddr(tun, conn, &servaddr, &addrlen);
+
+    set_nonblocking(tcp_sock, 1);
+
+    uint8_t in_progress = 0;
+
+    init_tcp_conn(tun, pkt, conn);
+
+    int rv;
+
+#ifdef ZDTUN_INSTRUMENTATION
+    conn->instr_start_us = instr_now_us();
+#endif
+
+#ifdef MSG_FASTOPEN
+    if(is_socks5(conn) && (tun->socks5_opts & ZDTUN_SOCKS5_FASTOPEN))
+      rv = socks5_fastopen_connect(tun, conn, (struct sockaddr *) &servaddr, addrlen);
+    else
+#endif
+      rv = connect(tcp_sock, (struct sockaddr *) &servaddr, addrlen);
+
+    // connect with the server
+    if(rv == SOCKET_ERROR) {
+      if(socket_errno == socket_in_progress) {
+        debug("Connection in progress");
+        in_progress = 1;
+      } else {
+        close_with_socket_error(tun, conn, "TCP connect");
+        return 0;
+      }
+    }
+
+    if(!in_progress)
+      return tcp_socket_syn(tun, conn);
+
+    conn->status = CONN_STATUS_CONNECTING;
+    conn_set_events(tun, conn, conn->ev_mask | ZDTUN_EV_WRITE);
+    return 0;
+  }
+
+  // Here a connection is already active
+  account_pkt(tun, pkt, 1 /* to zdtun */, conn);
+
+  uint32_t seq = ntohl(data->th_seq);
+  uint8_t is_keep_alive = ((data->th_flags & TH_ACK) &&
+    ((seq + 1) == conn->tcp.client_seq));
+
+  if(((data->th_flags & (TH_SYN | TH_ACK)) == TH_SYN) && ((seq + 1) == conn->tcp.client_seq)) {
+    // SYN retransmission, the SYN+ACK may have been lost
+    if(!socks5_in_progress(conn) && (conn->tcp.zdtun_seq == (TCP_ISN + 1))) {
+      debug("SYN retransmission, sending the SYN+ACK again");
+      conn->tcp.zdtun_seq = TCP_ISN;
+
+      if(send_syn_ack(tun, conn) != 0)
+        conn->tcp.zdtun_seq = TCP_ISN + 1;
+    }
+
+    return 0;
+  }
+
+  if(!is_keep_alive && (seq != (conn->tcp.client_seq + conn->tcp.tx_queue_size))) {
+    debug("ignoring out of sequence data: expected %d, got %d", conn->tcp.client_seq, seq);
+    return 0;
+  }
+
+  if(socks5_in_progress(conn)) {
+    error("Got data while SOCKS5 in progress (status: %d, %d bytes, TCP flags: %d)",
+        conn->ext->socks5_status, pkt->l7_len, data->th_flags);
+
+    zdtun_conn_close(tun, conn, CONN_STATUS_SOCKS5_ERROR);
+    return -1;
+  }
+
+  if(data->th_flags & TH_RST) {
+    debug("Got TCP reset from client");
+    zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+
+    return 0;
+  } else if((data->th_flags & (TH_FIN | TH_ACK)) == (TH_FIN | TH_ACK)) {
+    int rv;
+
+    debug("Got TCP FIN+ACK from client");
+
+    if(conn->sock != INVALID_SOCKET) {
+      // Half close the socket to possibly signal the remote server
+      // (e.g. in after an HTTP request is completed).
+
+      if(shutdown(conn->sock, SHUT_WR) != 0)
+        debug("shutdown failed[%d] %s", errno, strerror(errno));
+    }
+
+    conn->tcp.client_seq += ((uint32_t)pkt->l7_len) + 1;
+    conn->tcp.client_closed = 1;
+
+    // send the ACK
+    build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
+    rv = send_to_client(tun, conn, TCP_HEADER_LEN);
+
+    if(conn->sock == INVALID_SOCKET)
+      // Both the client and the server have closed, terminate the connection
+      zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+
+    return rv;
+  }
+
+  if((data->th_flags & TH_ACK) && (conn->sock != INVALID_SOCKET)) {
+    if(is_keep_alive) {
+      debug("TCP KEEPALIVE");
+
+      int val = 1;
+      if(setsockopt(conn->sock, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val)) != 0)
+        error("setsockopt SO_KEEPALIVE failed[%d]: %s", errno, strerror(errno));
+
+      // Assume that the server is alive until its socket is closed.
+      build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
+
+      if(send_to_client(tun, conn, TCP_HEADER_LEN) != 0)
+        return -1;
+    } else {
+      // Received ACK from the client, update the window. Take into account
+      // the in flight bytes which the client has not ACK-ed yet.
+      uint32_t ack_num = ntohl(data->th_ack);
+      uint32_t in_flight;
+
+      if(conn->tcp.zdtun_seq >= ack_num)
+        in_flight = conn->tcp.zdtun_seq - ack_num;
+      else
+        // TCP seq wrapped
+        in_flight = 0xFFFFFFFF - ack_num + conn->tcp.zdtun_seq + 1;
+
+      uint32_t window = ntohs(data->th_win) << conn->tcp.window_scale;
+      conn->tcp.window_size = window - in_flight;
+
+      if(!(conn->ev_mask & ZDTUN_EV_READ) && (conn->tcp.window_size > 0)) {
+        log_tcp_window("[%d][Window size: %u] enabling socket", conn->tuple.src_port, conn->tcp.window_size);
+
+        // make the socket selectable again
+        conn_set_events(tun, conn, conn->ev_mask | ZDTUN_EV_READ);
+      }
+    }
+  }
+
+  // check for payload data (avoid sending ACK to an ACK)
+  if(pkt->l7_len > 0) {
+    if(conn->sock == INVALID_SOCKET) {
+      // The server may have closed the connection while the client is still
+      // sending data. We should still ACK this data
+      debug("Write after server socket closed");
+
+      // send the ACK
+      conn->tcp.client_seq += pkt->l7_len;
+      build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
+      return send_to_client(tun, conn, TCP_HEADER_LEN);
+    } else
+      // data send is deferred to handle_queued_tcp_data, when socket will be ready for TX
+      return enqueue_tcp_data(tun, conn, pkt->l7, pkt->l7_len, data->th_flags);
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+static int fill_ipv6_bind_addr(struct sockaddr_in6 *addr) {
+  struct addrinfo *ainfo = NULL;
+  struct addrinfo hint = {};
+
+  hint.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+  hint.ai_family = AF_INET6;
+  hint.ai_socktype = SOCK_DGRAM;
+  hint.ai_protocol = IPPROTO_UDP;
+
+  if(getaddrinfo("::0", NULL, &hint, &ainfo) < 0) {
+    error("getaddrinfo failed");
+    return -1;
+  }
+
+  if(!ainfo || (ainfo->ai_family != AF_INET6)) {
+    error("getaddrinfo invalid family");
+    freeaddrinfo(ainfo);
+    return -1;
+  }
+
+  *addr = *(struct sockaddr_in6*)ainfo->ai_addr;
+  freeaddrinfo(ainfo);
+  return 0;
+}
+
+/* ******************************************************* */
+
+// UDP socket operations:
+//  - bind: picks up a local port for inbound packets. This is normally done
+//    by sendto, but here we will possibly reuse an existing port from udp_mapping_t
+//    to make STUN to work properly
+//  - connect: ensures that the socket can only send/receive from the specified peer.
+//    Moreover, it speeds up send/sendto, removing route lookup on each packet
+static int bind_and_connect_udp(zdtun_t *tun, zdtun_conn_t *conn) {
+  uint8_t ipver = sock_ipver(tun, conn);
+  struct sockaddr_in6 bind_addr = {0};
+  socklen_t addrlen = (ipver == 4) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+  if(ipver == 6) {
+    if(fill_ipv6_bind_addr(&bind_addr) < 0) {
+      zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+      return -1;
+    }
+  }
+
+  udp_mapping_key_t key;
+  udp_mapping_t *mapping;
+
+  udp_mapping_key(&conn->tuple, &key);
+  HASH_FIND(hh, tun->udp_mappings, &key, sizeof(key), mapping);
+  if(mapping != NULL) {
+    // If the client opens a UDP connection with the same source port of an
+    // existing (not purged) connection, then reuse the existing local port.
+    // This makes NAT traversal protocols like STUN work.
+    if(ipver == 4)
+      ((struct sockaddr_in*)&bind_addr)->sin_port = mapping->port;
+    else
+      bind_addr.sin6_port = mapping->port;
+  } // else pick a random local port (see below getsockname)
+
+  // port can be used by multiple sockets (when mapping->num_uses > 1)
+  if(setsockopt(conn->sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+    close_with_socket_error(tun, conn, "UDP SO_REUSEADDR");
+    return -1;
+  }
+
+  if(bind(conn->sock, (struct sockaddr *) &bind_addr, addrlen) == SOCKET_ERROR) {
+    close_with_socket_error(tun, conn, "UDP bind");
+    return -1;
+  }
+
+  struct sockaddr_in6 servaddr = {0};
+  fill_conn_sockaddr(tun, conn, &servaddr, &addrlen);
+
+  if(connect(conn->sock, (struct sockaddr *) &servaddr, addrlen) == SOCKET_ERROR) {
+    close_with_socket_error(tun, conn, "UDP connect");
+    return -1;
+  }
+
+  if(mapping == NULL) {
+    // random port was requested with bind, get the assigned port number
+    if(getsockname(conn->sock, (struct sockaddr *)&bind_addr, &addrlen) < 0) {
+      close_with_socket_error(tun, conn, "UDP getsockname");
+      return -1;
+    }
+
+    safe_alloc(mapping, udp_mapping_t);
+    mapping->key = key;
+    mapping->sock = INVALID_SOCKET;
+    mapping->port = (ipver == 4) ? ((struct sockaddr_in*)&bind_addr)->sin_port : bind_addr.sin6_port;
+    mapping->num_uses = 1;
+
+    HASH_ADD(hh, tun->udp_mappings, key, sizeof(key), mapping);
+  } else if(mapping->num_uses < (uint16_t)-1) {
+    mapping->num_uses++;
+    debug("Reusing UDP port: client=%d, local=%d", htons(conn->tuple.src_port), htons(mapping->port));
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+// Broadcasts, multicasts and proxied connections use a connected socket
+static int use_shared_udp(zdtun_t *tun, zdtun_conn_t *conn) {
+  if(!tun->cfg.udp_shared_sockets || (conn->proxy_mode != PROXY_NONE))
+    return 0;
+
+  if(conn->tuple.ipver == 4)
+    return(conn->tuple.dst_ip.ip4 != INADDR_BROADCAST);
+  else
+    return(conn->tuple.dst_ip.ip6.s6_addr[0] != 0xFF);
+}
+
+/* ******************************************************* */
+
+// With udp_shared_sockets, all the connections of a client port share a single
+// unconnected socket, bound to the mapping port. Packets are sent with sendto
+// and the replies are matched to the connections by their source address (see
+// handle_shared_udp_reply).
+static int bind_shared_udp(zdtun_t *tun, zdtun_conn_t *conn) {
+  uint8_t ipver = conn->tuple.ipver;
+  udp_mapping_key_t key;
+  udp_mapping_t *mapping;
+
+  udp_mapping_key(&conn->tuple, &key);
+  HASH_FIND(hh, tun->udp_mappings, &key, sizeof(key), mapping);
+
+  if(mapping == NULL) {
+    safe_alloc(mapping, udp_mapping_t);
+    mapping->key = key;
+    mapping->sock = INVALID_SOCKET;
+
+    HASH_ADD(hh, tun->udp_mappings, key, sizeof(key), mapping);
+  }
+
+  // set before opening the socket, so that zdtun_conn_close releases it on error
+  mapping->shared = 1;
+  conn->udp.shared = mapping;
+
+  if(mapping->num_uses < (uint16_t)-1)
+    mapping->num_uses++;
+
+  if(mapping->sock != INVALID_SOCKET)
+    return 0;
+
+  struct sockaddr_in6 bind_addr = {0};
+  socklen_t addrlen = (ipver == 4) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+
+  if(ipver == 6) {
+    if(fill_ipv6_bind_addr(&bind_addr) < 0) {
+      zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+      return -1;
+    }
+  }
+
+  // reuse the local port of the mapping, if any, otherwise pick a random one
+  if(ipver == 4)
+    ((struct sockaddr_in*)&bind_addr)->sin_port = mapping->port;
+  else
+    bind_addr.sin6_port = mapping->port;
+
+  socket_t sock = new_socket(tun, (ipver == 4) ? PF_INET : PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+
+  if(sock == INVALID_SOCKET) {
+    error("Cannot create UDP socket[%d]", socket_errno);
+    zdtun_conn_close(tun, conn, CONN_STATUS_SOCKET_ERROR);
+    return -1;
+  }
+
+  mapping->sock = sock;
+  set_socket_events(tun, sock, (void*)((uintptr_t)mapping | EV_TAG_UDP_MAPPING), 0, ZDTUN_EV_READ);
+
+  // the port may also be used by connected sockets (see bind_and_connect_udp)
+  if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+    close_with_socket_error(tun, conn, "UDP SO_REUSEADDR");
+    close_shared_udp(tun, mapping);
+    return -1;
+  }
+
+  if(bind(sock, (struct sockaddr *) &bind_addr, addrlen) == SOCKET_ERROR) {
+    close_with_socket_error(tun, conn, "UDP bind");
+    close_shared_udp(tun, mapping);
+    return -1;
+  }
+
+  if(mapping->port == 0) {
+    if(getsockname(sock, (struct sockaddr *)&bind_addr, &addrlen) < 0) {
+      close_with_socket_error(tun, conn, "UDP getsockname");
+      close_shared_udp(tun, mapping);
+      return -1;
+    }
+
+    mapping->port = (ipver == 4) ? ((struct sockaddr_in*)&bind_addr)->sin_port : bind_addr.sin6_port;
+  }
+
+  debug("Shared UDP socket: client=%d, local=%d", htons(conn->tuple.src_port), htons(mapping->port));
+  return 0;
+}
+
+/* ******************************************************* */
+
+static int handle_udp_fwd(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
+  struct udphdr *data = pkt->udp;
+  uint8_t ipver = sock_ipver(tun, conn);
+  int family = (ipver == 4) ? PF_INET : PF_INET6;
+
+  if(tun->dns_cache.max_entries && check_dns_cache_query(tun, conn, pkt))
+    return 0;
+
+  if((conn->status == CONN_STATUS_NEW) && use_shared_udp(tun, conn)) {
+    if(bind_shared_udp(tun, conn) < 0)
+      return -1;
+
+    conn->status = CONN_STATUS_CONNECTED;
+  }
+
+  if(conn->status == CONN_STATUS_NEW) {
+    debug("Allocating new UDP socket for port %d", ntohs(data->uh_sport));
+
+    socket_t udp_sock = open_socket(tun, conn, family, SOCK_DGRAM, IPPROTO_UDP);
+    if(udp_sock == INVALID_SOCKET) {
+      error("Cannot create UDP socket[%d]", socket_errno);
+      return -1;
+    }
+
+    // Check for broadcasts/multicasts
+    if(ipver == 4) {
+      if(conn->tuple.dst_ip.ip4 == INADDR_BROADCAST) {
+        int on = 1;
+
+        debug("UDP4 broadcast detected");
+
+        if(setsockopt(udp_sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)))
+          error("UDP setsockopt SO_BROADCAST failed[%d]: %s", errno, strerror(errno));
+      }
+    } else {
+      // Adapted from netguard/udp.c
+      if(conn->tuple.dst_ip.ip6.s6_addr[0] == 0xFF) {
+        debug("UDP6 broadcast detected");
+
+        int loop = 1; // true
+        if(setsockopt(udp_sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)))
+          error("UDP setsockopt IPV6_MULTICAST_LOOP failed[%d]: %s",
+                  errno, strerror(errno));
+
+        int ttl = -1; // route default
+        if(setsockopt(udp_sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)))
+          error("UDP setsockopt IPV6_MULTICAST_HOPS failed[%d]: %s",
+                  errno, strerror(errno));
+
+        struct ipv6_mreq mreq6;
+        memcpy(&mreq6.ipv6mr_multiaddr, &conn->tuple.dst_ip.ip6, 16);
+        mreq6.ipv6mr_interface = INADDR_ANY;
+
+        if(setsockopt(udp_sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq6, sizeof(mreq6)))
+          error("UDP setsockopt IPV6_ADD_MEMBERSHIP failed[%d]: %s",
+                  errno, strerror(errno));
+      }
+    }
+
+    // TODO exclude broadcast/multicast addresses?
+    if(bind_and_connect_udp(tun, conn) < 0)
+      return -1;
+
+    conn->status = CONN_STATUS_CONNECTED;
+  }
+
+  account_pkt(tun, pkt, 1 /* to zdtun */, conn);
+
+  if(conn->udp.shared) {
+    struct sockaddr_in6 servaddr = {0};
+    socklen_t addrlen;
+
+    if(conn->udp.shared->sock == INVALID_SOCKET) {
+      // the shared socket was closed on error
+      zdtun_conn_close(tun, conn, CONN_STATUS_SOCKET_ERROR);
+      return 0;
+    }
+
+    fill_conn_sockaddr(tun, conn, &servaddr, &addrlen);
+
+    if(sendto(conn->udp.shared->sock, pkt->l7, pkt->l7_len, 0,
+        (struct sockaddr*) &servaddr, addrlen) < 0) {
+      close_with_socket_error(tun, conn, "UDP sendto");
+      return 0;
+    }
+  } else if(send(conn->sock, pkt->l7, pkt->l7_len, 0) < 0) {
+    close_with_socket_error(tun, conn, "UDP sendto");
+    return 0;
+  }
+
+  check_dns_request(tun, conn, pkt->l7, pkt->l7_len);
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+/* NOTE: a collision may occure between ICMP packets seq from host and tunneled packets, we ignore it */
+static int handle_icmp_fwd(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
+  struct icmphdr *data = pkt->icmp;
+  const uint16_t icmp_len = pkt->l4_hdr_len + pkt->l7_len;
+
+  if(conn->status == CONN_STATUS_NEW) {
+    int family = (sock_ipver(tun, conn) == 4) ? PF_INET : PF_INET6;
+    int proto = (family == PF_INET) ? IPPROTO_ICMP : IPPROTO_ICMPV6;
+
+    /*
+     * Either a SOCK_RAW or SOCK_DGRAM can be used. The SOCK_DGRAM, however, does not require root
+     * privileges, so it is a better choice (also for Android). See https://lwn.net/Articles/443051
+     * for more details.
+     *
+     * However the SOCK_DGRAM:
+     *  - Contrary to the RAW socket, requires a separate socket per ICMP connection.
+     *  - The reply received via recv misses the IP header.
+     *  - Does not honor all the ICMP header fields (e.g. the ICMP echo ID).
+     */
+    socket_t icmp_sock = open_socket(tun, conn, family, SOCK_DGRAM, proto);
+    debug("Allocating new ICMP socket for id %d", ntohs(data->un.echo.id));
+
+    if(icmp_sock == INVALID_SOCKET) {
+      error("Cannot create ICMP socket[%d]", socket_errno);
+      conn->status = CONN_STATUS_SOCKET_ERROR;
+      return -1;
+    }
+    conn->status = CONN_STATUS_CONNECTED;
+    conn->tuple.src_port = data->un.echo.id;
+  }
+
+  debug("ICMP.fw[len=%u] id=%d seq=%d type=%d code=%d", icmp_len, data->un.echo.id,
+          data->un.echo.sequence, data->type, data->code);
+
+  account_pkt(tun, pkt, 1 /* to zdtun */, conn);
+
+  struct sockaddr_in6 servaddr = {0};
+  socklen_t addrlen;
+  fill_conn_sockaddr(tun, conn, &servaddr, &addrlen);
+
+  if(sendto(conn->sock, data, icmp_len, 0, (struct sockaddr*)&servaddr, addrlen) < 0) {
+    close_with_socket_error(tun, conn, "ICMP sendto");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+// Holds the first packet of a connection waiting for zdtun_conn_verdict. The
+// other packets (e.g. the client retransmissions) are dropped.
+static int hold_pkt(zdtun_t *tun, zdtun_conn_t *conn, const zdtun_pkt_t *pkt) {
+  conn_ext_t *ext = conn_ext(tun, conn);
+
+  if(!ext)
+    return -1;
+
+  if(ext->held_pkt) {
+    debug("Dropping packet of a pending connection");
+    return 0;
+  }
+
+  if(!(ext->held_pkt = malloc(pkt->len))) {
+    error("held packet alloc failed");
+    return -1;
+  }
+
+  memcpy(ext->held_pkt, pkt->buf, pkt->len);
+  ext->held_len = pkt->len;
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+static int forward_pkt(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
+  int rv = 0;
+
+  if(conn->status >= CONN_STATUS_CLOSED) {
+    debug("Refusing to forward closed connection");
+    return 0;
+  }
+
+  if(conn->verdict_pending)
+    return hold_pkt(tun, conn, pkt);
+
+  instr_pkt(tun, pkt, 1);
+
+  switch(pkt->tuple.ipproto) {
+    case IPPROTO_TCP:
+      rv = handle_tcp_fwd(tun, pkt, conn);
+      break;
+    case IPPROTO_UDP:
+      rv = handle_udp_fwd(tun, pkt, conn);
+      break;
+    case IPPROTO_ICMP:
+      rv = handle_icmp_fwd(tun, pkt, conn);
+      break;
+    default:
+      error("Ignoring unhandled IP protocol %d", pkt->tuple.ipproto);
+      return -2;
+  }
+
+  if(rv == 0) {
+    conn_touch(tun, conn);
+
+    // a conn without a socket is only expected while waiting for the DNS cache
+    if((conn->status == CONN_STATUS_NEW) && !conn_cache_waits(conn))
+      error("Connection status must not be CONN_STATUS_NEW here!");
+  }
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+int zdtun_forward(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
+  int rv = forward_pkt(tun, pkt, conn);
+
+  zdtun_flush(tun);
+  return rv;
+}
+
+/* ******************************************************* */
+
+int zdtun_conn_verdict(zdtun_t *tun, zdtun_conn_t *conn, zdtun_verdict_t verdict) {
+  if(!conn->verdict_pending || (conn->status >= CONN_STATUS_CLOSED)) {
+    debug("zdtun_conn_verdict: the connection is not pending");
+    return -1;
+  }
+
+  if(verdict != ZDTUN_VERDICT_ALLOW) {
+    zdtun_conn_close(tun, conn, CONN_STATUS_BLOCKED);
+    zdtun_flush(tun);
+    return 0;
+  }
+
+  conn->verdict_pending = 0;
+  tun->stats.num_pending_verdicts--;
+  list_move(tun, conn, proto_list_id(conn->tuple.ipproto));
+  conn_touch(tun, conn);
+
+  if(!conn->ext || !conn->ext->held_pkt)
+    // will be established by the next packet
+    return 0;
+
+  zdtun_pkt_t pkt;
+  char *held_pkt = conn->ext->held_pkt;
+  int rv;
+
+  conn->ext->held_pkt = NULL;
+
+  if(((rv = parse_pkt(tun, held_pkt, conn->ext->held_len, &pkt)) != 0) ||
+      ((rv = forward_pkt(tun, &pkt, conn)) != 0)) {
+    debug("zdtun_conn_verdict: forward failed");
+    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+    rv = -1;
+  }
+
+  free(held_pkt);
+  zdtun_flush(tun);
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+int zdtun_forward_owned(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
+  if(!tun->callbacks.release_buf) {
+    error("zdtun_forward_owned requires the release_buf callback");
+    return -1;
+  }
+
+  // possibly referenced by enqueue_tcp_data
+  tun->owned_buf = pkt->buf;
+
+  int rv = zdtun_forward(tun, pkt, conn);
+
+  if(tun->owned_buf) {
+    tun->callbacks.release_buf(tun, tun->owned_buf);
+    tun->owned_buf = NULL;
+  }
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+static zdtun_conn_t* lookup_and_forward(zdtun_t *tun, const zdtun_pkt_t *pkt) {
+  if(pkt->flags & ZDTUN_PKT_IS_FRAGMENT) {
+    debug("TCP: ignoring fragmented IP");
+    return NULL;
+  }
+
+  uint8_t is_tcp_established = ((pkt->tuple.ipproto == IPPROTO_TCP) &&
+    (!(pkt->tcp->th_flags & TH_SYN) || (pkt->tcp->th_flags & TH_ACK)));
+
+  zdtun_conn_t *conn = zdtun_lookup(tun, &pkt->tuple, !is_tcp_established);
+
+  if(!conn) {
+    if(is_tcp_established) {
+      debug("TCP: ignoring non SYN connection");
+    } else {
+      debug("zdtun_lookup failed");
+    }
+
+    return NULL;
+  }
+
+  if(forward_pkt(tun, pkt, conn) != 0) {
+    debug("zdtun_forward failed");
+
+    /* Close the connection as soon an any error occurs */
+    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+    return NULL;
+  }
 
-  // port can be used by multiple sockets (when mapping->num_uses > 1)
-  if(setsockopt(conn->sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
-    close_with_socket_error(tun, conn, "UDP SO_REUSEADDR");
+  return conn;
+}
+
+/* ******************************************************* */
+
+zdtun_conn_t* zdtun_easy_forward(zdtun_t *tun, const char *pkt_buf, int pkt_len) {
+  zdtun_pkt_t pkt;
+  zdtun_conn_t *conn;
+
+  if(zdtun_parse_pkt(tun, pkt_buf, pkt_len, &pkt) != 0) {
+    debug("zdtun_easy_forward: zdtun_parse_pkt failed");
+    return NULL;
+  }
+
+  conn = lookup_and_forward(tun, &pkt);
+  zdtun_flush(tun);
+
+  return conn;
+}
+
+/* ******************************************************* */
+
+int zdtun_forward_batch(zdtun_t *tun, const zdtun_pkt_t *pkts, int num_pkts) {
+  int num_fwd = 0;
+
+  for(int i = 0; i < num_pkts; i++) {
+    if(lookup_and_forward(tun, &pkts[i]))
+      num_fwd++;
+  }
+
+  zdtun_flush(tun);
+  return num_fwd;
+}
+
+/* ******************************************************* */
+
+static int handle_icmp_reply(zdtun_t *tun, zdtun_conn_t *conn) {
+  int iphdr_len = zdtun_iphdr_len(tun, conn);
+  int icmp_len = recv(conn->sock, tun->reply_buf + iphdr_len,
+          REPLY_BUF_SIZE - iphdr_len, 0);
+
+  if(icmp_len == SOCKET_ERROR) {
+    close_with_socket_error(tun, conn, "ICMP recv");
     return -1;
   }
 
-  if(bind(conn->sock, (struct sockaddr *) &bind_addr, addrlen) == SOCKET_ERROR) {
-    close_with_socket_error(tun, conn, "UDP bind");
+  if(icmp_len < sizeof(struct icmphdr)) {
+    error("ICMP packet too small[%d]", icmp_len);
+    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
     return -1;
   }
 
-  struct sockaddr_in6 servaddr = {0};
-  fill_conn_sockaddr(tun, conn, &servaddr, &addrlen);
+  struct icmphdr *data = (struct icmphdr*) &tun->reply_buf[iphdr_len];
 
-  if(connect(conn->sock, (struct sockaddr *) &servaddr, addrlen) == SOCKET_ERROR) {
-    close_with_socket_error(tun, conn, "UDP connect");
-    return -1;
+  if((data->type != ICMP_ECHO) && (data->type != ICMP_ECHOREPLY) &&
+	  (data->type != ICMPv6_ECHO) && (data->type != ICMPv6_ECHOREPLY)) {
+    debug("Discarding unsupported ICMP[%d]", data->type);
+    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+    return 0;
   }
 
-  if(mapping == NULL) {
-    // random port was requested with bind, get the assigned port number
-    if(getsockname(conn->sock, (struct sockaddr *)&bind_addr, &addrlen) < 0) {
-      close_with_socket_error(tun, conn, "UDP getsockname");
+  uint8_t ipver = sock_ipver(tun, conn);
+
+  // Reset the correct ID (the kernel changes it). The kernel has already
+  // verified the ICMPv4 checksum, so it can be incrementally updated.
+  if(ipver == 4)
+    data->checksum = csum_update16(data->checksum, data->un.echo.id, conn->tuple.echo_id);
+  data->un.echo.id = conn->tuple.echo_id;
+
+  debug("ICMP.re[len=%d] id=%d seq=%d type=%d code=%d", icmp_len, data->un.echo.id,
+          data->un.echo.sequence, data->type, data->code);
+
+  conn_touch(tun, conn);
+
+  zdtun_make_iphdr(tun, conn, tun->reply_buf, icmp_len);
+
+  if(ipver == 6) {
+    data->checksum = 0;
+    data->checksum = reply_l4_checksum(tun, conn, tun->reply_buf, (char*)data, icmp_len, 0);
+  }
+
+  return send_to_client(tun, conn, icmp_len);
+}
+
+/* ******************************************************* */
+
+// Sends the data received from the server, which is located in reply_buf
+// (or in an owned buffer, see alloc_buf) after the room for the headers. Data
+// bigger than the MSS is either sent as a single GSO super segment or split
+// in place into MSS segments: each segment headers overwrite the tail of the
+// previous (already sent) segment. An owned buffer always holds a single segment.
+static int send_tcp_data(zdtun_t *tun, zdtun_conn_t *conn, char *payload, int l4_len,
+        uint8_t push, uint8_t owned) {
+  int hdr_len = zdtun_iphdr_len(tun, conn) + TCP_HEADER_LEN;
+  int mss = conn->tcp.mss ? conn->tcp.mss : default_mss(tun, conn);
+  uint16_t gso_size = ((tun->offload & ZDTUN_OFFLOAD_TCP_GSO) && (l4_len > mss)) ? mss : 0;
+  int sofar = 0;
+
+  while(sofar < l4_len) {
+    int seg_len = gso_size ? l4_len : min(mss, l4_len - sofar);
+    char *pkt_buf = payload + sofar - hdr_len;
+    uint8_t flags = TH_ACK;
+
+    if(push && ((sofar + seg_len) == l4_len))
+      flags |= TH_PUSH;
+
+    // NAT back the TCP port and reconstruct the TCP header
+    build_tcp_segment(tun, conn, pkt_buf, flags, seg_len, 0, (gso_size != 0));
+
+    if(send_pkt_to_client(tun, conn, pkt_buf, hdr_len + seg_len, gso_size, owned) != 0)
       return -1;
+
+    conn->tcp.zdtun_seq += seg_len;
+    conn->tcp.window_size -= seg_len;
+    sofar += seg_len;
+  }
+
+  if(conn->tcp.window_size == 0) {
+    log_tcp_window("[%d] Zero window size detected [l4=%d], disabling socket",
+      conn->tuple.src_port, l4_len);
+
+    // stop receiving updates for the socket, until the TCP window is updated
+    conn_set_events(tun, conn, conn->ev_mask & ~ZDTUN_EV_READ);
+    instr_drop(tun, ZDTUN_DROP_ZERO_WINDOW);
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+static int handle_tcp_reply(zdtun_t *tun, zdtun_conn_t *conn) {
+  int hdrs_len = zdtun_iphdr_len(tun, conn) + TCP_HEADER_LEN;
+  char *pkt_buf = tun->reply_buf;
+  int bufsize = REPLY_BUF_SIZE;
+  int max_recv = conn->tcp.mss;
+  uint8_t owned = 0;
+
+  if(tun->callbacks.alloc_buf && !socks5_in_progress(conn)) {
+    // zero-copy: receive the payload straight into a caller buffer
+    int size = 0;
+    char *buf = tun->callbacks.alloc_buf(tun, &size);
+
+    if(buf && (size > hdrs_len)) {
+      pkt_buf = buf;
+      bufsize = min(size, REPLY_BUF_SIZE);
+      owned = 1;
+    } else if(buf)
+      tun->callbacks.release_buf(tun, buf);
+  }
+
+  char *payload_ptr = pkt_buf + hdrs_len;
+
+  // with large receives, read as much data as a single buffer can hold
+  if((tun->offload & (ZDTUN_OFFLOAD_TCP_LRO | ZDTUN_OFFLOAD_TCP_GSO)) && !socks5_in_progress(conn))
+    max_recv = bufsize - hdrs_len;
+
+  if(owned) {
+    // the buffer is passed to the client, it cannot be split in place
+    if(!(tun->offload & ZDTUN_OFFLOAD_TCP_GSO))
+      max_recv = min(max_recv, conn->tcp.mss);
+
+    max_recv = min(max_recv, bufsize - hdrs_len);
+  }
+
+  int to_recv = min(conn->tcp.window_size, max_recv);
+
+  if(tun->cfg.conn_pass_budget)
+    to_recv = min(to_recv, tun->cfg.conn_pass_budget);
+
+  // without GSO, the data is sent to the client in MSS sized packets
+  if(tun->cfg.conn_pass_pkts && !(tun->offload & ZDTUN_OFFLOAD_TCP_GSO) &&
+      ((uint64_t)tun->cfg.conn_pass_pkts * conn->tcp.mss < (uint64_t)to_recv))
+    to_recv = tun->cfg.conn_pass_pkts * conn->tcp.mss;
+
+  int l4_len = recv(conn->sock, payload_ptr, to_recv, 0);
+
+  conn_touch(tun, conn);
+
+  if(owned && ((l4_len <= 0) || (conn->tcp.window_size < l4_len)))
+    // not sent to the client, see below
+    tun->callbacks.release_buf(tun, pkt_buf);
+
+  if(l4_len == SOCKET_ERROR)
+    return close_with_socket_error(tun, conn, "TCP recv");
+  else if(l4_len == 0) {
+    debug("Server socket closed");
+
+    if(!conn->tcp.fin_ack_sent) {
+      tcp_socket_fin_ack(tun, conn);
+      conn->tcp.fin_ack_sent = 1;
     }
 
-    safe_alloc(mapping, udp_mapping_t);
-    mapping->key = key;
-    mapping->port = (ipver == 4) ? ((struct sockaddr_in*)&bind_addr)->sin_port : bind_addr.sin6_port;
-    mapping->num_uses = 1;
+    // close the socket, otherwise select will keep triggering
+    // The client communication can still go on (e.g. client sending ACK to FIN+ACK)
+    close_socket(tun, conn);
 
-    HASH_ADD(hh, tun->udp_mappings, key, sizeof(key), mapping);
-  } else if(mapping->num_uses < (uint16_t)-1) {
-    mapping->num_uses++;
-    debug("Reusing UDP port: client=%d, local=%d", htons(conn->tuple.src_port), htons(mapping->port));
+    if(conn->tcp.client_closed)
+      // Both the client and the server have closed, terminate the connection
+      zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+
+    return 0;
+  }
+
+  if(socks5_in_progress(conn)) {
+    int rv = handle_socks5_reply(tun, conn, payload_ptr, l4_len);
+
+    if(rv != 0)
+      return(rv);
+
+    if(conn->ext->socks5_status == SOCKS5_ESTABLISHED) {
+      instr_hist(tun, socks5_handshake_time, conn->instr_start_us);
+
+      // SOCKS5 handshake completed, send the SYN+ACK
+      rv = send_syn_ack(tun, conn);
+    }
+
+    return rv;
+  }
+
+  if(conn->tcp.window_size < l4_len) {
+    error("Invalid state: TCP windows_size < l4_len");
+    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+    return -1;
+  }
+
+  // Since we cannot determine server message bounds, we assume that
+  // message ends when no more data is available in the socket buffer,
+  // i.e. when the recv did not fill the buffer.
+  uint8_t push = (l4_len < to_recv);
+
+  // more data is likely waiting in the socket
+  conn->bulk = !push;
+
+  return send_tcp_data(tun, conn, payload_ptr, l4_len, push, owned);
+}
+
+/* ******************************************************* */
+
+// Sends to the client the l4_len bytes of UDP payload received into pkt_buf,
+// after the space for the IP and UDP headers
+static int send_udp_reply(zdtun_t *tun, zdtun_conn_t *conn, char *pkt_buf, int l4_len, uint8_t from_upstream) {
+  int iphdr_len = zdtun_iphdr_len(tun, conn);
+  char *payload_ptr = pkt_buf + iphdr_len + sizeof(struct udphdr);
+
+  // Reconstruct the UDP header
+  int l3_len = l4_len + sizeof(struct udphdr);
+  struct udphdr *data = (struct udphdr*) (pkt_buf + iphdr_len);
+  data->uh_ulen = htons(l3_len);
+  data->uh_sport = conn->tuple.dst_port;
+
+  // NAT back the UDP port
+  data->uh_dport = conn->tuple.src_port;
+
+  zdtun_make_iphdr(tun, conn, pkt_buf, l3_len);
+
+  // UDP checksum mandatory only for IPv6. Keep it 0 for IPv4 to speed up things.
+  data->uh_sum = 0;
+  if(sock_ipver(tun, conn) != 4)
+    data->uh_sum = reply_l4_checksum(tun, conn, pkt_buf, (char*)data, l3_len, 0);
+
+  int rv = send_pkt_to_client(tun, conn, pkt_buf, iphdr_len + l3_len, 0, 0);
+
+  if(rv == 0) {
+    // ok
+    conn_touch(tun, conn);
+
+    if(!from_upstream) {
+      // answered from the DNS cache, no need to keep a conn without a socket
+      if((conn->status == CONN_STATUS_NEW) && !conn_pending_queries(conn) && !conn_cache_waits(conn))
+        zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+    } else {
+      // before check_dns_cache_reply, which reuses reply_buf to answer the waiters
+      check_dns_purge(tun, conn, payload_ptr, l4_len);
+
+      if(tun->dns_cache.max_entries)
+        check_dns_cache_reply(tun, conn, payload_ptr, l4_len);
+    }
+  }
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+static int handle_udp_reply(zdtun_t *tun, zdtun_conn_t *conn) {
+  int hdrs_len = zdtun_iphdr_len(tun, conn) + sizeof(struct udphdr);
+  int l4_len = recv(conn->sock, tun->reply_buf + hdrs_len, REPLY_BUF_SIZE - hdrs_len, 0);
+
+  if(l4_len == SOCKET_ERROR) {
+    close_with_socket_error(tun, conn, "UDP recv");
+    return -1;
+  }
+
+  return send_udp_reply(tun, conn, tun->reply_buf, l4_len, 1);
+}
+
+/* ******************************************************* */
+
+// Reads the datagrams of a shared UDP socket (see bind_shared_udp), using
+// recvmmsg when available. Each datagram is delivered to the connection
+// matching its source address.
+static int handle_shared_udp_reply(zdtun_t *tun, udp_mapping_t *mapping) {
+  uint8_t ipver = mapping->key.ipver;
+  int hdrs_len = ((ipver == 4) ? IPV4_HEADER_LEN : IPV6_HEADER_LEN) + UDP_HEADER_LEN;
+  struct sockaddr_in6 addrs[UDP_RECV_BATCH];
+  int lens[UDP_RECV_BATCH];
+  int num_msgs;
+
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[UDP_RECV_BATCH];
+  struct iovec iovs[UDP_RECV_BATCH];
+
+  memset(msgs, 0, sizeof(msgs));
+
+  for(int i = 0; i < UDP_RECV_BATCH; i++) {
+    iovs[i].iov_base = tun->udp_rx_bufs + (size_t)i * REPLY_BUF_SIZE + hdrs_len;
+    iovs[i].iov_len = REPLY_BUF_SIZE - hdrs_len;
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  unsigned int max_msgs = UDP_RECV_BATCH;
+
+  if(tun->cfg.conn_pass_pkts && (tun->cfg.conn_pass_pkts < max_msgs))
+    max_msgs = tun->cfg.conn_pass_pkts;
+
+  num_msgs = recvmmsg(mapping->sock, msgs, max_msgs, MSG_DONTWAIT, NULL);
+
+  if((num_msgs < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+    return 0;
+
+  for(int i = 0; i < num_msgs; i++)
+    lens[i] = msgs[i].msg_len;
+#else
+  socklen_t addrlen = sizeof(addrs[0]);
+
+  lens[0] = recvfrom(mapping->sock, tun->udp_rx_bufs + hdrs_len, REPLY_BUF_SIZE - hdrs_len, 0,
+    (struct sockaddr*) &addrs[0], &addrlen);
+  num_msgs = (lens[0] == SOCKET_ERROR) ? SOCKET_ERROR : 1;
+#endif
+
+  if(num_msgs == SOCKET_ERROR) {
+    // the connections will fail on the next sendto
+    error("Shared UDP socket recv failed[%d]: %s", socket_errno, strerror(socket_errno));
+    close_shared_udp(tun, mapping);
+    return 0;
+  }
+
+  for(int i = 0; i < num_msgs; i++) {
+    zdtun_5tuple_t tuple;
+    zdtun_conn_t *conn;
+
+    memset(&tuple, 0, sizeof(tuple));
+    tuple.ipver = ipver;
+    tuple.ipproto = IPPROTO_UDP;
+    tuple.src_ip = mapping->key.client_ip;
+    tuple.src_port = mapping->key.client_port;
+
+    if(ipver == 4) {
+      struct sockaddr_in *addr4 = (struct sockaddr_in*) &addrs[i];
+
+      tuple.dst_ip.ip4 = addr4->sin_addr.s_addr;
+      tuple.dst_port = addr4->sin_port;
+    } else {
+      tuple.dst_ip.ip6 = addrs[i].sin6_addr;
+      tuple.dst_port = addrs[i].sin6_port;
+    }
+
+    conn = flowtable_find(&tun->conn_table, &tuple);
+
+    // like a connected socket, drop the datagrams of unknown peers
+    if(!conn || (conn->status >= CONN_STATUS_CLOSED) || (conn->udp.shared != mapping)) {
+      debug("Dropping shared UDP datagram from an unknown peer");
+      continue;
+    }
+
+    send_udp_reply(tun, conn, tun->udp_rx_bufs + (size_t)i * REPLY_BUF_SIZE, lens[i], 1);
   }
 
   return 0;
@@ -1468,554 +4136,725 @@ static int bind_and_connect_udp(zdtun_t *tun, zdtun_conn_t *conn) {
 
 /* ******************************************************* */
 
-static int handle_udp_fwd(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
-  struct udphdr *data = pkt->udp;
-  uint8_t ipver = sock_ipver(tun, conn);
-  int family = (ipver == 4) ? PF_INET : PF_INET6;
+static int handle_tcp_connect_async(zdtun_t *tun, zdtun_conn_t *conn) {
+  int optval = -1;
+  socklen_t optlen = sizeof (optval);
+  int rv = 0;
+
+  if(getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, (char*)&optval, &optlen) == SOCKET_ERROR) {
+    error("getsockopt failed: %d", socket_errno);
+
+    zdtun_conn_close(tun, conn, CONN_STATUS_SOCKET_ERROR);
+    rv = -1;
+  } else {
+    if(optval == 0) {
+      debug("TCP non-blocking socket connected");
+      rv = tcp_socket_syn(tun, conn);
+      conn_touch(tun, conn);
+    } else {
+#ifndef WIN32
+      errno = optval;
+#endif
+      close_with_socket_error(tun, conn, "TCP non-blocking connect");
+      rv = -1;
+    }
+  }
+
+  return rv;
+}
+
+/* ******************************************************* */
+
+#ifdef HAVE_MSG_ZEROCOPY
+
+// Accounts a completion of the MSG_ZEROCOPY sends [lo, hi] to an item. The
+// ids of the sends referencing the item are consecutive, as it's sent from the
+// head of the TX queue. Returns 1 when the kernel no longer references it.
+static int zc_complete(tcp_data_t *item, uint32_t lo, uint32_t hi) {
+  // the ids wrap around, compare them relative to lo
+  int32_t first = (int32_t)(item->zc_first - lo);
+  int32_t last = (int32_t)(item->zc_last - lo);
+  int32_t range = (int32_t)(hi - lo);
+
+  if(item->zc_refs == 0)
+    return 0;
+
+  first = max(first, 0);
+  last = min(last, range);
+
+  if(last >= first)
+    item->zc_refs -= min((uint32_t)(last - first + 1), (uint32_t)item->zc_refs);
 
-  if(conn->status == CONN_STATUS_NEW) {
-    debug("Allocating new UDP socket for port %d", ntohs(data->uh_sport));
+  return(item->zc_refs == 0);
+}
 
-    socket_t udp_sock = open_socket(tun, family, SOCK_DGRAM, IPPROTO_UDP);
-    if(udp_sock == INVALID_SOCKET) {
-      error("Cannot create UDP socket[%d]", socket_errno);
-      return -1;
-    }
+/* ******************************************************* */
 
-    conn->sock = udp_sock;
+// Reads the MSG_ZEROCOPY completions from the socket error queue and releases
+// the pending items no longer referenced by the kernel. head is the item at the
+// top of the TX queue, which may be partially sent, NULL if closed. Returns 1
+// if the kernel copied the data.
+static int read_zerocopy_completions(zdtun_t *tun, socket_t sock, tcp_data_t **pending, tcp_data_t *head) {
+  char control[128];
+  int copied = 0;
 
-    // Check for broadcasts/multicasts
-    if(ipver == 4) {
-      if(conn->tuple.dst_ip.ip4 == INADDR_BROADCAST) {
-        int on = 1;
+  while(1) {
+    struct msghdr msg = {0};
 
-        debug("UDP4 broadcast detected");
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
 
-        if(setsockopt(udp_sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)))
-          error("UDP setsockopt SO_BROADCAST failed[%d]: %s", errno, strerror(errno));
-      }
-    } else {
-      // Adapted from netguard/udp.c
-      if(conn->tuple.dst_ip.ip6.s6_addr[0] == 0xFF) {
-        debug("UDP6 broadcast detected");
+    if(recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
 
-        int loop = 1; // true
-        if(setsockopt(udp_sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)))
-          error("UDP setsockopt IPV6_MULTICAST_LOOP failed[%d]: %s",
-                  errno, strerror(errno));
+    for(struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if(!((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR)) &&
+          !((cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR)))
+        continue;
 
-        int ttl = -1; // route default
-        if(setsockopt(udp_sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)))
-          error("UDP setsockopt IPV6_MULTICAST_HOPS failed[%d]: %s",
-                  errno, strerror(errno));
+      struct sock_extended_err *serr = (struct sock_extended_err*) CMSG_DATA(cm);
 
-        struct ipv6_mreq mreq6;
-        memcpy(&mreq6.ipv6mr_multiaddr, &conn->tuple.dst_ip.ip6, 16);
-        mreq6.ipv6mr_interface = INADDR_ANY;
+      if((serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || (serr->ee_errno != 0))
+        continue;
 
-        if(setsockopt(udp_sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq6, sizeof(mreq6)))
-          error("UDP setsockopt IPV6_ADD_MEMBERSHIP failed[%d]: %s",
-                  errno, strerror(errno));
-      }
-    }
+      if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        copied = 1;
 
-    // TODO exclude broadcast/multicast addresses?
-    if(bind_and_connect_udp(tun, conn) < 0)
-      return -1;
+      uint32_t lo = serr->ee_info;
+      uint32_t hi = serr->ee_data;
+      tcp_data_t **prev = pending;
 
-    conn->status = CONN_STATUS_CONNECTED;
-  }
+      // still in the TX queue, freed once fully sent
+      if(head)
+        zc_complete(head, lo, hi);
 
-  if(tun->callbacks.account_packet)
-    tun->callbacks.account_packet(tun, pkt, 1 /* to zdtun */, conn);
+      while(*prev) {
+        tcp_data_t *item = *prev;
 
-  if(send(conn->sock, pkt->l7, pkt->l7_len, 0) < 0) {
-    close_with_socket_error(tun, conn, "UDP sendto");
-    return 0;
+        if(zc_complete(item, lo, hi)) {
+          *prev = item->next;
+          free_tcp_data(tun, item);
+        } else
+          prev = &item->next;
+      }
+    }
   }
 
-  check_dns_request(conn, pkt->l7, pkt->l7_len);
-
-  return 0;
+  return copied;
 }
 
 /* ******************************************************* */
 
-/* NOTE: a collision may occure between ICMP packets seq from host and tunneled packets, we ignore it */
-static int handle_icmp_fwd(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
-  struct icmphdr *data = pkt->icmp;
-  const uint16_t icmp_len = pkt->l4_hdr_len + pkt->l7_len;
+static void handle_zerocopy_completions(zdtun_t *tun, zdtun_conn_t *conn) {
+  // the kernel copied the data anyway (e.g. on loopback), stop pinning the pages
+  if(read_zerocopy_completions(tun, conn->sock, &conn->ext->zc_pending, conn->tcp.tx_queue))
+    conn->tcp.zerocopy = 0;
+}
 
-  if(conn->status == CONN_STATUS_NEW) {
-    int family = (sock_ipver(tun, conn) == 4) ? PF_INET : PF_INET6;
-    int proto = (family == PF_INET) ? IPPROTO_ICMP : IPPROTO_ICMPV6;
+/* ******************************************************* */
 
-    /*
-     * Either a SOCK_RAW or SOCK_DGRAM can be used. The SOCK_DGRAM, however, does not require root
-     * privileges, so it is a better choice (also for Android). See https://lwn.net/Articles/443051
-     * for more details.
-     *
-     * However the SOCK_DGRAM:
-     *  - Contrary to the RAW socket, requires a separate socket per ICMP connection.
-     *  - The reply received via recv misses the IP header.
-     *  - Does not honor all the ICMP header fields (e.g. the ICMP echo ID).
-     */
-    socket_t icmp_sock = open_socket(tun, family, SOCK_DGRAM, proto);
-    debug("Allocating new ICMP socket for id %d", ntohs(data->un.echo.id));
+// Called when closing a connection. Closing the socket would stop the
+// completions of the MSG_ZEROCOPY sends still referencing the zc_pending
+// buffers, so the socket is kept until they complete, see
+// purge_zerocopy_lingering.
+static void linger_zerocopy(zdtun_t *tun, zdtun_conn_t *conn) {
+  tcp_data_t *head = conn->tcp.tx_queue;
+  zc_linger_t *linger;
 
-    if(icmp_sock == INVALID_SOCKET) {
-      error("Cannot create ICMP socket[%d]", socket_errno);
-      conn->status = CONN_STATUS_SOCKET_ERROR;
-      return -1;
-    }
+  // a partially sent head may be referenced too
+  if(head && head->zc_refs) {
+    conn->tcp.tx_queue = head->next;
 
-    conn->sock = icmp_sock;
-    conn->status = CONN_STATUS_CONNECTED;
-    conn->tuple.src_port = data->un.echo.id;
-  }
+    if(!conn->tcp.tx_queue)
+      conn->tcp.tx_queue_tail = NULL;
 
-  debug("ICMP.fw[len=%u] id=%d seq=%d type=%d code=%d", icmp_len, data->un.echo.id,
-          data->un.echo.sequence, data->type, data->code);
+    head->next = conn->ext->zc_pending;
+    conn->ext->zc_pending = head;
+  }
 
-  if(tun->callbacks.account_packet)
-    tun->callbacks.account_packet(tun, pkt, 1 /* to zdtun */, conn);
+  handle_zerocopy_completions(tun, conn);
 
-  struct sockaddr_in6 servaddr = {0};
-  socklen_t addrlen;
-  fill_conn_sockaddr(tun, conn, &servaddr, &addrlen);
+  if(!conn->ext->zc_pending)
+    return;
 
-  if(sendto(conn->sock, data, icmp_len, 0, (struct sockaddr*)&servaddr, addrlen) < 0) {
-    close_with_socket_error(tun, conn, "ICMP sendto");
-    return -1;
+  if(!(linger = malloc(sizeof(zc_linger_t)))) {
+    error("zc_linger_t alloc failed");
+    return;
   }
 
-  return 0;
+  // the queued data is still sent, followed by the FIN
+  conn_set_events(tun, conn, 0);
+  shutdown(conn->sock, SHUT_RDWR);
+
+  linger->sock = conn->sock;
+  linger->pending = conn->ext->zc_pending;
+  linger->since = zdtun_now(tun);
+  linger->next = tun->zc_lingering;
+  tun->zc_lingering = linger;
+
+  conn->sock = INVALID_SOCKET;
+  conn->ext->zc_pending = NULL;
 }
 
 /* ******************************************************* */
 
-int zdtun_forward(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
-  int rv = 0;
+// Closes the lingering sockets, once their MSG_ZEROCOPY sends complete. On
+// timeout or when forced, the socket is reset, which discards its send queue
+// and so the kernel references to the buffers, before releasing them.
+static void purge_zerocopy_lingering(zdtun_t *tun, uint8_t force) {
+  zc_linger_t **prev = &tun->zc_lingering;
+  time_t now = zdtun_now(tun);
 
-  if(conn->status >= CONN_STATUS_CLOSED) {
-    debug("Refusing to forward closed connection");
-    return 0;
-  }
+  while(*prev) {
+    zc_linger_t *linger = *prev;
 
-  switch(pkt->tuple.ipproto) {
-    case IPPROTO_TCP:
-      rv = handle_tcp_fwd(tun, pkt, conn);
-      break;
-    case IPPROTO_UDP:
-      rv = handle_udp_fwd(tun, pkt, conn);
-      break;
-    case IPPROTO_ICMP:
-      rv = handle_icmp_fwd(tun, pkt, conn);
-      break;
-    default:
-      error("Ignoring unhandled IP protocol %d", pkt->tuple.ipproto);
-      return -2;
-  }
+    read_zerocopy_completions(tun, linger->sock, &linger->pending, NULL);
 
-  if(rv == 0) {
-    conn->tstamp = zdtun_now(tun);
+    if(linger->pending && !force && (now < (linger->since + ZC_LINGER_TIMEOUT))) {
+      prev = &linger->next;
+      continue;
+    }
 
-    if(conn->status == CONN_STATUS_NEW)
-      error("Connection status must not be CONN_STATUS_NEW here!");
-  }
+    if(linger->pending) {
+      struct linger lo = {1, 0};
+      tcp_data_t *cur = linger->pending;
 
-  return rv;
+      debug("MSG_ZEROCOPY completions timeout, resetting the socket");
+      setsockopt(linger->sock, SOL_SOCKET, SO_LINGER, &lo, sizeof(lo));
+      release_socket(tun, linger->sock);
+
+      while(cur) {
+        tcp_data_t *next = cur->next;
+        free_tcp_data(tun, cur);
+        cur = next;
+      }
+    } else
+      release_socket(tun, linger->sock);
+
+    *prev = linger->next;
+    free(linger);
+  }
 }
 
+#endif
+
 /* ******************************************************* */
 
-zdtun_conn_t* zdtun_easy_forward(zdtun_t *tun, const char *pkt_buf, int pkt_len) {
-  zdtun_pkt_t pkt;
+static int handle_queued_tcp_data(zdtun_t *tun, zdtun_conn_t *conn) {
+  uint32_t budget = tun->cfg.conn_pass_budget;
+  uint32_t max_sends = tun->cfg.conn_pass_pkts;
+  uint32_t num_sends = 0;
+  int sent = 0;
 
-  if(zdtun_parse_pkt(tun, pkt_buf, pkt_len, &pkt) != 0) {
-    debug("zdtun_easy_forward: zdtun_parse_pkt failed");
-    return NULL;
-  }
+  // the rest of the queue is sent in the next passes. The sends are also
+  // limited, as a queue of small segments can take many sends
+  while(conn->tcp.tx_queue && (!budget || ((uint32_t)sent < budget)) &&
+      (!max_sends || (num_sends++ < max_sends))) {
+    struct iovec iov[MAX_TX_IOVECS];
+    struct msghdr msg = {0};
+    tcp_data_t *item = conn->tcp.tx_queue;
+    int to_send = 0;
+    int flags = MSG_MORE;
+    uint8_t all_owned = 1;
+    uint8_t zerocopy = 0;
+
+    // Batch the chunks up to the first TH_PUSH one
+    while(item && (msg.msg_iovlen < MAX_TX_IOVECS)) {
+      iov[msg.msg_iovlen].iov_base = item->ptr + item->sofar;
+      iov[msg.msg_iovlen].iov_len = item->len - item->sofar;
+      to_send += item->len - item->sofar;
+      all_owned &= (item->owned != NULL);
+      msg.msg_iovlen++;
+
+      if(item->flags & TH_PUSH) {
+        flags = 0;
+        break;
+      }
 
-  if(pkt.flags & ZDTUN_PKT_IS_FRAGMENT) {
-    debug("TCP: ignoring fragmented IP");
-    return NULL;
-  }
+      item = item->next;
+    }
 
-  uint8_t is_tcp_established = ((pkt.tuple.ipproto == IPPROTO_TCP) &&
-    (!(pkt.tcp->th_flags & TH_SYN) || (pkt.tcp->th_flags & TH_ACK)));
+    msg.msg_iov = iov;
 
-  zdtun_conn_t *conn = zdtun_lookup(tun, &pkt.tuple, !is_tcp_established);
+#ifdef HAVE_MSG_ZEROCOPY
+    // Only the caller buffers can be pinned until the kernel completes the
+    // send, the TX chunks are reused as soon as they are sent
+    if(conn->tcp.zerocopy && all_owned && (to_send >= MIN_ZEROCOPY_SIZE)) {
+      flags |= MSG_ZEROCOPY;
+      zerocopy = 1;
+    }
+#endif
 
-  if(!conn) {
-    if(is_tcp_established) {
-      debug("TCP: ignoring non SYN connection");
-    } else {
-      debug("zdtun_lookup failed");
+    // MSG_MORE buffers packets until the TH_PUSH is set
+    // Use MSG_DONTWAIT to avoid blocking on large uploads
+    int rv = sendmsg(conn->sock, &msg, flags | MSG_DONTWAIT);
+
+    if(rv < 0) {
+      if((errno != EWOULDBLOCK) && (errno != EAGAIN))
+        return close_with_socket_error(tun, conn, "TCP send");
+
+      debug("EAGAIN hit");
+      instr_drop(tun, ZDTUN_DROP_TX_EAGAIN);
+
+      // the buffer is full, see get_available_sndbuf
+      conn->tcp.sndbuf_used = conn->tcp.sndbuf;
+      break;
     }
 
-    return NULL;
-  }
+    int partial = (rv != to_send);
+    uint32_t zc_id = 0;
+    sent += rv;
 
-  if(zdtun_forward(tun, &pkt, conn) != 0) {
-    debug("zdtun_forward failed");
+    if(zerocopy) {
+      // the kernel numbers the zerocopy sends of the socket
+      zc_id = conn->ext->zc_next_id++;
+      conn->tcp.zc_used = 1;
+    }
 
-    /* Close the connection as soon an any error occurs */
-    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
-    return NULL;
-  }
+    conn->tcp.sndbuf_used = partial ? conn->tcp.sndbuf : (conn->tcp.sndbuf_used + rv);
 
-  return conn;
-}
+    if(partial)
+      log_partial_send("TCP partial send: sent %d, still remaining %d", rv, to_send - rv);
 
-/* ******************************************************* */
+    // Release the fully sent chunks
+    while(rv > 0) {
+      item = conn->tcp.tx_queue;
 
-static int handle_icmp_reply(zdtun_t *tun, zdtun_conn_t *conn) {
-  int iphdr_len = zdtun_iphdr_len(tun, conn);
-  int icmp_len = recv(conn->sock, tun->reply_buf + iphdr_len,
-          REPLY_BUF_SIZE - iphdr_len, 0);
+      int remaining = item->len - item->sofar;
 
-  if(icmp_len == SOCKET_ERROR) {
-    close_with_socket_error(tun, conn, "ICMP recv");
-    return -1;
-  }
+      if(zerocopy) {
+        // referenced by the kernel until the completion of zc_id
+        if(!item->zc_refs)
+          item->zc_first = zc_id;
 
-  if(icmp_len < sizeof(struct icmphdr)) {
-    error("ICMP packet too small[%d]", icmp_len);
-    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
-    return -1;
-  }
+        item->zc_last = zc_id;
+        item->zc_refs++;
+      }
 
-  struct icmphdr *data = (struct icmphdr*) &tun->reply_buf[iphdr_len];
+      if(rv < remaining) {
+        item->sofar += rv;
+        break;
+      }
 
-  if((data->type != ICMP_ECHO) && (data->type != ICMP_ECHOREPLY) &&
-	  (data->type != ICMPv6_ECHO) && (data->type != ICMPv6_ECHOREPLY)) {
-    debug("Discarding unsupported ICMP[%d]", data->type);
-    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
-    return 0;
+      rv -= remaining;
+      conn->tcp.tx_queue = item->next;
+
+      if(item->zc_refs) {
+        // released by handle_zerocopy_completions
+        item->next = conn->ext->zc_pending;
+        conn->ext->zc_pending = item;
+      } else
+        free_tcp_data(tun, item);
+    }
+
+    if(!conn->tcp.tx_queue)
+      conn->tcp.tx_queue_tail = NULL;
+
+    if(partial)
+      break;
   }
 
-  // Reset the correct ID (the kernel changes it)
-  data->un.echo.id = conn->tuple.echo_id;
+  if(!conn->tcp.tx_queue)
+    // no more data to send
+    conn_set_events(tun, conn, conn->ev_mask & ~ZDTUN_EV_WRITE);
+  else
+    conn->bulk = 1;
 
-  debug("ICMP.re[len=%d] id=%d seq=%d type=%d code=%d", icmp_len, data->un.echo.id,
-          data->un.echo.sequence, data->type, data->code);
+  if(sent > 0) {
+    // ACK the sent packets
+    conn->tcp.client_seq += sent;
+    conn->tcp.tx_queue_size -= sent;
+    build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
 
-  conn->tstamp = zdtun_now(tun);
+    if(send_to_client(tun, conn, TCP_HEADER_LEN) < 0)
+      return -1;
+  }
 
-  uint8_t ipver = sock_ipver(tun, conn);
+  return 0;
+}
 
-  data->checksum = 0;
-  if(ipver == 4)
-    data->checksum = ~calc_checksum(data->checksum, (u_int8_t*)data, icmp_len);
+/* ******************************************************* */
 
-  zdtun_make_iphdr(tun, conn, tun->reply_buf, icmp_len);
+// Handles the socket events of a connection. The handlers set conn->bulk when
+// the connection has more data than what was handled in this pass: the bulk
+// connections are served after the others in the next pass, which keeps the
+// latency of the interactive flows (e.g. DNS) low during large transfers.
+static int handle_conn_event(zdtun_t *tun, zdtun_conn_t *conn, uint8_t readable, uint8_t writable) {
+  uint8_t ipproto = conn->tuple.ipproto;
+  int rv = 0;
 
-  if(ipver == 6)
-    data->checksum = zdtun_l3_checksum(tun, conn, tun->reply_buf, (char*)data, icmp_len);
+  conn->bulk = 0;
 
-  return send_to_client(tun, conn, icmp_len);
+  if(readable) {
+    if(ipproto == IPPROTO_TCP)
+      rv = handle_tcp_reply(tun, conn);
+    else if(ipproto == IPPROTO_UDP)
+      rv = handle_udp_reply(tun, conn);
+    else if(ipproto == IPPROTO_ICMP)
+      rv = handle_icmp_reply(tun, conn);
+    else
+      error("Unhandled socket.rd proto: %d", ipproto);
+  } else if(writable) {
+    if(ipproto == IPPROTO_TCP) {
+      if(conn->tcp.tx_queue)
+        rv = handle_queued_tcp_data(tun, conn);
+      else
+        rv = handle_tcp_connect_async(tun, conn);
+    } else
+      error("Unhandled socket.wr proto: %d", ipproto);
+  }
+
+  return rv;
 }
 
 /* ******************************************************* */
 
-static int handle_tcp_reply(zdtun_t *tun, zdtun_conn_t *conn) {
-  int iphdr_len = zdtun_iphdr_len(tun, conn);
-  char *payload_ptr = tun->reply_buf + iphdr_len + TCP_HEADER_LEN;
-  int to_recv = min(conn->tcp.window_size, conn->tcp.mss);
-  int l4_len = recv(conn->sock, payload_ptr, to_recv, 0);
-
-  conn->tstamp = zdtun_now(tun);
+// Records the error of a connection handler. Returns 1 if the pass must be
+// interrupted, see continue_on_error.
+static int pass_error(zdtun_t *tun, int *pass_rv, int rv) {
+  if(rv == 0)
+    return 0;
 
-  if(l4_len == SOCKET_ERROR)
-    return close_with_socket_error(tun, conn, "TCP recv");
-  else if(l4_len == 0) {
-    debug("Server socket closed");
+  if(*pass_rv == 0)
+    *pass_rv = rv;
 
-    if(!conn->tcp.fin_ack_sent) {
-      tcp_socket_fin_ack(tun, conn);
-      conn->tcp.fin_ack_sent = 1;
-    }
+  return !tun->cfg.continue_on_error;
+}
 
-    // close the socket, otherwise select will keep triggering
-    // The client communication can still go on (e.g. client sending ACK to FIN+ACK)
-    close_socket(tun, conn->sock);
-    conn->sock = INVALID_SOCKET;
+/* ******************************************************* */
 
-    if(conn->tcp.client_closed)
-      // Both the client and the server have closed, terminate the connection
-      zdtun_conn_close(tun, conn, CONN_STATUS_CLOSED);
+#ifdef HAVE_EPOLL
 
+static int handle_epoll_conn_event(zdtun_t *tun, zdtun_conn_t *conn, uint32_t evs) {
+  // the socket may have been closed while handling a previous event
+  if(conn->sock == INVALID_SOCKET)
     return 0;
+
+#ifdef HAVE_MSG_ZEROCOPY
+  if((evs & EPOLLERR) && (conn->tuple.ipproto == IPPROTO_TCP) && conn->tcp.zc_used) {
+    // the completions are reported as errors, the socket errors also set EPOLLHUP
+    handle_zerocopy_completions(tun, conn);
+    evs &= ~EPOLLERR;
   }
+#endif
 
-  if(socks5_in_progress(conn)) {
-    int rv = handle_socks5_reply(tun, conn, payload_ptr, l4_len);
+  // error conditions are reported as both readable and writable, like select does
+  return handle_conn_event(tun, conn,
+    (conn->ev_mask & ZDTUN_EV_READ) && (evs & (EPOLLIN | EPOLLERR | EPOLLHUP)),
+    (conn->ev_mask & ZDTUN_EV_WRITE) && (evs & (EPOLLOUT | EPOLLERR | EPOLLHUP)));
+}
 
-    if(rv != 0)
-      return(rv);
+/* ******************************************************* */
 
-    if(conn->socks5_status == SOCKS5_ESTABLISHED) {
-      // SOCKS5 handshake completed, send the SYN+ACK
-      rv = send_syn_ack(tun, conn);
-    }
+static int handle_epoll_events(zdtun_t *tun, int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS_PER_PASS];
+  int num_events = epoll_wait(tun->event_fd, events, MAX_EVENTS_PER_PASS, timeout_ms);
 
-    return rv;
-  }
+  if(num_events < 0) {
+    if(errno == EINTR)
+      return 0;
 
-  if(conn->tcp.window_size < l4_len) {
-    error("Invalid state: TCP windows_size < l4_len");
-    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
+    error("epoll_wait failed[%d]: %s", errno, strerror(errno));
     return -1;
   }
 
-  int flags = TH_ACK;
-
-#ifndef WIN32
-  // Since we cannot determine server message bounds, we assume that
-  // message ends when no more data is available in the socket buffer.
-  int count = 0;
-  ioctl(conn->sock, FIONREAD, &count);
+  int rv = 0;
+  int num_bulk = 0;
+  instr_start(start_us);
 
-  if(count == 0)
-    flags |= TH_PUSH;
-#endif
+  // handling a connection can destroy other ones, see destroy_conn
+  tun->pass_events = events;
+  tun->num_pass_events = num_events;
 
-  // NAT back the TCP port and reconstruct the TCP header
-  build_reply_tcpip(tun, conn, flags, l4_len, 0);
+  for(int i = 0; i < num_events; i++) {
+    zdtun_conn_t *conn = (zdtun_conn_t*) events[i].data.ptr;
+    uint32_t evs = events[i].events;
 
-  if(send_to_client(tun, conn, l4_len + TCP_HEADER_LEN) == 0) {
-    conn->tcp.zdtun_seq += l4_len;
-    conn->tcp.window_size -= l4_len;
+    if(!conn)
+      continue;
+    else if((uintptr_t)conn & EV_TAG_UDP_MAPPING) {
+      udp_mapping_t *mapping = (udp_mapping_t*) ((uintptr_t)conn & ~EV_TAG_UDP_MAPPING);
 
-    if(conn->tcp.window_size == 0) {
-      log_tcp_window("[%d] Zero window size detected [l4=%d], disabling socket",
-        conn->tuple.src_port, l4_len);
+      if(mapping->sock != INVALID_SOCKET)
+        handle_shared_udp_reply(tun, mapping);
+      continue;
+    } else if((uintptr_t)conn & EV_TAG_SOCKS5_POOL) {
+      socks5_pooled_t *entry = (socks5_pooled_t*) ((uintptr_t)conn & ~EV_TAG_SOCKS5_POOL);
 
-      // stop receiving updates for the socket, until the TCP window is updated
-      FD_CLR(conn->sock, &tun->all_fds);
+      if(entry->sock != INVALID_SOCKET)
+        handle_socks5_pool_event(tun, entry,
+          (entry->ev_mask & ZDTUN_EV_READ) && (evs & (EPOLLIN | EPOLLERR | EPOLLHUP)),
+          (entry->ev_mask & ZDTUN_EV_WRITE) && (evs & (EPOLLOUT | EPOLLERR | EPOLLHUP)));
+      continue;
     }
-  } else
-    return -1;
 
-  return 0;
-}
+    if(conn->bulk) {
+      // served after the other connections. The handled events are compacted
+      // at the start of the array
+      events[num_bulk++] = events[i];
+      continue;
+    }
 
-/* ******************************************************* */
+    if(pass_error(tun, &rv, handle_epoll_conn_event(tun, conn, evs)))
+      break;
+  }
 
-static int handle_udp_reply(zdtun_t *tun, zdtun_conn_t *conn) {
-  int iphdr_len = zdtun_iphdr_len(tun, conn);
-  char *payload_ptr = tun->reply_buf + iphdr_len + sizeof(struct udphdr);
-  int l4_len = recv(conn->sock, payload_ptr, REPLY_BUF_SIZE-iphdr_len-sizeof(struct udphdr), 0);
+  for(int i = 0; (i < num_bulk) && (!rv || tun->cfg.continue_on_error); i++) {
+    zdtun_conn_t *conn = (zdtun_conn_t*) events[i].data.ptr;
 
-  if(l4_len == SOCKET_ERROR) {
-    close_with_socket_error(tun, conn, "UDP recv");
-    return -1;
+    if(conn && pass_error(tun, &rv, handle_epoll_conn_event(tun, conn, events[i].events)))
+      break;
   }
 
-  // Reconstruct the UDP header
-  int l3_len = l4_len + sizeof(struct udphdr);
-  struct udphdr *data = (struct udphdr*) (tun->reply_buf + iphdr_len);
-  data->uh_ulen = htons(l3_len);
-  data->uh_sport = conn->tuple.dst_port;
+  tun->num_pass_events = 0;
 
-  // NAT back the UDP port
-  data->uh_dport = conn->tuple.src_port;
+  zdtun_flush(tun);
+  flows_export_step(tun);
 
-  zdtun_make_iphdr(tun, conn, tun->reply_buf, l3_len);
+  if(num_events > 0)
+    instr_hist(tun, handle_events_time, start_us);
 
-  // UDP checksum mandatory only for IPv6. Keep it 0 for IPv4 to speed up things.
-  data->uh_sum = 0;
-  if(sock_ipver(tun, conn) != 4)
-    data->uh_sum = zdtun_l3_checksum(tun, conn, tun->reply_buf, (char*)data, l3_len);
+  return (rv != 0) ? rv : num_events;
+}
 
-  int rv = send_to_client(tun, conn, l3_len);
+#endif
 
-  if(rv == 0) {
-    // ok
-    conn->tstamp = zdtun_now(tun);
+/* ******************************************************* */
 
-    check_dns_purge(tun, conn, payload_ptr, l4_len);
-  }
+int zdtun_handle_events(zdtun_t *tun, int timeout_ms) {
+  fd_set rdfds, wrfds;
+  int max_fd, num_ready, rv;
 
-  return rv;
-}
+#ifdef HAVE_EPOLL
+  if(tun->event_fd != INVALID_SOCKET)
+    return handle_epoll_events(tun, timeout_ms);
+#endif
 
-/* ******************************************************* */
+  // select fallback
+  struct timeval tv = {0};
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
 
-static int handle_tcp_connect_async(zdtun_t *tun, zdtun_conn_t *conn) {
-  int optval = -1;
-  socklen_t optlen = sizeof (optval);
-  int rv = 0;
+  zdtun_fds(tun, &max_fd, &rdfds, &wrfds);
+  num_ready = select(max_fd + 1, &rdfds, &wrfds, NULL, (timeout_ms >= 0) ? &tv : NULL);
 
-  if(getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, (char*)&optval, &optlen) == SOCKET_ERROR) {
-    error("getsockopt failed: %d", socket_errno);
+  if(num_ready == SOCKET_ERROR) {
+    if(socket_errno == EINTR)
+      return 0;
 
-    zdtun_conn_close(tun, conn, CONN_STATUS_SOCKET_ERROR);
-    rv = -1;
-  } else {
-    if(optval == 0) {
-      debug("TCP non-blocking socket connected");
-      rv = tcp_socket_syn(tun, conn);
-      conn->tstamp = zdtun_now(tun);
-    } else {
-#ifndef WIN32
-      errno = optval;
-#endif
-      close_with_socket_error(tun, conn, "TCP non-blocking connect");
-      rv = -1;
-    }
-  }
+    error("select failed[%d]", socket_errno);
+    return -1;
+  } else if(num_ready == 0)
+    return 0;
 
-  return rv;
+  if((rv = zdtun_handle_fd(tun, &rdfds, &wrfds)) != 0)
+    return rv;
+
+  return num_ready;
 }
 
 /* ******************************************************* */
 
-static int handle_queued_tcp_data(zdtun_t *tun, zdtun_conn_t *conn) {
-  int sent = 0;
+int zdtun_handle_fd(zdtun_t *tun, const fd_set *rd_fds, const fd_set *wr_fds) {
+  int rv = 0;
+  zdtun_conn_t *conn;
 
-  while(conn->tcp.tx_queue) {
-    tcp_data_t *item = conn->tcp.tx_queue;
+  if(tun->event_fd != INVALID_SOCKET) {
+    if(!FD_ISSET(tun->event_fd, rd_fds))
+      return 0;
 
-    // MSG_MORE buffers packets until the TH_PUSH is set
-    // Use MSG_DONTWAIT to avoid blocking on large uploads
-    int flags = ((item->flags & TH_PUSH) ? 0 : MSG_MORE) | MSG_DONTWAIT;
-    int to_send = item->len - item->sofar;
-    int rv = send(conn->sock, item->data + item->sofar, to_send, flags);
+#ifdef HAVE_EPOLL
+    rv = handle_epoll_events(tun, 0);
+#endif
 
-    if(rv < 0) {
-      if((errno != EWOULDBLOCK) && (errno != EAGAIN))
-        return close_with_socket_error(tun, conn, "TCP send");
+    return (rv < 0) ? rv : 0;
+  }
 
-      debug("EAGAIN hit");
-      break;
-    } else if(rv != to_send) {
-      log_partial_send("TCP partial send: sent %d, still remaining %d", rv, to_send - rv);
+  instr_start(start_us);
 
-      item->sofar += rv;
-      sent += rv;
-      break;
-    } else {
-      sent += to_send;
-      conn->tcp.tx_queue = item->next;
-      free(item);
+  uint32_t num_conns = flowtable_count(&tun->conn_table);
+  uint32_t start = num_conns ? (tun->rr_start++ % num_conns) : 0;
+
+  if(num_conns > tun->ready.size) {
+    zdtun_conn_t **conns = realloc(tun->ready.conns, num_conns * sizeof(zdtun_conn_t*));
+
+    if(!conns) {
+      error("ready connections alloc failed");
+      return -1;
     }
+
+    tun->ready.conns = conns;
+    tun->ready.size = num_conns;
   }
 
-  if(!conn->tcp.tx_queue)
-    // no more data to send
-    FD_CLR(conn->sock, &tun->write_fds);
+  // Snapshot the ready connections, as handling them can destroy connections,
+  // which moves other ones within the table. Each pass starts from a different
+  // connection, so that the table order does not favour some connections.
+  tun->ready.num = 0;
 
-  if(sent > 0) {
-    // ACK the sent packets
-    conn->tcp.client_seq += sent;
-    conn->tcp.tx_queue_size -= sent;
-    build_reply_tcpip(tun, conn, TH_ACK, 0, 0);
+  for(uint32_t k = num_conns; k-- > 0; ) {
+    conn = flowtable_value(&tun->conn_table, (start + k) % num_conns);
 
-    if(send_to_client(tun, conn, TCP_HEADER_LEN) < 0)
-      return -1;
+    if((conn->sock != INVALID_SOCKET) &&
+        (FD_ISSET(conn->sock, rd_fds) || FD_ISSET(conn->sock, wr_fds)))
+      tun->ready.conns[tun->ready.num++] = conn;
   }
 
-  return 0;
-}
+  // The bulk connections are deferred to a second round (see handle_conn_event)
+  // and marked, as the first round can set bulk on the connections it serves.
+  for(int round = 0; (round < 2) && (!rv || tun->cfg.continue_on_error); round++) {
+    for(uint32_t k = 0; k < tun->ready.num; k++) {
+      // destroyed, see destroy_conn
+      if(!(conn = tun->ready.conns[k]))
+        continue;
 
-/* ******************************************************* */
+      if((conn->sock == INVALID_SOCKET) ||
+          (!FD_ISSET(conn->sock, rd_fds) && !FD_ISSET(conn->sock, wr_fds)))
+        continue;
 
-int zdtun_handle_fd(zdtun_t *tun, const fd_set *rd_fds, const fd_set *wr_fds) {
-  int rv = 0;
-  zdtun_conn_t *conn, *tmp;
+      if((round == 0) && conn->bulk) {
+        conn->bulk = BULK_DEFERRED;
+        continue;
+      } else if((round == 1) && (conn->bulk != BULK_DEFERRED))
+        continue;
 
-  HASH_ITER(hh, tun->conn_table, conn, tmp) {
-    uint8_t ipproto = conn->tuple.ipproto;
+      if(pass_error(tun, &rv, handle_conn_event(tun, conn, FD_ISSET(conn->sock, rd_fds),
+          FD_ISSET(conn->sock, wr_fds))))
+        break;
+    }
+  }
 
-    if(conn->sock == INVALID_SOCKET)
-      continue;
+  if((!rv || tun->cfg.continue_on_error) && tun->cfg.udp_shared_sockets) {
+    udp_mapping_t *mapping, *tmp;
 
-    if(FD_ISSET(conn->sock, rd_fds)) {
-      if(ipproto == IPPROTO_TCP)
-        rv = handle_tcp_reply(tun, conn);
-      else if(ipproto == IPPROTO_UDP)
-        rv = handle_udp_reply(tun, conn);
-      else if(ipproto == IPPROTO_ICMP)
-        rv = handle_icmp_reply(tun, conn);
-      else
-        error("Unhandled socket.rd proto: %d", ipproto);
-    } else if(FD_ISSET(conn->sock, wr_fds)) {
-      if(ipproto == IPPROTO_TCP) {
-        if(conn->tcp.tx_queue)
-          rv = handle_queued_tcp_data(tun, conn);
-        else
-          rv = handle_tcp_connect_async(tun, conn);
-      } else
-        error("Unhandled socket.wr proto: %d", ipproto);
+    // the mappings are only freed by zdtun_purge_expired
+    HASH_ITER(hh, tun->udp_mappings, mapping, tmp) {
+      if((mapping->sock != INVALID_SOCKET) && FD_ISSET(mapping->sock, rd_fds))
+        handle_shared_udp_reply(tun, mapping);
     }
+  }
 
-    if(rv != 0)
-      break;
+  if(!rv || tun->cfg.continue_on_error) {
+    // the entries are only freed by zdtun_purge_expired
+    for(socks5_pooled_t *entry = tun->socks5_pool; entry; entry = entry->next) {
+      if(entry->sock != INVALID_SOCKET)
+        handle_socks5_pool_event(tun, entry, FD_ISSET(entry->sock, rd_fds),
+          FD_ISSET(entry->sock, wr_fds));
+    }
   }
 
+  tun->ready.num = 0;
+
+  zdtun_flush(tun);
+  flows_export_step(tun);
+  instr_hist(tun, handle_events_time, start_us);
+
   return rv;
 }
 
 /* ******************************************************* */
 
-// negative, zero, or positive <=> A before, equal to, or after B
-static inline int zdtun_conn_cmp_timestamp_asc(zdtun_conn_t *a, zdtun_conn_t *b) {
-  return(a->tstamp - b->tstamp);
-}
-
 // purges old connections. Harvests the closed connections (set by close_conn)
 // and purges them (assuming no dangling pointers around).
+// Only the closed and expired connections are visited.
 void zdtun_purge_expired(zdtun_t *tun) {
-  zdtun_conn_t *conn, *tmp;
+  zdtun_conn_t *conn;
   time_t now = zdtun_now(tun);
 
-  /* Purge by idleness */
-  HASH_ITER(hh, tun->conn_table, conn, tmp) {
-    time_t timeout = 0;
+  if(tun->num_unused_mappings > 0) {
+    udp_mapping_t *mapping, *tmp;
 
-    switch(conn->tuple.ipproto) {
-    case IPPROTO_TCP:
-      timeout = TCP_TIMEOUT_SEC;
-      break;
-    case IPPROTO_UDP:
-      timeout = UDP_TIMEOUT_SEC;
-      break;
-    case IPPROTO_ICMP:
-      timeout = ICMP_TIMEOUT_SEC;
-      break;
+    // the shared UDP mappings are freed here, when no events can reference them
+    HASH_ITER(hh, tun->udp_mappings, mapping, tmp) {
+      if(mapping->num_uses == 0) {
+        close_shared_udp(tun, mapping);
+        HASH_DELETE(hh, tun->udp_mappings, mapping);
+        free(mapping);
+      }
     }
 
-    if((conn->status >= CONN_STATUS_CLOSED) || (now >= (timeout + conn->tstamp))) {
+    tun->num_unused_mappings = 0;
+  }
+
+  while((conn = tun->conn_lists[CONN_LIST_CLOSED].head))
+    destroy_conn(tun, conn);
+
+  /* Purge by idleness */
+  for(int i = 0; i < CONN_LIST_CLOSED; i++) {
+    time_t timeout = list_timeout(tun, i);
+
+    while((conn = tun->conn_lists[i].head) && (now >= (timeout + conn->tstamp))) {
+      if(i == CONN_LIST_TCP_CONNECTING) {
+        char buf[256];
+
+        // notify the client now, will be destroyed in the next purge
+        log("TCP connect timeout - %s", zdtun_5tuple2str(&conn->tuple, buf, sizeof(buf)));
+        zdtun_conn_close(tun, conn, CONN_STATUS_CONNECT_TIMEOUT);
+        continue;
+      } else if(i == CONN_LIST_PENDING) {
+        debug("Verdict timeout");
+        zdtun_conn_close(tun, conn, CONN_STATUS_VERDICT_TIMEOUT);
+        continue;
+      }
+
       debug("IDLE (type=%d)", conn->tuple.ipproto);
       destroy_conn(tun, conn);
     }
   }
 
-  if(tun->stats.num_open_sockets >= MAX_NUM_SOCKETS) {
-    int to_purge = tun->stats.num_open_sockets - NUM_SOCKETS_AFTER_PURGE;
+  socks5_pool_purge(tun, now);
+
+#ifdef HAVE_MSG_ZEROCOPY
+  if(tun->zc_lingering)
+    purge_zerocopy_lingering(tun, 0);
+#endif
 
-    debug("FORCE PURGE %d items", to_purge);
+  if(tun->stats.num_open_sockets >= tun->cfg.max_sockets)
+    purge_lru(tun, tun->cfg.sockets_after_purge);
 
-    HASH_SORT(tun->conn_table, zdtun_conn_cmp_timestamp_asc);
+  flows_export_step(tun);
+}
 
-    HASH_ITER(hh, tun->conn_table, conn, tmp) {
-      if(to_purge == 0)
-        break;
+/* ******************************************************* */
 
-      destroy_conn(tun, conn);
-      to_purge--;
+int zdtun_next_timeout_ms(zdtun_t *tun) {
+  struct timespec ts;
+  int64_t now_ms;
+  int64_t next_ms = -1;
+
+  if(tun->conn_lists[CONN_LIST_CLOSED].head)
+    return 0;
+
+  // NOTE: must use the same clock as zdtun_now
+  if(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) != 0)
+    return 1000;
+
+  now_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  for(int i = 0; i < CONN_LIST_CLOSED; i++) {
+    zdtun_conn_t *conn = tun->conn_lists[i].head;
+
+    if(conn) {
+      int64_t remaining = ((int64_t)conn->tstamp + list_timeout(tun, i)) * 1000 - now_ms;
+
+      remaining = max(remaining, 0);
+      next_ms = (next_ms < 0) ? remaining : min(next_ms, remaining);
     }
   }
+
+  return (next_ms > INT32_MAX) ? INT32_MAX : (int)next_ms;
 }
 
 /* ******************************************************* */
 
 int zdtun_iter_connections(zdtun_t *tun, zdtun_conn_iterator_t iterator, void *userdata) {
-  zdtun_conn_t *conn, *tmp;
+  // backwards, see zdtun_handle_fd
+  for(uint32_t i = flowtable_count(&tun->conn_table); i-- > 0; ) {
+    if(i >= flowtable_count(&tun->conn_table))
+      continue;
+
+    zdtun_conn_t *conn = flowtable_value(&tun->conn_table, i);
 
-  HASH_ITER(hh, tun->conn_table, conn, tmp) {
     // Do not iterate closed connections. User may have already free some data in
     // on_connection_close so this may lead to invalid memory access.
     if(conn->status < CONN_STATUS_CLOSED) {
@@ -2029,6 +4868,120 @@ int zdtun_iter_connections(zdtun_t *tun, zdtun_conn_iterator_t iterator, void *u
 
 /* ******************************************************* */
 
+zdtun_conn_t* zdtun_conn_next(zdtun_t *tun, zdtun_conn_cursor_t *cursor) {
+  uint32_t num_conns = flowtable_count(&tun->conn_table);
+
+  if(!cursor->started) {
+    cursor->pos = num_conns;
+    cursor->started = 1;
+  }
+
+  // backwards, as zdtun_iter_connections. The destroyed connections are
+  // replaced by the last ones, which were already visited
+  cursor->pos = min(cursor->pos, num_conns);
+
+  while(cursor->pos > 0) {
+    zdtun_conn_t *conn = flowtable_value(&tun->conn_table, --cursor->pos);
+
+    if(conn->status < CONN_STATUS_CLOSED)
+      return(conn);
+  }
+
+  return(NULL);
+}
+
+/* ******************************************************* */
+
+int zdtun_flows_export(zdtun_t *tun, u_int32_t max_flows) {
+  if(tun->flows.exp) {
+    flow_export_destroy(tun->flows.exp);
+    tun->flows.exp = NULL;
+  }
+
+  tun->flows.active = 0;
+  tun->flows.last_publish = 0;
+
+  if(max_flows && !(tun->flows.exp = flow_export_create(max_flows)))
+    return(-1);
+
+  return(0);
+}
+
+/* ******************************************************* */
+
+int zdtun_flows_snapshot(zdtun_t *tun, zdtun_flow_t *flows, u_int32_t max_flows) {
+  if(!tun->flows.exp)
+    return(-1);
+
+  return(flow_export_read(tun->flows.exp, flows, max_flows));
+}
+
+/* ******************************************************* */
+
+// Stages the records of up to FLOWS_EXPORT_BATCH connections, publishing them
+// at the end of the round. The connections with an extension are staged once
+// per round, even if the cursor returns them twice. No extension is allocated
+// here: the rare duplicate of a connection without one is accepted.
+static void flows_export_step(zdtun_t *tun) {
+  zdtun_flow_t *staging;
+  uint32_t capacity;
+
+  if(!tun->flows.exp)
+    return;
+
+  if(!tun->flows.active) {
+    if(zdtun_now(tun) < (tun->flows.last_publish + FLOWS_EXPORT_INTERVAL))
+      return;
+
+    memset(&tun->flows.cursor, 0, sizeof(tun->flows.cursor));
+    tun->flows.staged = 0;
+    // 0 marks the connections never staged
+    if(++tun->flows.round == 0)
+      tun->flows.round = 1;
+    tun->flows.active = 1;
+  }
+
+  staging = flow_export_staging(tun->flows.exp);
+  capacity = flow_export_capacity(tun->flows.exp);
+
+  for(int i = 0; i < FLOWS_EXPORT_BATCH; i++) {
+    zdtun_conn_t *conn = zdtun_conn_next(tun, &tun->flows.cursor);
+
+    if(!conn || (tun->flows.staged == capacity)) {
+      flow_export_publish(tun->flows.exp, tun->flows.staged);
+      tun->flows.active = 0;
+      tun->flows.last_publish = zdtun_now(tun);
+      return;
+    }
+
+    // allocated by account_pkt for the accounted connections
+    conn_ext_t *ext = conn->ext;
+
+    if(ext && (ext->export_round == tun->flows.round))
+      continue;
+
+    zdtun_flow_t *flow = &staging[tun->flows.staged++];
+
+    flow->tuple = conn->tuple;
+    flow->status = conn->status;
+    flow->last_seen = conn->tstamp;
+
+    if(ext) {
+      ext->export_round = tun->flows.round;
+      flow->pkts_fwd = ext->pkts[1];
+      flow->pkts_reply = ext->pkts[0];
+      flow->bytes_fwd = ext->bytes[1];
+      flow->bytes_reply = ext->bytes[0];
+    } else {
+      // not accounted, e.g. ZDTUN_NO_ACCOUNTING
+      flow->pkts_fwd = flow->pkts_reply = 0;
+      flow->bytes_fwd = flow->bytes_reply = 0;
+    }
+  }
+}
+
+/* ******************************************************* */
+
 int zdtun_get_num_connections(zdtun_t *tun) {
   return(tun->stats.num_tcp_conn + tun->stats.num_udp_conn + tun->stats.num_icmp_conn);
 }
@@ -2037,6 +4990,11 @@ int zdtun_get_num_connections(zdtun_t *tun) {
 
 void zdtun_get_stats(zdtun_t *tun, zdtun_statistics_t *stats) {
   *stats = tun->stats;
+
+  stats->conn_pool_hits = tun->conn_pool.hits;
+  stats->conn_pool_misses = tun->conn_pool.misses;
+  stats->tx_pool_hits = tun->tx_pool.hits;
+  stats->tx_pool_misses = tun->tx_pool.misses;
 }
 
 /* ******************************************************* */
@@ -2056,6 +5014,94 @@ const char* zdtun_proto2str(int ipproto) {
 
 /* ******************************************************* */
 
+int zdtun_get_ext_stats(zdtun_t *tun, zdtun_ext_statistics_t *stats) {
+#ifdef ZDTUN_INSTRUMENTATION
+  *stats = tun->ext_stats;
+  return 0;
+#else
+  memset(stats, 0, sizeof(*stats));
+  return -1;
+#endif
+}
+
+/* ******************************************************* */
+
+void zdtun_get_shards_stats(zdtun_t **shards, int num_shards, zdtun_statistics_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+
+  for(int i = 0; i < num_shards; i++) {
+    zdtun_statistics_t shard;
+
+    zdtun_get_stats(shards[i], &shard);
+
+    stats->num_icmp_conn += shard.num_icmp_conn;
+    stats->num_tcp_conn += shard.num_tcp_conn;
+    stats->num_udp_conn += shard.num_udp_conn;
+    stats->num_icmp_opened += shard.num_icmp_opened;
+    stats->num_tcp_opened += shard.num_tcp_opened;
+    stats->num_udp_opened += shard.num_udp_opened;
+    stats->conn_pool_hits += shard.conn_pool_hits;
+    stats->conn_pool_misses += shard.conn_pool_misses;
+    stats->tx_pool_hits += shard.tx_pool_hits;
+    stats->tx_pool_misses += shard.tx_pool_misses;
+    stats->flow_cache_hits += shard.flow_cache_hits;
+    stats->flow_cache_misses += shard.flow_cache_misses;
+    stats->socks5_pool_hits += shard.socks5_pool_hits;
+    stats->socks5_pool_misses += shard.socks5_pool_misses;
+    stats->num_pending_verdicts += shard.num_pending_verdicts;
+    stats->num_open_sockets += shard.num_open_sockets;
+    stats->all_max_fd = max(stats->all_max_fd, shard.all_max_fd);
+  }
+}
+
+/* ******************************************************* */
+
+// murmur3 finalizer
+static uint32_t mix32(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static uint32_t endpoint_hash(uint8_t ipver, zdtun_ip_t ip, uint16_t port) {
+  uint32_t h = port;
+
+  if(ipver == 4)
+    h ^= ip.ip4;
+  else {
+    uint32_t words[4];
+
+    memcpy(words, &ip.ip6, sizeof(words));
+    h ^= words[0] ^ words[1] ^ words[2] ^ words[3];
+  }
+
+  return mix32(h);
+}
+
+int zdtun_5tuple_shard(const zdtun_5tuple_t *tuple, int num_shards) {
+  uint32_t h;
+
+  if(num_shards <= 1)
+    return 0;
+
+  if(tuple->ipproto == IPPROTO_UDP)
+    // UDP sockets are shared by the client port (see udp_mapping_key), so
+    // all the flows from a client port must be handled by the same shard
+    h = endpoint_hash(tuple->ipver, tuple->src_ip, tuple->src_port);
+  else
+    // symmetric: the sum does not depend on the direction
+    h = endpoint_hash(tuple->ipver, tuple->src_ip, tuple->src_port) +
+      endpoint_hash(tuple->ipver, tuple->dst_ip, tuple->dst_port) + tuple->ipproto;
+
+  return h % num_shards;
+}
+
+/* ******************************************************* */
+
 char* zdtun_5tuple2str(const zdtun_5tuple_t *tuple, char *buf, size_t bufsize) {
   char srcip[INET6_ADDRSTRLEN];
   char dstip[INET6_ADDRSTRLEN];
@@ -2097,9 +5143,17 @@ const char* zdtun_conn_status2str(zdtun_conn_status_t status) {
       return "UNREACHABLE";
     case CONN_STATUS_SOCKS5_ERROR:
       return "SOCKS5_ERROR";
+    case CONN_STATUS_CONNECT_TIMEOUT:
+      return "CONNECT_TIMEOUT";
+    case CONN_STATUS_BLOCKED:
+      return "BLOCKED";
+    case CONN_STATUS_VERDICT_TIMEOUT:
+      return "VERDICT_TIMEOUT";
   }
 
   return "UNKNOWN";
 }
 
+#ifndef ZDTUN_NO_SOCKS5
 #include "socks5.c"
+#endif
@@ -181,10 +181,92 @@ typedef struct zdtun_statistics {
   u_int32_t num_tcp_opened;             ///< total number of TCP connections (since zdtun_init)
   u_int32_t num_udp_opened;             ///< total number of UDP connections (since zdtun_init)
 
+  u_int32_t conn_pool_hits;             ///< connections allocated from the connections pool free list
+  u_int32_t conn_pool_misses;           ///< connections pool allocations which required a new slab
+  u_int32_t tx_pool_hits;               ///< TCP TX buffers served from the buffers pool
+  u_int32_t tx_pool_misses;             ///< TCP TX buffers which required a malloc
+  u_int32_t flow_cache_hits;            ///< zdtun_lookup calls served by the last used connections cache
+  u_int32_t flow_cache_misses;          ///< zdtun_lookup calls which required a connections table lookup
+  u_int32_t socks5_pool_hits;           ///< SOCKS5 connections served by the pool, see zdtun_set_socks5_pool
+  u_int32_t socks5_pool_misses;         ///< SOCKS5 connections which required a new proxy connection, with a pool
+
+  u_int32_t num_pending_verdicts;       ///< current number of connections waiting for zdtun_conn_verdict
   u_int32_t num_open_sockets;           ///< number of opened sockets in zdtun
-  int all_max_fd;                       ///< select nfds value
+  int all_max_fd;                       ///< select nfds value (the event fd when an event backend is used)
 } zdtun_statistics_t;
 
+/*
+ * @brief the reasons of the dropped packets and connections, see zdtun_ext_statistics_t.
+ */
+typedef enum {
+  ZDTUN_DROP_PARSE_ERROR = 0,           ///< packets rejected by zdtun_parse_pkt
+  ZDTUN_DROP_PURGED,                    ///< connections evicted to stay within max_sockets or max_connections
+  ZDTUN_DROP_SEND_CLIENT,               ///< send_client/send_client_batch failures
+  ZDTUN_DROP_ZERO_WINDOW,               ///< TCP socket reads paused by the client zero window
+  ZDTUN_DROP_TX_EAGAIN,                 ///< TCP sends stopped by a full socket buffer
+  ZDTUN_DROP_MAX
+} zdtun_drop_reason_t;
+
+/* zdtun_histogram_t buckets */
+#define ZDTUN_HIST_BUCKETS 24
+
+/*
+ * @brief a histogram of durations. Bucket 0 counts the samples below 1 us,
+ * bucket i the samples in [2^(i-1), 2^i) us, the last one also the longer ones.
+ */
+typedef struct zdtun_histogram {
+  u_int32_t buckets[ZDTUN_HIST_BUCKETS];
+  u_int32_t count;                      ///< number of samples
+  u_int64_t sum_us;                     ///< sum of the samples, in microseconds
+} zdtun_histogram_t;
+
+/* zdtun_ext_statistics_t protocol index */
+#define ZDTUN_STATS_TCP   0
+#define ZDTUN_STATS_UDP   1
+#define ZDTUN_STATS_ICMP  2
+#define ZDTUN_STATS_PROTOS 3
+
+/*
+ * @brief detailed statistics, only collected when zdtun is built with
+ * ZDTUN_INSTRUMENTATION. See zdtun_get_ext_stats.
+ */
+typedef struct zdtun_ext_statistics {
+  u_int64_t pkts_fwd[ZDTUN_STATS_PROTOS];   ///< client packets forwarded, by ZDTUN_STATS_* protocol
+  u_int64_t bytes_fwd[ZDTUN_STATS_PROTOS];  ///< client bytes forwarded (IP packet length)
+  u_int64_t pkts_reply[ZDTUN_STATS_PROTOS]; ///< packets sent to the client (a GSO super segment counts as one)
+  u_int64_t bytes_reply[ZDTUN_STATS_PROTOS];///< bytes sent to the client
+
+  u_int32_t drops[ZDTUN_DROP_MAX];      ///< counters by zdtun_drop_reason_t
+
+  zdtun_histogram_t tcp_connect_time;   ///< from the TCP connect to the socket connected
+  zdtun_histogram_t socks5_handshake_time; ///< from the proxy connected (or taken from the pool) to SOCKS5 established
+  zdtun_histogram_t handle_events_time; ///< time spent handling the ready sockets, per zdtun_handle_fd/zdtun_handle_events pass
+} zdtun_ext_statistics_t;
+
+/*
+ * @brief zdtun instance configuration. See zdtun_init_ex.
+ */
+typedef struct zdtun_config {
+  u_int32_t max_sockets;                ///< max number of open sockets. When reached, the oldest connections are purged
+  u_int32_t sockets_after_purge;        ///< number of open sockets to keep when the oldest connections are purged
+  u_int32_t max_connections;            ///< max number of connections (0 for no limit). When reached, the oldest one is purged
+
+  u_int32_t tcp_timeout;                ///< TCP connections idle timeout, in seconds
+  u_int32_t udp_timeout;                ///< UDP connections idle timeout, in seconds
+  u_int32_t icmp_timeout;               ///< ICMP connections idle timeout, in seconds
+  u_int32_t tcp_connect_timeout;        ///< max time to establish a TCP connection (including SOCKS5), in seconds. 0 to use tcp_timeout
+  u_int8_t tcp_unreachable_icmp;        ///< reply with ICMP host unreachable, instead of TCP RST, to the timed out or unreachable TCP connects
+
+  u_int8_t udp_shared_sockets;          ///< share a single unconnected UDP socket among the connections of a client IP and port
+
+  u_int32_t max_pending_verdicts;       ///< max number of connections waiting for zdtun_conn_verdict. When reached, new pending connections are closed as CONN_STATUS_BLOCKED (on_connection_close is called)
+  u_int32_t verdict_timeout;            ///< max time to wait for zdtun_conn_verdict, in seconds. The connection is then blocked
+
+  u_int32_t conn_pass_budget;           ///< max bytes a connection socket can transfer per zdtun_handle_fd/zdtun_handle_events pass (0 for no limit)
+  u_int32_t conn_pass_pkts;             ///< max packets (TCP sends, TCP segments or UDP datagrams received) a connection socket can transfer per pass (0 for no limit)
+  u_int8_t continue_on_error;           ///< keep handling the other connections of a pass after a connection error, the first error is returned
+} zdtun_config_t;
+
 typedef union zdtun_ip {
   u_int32_t ip4;
   struct in6_addr ip6;
@@ -213,6 +295,16 @@ typedef struct zdtun_conn zdtun_conn_t;
 
 #define ZDTUN_PKT_IS_FRAGMENT 1
 #define ZDTUN_PKT_IS_FIRST_FRAGMENT 2
+#define ZDTUN_PKT_CSUM_PARTIAL 4        ///< the L4 checksum must be completed, see csum_start
+#define ZDTUN_PKT_CSUM_NONE 8           ///< the L4 checksum was not computed
+#define ZDTUN_PKT_GSO 16                ///< a TCP super segment, to be split in gso_size segments
+#define ZDTUN_PKT_OWNED 32              ///< buf comes from alloc_buf, its ownership is passed to the callee
+
+/* Offload flags, see zdtun_set_offload */
+#define ZDTUN_OFFLOAD_CSUM_PARTIAL 0x01
+#define ZDTUN_OFFLOAD_CSUM_NONE 0x02
+#define ZDTUN_OFFLOAD_TCP_LRO 0x04
+#define ZDTUN_OFFLOAD_TCP_GSO 0x08
 
 /*
  * @brief a container for a packet metadata.
@@ -226,6 +318,15 @@ typedef struct zdtun_pkt {
   u_int16_t l4_hdr_len;
   u_int16_t l7_len;
 
+  /* With ZDTUN_PKT_CSUM_PARTIAL, the checksum field (at csum_start + csum_offset)
+   * only contains the pseudo header sum: the consumer must complete it with the
+   * data from csum_start to the end of the packet (e.g. IFF_VNET_HDR NEEDS_CSUM) */
+  u_int16_t csum_start;
+  u_int16_t csum_offset;
+
+  /* With ZDTUN_PKT_GSO, the TCP payload size of each segment (the client MSS) */
+  u_int16_t gso_size;
+
   /* Packet buffer */
   char *buf;
 
@@ -261,8 +362,20 @@ typedef enum {
   CONN_STATUS_RESET,
   CONN_STATUS_UNREACHABLE,
   CONN_STATUS_SOCKS5_ERROR,
+  CONN_STATUS_CONNECT_TIMEOUT,
+  CONN_STATUS_BLOCKED,
+  CONN_STATUS_VERDICT_TIMEOUT,
 } zdtun_conn_status_t;
 
+/*
+ * @brief The verdicts for a new connection, see on_connection_open and zdtun_conn_verdict.
+ */
+typedef enum {
+  ZDTUN_VERDICT_ALLOW = 0,              ///< establish the connection
+  ZDTUN_VERDICT_BLOCK = 1,              ///< drop the connection
+  ZDTUN_VERDICT_PENDING = 2,            ///< hold the connection until zdtun_conn_verdict is called
+} zdtun_verdict_t;
+
 /*
  * @brief A connections iterator.
  * @return 0 to continue iteration, != 0 to abort it.
@@ -281,6 +394,23 @@ typedef struct zdtun_callbacks {
    */
   int (*send_client) (zdtun_t *tun, zdtun_pkt_t *pkt, const zdtun_conn_t *conn_info);
 
+  /*
+   * @brief Send multiple packets to the client. If set, it replaces send_client.
+   * The packets generated during a zdtun_forward, zdtun_forward_batch, zdtun_handle_fd,
+   * zdtun_handle_events or zdtun_purge_expired call are collected and passed to this
+   * callback before the call returns. See zdtun_flush.
+   *
+   * @param tun the zdtun instance the packets come from
+   * @param pkts the packets to send
+   * @param conns_info the connection of each packet
+   * @param num_pkts the number of packets
+   *
+   * @return the number of packets sent. The connection of the first unsent packet is closed,
+   * the following packets are passed again in the next call, except the ones of that connection.
+   * The ownership of a ZDTUN_PKT_OWNED packet is transferred when it is sent or it fails.
+   */
+  int (*send_client_batch) (zdtun_t *tun, zdtun_pkt_t *pkts, const zdtun_conn_t **conns_info, int num_pkts);
+
   /*
    * @brief A callback to easily account packets exchanged between the pivot and zdtun.
    *
@@ -311,7 +441,9 @@ typedef struct zdtun_callbacks {
    * @param tun the zdtun instance
    * @param conn_info information about the connection
    *
-   * @return 0 if the connection can be established, 1 to block it
+   * @return a zdtun_verdict_t. With ZDTUN_VERDICT_PENDING, the first client packet is
+   * held until the verdict is given via zdtun_conn_verdict, so that slow decisions
+   * do not block the other connections.
    */
   int (*on_connection_open) (zdtun_t *tun, zdtun_conn_t *conn_info);
 
@@ -322,6 +454,29 @@ typedef struct zdtun_callbacks {
    * @param conn_info information about the connection. User provided user_data should be manually freed.
    */
   void (*on_connection_close) (zdtun_t *tun, const zdtun_conn_t *conn_info);
+
+  /*
+   * @brief (optional) Provide a buffer to receive the TCP payload from the server (zero-copy).
+   * The payload is received after the room for the IP and TCP headers, which are then built
+   * in place, so the packet starts at the beginning of the buffer. The packet is passed to
+   * send_client (or send_client_batch) with the ZDTUN_PKT_OWNED flag, which transfers the
+   * buffer ownership to the callback, even if the send fails. Requires release_buf.
+   *
+   * @param tun the zdtun instance
+   * @param size must be set to the buffer size
+   *
+   * @return the buffer, or NULL to use the zdtun internal buffer
+   */
+  char* (*alloc_buf) (zdtun_t *tun, int *size);
+
+  /*
+   * @brief Release a buffer which zdtun no longer needs: a buffer of alloc_buf which was not
+   * sent to the client, or a buffer passed to zdtun_forward_owned.
+   *
+   * @param tun the zdtun instance
+   * @param buf the buffer to release
+   */
+  void (*release_buf) (zdtun_t *tun, char *buf);
 } zdtun_callbacks_t;
 
 /*
@@ -334,6 +489,25 @@ typedef struct zdtun_callbacks {
  */
 zdtun_t* zdtun_init(struct zdtun_callbacks *callbacks, void *udata);
 
+/*
+ * @brief Inizialize a zdtun instance with a custom configuration.
+ *
+ * @param client_callback the callback to use to send data to the client.
+ * @param udata a user data pointer that will be passed to the client_callback.
+ * @param config the instance configuration, as initialized by zdtun_default_config.
+ *        If NULL, the default configuration is used.
+ *
+ * @return a zdtun_t instance on success, NULL on failure.
+ */
+zdtun_t* zdtun_init_ex(struct zdtun_callbacks *callbacks, void *udata, const zdtun_config_t *config);
+
+/*
+ * @brief Fill the configuration with the default values.
+ *
+ * @param config the configuration to initialize.
+ */
+void zdtun_default_config(zdtun_config_t *config);
+
 /*
  * @brief Retrieves user data passed in zdtun_init from a zdtun connection.
  *
@@ -355,9 +529,35 @@ void zdtun_finalize(zdtun_t *tun);
  * @param max_fd will be filled with the maximum global_fd number from zdtun.
  * @param rdfd will be filled with zdtun readable file descriptors.
  * @param wrfd will be filled with zdtun writable file descriptors.
+ *
+ * @note when an event backend (e.g. epoll) is in use, only the event fd is
+ * reported, see zdtun_get_event_fd.
  */
 void zdtun_fds(zdtun_t *tun, int *max_fd, fd_set *rdfd, fd_set *wrfd);
 
+/*
+ * @brief Get the event backend file descriptor (e.g. the epoll fd on Linux).
+ * The fd becomes readable when some zdtun socket is ready, so it can be
+ * added to the caller poll loop. zdtun_handle_events should then be called.
+ *
+ * @param tun a zdtun instance.
+ *
+ * @return the event fd, or INVALID_SOCKET if the select backend is used.
+ */
+socket_t zdtun_get_event_fd(zdtun_t *tun);
+
+/*
+ * @brief Wait for socket events and handle the ready sockets. With an event
+ * backend, only the ready sockets are visited. With the select backend, this
+ * is equivalent to zdtun_fds + select + zdtun_handle_fd.
+ *
+ * @param tun a zdtun instance.
+ * @param timeout_ms max time to wait for events, 0 to poll, -1 to wait forever.
+ *
+ * @return the number of ready events on success, a negative value on error.
+ */
+int zdtun_handle_events(zdtun_t *tun, int timeout_ms);
+
 /*
  * @brief Iterate the active connections
  *
@@ -369,6 +569,71 @@ void zdtun_fds(zdtun_t *tun, int *max_fd, fd_set *rdfd, fd_set *wrfd);
  */
 int zdtun_iter_connections(zdtun_t *tun, zdtun_conn_iterator_t iterator, void *userdata);
 
+/*
+ * @brief a position in the connections table, see zdtun_conn_next. Zero
+ * initialize it to start a new iteration.
+ */
+typedef struct zdtun_conn_cursor {
+  u_int32_t pos;                        ///< next position to visit, backwards
+  u_int8_t started;
+} zdtun_conn_cursor_t;
+
+/*
+ * @brief Get the next active connection, without callbacks or allocations.
+ *
+ * The iteration can be resumed across the event loop passes, so that a large
+ * connections table can be visited a few connections at a time. The connections
+ * opened after the start of the iteration may be skipped, and a connection may be
+ * returned twice if other connections are destroyed between the calls.
+ *
+ * @param tun a zdtun instance.
+ * @param cursor the iteration position, updated by the call.
+ *
+ * @return the next connection, or NULL when all the connections were visited.
+ */
+zdtun_conn_t* zdtun_conn_next(zdtun_t *tun, zdtun_conn_cursor_t *cursor);
+
+/*
+ * @brief a connection record, see zdtun_flows_snapshot.
+ */
+typedef struct zdtun_flow {
+  zdtun_5tuple_t tuple;
+  u_int8_t status;                      ///< zdtun_conn_status_t
+  u_int32_t last_seen;                  ///< see zdtun_conn_get_last_seen
+  u_int32_t pkts_fwd;                   ///< client packets forwarded
+  u_int32_t pkts_reply;                 ///< packets sent to the client
+  u_int64_t bytes_fwd;                  ///< client bytes forwarded (IP packet length)
+  u_int64_t bytes_reply;                ///< bytes sent to the client
+} zdtun_flow_t;
+
+/*
+ * @brief Publish the connections records for zdtun_flows_snapshot.
+ *
+ * Each second, the zdtun thread collects the records of the active connections,
+ * a few connections per zdtun_handle_fd/zdtun_handle_events/zdtun_purge_expired
+ * call, and then publishes them at once. The packets and bytes of a connection
+ * are only counted while the export is enabled. Not supported on Windows.
+ *
+ * @param tun a zdtun instance.
+ * @param max_flows max number of records to publish, 0 to disable the export.
+ *
+ * @return 0 on success, -1 on error.
+ * @note must not be called while other threads may call zdtun_flows_snapshot.
+ */
+int zdtun_flows_export(zdtun_t *tun, u_int32_t max_flows);
+
+/*
+ * @brief Copy the last published connections records. Can be called from any
+ * thread, without locks and without slowing down the zdtun thread.
+ *
+ * @param tun a zdtun instance.
+ * @param flows array to be filled with the records.
+ * @param max_flows size of the flows array.
+ *
+ * @return the number of copied records, -1 if the export is disabled.
+ */
+int zdtun_flows_snapshot(zdtun_t *tun, zdtun_flow_t *flows, u_int32_t max_flows);
+
 /*
  * @brief handle zdtun ready file descriptors. To be called after a select.
  *
@@ -387,6 +652,18 @@ int zdtun_handle_fd(zdtun_t *tun, const fd_set *rd_fds, const fd_set *wr_fds);
  */
 void zdtun_purge_expired(zdtun_t *tun);
 
+/*
+ * @brief Get the time until the next connection expires.
+ * Can be used as the poll/select timeout. zdtun_purge_expired should be called
+ * when the timeout expires.
+ *
+ * @param tun a zdtun instance.
+ *
+ * @return the timeout in milliseconds, 0 if some connections must be purged now,
+ *         -1 if there are no connections.
+ */
+int zdtun_next_timeout_ms(zdtun_t *tun);
+
 /*
  * Get zdtun statisticts.
  *
@@ -395,6 +672,44 @@ void zdtun_purge_expired(zdtun_t *tun);
  */
 void zdtun_get_stats(zdtun_t *tun, zdtun_statistics_t *stats);
 
+/*
+ * Get the statistics of multiple zdtun instances, summed together.
+ * all_max_fd is set to the max value among the instances.
+ *
+ * @param shards the zdtun instances.
+ * @param num_shards number of instances.
+ * @param stats structure to be filled with the aggregated statisticts.
+ */
+void zdtun_get_shards_stats(zdtun_t **shards, int num_shards, zdtun_statistics_t *stats);
+
+/*
+ * Get the detailed statistics. These are only collected when zdtun is built
+ * with ZDTUN_INSTRUMENTATION (cmake -DZDTUN_INSTRUMENTATION=ON), otherwise the
+ * instrumentation is compiled out.
+ *
+ * @param tun a zdtun instance.
+ * @param stats structure to be filled with the statistics.
+ *
+ * @return 0 on success, -1 if the instrumentation is not available.
+ */
+int zdtun_get_ext_stats(zdtun_t *tun, zdtun_ext_statistics_t *stats);
+
+/*
+ * Pick the shard which should handle a connection, when the connections are
+ * split among multiple independent zdtun instances (e.g. one per thread).
+ * TCP and ICMP connections are hashed on the full 5-tuple, symmetrically, so
+ * the swapped tuple maps to the same shard. UDP connections are hashed on the
+ * client IP and port only, as zdtun shares a UDP socket among the connections
+ * from the same client port: this keeps each port mapping within one shard.
+ * zdtun instances are not thread safe, each shard must only be accessed by its thread.
+ *
+ * @param tuple the connection 5-tuple, as parsed from a client packet.
+ * @param num_shards number of shards.
+ *
+ * @return the shard index, in the range [0, num_shards).
+ */
+int zdtun_5tuple_shard(const zdtun_5tuple_t *tuple, int num_shards);
+
 /*
  * Get the number of active connections
  *
@@ -416,6 +731,25 @@ int zdtun_get_num_connections(zdtun_t *tun);
  */
 int zdtun_parse_pkt(zdtun_t *tun, const char *pkt_buf, uint16_t pkt_len, zdtun_pkt_t *pinfo);
 
+/*
+ * Offload the L4 checksum of the packets sent to the client, when the consumer
+ * can compute or ignore it (e.g. a TUN device with IFF_VNET_HDR).
+ *
+ * With ZDTUN_OFFLOAD_CSUM_PARTIAL, the checksums are left partial and the packets
+ * are marked with ZDTUN_PKT_CSUM_PARTIAL. With ZDTUN_OFFLOAD_CSUM_NONE, the checksums
+ * are not computed at all and the packets are marked with ZDTUN_PKT_CSUM_NONE.
+ * IPv4 headers, IPv4 ICMP and IPv4 UDP checksums are not affected.
+ *
+ * With ZDTUN_OFFLOAD_TCP_LRO, up to 64 KB are read from a TCP socket at once,
+ * and split into MSS sized segments. ZDTUN_OFFLOAD_TCP_GSO works similarly, but
+ * sends a single super segment, marked with ZDTUN_PKT_GSO and with a partial
+ * checksum, which must be segmented by the consumer (e.g. IFF_VNET_HDR GSO).
+ *
+ * @param tun a zdtun instance.
+ * @param flags a combination of ZDTUN_OFFLOAD_* flags, 0 to compute the checksums.
+ */
+void zdtun_set_offload(zdtun_t *tun, uint8_t flags);
+
 /*
  * Set the virtual MTU. It is used to determine the MSS.
  */
@@ -465,6 +799,42 @@ zdtun_conn_t* zdtun_easy_forward(zdtun_t *tun, const char *pkt_buf, int pkt_len)
  */
 int zdtun_forward(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn);
 
+/*
+ * Forward a client packet through the pivot, transferring the ownership of pkt->buf
+ * to zdtun (zero-copy). The TCP payload waiting to be sent to the server is
+ * referenced instead of being copied and, on Linux, large payloads are sent with
+ * MSG_ZEROCOPY. The buffer is released via the release_buf callback when no longer
+ * needed, which may happen before this function returns, also on failure.
+ *
+ * @param tun a zdtun instance.
+ * @param pkt the packet to forward.
+ * @param conn the connection, obtained by calling zdtun_lookup.
+ *
+ * @return 0 on success, errcode otherwise.
+ */
+int zdtun_forward_owned(zdtun_t *tun, const zdtun_pkt_t *pkt, zdtun_conn_t *conn);
+
+/*
+ * Forward multiple client packets through the pivot. Each packet is looked up
+ * and forwarded as in zdtun_easy_forward. The replies are delivered in a single
+ * send_client_batch call, when set.
+ *
+ * @param tun a zdtun instance.
+ * @param pkts the parsed packets to forward.
+ * @param num_pkts the number of packets.
+ *
+ * @return the number of packets successfully forwarded.
+ */
+int zdtun_forward_batch(zdtun_t *tun, const zdtun_pkt_t *pkts, int num_pkts);
+
+/*
+ * Deliver the packets collected for send_client_batch. This is only needed after
+ * calling zdtun_conn_close or zdtun_lookup outside of the zdtun event handling functions.
+ *
+ * @param tun a zdtun instance.
+ */
+void zdtun_flush(zdtun_t *tun);
+
 /*
  * Look up a flow or create it if it's not found.
  *
@@ -505,6 +875,175 @@ void zdtun_set_socks5_proxy(zdtun_t *tun, const zdtun_ip_t *proxy_ip, uint16_t p
  */
 void zdtun_set_socks5_userpass(zdtun_t *tun, const char *username, const char *password);
 
+/* SOCKS5 options, see zdtun_set_socks5_opts */
+#define ZDTUN_SOCKS5_PIPELINE 0x01
+#define ZDTUN_SOCKS5_FASTOPEN 0x02
+
+/*
+ * Set the SOCKS5 handshake options.
+ *
+ * With ZDTUN_SOCKS5_PIPELINE, the greeting, the auth request and the CONNECT
+ * request are sent at once, without waiting the proxy replies, which are then
+ * validated in order. This saves up to 2 RTTs per connection, but requires a
+ * proxy which accepts the pipelined requests.
+ *
+ * ZDTUN_SOCKS5_FASTOPEN implies ZDTUN_SOCKS5_PIPELINE and connects to the proxy
+ * with TCP Fast Open (Linux only), sending the handshake in the SYN when a TFO
+ * cookie for the proxy is available. If the kernel refuses TFO, e.g. when it is
+ * disabled via net.ipv4.tcp_fastopen, it falls back to ZDTUN_SOCKS5_PIPELINE.
+ *
+ * @param tun a zdtun instance.
+ * @param flags a combination of ZDTUN_SOCKS5_* flags, 0 for the standard handshake.
+ */
+void zdtun_set_socks5_opts(zdtun_t *tun, uint8_t flags);
+
+/*
+ * Keep a pool of connections to the SOCKS5 proxy, already connected and
+ * authenticated. A new proxied connection takes one of them, so only the
+ * CONNECT request is needed, and the pool is refilled.
+ *
+ * A pooled connection is dropped when closed by the proxy, or replaced after
+ * being idle for 60 seconds. The failed connections are retried on
+ * zdtun_purge_expired. Must be called after zdtun_set_socks5_proxy.
+ *
+ * @param tun a zdtun instance.
+ * @param size the number of connections to keep (max 64), 0 to disable the pool.
+ */
+void zdtun_set_socks5_pool(zdtun_t *tun, uint8_t size);
+
+/*
+ * @brief statistics of the DNS cache, see zdtun_dns_cache_get_stats.
+ */
+typedef struct zdtun_dns_cache_stats {
+  u_int32_t num_entries;                ///< current number of entries, including the pending ones
+  u_int32_t max_entries;                ///< max number of entries, 0 if the cache is disabled
+  u_int32_t hits;                       ///< queries answered from the cache
+  u_int32_t misses;                     ///< queries not found in the cache
+  u_int32_t coalesced;                  ///< queries which waited for an identical in-flight query
+} zdtun_dns_cache_stats_t;
+
+/*
+ * Set the size of the DNS cache, which is disabled by default.
+ *
+ * When enabled, the DNS responses are cached by (qname, qtype, qclass), the
+ * DO and CD bits and the resolver address, for the minimum TTL of their RRs.
+ * Standard queries found in the cache are answered directly, without opening
+ * a socket, if the response fits their EDNS UDP payload size (512 bytes
+ * without EDNS). The identical queries received while waiting for an upstream
+ * response are answered with that response. When full, the least recently
+ * used entries are evicted.
+ *
+ * @param tun a zdtun instance.
+ * @param max_entries the max number of cached responses, 0 to disable (and flush) the cache.
+ */
+void zdtun_dns_cache_set_size(zdtun_t *tun, u_int32_t max_entries);
+
+/*
+ * Remove all the entries from the DNS cache.
+ */
+void zdtun_dns_cache_flush(zdtun_t *tun);
+
+/*
+ * Get the DNS cache statistics.
+ *
+ * @param tun a zdtun instance.
+ * @param stats structure to be filled with the DNS cache statistics.
+ */
+void zdtun_dns_cache_get_stats(zdtun_t *tun, zdtun_dns_cache_stats_t *stats);
+
+/*
+ * Callback for zdtun_dns_cache_iter.
+ *
+ * @param qname the dotted query name, lowercase.
+ * @param qtype the query type.
+ * @param ttl the remaining TTL in seconds.
+ *
+ * @return 0 to continue the iteration, non-zero to stop it.
+ */
+typedef int (*zdtun_dns_cache_iterator_t)(zdtun_t *tun, const char *qname, uint16_t qtype,
+        u_int32_t ttl, void *user_data);
+
+/*
+ * Iterate the valid responses in the DNS cache, from the least recently used.
+ *
+ * @param tun a zdtun instance.
+ * @param iterator the callback to call for each entry.
+ * @param user_data data to pass to the iterator.
+ *
+ * @return the number of entries iterated.
+ */
+int zdtun_dns_cache_iter(zdtun_t *tun, zdtun_dns_cache_iterator_t iterator, void *user_data);
+
+/*
+ * @brief packet capture configuration, see zdtun_capture_start.
+ */
+typedef struct zdtun_capture_config {
+  const char *path;                     ///< the pcapng file. With max_file_size, the files are named <path>.<n>
+  u_int32_t snaplen;                    ///< max bytes captured per packet, 0 to capture the whole packets
+  u_int32_t ring_size;                  ///< size of the packets ring in bytes, rounded up to a power of 2. 0 for the default (4 MB)
+  u_int64_t max_file_size;              ///< start a new file when this size is reached, 0 to write a single file
+  u_int32_t max_files;                  ///< with max_file_size, number of files to keep (0 to keep all of them)
+  u_int8_t use_mmap;                    ///< write the files through a memory mapping, rather than write()
+} zdtun_capture_config_t;
+
+/*
+ * @brief statistics of the packet capture, see zdtun_capture_get_stats.
+ */
+typedef struct zdtun_capture_stats {
+  u_int64_t pkts;                       ///< packets written to the capture files
+  u_int64_t bytes;                      ///< bytes written to the capture files, including the pcapng blocks
+  u_int64_t drops;                      ///< packets dropped as the ring was full or the output failed
+  u_int32_t num_files;                  ///< number of capture files opened
+} zdtun_capture_stats_t;
+
+/*
+ * Start capturing the packets exchanged with the client to a pcapng file.
+ *
+ * The packets seen by account_packet are copied into a lock-free ring, which
+ * is drained by a dedicated writer thread, so that the file I/O does not slow
+ * down the forwarding. When the writer lags behind and the ring is full, the
+ * packets are dropped from the capture, not from the connections. The client
+ * packets are marked as outbound, the zdtun replies as inbound. Not supported
+ * on Windows.
+ *
+ * @param tun a zdtun instance.
+ * @param config the capture configuration.
+ *
+ * @return 0 on success, -1 on error (e.g. if a capture is already running).
+ */
+int zdtun_capture_start(zdtun_t *tun, const zdtun_capture_config_t *config);
+
+/*
+ * Stop the packet capture, after writing the packets in the ring. Also called by
+ * zdtun_finalize.
+ */
+void zdtun_capture_stop(zdtun_t *tun);
+
+/*
+ * Get the packet capture statistics.
+ *
+ * @param tun a zdtun instance.
+ * @param stats structure to be filled with the capture statistics.
+ *
+ * @return 0 on success, -1 if no capture is running.
+ */
+int zdtun_capture_get_stats(zdtun_t *tun, zdtun_capture_stats_t *stats);
+
+/*
+ * Resume a connection held by on_connection_open. Must be called from the thread
+ * which handles the zdtun instance. To redirect the connection, call zdtun_conn_dnat
+ * or zdtun_conn_proxy before allowing it. The connection must not be used after the
+ * on_connection_close callback, which is called when the connection is blocked,
+ * purged or when verdict_timeout expires.
+ *
+ * @param tun a zdtun instance.
+ * @param conn the pending connection.
+ * @param verdict ZDTUN_VERDICT_ALLOW or ZDTUN_VERDICT_BLOCK.
+ *
+ * @return 0 on success, -1 if the connection is not pending or cannot be established.
+ */
+int zdtun_conn_verdict(zdtun_t *tun, zdtun_conn_t *conn, zdtun_verdict_t verdict);
+
 /* Connection methods */
 void* zdtun_conn_get_userdata(const zdtun_conn_t *conn);
 void zdtun_conn_set_userdata(zdtun_conn_t *conn, void *userdata);
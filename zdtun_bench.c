@@ -0,0 +1,1011 @@
+/* ----------------------------------------------------------------------------
+ * Zero Dep Tunnel: VPN library without dependencies
+ * ----------------------------------------------------------------------------
+ *
+ * Copyright (C) 2018 - Emanuele Faranda
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Benchmarks for zdtun: microbenchmarks of the internals and loopback
+ * scenarios. In the loopback scenarios, a synthetic client feeds the packets
+ * to zdtun_easy_forward (or zdtun_forward_owned, to use MSG_ZEROCOPY) and
+ * handles the replies from send_client, while local TCP/UDP echo servers run
+ * in a separate thread.
+ *
+ * Usage: zdtun_bench [-j] [-n iterations] [-t seconds] [-c idle_conns] [scenario...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "zdtun.h"
+#include "third_party/net_headers.h"
+
+#define DEFAULT_ITERATIONS 10000000
+#define DEFAULT_DURATION 2
+#define DEFAULT_IDLE_CONNS 10000
+#define PAYLOAD_LEN 64
+
+#define CLIENT_IP 0x0A000001
+#define LOOPBACK_IP 0x7F000001
+#define CLIENT_WINDOW 65535
+#define TCP_MSS 1400
+#define FIRST_PORT 10000
+#define MAX_PORTS 50000
+
+// max unacknowledged client bytes in the TCP bulk scenario
+#define TCP_MAX_INFLIGHT (256 * 1024)
+
+// max client segments per pass in the TCP bulk scenario
+#define TCP_BURST 16
+
+// max UDP datagrams waiting for the echo reply
+#define UDP_MAX_INFLIGHT 64
+
+// the outstanding UDP datagrams are considered lost after this time
+#define UDP_LOSS_TIMEOUT_NS 100000000ULL
+
+// concurrent flows and request size of the TCP churn scenario
+#define CHURN_FLOWS 32
+#define CHURN_REQ_LEN 64
+#define CHURN_FLOW_TIMEOUT_NS 1000000000ULL
+
+typedef struct {
+  const char *name;
+  char buf[128];
+  uint16_t len;
+} bench_pkt_t;
+
+typedef struct {
+  const char *key;      // JSON key
+  const char *unit;     // text output unit
+  double value;
+} bench_metric_t;
+
+typedef enum {
+  FLOW_SYN_SENT = 0,
+  FLOW_ESTABLISHED,
+  FLOW_REQ_SENT,
+  FLOW_FIN_SENT,
+  FLOW_FAILED,
+} flow_state_t;
+
+// client side state of a TCP flow
+typedef struct {
+  flow_state_t state;
+  uint32_t seq;         // next client sequence number
+  uint32_t acked;       // client bytes acknowledged by zdtun
+  uint32_t peer_seq;    // next zdtun sequence number
+  uint16_t peer_win;
+  uint8_t need_ack;
+  uint8_t peer_fin;
+  uint64_t rx_bytes;
+  uint64_t start_ns;
+} bench_flow_t;
+
+typedef struct {
+  int epfd;
+  int tcp_fd;
+  int udp_fd;
+  uint16_t tcp_port;    // network byte order
+  uint16_t udp_port;    // network byte order
+  volatile int running;
+  pthread_t thread;
+} echo_server_t;
+
+static volatile uint32_t sink;
+static uint8_t json_output = 0;
+static int num_reported = 0;
+
+static echo_server_t echo;
+static bench_flow_t *flows;     // indexed by the client port
+static uint8_t owned_tx;        // forward the client packets with zdtun_forward_owned
+
+// loopback counters, updated by loopback_send_client
+static uint64_t pkts_to_zdtun;
+static uint64_t pkts_from_zdtun;
+static uint64_t udp_replies;
+static uint64_t udp_rtt_sum_ns;
+static uint64_t udp_rtt_max_ns;
+static uint64_t udp_last_reply_ns;
+
+/* ******************************************************* */
+
+static uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/* ******************************************************* */
+
+static void report(const char *name, const bench_metric_t *metrics, int num_metrics) {
+  if(json_output) {
+    printf("%s\n    {\"name\": \"%s\"", (num_reported > 0) ? "," : "", name);
+
+    for(int i = 0; i < num_metrics; i++)
+      printf(", \"%s\": %.3f", metrics[i].key, metrics[i].value);
+
+    printf("}");
+  } else {
+    printf("%-24s", name);
+
+    for(int i = 0; i < num_metrics; i++)
+      printf(" %10.2f %s", metrics[i].value, metrics[i].unit);
+
+    printf("\n");
+  }
+
+  num_reported++;
+  fflush(stdout);
+}
+
+/* ******************************************************* */
+
+static int dummy_send_client(zdtun_t *tun, zdtun_pkt_t *pkt, const zdtun_conn_t *conn_info) {
+  return 0;
+}
+
+/* ******************************************************* */
+
+// Builds an IPv4 header with opts_len bytes of (NOP) options
+static int build_ip4(char *buf, uint8_t proto, int l4_len, int opts_len, uint16_t frag_off) {
+  struct iphdr *ip = (struct iphdr*) buf;
+  int iphdr_len = 20 + opts_len;
+
+  memset(buf, 0, iphdr_len);
+  ip->version = 4;
+  ip->ihl = iphdr_len / 4;
+  ip->tot_len = htons(iphdr_len + l4_len);
+  ip->id = htons(1234);
+  ip->frag_off = htons(frag_off);
+  ip->ttl = 64;
+  ip->protocol = proto;
+  ip->saddr = htonl(0x0A000001);
+  ip->daddr = htonl(0x0A000002);
+  memset(buf + 20, 1 /* NOP */, opts_len);
+
+  return iphdr_len;
+}
+
+/* ******************************************************* */
+
+static int build_ip6(char *buf, uint8_t proto, int l4_len) {
+  struct ipv6_hdr *ip = (struct ipv6_hdr*) buf;
+
+  memset(buf, 0, sizeof(*ip));
+  ip->version = 6;
+  ip->payload_len = htons(l4_len);
+  ip->nexthdr = proto;
+  ip->hop_limit = 64;
+  inet_pton(AF_INET6, "fd00::1", &ip->saddr);
+  inet_pton(AF_INET6, "fd00::2", &ip->daddr);
+
+  return sizeof(*ip);
+}
+
+/* ******************************************************* */
+
+static int build_l4(char *buf, uint8_t proto) {
+  if(proto == IPPROTO_TCP) {
+    struct tcphdr *tcp = (struct tcphdr*) buf;
+
+    memset(tcp, 0, sizeof(*tcp));
+    tcp->th_sport = htons(40000);
+    tcp->th_dport = htons(443);
+    tcp->th_off = 5;
+    tcp->th_flags = TH_ACK | TH_PUSH;
+    tcp->th_win = htons(65535);
+    memset(buf + sizeof(*tcp), 'a', PAYLOAD_LEN);
+
+    return(sizeof(*tcp) + PAYLOAD_LEN);
+  } else {
+    struct udphdr *udp = (struct udphdr*) buf;
+
+    udp->uh_sport = htons(40000);
+    udp->uh_dport = htons(53);
+    udp->uh_ulen = htons(sizeof(*udp) + PAYLOAD_LEN);
+    udp->uh_sum = 0;
+    memset(buf + sizeof(*udp), 'a', PAYLOAD_LEN);
+
+    return(sizeof(*udp) + PAYLOAD_LEN);
+  }
+}
+
+/* ******************************************************* */
+
+static void init_pkt(bench_pkt_t *pkt, const char *name, uint8_t ipver, uint8_t proto,
+        int ip4_opts_len, uint16_t ip4_frag_off) {
+  char l4[64 + PAYLOAD_LEN];
+  int l4_len = build_l4(l4, proto);
+  int iphdr_len;
+
+  if(ipver == 4)
+    iphdr_len = build_ip4(pkt->buf, proto, l4_len, ip4_opts_len, ip4_frag_off);
+  else
+    iphdr_len = build_ip6(pkt->buf, proto, l4_len);
+
+  memcpy(pkt->buf + iphdr_len, l4, l4_len);
+  pkt->len = iphdr_len + l4_len;
+  pkt->name = name;
+}
+
+/* ******************************************************* */
+
+static void bench_parse(zdtun_t *tun, bench_pkt_t *pkt, long iterations) {
+  zdtun_pkt_t pinfo;
+  uint32_t acc = 0;
+  uint64_t start = now_ns();
+
+  for(long i = 0; i < iterations; i++) {
+    if(zdtun_parse_pkt(tun, pkt->buf, pkt->len, &pinfo) != 0) {
+      fprintf(stderr, "%s: parse failed\n", pkt->name);
+      return;
+    }
+
+    acc += pinfo.l7_len + pinfo.tuple.src_port;
+  }
+
+  uint64_t elapsed = now_ns() - start;
+  sink += acc;
+
+  bench_metric_t metrics[] = {
+    {"mpps", "Mpps", (iterations * 1000.0) / elapsed},
+    {"ns_per_pkt", "ns/pkt", ((double) elapsed) / iterations},
+  };
+
+  report(pkt->name, metrics, 2);
+}
+
+/* ******************************************************* */
+
+
+static void bench_parse_all(long iterations) {
+  zdtun_callbacks_t callbacks = {
+    .send_client = dummy_send_client,
+  };
+  bench_pkt_t pkts[6];
+  int num_pkts = 0;
+  zdtun_t *tun = zdtun_init(&callbacks, NULL);
+
+  if(!tun) {
+    fprintf(stderr, "zdtun_init failed\n");
+    return;
+  }
+
+  init_pkt(&pkts[num_pkts++], "parse.ipv4.tcp", 4, IPPROTO_TCP, 0, 0x4000 /* DF */);
+  init_pkt(&pkts[num_pkts++], "parse.ipv4.udp", 4, IPPROTO_UDP, 0, 0);
+  init_pkt(&pkts[num_pkts++], "parse.ipv6.tcp", 6, IPPROTO_TCP, 0, 0);
+  init_pkt(&pkts[num_pkts++], "parse.ipv6.udp", 6, IPPROTO_UDP, 0, 0);
+
+  // these take the full parser path
+  init_pkt(&pkts[num_pkts++], "parse.ipv4.tcp.options", 4, IPPROTO_TCP, 8, 0);
+  init_pkt(&pkts[num_pkts++], "parse.ipv4.udp.fragment", 4, IPPROTO_UDP, 0, 0x2000 /* MF */);
+
+  for(int i = 0; i < num_pkts; i++)
+    bench_parse(tun, &pkts[i], iterations);
+
+  zdtun_finalize(tun);
+}
+
+/* ******************************************************* */
+/*                    Loopback echo servers                */
+/* ******************************************************* */
+
+static int echo_listen(int type, uint16_t *port) {
+  struct sockaddr_in addr = {0};
+  socklen_t addrlen = sizeof(addr);
+  int sock = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+  int one = 1;
+
+  if(sock < 0)
+    return -1;
+
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(LOOPBACK_IP);
+
+  if((bind(sock, (struct sockaddr*) &addr, addrlen) != 0) ||
+      ((type == SOCK_STREAM) && (listen(sock, 1024) != 0)) ||
+      (getsockname(sock, (struct sockaddr*) &addr, &addrlen) != 0)) {
+    close(sock);
+    return -1;
+  }
+
+  *port = addr.sin_port;
+  return sock;
+}
+
+/* ******************************************************* */
+
+static void echo_watch(int fd) {
+  struct epoll_event ev = {0};
+
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  epoll_ctl(echo.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* ******************************************************* */
+
+static void* echo_thread(void *arg) {
+  struct epoll_event events[64];
+  static char buf[65536];
+
+  while(echo.running) {
+    int num_events = epoll_wait(echo.epfd, events, 64, 100);
+
+    for(int i = 0; i < num_events; i++) {
+      int fd = events[i].data.fd;
+      int len;
+
+      if(fd == echo.tcp_fd) {
+        int client;
+
+        // the accepted sockets are blocking, the replies are sent as a whole
+        while((client = accept(echo.tcp_fd, NULL, NULL)) >= 0)
+          echo_watch(client);
+      } else if(fd == echo.udp_fd) {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+
+        while((len = recvfrom(echo.udp_fd, buf, sizeof(buf), 0,
+            (struct sockaddr*) &addr, &addrlen)) > 0) {
+          sendto(echo.udp_fd, buf, len, 0, (struct sockaddr*) &addr, addrlen);
+          addrlen = sizeof(addr);
+        }
+      } else {
+        if(((len = recv(fd, buf, sizeof(buf), 0)) <= 0) ||
+            (send(fd, buf, len, MSG_NOSIGNAL) != len))
+          close(fd);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/* ******************************************************* */
+
+static int echo_start() {
+  if(((echo.epfd = epoll_create1(0)) < 0) ||
+      ((echo.tcp_fd = echo_listen(SOCK_STREAM, &echo.tcp_port)) < 0) ||
+      ((echo.udp_fd = echo_listen(SOCK_DGRAM, &echo.udp_port)) < 0)) {
+    fprintf(stderr, "Cannot start the echo servers[%d]: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  echo_watch(echo.tcp_fd);
+  echo_watch(echo.udp_fd);
+  echo.running = 1;
+
+  if(pthread_create(&echo.thread, NULL, echo_thread, NULL) != 0) {
+    fprintf(stderr, "pthread_create failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+// NOTE: the zdtun instances must be finalized first, to unblock the echo sends
+static void echo_stop() {
+  echo.running = 0;
+  pthread_join(echo.thread, NULL);
+
+  // the accepted sockets are closed on exit
+  close(echo.tcp_fd);
+  close(echo.udp_fd);
+  close(echo.epfd);
+}
+
+/* ******************************************************* */
+/*                     Synthetic client                    */
+/* ******************************************************* */
+
+static int loopback_send_client(zdtun_t *tun, zdtun_pkt_t *pkt, const zdtun_conn_t *conn_info) {
+  pkts_from_zdtun++;
+
+  if(pkt->tuple.ipproto == IPPROTO_UDP) {
+    uint64_t sent_ns;
+
+    if(pkt->l7_len >= sizeof(sent_ns)) {
+      uint64_t now = now_ns();
+      uint64_t rtt;
+
+      memcpy(&sent_ns, pkt->l7, sizeof(sent_ns));
+      rtt = now - sent_ns;
+
+      udp_rtt_sum_ns += rtt;
+      udp_rtt_max_ns = (rtt > udp_rtt_max_ns) ? rtt : udp_rtt_max_ns;
+      udp_last_reply_ns = now;
+      udp_replies++;
+    }
+
+    return 0;
+  } else if(pkt->tuple.ipproto != IPPROTO_TCP)
+    return 0;
+
+  struct tcphdr *tcp = pkt->tcp;
+  bench_flow_t *flow = &flows[ntohs(pkt->tuple.dst_port)];
+  uint32_t seq = ntohl(tcp->th_seq);
+
+  if(tcp->th_flags & TH_RST) {
+    flow->state = FLOW_FAILED;
+    return 0;
+  }
+
+  if((tcp->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+    flow->peer_seq = seq + 1;
+
+    if(flow->state == FLOW_SYN_SENT)
+      flow->state = FLOW_ESTABLISHED;
+
+    flow->need_ack = 1;
+  }
+
+  if(tcp->th_flags & TH_ACK) {
+    uint32_t ack = ntohl(tcp->th_ack);
+
+    if((int32_t)(ack - flow->acked) > 0)
+      flow->acked = ack;
+
+    flow->peer_win = ntohs(tcp->th_win);
+  }
+
+  if((pkt->l7_len > 0) && (seq == flow->peer_seq)) {
+    flow->peer_seq += pkt->l7_len;
+    flow->rx_bytes += pkt->l7_len;
+    flow->need_ack = 1;
+  }
+
+  if((tcp->th_flags & TH_FIN) && !flow->peer_fin) {
+    flow->peer_seq++;
+    flow->peer_fin = 1;
+    flow->need_ack = 1;
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+// Forwards a client packet. With owned_tx, buf is a heap buffer passed to
+// zdtun_forward_owned, released by loopback_release_buf.
+static void forward_client_pkt(zdtun_t *tun, char *buf, int len, uint8_t create) {
+  zdtun_pkt_t pkt;
+  zdtun_conn_t *conn;
+
+  if(!owned_tx) {
+    zdtun_easy_forward(tun, buf, len);
+    return;
+  }
+
+  if((zdtun_parse_pkt(tun, buf, len, &pkt) != 0) || !(conn = zdtun_lookup(tun, &pkt.tuple, create))) {
+    free(buf);
+    return;
+  }
+
+  zdtun_forward_owned(tun, &pkt, conn);
+}
+
+/* ******************************************************* */
+
+static void loopback_release_buf(zdtun_t *tun, char *buf) {
+  free(buf);
+}
+
+/* ******************************************************* */
+
+static void send_tcp(zdtun_t *tun, uint16_t sport, uint8_t flags, int data_len) {
+  bench_flow_t *flow = &flows[sport];
+  char stack_buf[20 + 20 + TCP_MSS];
+  char *buf = owned_tx ? malloc(sizeof(stack_buf)) : stack_buf;
+
+  if(!buf)
+    return;
+
+  int iphdr_len = build_ip4(buf, IPPROTO_TCP, sizeof(struct tcphdr) + data_len, 0, 0x4000 /* DF */);
+  struct tcphdr *tcp = (struct tcphdr*) (buf + iphdr_len);
+
+  ((struct iphdr*) buf)->saddr = htonl(CLIENT_IP);
+  ((struct iphdr*) buf)->daddr = htonl(LOOPBACK_IP);
+
+  memset(tcp, 0, sizeof(*tcp));
+  tcp->th_sport = htons(sport);
+  tcp->th_dport = echo.tcp_port;
+  tcp->th_seq = htonl(flow->seq);
+  tcp->th_ack = (flags & TH_ACK) ? htonl(flow->peer_seq) : 0;
+  tcp->th_off = 5;
+  tcp->th_flags = flags;
+  tcp->th_win = htons(CLIENT_WINDOW);
+  memset(buf + iphdr_len + sizeof(*tcp), 'a', data_len);
+
+  if(flags & TH_ACK)
+    flow->need_ack = 0;
+
+  flow->seq += data_len + ((flags & (TH_SYN | TH_FIN)) ? 1 : 0);
+  pkts_to_zdtun++;
+
+  forward_client_pkt(tun, buf, iphdr_len + sizeof(*tcp) + data_len, (flags & TH_SYN) != 0);
+}
+
+/* ******************************************************* */
+
+// The payload carries the send time, to measure the RTT
+static void send_udp(zdtun_t *tun, uint16_t sport) {
+  char buf[20 + 8 + PAYLOAD_LEN];
+  int iphdr_len = build_ip4(buf, IPPROTO_UDP, sizeof(struct udphdr) + PAYLOAD_LEN, 0, 0);
+  struct udphdr *udp = (struct udphdr*) (buf + iphdr_len);
+  uint64_t now = now_ns();
+
+  ((struct iphdr*) buf)->daddr = htonl(LOOPBACK_IP);
+
+  udp->uh_sport = htons(sport);
+  udp->uh_dport = echo.udp_port;
+  udp->uh_ulen = htons(sizeof(*udp) + PAYLOAD_LEN);
+  udp->uh_sum = 0;
+  memset(buf + iphdr_len + sizeof(*udp), 'a', PAYLOAD_LEN);
+  memcpy(buf + iphdr_len + sizeof(*udp), &now, sizeof(now));
+
+  pkts_to_zdtun++;
+
+  zdtun_easy_forward(tun, buf, iphdr_len + sizeof(*udp) + PAYLOAD_LEN);
+}
+
+/* ******************************************************* */
+
+static void start_flow(zdtun_t *tun, uint16_t sport) {
+  bench_flow_t *flow = &flows[sport];
+
+  memset(flow, 0, sizeof(*flow));
+  flow->state = FLOW_SYN_SENT;
+  flow->seq = 1000;
+  flow->acked = 1001;
+  flow->start_ns = now_ns();
+
+  send_tcp(tun, sport, TH_SYN, 0);
+}
+
+/* ******************************************************* */
+
+static zdtun_t* loopback_init(const zdtun_config_t *config) {
+  zdtun_callbacks_t callbacks = {
+    .send_client = loopback_send_client,
+    // also enables SO_ZEROCOPY on the TCP sockets
+    .release_buf = owned_tx ? loopback_release_buf : NULL,
+  };
+
+  pkts_to_zdtun = pkts_from_zdtun = 0;
+  udp_replies = udp_rtt_sum_ns = udp_rtt_max_ns = 0;
+
+  return zdtun_init_ex(&callbacks, NULL, config);
+}
+
+/* ******************************************************* */
+
+// Waits for the UDP replies, until at most max_inflight datagrams are outstanding.
+// Returns the number of datagrams considered lost.
+static uint64_t udp_wait_replies(zdtun_t *tun, uint64_t num_sent, uint64_t max_inflight) {
+  uint64_t wait_start = now_ns();
+
+  while((num_sent - udp_replies) > max_inflight) {
+    zdtun_handle_events(tun, 1);
+
+    uint64_t now = now_ns();
+
+    if(((now - udp_last_reply_ns) > UDP_LOSS_TIMEOUT_NS) && ((now - wait_start) > UDP_LOSS_TIMEOUT_NS)) {
+      uint64_t lost = num_sent - udp_replies;
+
+      // account the lost datagrams as replied, to move on
+      udp_replies = num_sent;
+      return lost;
+    }
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+/*                   Loopback scenarios                    */
+/* ******************************************************* */
+
+// A single TCP flow, uploading MSS sized segments which are echoed back. With
+// zerocopy, the segments are forwarded with zdtun_forward_owned and only the
+// last one of each burst has TH_PUSH, so that zdtun sends them at once with
+// MSG_ZEROCOPY. On loopback the kernel still copies the data.
+static void bench_tcp_bulk(int duration, uint8_t zerocopy) {
+  zdtun_t *tun;
+  uint16_t sport = FIRST_PORT;
+  bench_flow_t *flow = &flows[sport];
+
+  owned_tx = zerocopy;
+
+  if(!(tun = loopback_init(NULL))) {
+    owned_tx = 0;
+    return;
+  }
+
+  start_flow(tun, sport);
+
+  while((flow->state == FLOW_SYN_SENT) && ((now_ns() - flow->start_ns) < CHURN_FLOW_TIMEOUT_NS))
+    zdtun_handle_events(tun, 1);
+
+  if(flow->state != FLOW_ESTABLISHED) {
+    fprintf(stderr, "tcp_bulk: connection failed\n");
+    zdtun_finalize(tun);
+    owned_tx = 0;
+    return;
+  }
+
+  send_tcp(tun, sport, TH_ACK, 0);
+
+  uint32_t start_seq = flow->seq;
+  uint64_t start = now_ns();
+  uint64_t end = start + duration * 1000000000ULL;
+  uint64_t now;
+
+  while(((now = now_ns()) < end) && (flow->state != FLOW_FAILED)) {
+    uint32_t inflight = flow->seq - flow->acked;
+    uint32_t limit = (flow->peer_win > TCP_MSS) ? flow->peer_win : TCP_MSS;
+    int burst = 0;
+
+    // zdtun queues the segments exceeding its window, bound them
+    if(limit > TCP_MAX_INFLIGHT)
+      limit = TCP_MAX_INFLIGHT;
+
+    while(((inflight + (burst + 1) * TCP_MSS) <= limit) && (burst < TCP_BURST))
+      burst++;
+
+    for(int i = 0; i < burst; i++) {
+      uint8_t push = !zerocopy || (i == (burst - 1));
+
+      send_tcp(tun, sport, TH_ACK | (push ? TH_PUSH : 0), TCP_MSS);
+    }
+
+    zdtun_handle_events(tun, burst ? 0 : 1);
+
+    if(flow->need_ack)
+      send_tcp(tun, sport, TH_ACK, 0);
+  }
+
+  double elapsed = (now - start) / 1e9;
+
+  bench_metric_t metrics[] = {
+    {"kpps", "Kpps", (pkts_to_zdtun + pkts_from_zdtun) / elapsed / 1e3},
+    {"up_mbps", "Mbps up", (double)(flow->acked - start_seq) * 8 / elapsed / 1e6},
+    {"down_mbps", "Mbps down", flow->rx_bytes * 8 / elapsed / 1e6},
+  };
+
+  report(zerocopy ? "loopback.tcp_bulk_zc" : "loopback.tcp_bulk", metrics, 3);
+  zdtun_finalize(tun);
+  owned_tx = 0;
+}
+
+/* ******************************************************* */
+
+// A single UDP flow, with up to UDP_MAX_INFLIGHT small datagrams in flight
+static void bench_udp_small(int duration) {
+  zdtun_t *tun = loopback_init(NULL);
+  uint64_t num_sent = 0, lost = 0;
+
+  if(!tun)
+    return;
+
+  uint64_t start = now_ns();
+  uint64_t end = start + duration * 1000000000ULL;
+  uint64_t now;
+
+  udp_last_reply_ns = start;
+
+  while((now = now_ns()) < end) {
+    while((num_sent - udp_replies) < UDP_MAX_INFLIGHT) {
+      send_udp(tun, FIRST_PORT);
+      num_sent++;
+    }
+
+    lost += udp_wait_replies(tun, num_sent, UDP_MAX_INFLIGHT - 1);
+  }
+
+  double elapsed = (now - start) / 1e9;
+  uint64_t received = udp_replies - lost;
+
+  bench_metric_t metrics[] = {
+    {"kpps", "Kpps", (pkts_to_zdtun + pkts_from_zdtun) / elapsed / 1e3},
+    {"mbps", "Mbps", (num_sent + received) * PAYLOAD_LEN * 8 / elapsed / 1e6},
+    {"rtt_avg_us", "us rtt", received ? (udp_rtt_sum_ns / 1e3 / received) : 0},
+    {"rtt_max_us", "us max", udp_rtt_max_ns / 1e3},
+    {"lost", "lost", lost},
+  };
+
+  report("loopback.udp_small", metrics, 5);
+  zdtun_finalize(tun);
+}
+
+/* ******************************************************* */
+
+// CHURN_FLOWS concurrent short TCP flows: connect, request, response, close.
+// zdtun_purge_expired runs at every pass to reap the closed connections.
+static void bench_tcp_churn(int duration) {
+  zdtun_t *tun = loopback_init(NULL);
+  uint16_t slots[CHURN_FLOWS];
+  uint16_t next_port = 0;
+  uint64_t completed = 0, failed = 0, flow_time_ns = 0;
+
+  if(!tun)
+    return;
+
+  for(int i = 0; i < CHURN_FLOWS; i++) {
+    slots[i] = FIRST_PORT + (next_port++ % MAX_PORTS);
+    start_flow(tun, slots[i]);
+  }
+
+  uint64_t start = now_ns();
+  uint64_t end = start + duration * 1000000000ULL;
+  uint64_t now;
+
+  while((now = now_ns()) < end) {
+    zdtun_handle_events(tun, 1);
+
+    for(int i = 0; i < CHURN_FLOWS; i++) {
+      uint16_t sport = slots[i];
+      bench_flow_t *flow = &flows[sport];
+      uint8_t done = 0;
+
+      if(flow->state == FLOW_ESTABLISHED) {
+        send_tcp(tun, sport, TH_ACK | TH_PUSH, CHURN_REQ_LEN);
+        flow->state = FLOW_REQ_SENT;
+      } else if((flow->state == FLOW_REQ_SENT) && (flow->rx_bytes >= CHURN_REQ_LEN)) {
+        send_tcp(tun, sport, TH_FIN | TH_ACK, 0);
+        flow->state = FLOW_FIN_SENT;
+      } else if((flow->state == FLOW_FIN_SENT) && flow->peer_fin) {
+        send_tcp(tun, sport, TH_ACK, 0);
+        flow_time_ns += now_ns() - flow->start_ns;
+        completed++;
+        done = 1;
+      } else if((flow->state == FLOW_FAILED) || ((now - flow->start_ns) > CHURN_FLOW_TIMEOUT_NS)) {
+        failed++;
+        done = 1;
+      } else if(flow->need_ack)
+        send_tcp(tun, sport, TH_ACK, 0);
+
+      if(done) {
+        slots[i] = FIRST_PORT + (next_port++ % MAX_PORTS);
+        start_flow(tun, slots[i]);
+      }
+    }
+
+    zdtun_purge_expired(tun);
+  }
+
+  double elapsed = (now - start) / 1e9;
+
+  bench_metric_t metrics[] = {
+    {"flows_per_sec", "flows/s", completed / elapsed},
+    {"flow_avg_us", "us/flow", completed ? (flow_time_ns / 1e3 / completed) : 0},
+    {"kpps", "Kpps", (pkts_to_zdtun + pkts_from_zdtun) / elapsed / 1e3},
+    {"failed", "failed", failed},
+  };
+
+  report("loopback.tcp_churn", metrics, 4);
+  zdtun_finalize(tun);
+}
+
+/* ******************************************************* */
+
+// Opens num_conns UDP connections, which then stay idle, and measures the
+// cost of zdtun_purge_expired and the RTT of an active flow among them
+static void bench_idle_conns(int duration, int num_conns) {
+  struct rlimit rl;
+  zdtun_config_t config;
+  uint64_t num_sent = 0, lost = 0;
+
+  // each connection holds a socket
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    if(rl.rlim_cur < (num_conns + 256)) {
+      rl.rlim_cur = (rl.rlim_max < (num_conns + 256)) ? rl.rlim_max : (num_conns + 256);
+      setrlimit(RLIMIT_NOFILE, &rl);
+      getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    if(rl.rlim_cur < (num_conns + 256)) {
+      num_conns = (rl.rlim_cur > 512) ? (rl.rlim_cur - 256) : 256;
+      fprintf(stderr, "idle_conns: open files limit reached, using %d connections\n", num_conns);
+    }
+  }
+
+  if(num_conns > MAX_PORTS)
+    num_conns = MAX_PORTS;
+
+  zdtun_default_config(&config);
+  config.max_sockets = num_conns + 64;
+  config.sockets_after_purge = num_conns + 32;
+  config.udp_timeout = duration + 60;
+
+  zdtun_t *tun = loopback_init(&config);
+
+  if(!tun)
+    return;
+
+  uint64_t start = now_ns();
+  udp_last_reply_ns = start;
+
+  for(int i = 0; i < num_conns; i++) {
+    send_udp(tun, FIRST_PORT + i);
+    num_sent++;
+
+    // avoid overflowing the echo server socket buffer
+    lost += udp_wait_replies(tun, num_sent, UDP_MAX_INFLIGHT);
+  }
+
+  lost += udp_wait_replies(tun, num_sent, 0);
+
+  double setup_elapsed = (now_ns() - start) / 1e9;
+  int purge_iterations = 1000;
+
+  start = now_ns();
+  for(int i = 0; i < purge_iterations; i++)
+    zdtun_purge_expired(tun);
+
+  double purge_us = (now_ns() - start) / 1e3 / purge_iterations;
+  int active_conns = zdtun_get_num_connections(tun);
+
+  // ping-pong on the first flow
+  uint64_t end = now_ns() + duration * 1000000000ULL;
+  uint64_t first_reply = udp_replies;
+
+  udp_rtt_sum_ns = udp_rtt_max_ns = 0;
+
+  while(now_ns() < end) {
+    send_udp(tun, FIRST_PORT);
+    num_sent++;
+    lost += udp_wait_replies(tun, num_sent, 0);
+  }
+
+  uint64_t pongs = udp_replies - first_reply;
+
+  bench_metric_t metrics[] = {
+    {"conns", "conns", active_conns},
+    {"setup_conns_per_sec", "conns/s", num_conns / setup_elapsed},
+    {"purge_us", "us/purge", purge_us},
+    {"rtt_avg_us", "us rtt", pongs ? (udp_rtt_sum_ns / 1e3 / pongs) : 0},
+    {"lost", "lost", lost},
+  };
+
+  report("loopback.idle_conns", metrics, 5);
+  zdtun_finalize(tun);
+}
+
+/* ******************************************************* */
+
+static void usage(char **argv) {
+  fprintf(stderr, "Usage: %s [-j] [-n iterations] [-t seconds] [-c idle_conns] [scenario...]\n"
+    "\n"
+    "  -j               machine-readable (JSON) output\n"
+    "  -n iterations    iterations of the parse microbenchmarks (default: %d)\n"
+    "  -t seconds       duration of each loopback scenario (default: %d)\n"
+    "  -c idle_conns    connections of the idle_conns scenario (default: %d)\n"
+    "\n"
+    "Scenarios: parse tcp_bulk tcp_bulk_zc udp_small tcp_churn idle_conns (default: all)\n",
+    argv[0], DEFAULT_ITERATIONS, DEFAULT_DURATION, DEFAULT_IDLE_CONNS);
+
+  exit(1);
+}
+
+/* ******************************************************* */
+
+static int scenario_enabled(int argc, char **argv, const char *name) {
+  if(optind >= argc)
+    return 1;
+
+  for(int i = optind; i < argc; i++) {
+    if(!strcmp(argv[i], name))
+      return 1;
+  }
+
+  return 0;
+}
+
+/* ******************************************************* */
+
+int main(int argc, char **argv) {
+  long iterations = DEFAULT_ITERATIONS;
+  int duration = DEFAULT_DURATION;
+  int idle_conns = DEFAULT_IDLE_CONNS;
+  const char *scenarios[] = {"parse", "tcp_bulk", "tcp_bulk_zc", "udp_small", "tcp_churn", "idle_conns"};
+  int opt;
+
+  while((opt = getopt(argc, argv, "jn:t:c:h")) != -1) {
+    switch(opt) {
+      case 'j':
+        json_output = 1;
+        break;
+      case 'n':
+        iterations = atol(optarg);
+        break;
+      case 't':
+        duration = atoi(optarg);
+        break;
+      case 'c':
+        idle_conns = atoi(optarg);
+        break;
+      default:
+        usage(argv);
+    }
+  }
+
+  if((iterations <= 0) || (duration <= 0) || (idle_conns <= 0))
+    usage(argv);
+
+  for(int i = optind; i < argc; i++) {
+    int found = 0;
+
+    for(int j = 0; j < (sizeof(scenarios) / sizeof(*scenarios)); j++)
+      found |= !strcmp(argv[i], scenarios[j]);
+
+    if(!found)
+      usage(argv);
+  }
+
+  if(json_output)
+    printf("{\n  \"benchmarks\": [");
+
+  if(scenario_enabled(argc, argv, "parse"))
+    bench_parse_all(iterations);
+
+  if(scenario_enabled(argc, argv, "tcp_bulk") || scenario_enabled(argc, argv, "tcp_bulk_zc") ||
+      scenario_enabled(argc, argv, "udp_small") || scenario_enabled(argc, argv, "tcp_churn") ||
+      scenario_enabled(argc, argv, "idle_conns")) {
+    if(!(flows = calloc(65536, sizeof(bench_flow_t))) || (echo_start() != 0))
+      return 1;
+
+    if(scenario_enabled(argc, argv, "tcp_bulk"))
+      bench_tcp_bulk(duration, 0);
+    if(scenario_enabled(argc, argv, "tcp_bulk_zc"))
+      bench_tcp_bulk(duration, 1);
+    if(scenario_enabled(argc, argv, "udp_small"))
+      bench_udp_small(duration);
+    if(scenario_enabled(argc, argv, "tcp_churn"))
+      bench_tcp_churn(duration);
+    if(scenario_enabled(argc, argv, "idle_conns"))
+      bench_idle_conns(duration, idle_conns);
+
+    echo_stop();
+    free(flows);
+  }
+
+  if(json_output)
+    printf("\n  ]\n}\n");
+
+  return 0;
+}
@@ -43,6 +43,7 @@
 int tun1_fd;
 
 socket_t server_sock = 0;
+con_link_t server_link;
 u_int32_t tun_ip_addr = 0;
 
 /* ******************************************************* */
@@ -73,20 +74,28 @@ static void send_server(char *pkt_buf, u_int32_t pkt_size) {
       return;
   }
 
-  con_send(server_sock, pkt_buf, pkt_size);
+  if(con_send(&server_link, pkt_buf, pkt_size) != 0)
+    exit(1);
 }
 
 /* ******************************************************* */
 
-static void recv_server(char *buffer) {
-  u_int32_t size = con_recv(server_sock, buffer, PACKET_BUFSIZE);
+static void recv_server() {
+  char *frame;
+  u_int32_t size;
+  int rv;
 
-  if(!size)
+  if(con_recv(&server_link) != 0)
     exit(1);
 
-  debug("Got %u bytes from the server", size);
+  while((rv = con_next_frame(&server_link, &frame, &size)) > 0) {
+    debug("Got %u bytes from the server", size);
+
+    write(tun1_fd, frame, size);
+  }
 
-  write(tun1_fd, buffer, size);
+  if(rv < 0)
+    exit(1);
 }
 
 /* ******************************************************* */
@@ -118,6 +127,7 @@ int main(int argc, char **argv) {
   while(1) {
     struct sockaddr_in server_addr;
     server_sock = con_wait_connection(&info, &server_addr);
+    con_link_init(&server_link, server_sock);
 
     char buf1[INET_ADDRSTRLEN];
     log("Server connection: %s", ipv4str(server_addr.sin_addr.s_addr, buf1));
@@ -150,7 +160,7 @@ int main(int argc, char **argv) {
           } else
             send_server(pkt_buf, pkt_size);
         } else if(FD_ISSET(server_sock, &fdset))
-          recv_server(pkt_buf);
+          recv_server();
       }
     }
 
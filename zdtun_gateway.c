@@ -37,7 +37,14 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <linux/if.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <sys/uio.h>
 
 #include <netinet/udp.h>
 #include <netinet/tcp.h>
@@ -48,7 +55,18 @@
 #define TUN_DEV "zdtun0"
 
 #define PACKET_BUFSIZE 65535
-#define MAX_PURGE_SECS 3
+
+// max number of packets read from the TUN device per wakeup
+#define MAX_BATCH_PKTS 32
+
+// max number of worker threads, each one running its own zdtun instance
+#define MAX_WORKERS 64
+
+// max select timeout, to periodically check the running flag
+#define MAX_WAIT_MS 1000
+
+// number of fds to leave to the gateway itself
+#define RESERVED_FDS 32
 
 // The TUN interface network details
 #define TUN_IP            "10.66.12.1"
@@ -66,69 +84,130 @@
 
 /* ******************************************************* */
 
+typedef struct {
+  zdtun_t *tun;
+  int pkt_fd;       // receives the packets from the dispatcher
+  int dispatch_fd;  // used by the dispatcher to send packets to the worker
+  pthread_t thread;
+} worker_t;
+
 static int tun_fd;
-static uint8_t running;
+static volatile uint8_t running;
 static uint8_t proxy_ipver = 0;
+static worker_t workers[MAX_WORKERS];
+static int num_workers = 1;
+static uint8_t vnet_hdr = 0;
+static uint8_t udp_shared = 0;
+static int dns_cache_size = 0;
+static uint8_t socks5_opts = 0;
+static int socks5_pool_size = 0;
+static const char *capture_path = NULL;
 
 /* ******************************************************* */
 
-static int data_in(zdtun_t *tun, zdtun_pkt_t *pkt, const zdtun_conn_t *conn_info) {
-  int rv = write(tun_fd, pkt->buf, pkt->len);
+static int data_in(zdtun_t *tun, zdtun_pkt_t *pkts, const zdtun_conn_t **conns_info, int num_pkts) {
+  // A TUN device only accepts a single packet per write
+  for(int i = 0; i < num_pkts; i++) {
+    zdtun_pkt_t *pkt = &pkts[i];
+    struct virtio_net_hdr hdr = {0};
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if(vnet_hdr) {
+      // let the kernel complete the checksum
+      if(pkt->flags & ZDTUN_PKT_CSUM_PARTIAL) {
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.csum_start = pkt->csum_start;
+        hdr.csum_offset = pkt->csum_offset;
+      }
+
+      // let the kernel split the super segment
+      if(pkt->flags & ZDTUN_PKT_GSO) {
+        hdr.gso_type = (pkt->tuple.ipver == 4) ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+        hdr.gso_size = pkt->gso_size;
+        hdr.hdr_len = pkt->ip_hdr_len + pkt->l4_hdr_len;
+      }
+
+      iov[iovcnt].iov_base = &hdr;
+      iov[iovcnt++].iov_len = sizeof(hdr);
+    }
+
+    iov[iovcnt].iov_base = pkt->buf;
+    iov[iovcnt++].iov_len = pkt->len;
+
+    int expected = pkt->len + (vnet_hdr ? sizeof(hdr) : 0);
+    int rv = writev(tun_fd, iov, iovcnt);
 
-  if(rv < 0) {
-    error("write(tun) failed[%d]: %s", errno, strerror(errno));
-    return(rv);
-  } else if(rv != pkt->len) {
-    error("write(tun): unexpected rv (expected %d, got %d)", pkt->len, rv);
-    return(rv);
+    if(rv < 0) {
+      error("write(tun) failed[%d]: %s", errno, strerror(errno));
+      return(i);
+    } else if(rv != expected) {
+      error("write(tun): unexpected rv (expected %d, got %d)", expected, rv);
+      return(i);
+    }
   }
 
   // success
-  return(0);
+  return(num_pkts);
 }
 
 /* ******************************************************* */
 
-static zdtun_conn_t* data_out(zdtun_t *tun, const char *pkt_buf, int pkt_len) {
-  zdtun_pkt_t pkt;
+static int tun_hdr_len() {
+  return vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+}
 
-  if(zdtun_parse_pkt(tun, pkt_buf, pkt_len, &pkt) != 0) {
-    debug("zdtun_parse_pkt failed");
-    return NULL;
-  }
+/* ******************************************************* */
 
-  if(pkt.flags & ZDTUN_PKT_IS_FRAGMENT) {
-    debug("discarding IP fragment");
-    return NULL;
-  }
+// Read up to MAX_BATCH_PKTS packets from the non-blocking fd. Each packet
+// is preceded by a hdr_len bytes header, which is skipped.
+static int read_batch(zdtun_t *tun, int fd, int hdr_len, char *pkt_bufs, zdtun_pkt_t *pkts) {
+  int num_pkts = 0;
 
-  uint8_t is_tcp_established = ((pkt.tuple.ipproto == IPPROTO_TCP) &&
-    (!(pkt.tcp->th_flags & TH_SYN) || (pkt.tcp->th_flags & TH_ACK)));
+  for(int i = 0; i < MAX_BATCH_PKTS; i++) {
+    char *pkt_buf = pkt_bufs + i * PACKET_BUFSIZE;
+    int rv = read(fd, pkt_buf, PACKET_BUFSIZE);
 
-  zdtun_conn_t *conn = zdtun_lookup(tun, &pkt.tuple, !is_tcp_established);
+    if(rv < 0) {
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
 
-  if(!conn) {
-    if(is_tcp_established) {
-      debug("TCP: ignoring non SYN connection");
-    } else {
-      error("zdtun_lookup failed");
+      fatal("Error reading packet[%d]: %s", rv, strerror(errno));
     }
 
-    return NULL;
-  }
+    int pkt_size = rv - hdr_len;
+    pkt_buf += hdr_len;
 
-  if((proxy_ipver != 0) && (pkt.tuple.ipproto == IPPROTO_TCP))
-    zdtun_conn_proxy(conn);
+    if(pkt_size < (int)sizeof(struct iphdr)) {
+      error("Packet too small: %lu < %d", sizeof(struct iphdr), pkt_size);
+      continue;
+    }
 
-  if(zdtun_forward(tun, &pkt, conn) != 0) {
-    error("zdtun_forward failed");
+    if(zdtun_parse_pkt(tun, pkt_buf, pkt_size, &pkts[num_pkts]) != 0) {
+      debug("zdtun_parse_pkt failed");
+      continue;
+    }
+
+    if(pkts[num_pkts].flags & ZDTUN_PKT_IS_FRAGMENT) {
+      debug("discarding IP fragment");
+      continue;
+    }
 
-    /* Close the connection as soon an any error occurs */
-    zdtun_conn_close(tun, conn, CONN_STATUS_ERROR);
-    return NULL;
+    num_pkts++;
   }
 
-  return conn;
+  return num_pkts;
+}
+
+/* ******************************************************* */
+
+// Drain the fd and forward the packets in a single batch
+static void data_out(zdtun_t *tun, int fd, int hdr_len, char *pkt_bufs) {
+  zdtun_pkt_t pkts[MAX_BATCH_PKTS];
+  int num_pkts = read_batch(tun, fd, hdr_len, pkt_bufs, pkts);
+
+  if(num_pkts > 0)
+    zdtun_forward_batch(tun, pkts, num_pkts);
 }
 
 /* ******************************************************* */
@@ -140,6 +219,10 @@ static int handle_new_connection(zdtun_t *tun, zdtun_conn_t *conn_info) {
 
   printf("[+] %s\n", buf);
 
+  // only affects TCP connections
+  if(proxy_ipver != 0)
+    zdtun_conn_proxy(conn_info);
+
   /* accept connection */
   return(0);
 }
@@ -238,30 +321,178 @@ static void cleanup_zdtun_routing() {
 /* ******************************************************* */
 
 static void usage(char **argv) {
-  fprintf(stderr, "Usage: %s [proxy_ip proxy_port]\n"
+  fprintf(stderr, "Usage: %s [-t num_threads] [-o] [-u] [-c dns_cache_size] [-p] [-s pool_size] [-w file.pcapng] [proxy_ip proxy_port]\n"
     "\n"
     "Routes all the local/internet traffic via zdtun.\n"
     "An optional SOCKS5 proxy can be used for TCP connections.\n"
-    "", argv[0]);
+    "\n"
+    "  -t num_threads   split the connections among multiple threads (max %d)\n"
+    "  -o               offload the checksums and the TCP segmentation to the kernel (IFF_VNET_HDR)\n"
+    "  -u               share a single UDP socket among the connections of a client port\n"
+    "  -c entries       cache up to the given number of DNS responses per thread\n"
+    "  -p               pipeline the SOCKS5 handshake, using TCP Fast Open when possible\n"
+    "  -s pool_size     keep the given number of authenticated SOCKS5 connections per thread\n"
+    "  -w file.pcapng   capture the packets to the given file (one file per thread, with -t)\n"
+    "", argv[0], MAX_WORKERS);
 
   exit(0);
 }
 
 /* ******************************************************* */
 
+// Runs the zdtun event loop, reading the client packets from in_fd
+static void run_worker(zdtun_t *tun, int in_fd, int in_hdr_len) {
+  char *pkt_bufs;
+
+  if(!(pkt_bufs = (char*) malloc(MAX_BATCH_PKTS * PACKET_BUFSIZE)))
+    fatal("Cannot allocate packet buffer");
+
+  while(running) {
+    fd_set fdset;
+    fd_set wrfds;
+    int max_fd = 0;
+
+    zdtun_fds(tun, &max_fd, &fdset, &wrfds);
+
+    FD_SET(in_fd, &fdset);
+    max_fd = max(max_fd, in_fd);
+
+    // only wake up when a connection may have expired
+    int timeout_ms = zdtun_next_timeout_ms(tun);
+
+    if((timeout_ms < 0) || (timeout_ms > MAX_WAIT_MS))
+      timeout_ms = MAX_WAIT_MS;
+
+    struct timeval tv = {0};
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    int ret = select(max_fd + 1, &fdset, &wrfds, NULL, &tv);
+
+    if(!running)
+      break;
+    else if(ret < 0) {
+      fatal("Select error[%d]: %s\n", ret, strerror(errno));
+    } else if (ret > 0) {
+      if(FD_ISSET(in_fd, &fdset))
+        data_out(tun, in_fd, in_hdr_len, pkt_bufs);
+      else
+        zdtun_handle_fd(tun, &fdset, &wrfds);
+    }
+
+    if(zdtun_next_timeout_ms(tun) == 0)
+      zdtun_purge_expired(tun);
+  }
+
+  free(pkt_bufs);
+}
+
+/* ******************************************************* */
+
+static void* worker_thread(void *arg) {
+  worker_t *worker = (worker_t*) arg;
+
+  // the dispatcher strips the virtio_net_hdr
+  run_worker(worker->tun, worker->pkt_fd, 0);
+  return NULL;
+}
+
+/* ******************************************************* */
+
+// Reads the packets from the TUN device and sends each one to the worker
+// which owns its connection
+static void run_dispatcher(zdtun_t *parser) {
+  zdtun_pkt_t pkts[MAX_BATCH_PKTS];
+  char *pkt_bufs;
+
+  if(!(pkt_bufs = (char*) malloc(MAX_BATCH_PKTS * PACKET_BUFSIZE)))
+    fatal("Cannot allocate packet buffer");
+
+  while(running) {
+    fd_set fdset;
+    struct timeval tv = {0};
+
+    FD_ZERO(&fdset);
+    FD_SET(tun_fd, &fdset);
+    tv.tv_sec = MAX_WAIT_MS / 1000;
+    tv.tv_usec = (MAX_WAIT_MS % 1000) * 1000;
+
+    int ret = select(tun_fd + 1, &fdset, NULL, NULL, &tv);
+
+    if(!running)
+      break;
+    else if(ret < 0) {
+      fatal("Select error[%d]: %s\n", ret, strerror(errno));
+    } else if(ret == 0)
+      continue;
+
+    int num_pkts = read_batch(parser, tun_fd, tun_hdr_len(), pkt_bufs, pkts);
+
+    for(int i = 0; i < num_pkts; i++) {
+      worker_t *worker = &workers[zdtun_5tuple_shard(&pkts[i].tuple, num_workers)];
+
+      // like a full NIC queue, drop the packet if the worker is lagging behind
+      if(send(worker->dispatch_fd, pkts[i].buf, pkts[i].len, MSG_DONTWAIT) < 0)
+        debug("dispatch failed[%d]: %s", errno, strerror(errno));
+    }
+  }
+
+  free(pkt_bufs);
+}
+
+/* ******************************************************* */
+
 int main(int argc, char **argv) {
-  char *pkt_buf;
-  zdtun_t *tun;
-  time_t last_purge;
   zdtun_ip_t proxy_ip = {0};
   int proxy_port = 0;
+  int opt;
 
   zdtun_callbacks_t callbacks = {
-    .send_client = data_in,
+    .send_client_batch = data_in,
     .on_connection_open = handle_new_connection,
     .on_socket_open = protect_socket,
   };
 
+  while((opt = getopt(argc, argv, "t:ouc:ps:w:h")) != -1) {
+    switch(opt) {
+      case 't':
+        num_workers = atoi(optarg);
+
+        if((num_workers < 1) || (num_workers > MAX_WORKERS))
+          usage(argv);
+        break;
+      case 'o':
+        vnet_hdr = 1;
+        break;
+      case 'u':
+        udp_shared = 1;
+        break;
+      case 'p':
+        socks5_opts = ZDTUN_SOCKS5_FASTOPEN;
+        break;
+      case 's':
+        socks5_pool_size = atoi(optarg);
+
+        if((socks5_pool_size < 0) || (socks5_pool_size > 64))
+          usage(argv);
+        break;
+      case 'w':
+        capture_path = optarg;
+        break;
+      case 'c':
+        dns_cache_size = atoi(optarg);
+
+        if(dns_cache_size < 0)
+          usage(argv);
+        break;
+      default:
+        usage(argv);
+    }
+  }
+
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if((argc != 1) && (argc != 3))
     usage(argv);
 
@@ -279,73 +510,125 @@ int main(int argc, char **argv) {
     proxy_ipver = (af == AF_INET) ? 4 : 6;
   }
 
-  if(!(pkt_buf = (char*) malloc(PACKET_BUFSIZE)))
-    fatal("Cannot allocate packet buffer");
+  // with epoll, zdtun is only limited by the max number of open files
+  zdtun_config_t config;
+  struct rlimit nofile;
 
-  tun_fd = open_tun(TUN_DEV, TUN_IP, TUN_NETMASK);
-  tun = zdtun_init(&callbacks, NULL);
+  zdtun_default_config(&config);
+  config.udp_shared_sockets = udp_shared;
 
-  if(!tun)
-    fatal("zdtun_init failed");
+  if((getrlimit(RLIMIT_NOFILE, &nofile) == 0) && (nofile.rlim_cur > (RESERVED_FDS * 2))
+      && (nofile.rlim_cur != RLIM_INFINITY)) {
+    // the open files limit is shared by the workers
+    config.max_sockets = (nofile.rlim_cur - RESERVED_FDS) / num_workers;
+    config.sockets_after_purge = config.max_sockets * 3 / 4;
+  }
 
-  if(proxy_ipver != 0)
-    zdtun_set_socks5_proxy(tun, &proxy_ip, proxy_port, proxy_ipver);
+  tun_fd = open_tun_ex(TUN_DEV, TUN_IP, TUN_NETMASK, vnet_hdr ? IFF_VNET_HDR : 0);
+  fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL) | O_NONBLOCK);
+
+  for(int i = 0; i < num_workers; i++) {
+    worker_t *worker = &workers[i];
+
+    if(!(worker->tun = zdtun_init_ex(&callbacks, NULL, &config)))
+      fatal("zdtun_init failed");
+
+    if(proxy_ipver != 0) {
+      zdtun_set_socks5_proxy(worker->tun, &proxy_ip, proxy_port, proxy_ipver);
+      zdtun_set_socks5_opts(worker->tun, socks5_opts);
+      zdtun_set_socks5_pool(worker->tun, socks5_pool_size);
+    }
+
+    // read the TCP data in large chunks
+    if(vnet_hdr)
+      zdtun_set_offload(worker->tun, ZDTUN_OFFLOAD_CSUM_PARTIAL | ZDTUN_OFFLOAD_TCP_GSO);
+    else
+      zdtun_set_offload(worker->tun, ZDTUN_OFFLOAD_TCP_LRO);
+
+    zdtun_dns_cache_set_size(worker->tun, dns_cache_size);
+
+    if(capture_path) {
+      zdtun_capture_config_t capture = {0};
+      char path[1024];
+
+      if(num_workers > 1)
+        snprintf(path, sizeof(path), "%s.%d", capture_path, i);
+      else
+        snprintf(path, sizeof(path), "%s", capture_path);
+
+      capture.path = path;
+
+      if(zdtun_capture_start(worker->tun, &capture) != 0)
+        fatal("Cannot start the capture to %s", path);
+    }
+  }
 
   setup_zdtun_routing();
   signal(SIGPIPE, SIG_IGN);
   signal(SIGINT, term_handler);
 
-  last_purge = time(NULL);
   running = 1;
   printf("zdtun running\n");
 
-  while(running) {
-    fd_set fdset;
-    fd_set wrfds;
-    int max_fd = 0;
+  if(num_workers == 1)
+    run_worker(workers[0].tun, tun_fd, tun_hdr_len());
+  else {
+    // only used to parse the packets to dispatch
+    zdtun_t *parser = zdtun_init(&callbacks, NULL);
 
-    zdtun_fds(tun, &max_fd, &fdset, &wrfds);
+    if(!parser)
+      fatal("zdtun_init failed");
 
-    FD_SET(tun_fd, &fdset);
-    max_fd = max(max_fd, tun_fd);
+    for(int i = 0; i < num_workers; i++) {
+      worker_t *worker = &workers[i];
+      int fds[2];
 
-    struct timeval tv = {0};
-    tv.tv_sec = 1;
+      // SOCK_SEQPACKET preserves the packets boundaries
+      if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0)
+        fatal("socketpair failed[%d]: %s", errno, strerror(errno));
 
-    int ret = select(max_fd + 1, &fdset, &wrfds, NULL, &tv);
+      worker->dispatch_fd = fds[0];
+      worker->pkt_fd = fds[1];
+      fcntl(worker->pkt_fd, F_SETFL, fcntl(worker->pkt_fd, F_GETFL) | O_NONBLOCK);
 
-    if(!running)
-      break;
-    else if(ret < 0) {
-      fatal("Select error[%d]: %s\n", ret, strerror(errno));
-    } else if (ret > 0) {
-      if(FD_ISSET(tun_fd, &fdset)) {
-        int pkt_size = read(tun_fd, pkt_buf, PACKET_BUFSIZE);
-
-        if(pkt_size < 0) {
-          fatal("Error reading packet[%d]: %s", (int)pkt_size, strerror(errno));
-        } else if(pkt_size < sizeof(struct iphdr)) {
-          error("Packet too small: %lu < %d", sizeof(struct iphdr), pkt_size);
-        } else
-          data_out(tun, pkt_buf, pkt_size);
-      } else
-        zdtun_handle_fd(tun, &fdset, &wrfds);
+      if(pthread_create(&worker->thread, NULL, worker_thread, worker) != 0)
+        fatal("pthread_create failed");
     }
 
-    if((time(NULL) - last_purge) >= MAX_PURGE_SECS) {
-      zdtun_purge_expired(tun);
-      last_purge = time(NULL);
+    run_dispatcher(parser);
+
+    for(int i = 0; i < num_workers; i++) {
+      pthread_join(workers[i].thread, NULL);
+      close(workers[i].dispatch_fd);
+      close(workers[i].pkt_fd);
     }
+
+    zdtun_finalize(parser);
   }
 
   // print still active connections
   printf("\nActive connections:\n");
-  zdtun_iter_connections(tun, print_conn_iterator, NULL);
+
+  for(int i = 0; i < num_workers; i++)
+    zdtun_iter_connections(workers[i].tun, print_conn_iterator, NULL);
+
+  if(num_workers > 1) {
+    zdtun_t *shards[MAX_WORKERS];
+    zdtun_statistics_t stats;
+
+    for(int i = 0; i < num_workers; i++)
+      shards[i] = workers[i].tun;
+
+    zdtun_get_shards_stats(shards, num_workers, &stats);
+    printf("\nTotal connections: %u TCP, %u UDP, %u ICMP\n",
+      stats.num_tcp_opened, stats.num_udp_opened, stats.num_icmp_opened);
+  }
 
   // cleanup
   cleanup_zdtun_routing();
-  zdtun_finalize(tun);
-  free(pkt_buf);
+
+  for(int i = 0; i < num_workers; i++)
+    zdtun_finalize(workers[i].tun);
 
   return(0);
 }
@@ -42,10 +42,10 @@
 /* ******************************************************* */
 
 static int data_in(zdtun_t *tun, zdtun_pkt_t *pkt, const zdtun_conn_t *conn_info) {
-  socket_t client_sock = *((socket_t *)zdtun_userdata(tun));
+  con_link_t *link = (con_link_t*) zdtun_userdata(tun);
 
-  con_send(client_sock, pkt->buf, pkt->len);
-  return 0;
+  // flushed after handling the zdtun events
+  return con_queue(link, pkt->buf, pkt->len);
 }
 
 /* ******************************************************* */
@@ -154,13 +154,9 @@ int main(int argc, char **argv) {
   con_mode_info info;
   con_parse_args(argv, &info);
 
-  char *buffer = (char *) malloc(PACKET_BUFSIZE);
-
-  if(!buffer)
-    fatal("Cannot allocate packet buffer[%d]", errno);
-
   zdtun_t *tun;
   socket_t sock;
+  con_link_t link;
   zdtun_callbacks_t callbacks = {
     .send_client = data_in,
   };
@@ -173,7 +169,8 @@ int main(int argc, char **argv) {
     log("Client connection: %s", ipv4str(client_addr.sin_addr.s_addr, buf1));
 
     time_t last_purge = time(NULL);
-    tun = zdtun_init(&callbacks, &sock);
+    con_link_init(&link, sock);
+    tun = zdtun_init(&callbacks, &link);
 
     if(!tun)
       exit(1);
@@ -207,17 +204,28 @@ int main(int argc, char **argv) {
           fatal("Select error[%d]\n", socket_errno);
         } else if (ret > 0) {
           if(FD_ISSET(sock, &fdset)) {
-            u_int32_t size = con_recv(sock, buffer, PACKET_BUFSIZE);
+            char *frame;
+            u_int32_t size;
+            int rv;
 
-            if(!size)
+            if(con_recv(&link) != 0)
               break;
 
-            debug("Got %u bytes from the client", size);
+            while((rv = con_next_frame(&link, &frame, &size)) > 0) {
+              debug("Got %u bytes from the client", size);
 
-            if(!zdtun_easy_forward(tun, buffer, size))
-              error("zdtun_easy_forward failed");
+              if(!zdtun_easy_forward(tun, frame, size))
+                error("zdtun_easy_forward failed");
+            }
+
+            if(rv < 0)
+              break;
           } else
             zdtun_handle_fd(tun, &fdset, &wrfds);
+
+          // the replies queued by data_in
+          if(con_flush(&link) != 0)
+            break;
         } else {
           do_purge = true;
         }
@@ -227,6 +235,7 @@ int main(int argc, char **argv) {
         print_zdtun_stats(tun);
         last_purge = time(NULL);
         zdtun_purge_expired(tun);
+        con_flush(&link);
       }
     }
 
@@ -234,7 +243,7 @@ int main(int argc, char **argv) {
     break;
   }
 
-  free(buffer);
   closesocket(sock);
   zdtun_finalize(tun);
+  con_link_destroy(&link);
 }